@@ -0,0 +1,253 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "arc_cache.h"
+#include "types.h"
+
+
+template <typename K>
+arc_cache<K>::arc_cache(const uint64_t max_memory, const size_t ghost_size) :
+	max_memory(max_memory),
+	ghost_size(ghost_size)
+{
+}
+
+template <typename K>
+arc_cache<K>::~arc_cache()
+{
+}
+
+template <typename K>
+size_t arc_cache<K>::entry_size(const cache_entry_t & e) const
+{
+	// ghost entries are accounted as the block they stand for
+	if (e.list == cl_b1 || e.list == cl_b2)
+		return ghost_size;
+
+	return e.data.value().get_size();
+}
+
+// moves an entry to the MRU end of 'to', resident -> ghost drops the data
+template <typename K>
+void arc_cache<K>::move_to(const K & key, cache_entry_t & e, const cache_list_t to)
+{
+	list_bytes[e.list] -= entry_size(e);
+	lists[e.list].erase(e.it);
+
+	if (to == cl_b1 || to == cl_b2)
+		e.data.reset();
+
+	e.list = to;
+
+	lists[to].push_front(key);
+	e.it = lists[to].begin();
+
+	list_bytes[to] += entry_size(e);
+}
+
+template <typename K>
+void arc_cache<K>::remove(const K & key)
+{
+	auto it = entries.find(key);
+
+	list_bytes[it->second.list] -= entry_size(it->second);
+	lists[it->second.list].erase(it->second.it);
+
+	entries.erase(it);
+}
+
+// make room for 'incoming' bytes in t1 + t2
+template <typename K>
+void arc_cache<K>::replace(const bool in_b2, const size_t incoming)
+{
+	while(list_bytes[cl_t1] + list_bytes[cl_t2] + incoming > max_memory) {
+		cache_list_t from = cl_t2;
+
+		if (lists[cl_t1].empty() == false && (list_bytes[cl_t1] > p || (in_b2 && list_bytes[cl_t1] == p) || lists[cl_t2].empty()))
+			from = cl_t1;
+		else if (lists[cl_t2].empty())
+			break;
+
+		// a copy: the list element goes away
+		const K victim = lists[from].back();
+
+		move_to(victim, entries.at(victim), from == cl_t1 ? cl_b1 : cl_b2);
+
+		n_evictions++;
+	}
+
+	// the ghost lists remember at most 'max_memory' worth of blocks
+	while(list_bytes[cl_b1] + list_bytes[cl_b2] > max_memory)
+		remove(lists[list_bytes[cl_b1] > list_bytes[cl_b2] ? cl_b1 : cl_b2].back());
+}
+
+template <typename K>
+uint64_t & arc_cache<K>::generation_of(const K & key)
+{
+	return generations[std::hash<K>()(key) % n_generations];
+}
+
+template <typename K>
+std::optional<block> arc_cache<K>::lookup(const K & key, bool *const tag)
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	auto it = entries.find(key);
+
+	if (it == entries.end() || it->second.list == cl_b1 || it->second.list == cl_b2) {
+		n_misses++;
+		return { };
+	}
+
+	// (at least) the second access: it is "frequently used" now
+	move_to(key, it->second, cl_t2);
+
+	n_hits++;
+
+	if (tag)
+		*tag = it->second.tag;
+
+	return it->second.data;
+}
+
+template <typename K>
+uint64_t arc_cache<K>::get_generation(const K & key)
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	return generation_of(key);
+}
+
+template <typename K>
+void arc_cache<K>::insert(const K & key, const block & data, const bool tag, const uint64_t generation)
+{
+	const size_t size = data.get_size();
+
+	std::unique_lock<std::mutex> lck(lock);
+
+	// forgotten while the data was being retrieved: it may be outdated
+	if (generation_of(key) != generation)
+		return;
+
+	auto it = entries.find(key);
+
+	if (it != entries.end() && (it->second.list == cl_t1 || it->second.list == cl_t2))
+		return;  // a concurrent reader was first
+
+	cache_list_t target = cl_t1;
+
+	if (it != entries.end()) {
+		// it was evicted not long ago: adapt the target size of t1 into the direction of the list it came from
+		n_ghost_hits++;
+
+		const bool     in_b2 = it->second.list == cl_b2;
+		const uint64_t b1    = std::max(list_bytes[cl_b1], uint64_t(1));
+		const uint64_t b2    = std::max(list_bytes[cl_b2], uint64_t(1));
+
+		if (in_b2) {
+			uint64_t delta = std::max(b1 / b2, uint64_t(1)) * ghost_size;
+			p = p > delta ? p - delta : 0;
+		}
+		else {
+			uint64_t delta = std::max(b2 / b1, uint64_t(1)) * ghost_size;
+			p = std::min(max_memory, p + delta);
+		}
+
+		remove(key);
+
+		replace(in_b2, size);
+
+		target = cl_t2;
+	}
+	else {
+		if (list_bytes[cl_t1] + list_bytes[cl_b1] >= max_memory) {
+			if (lists[cl_b1].empty() == false)
+				remove(lists[cl_b1].back());
+			else if (lists[cl_t1].empty() == false) {
+				remove(lists[cl_t1].back());
+				n_evictions++;
+			}
+		}
+		else if (list_bytes[cl_t1] + list_bytes[cl_t2] + list_bytes[cl_b1] + list_bytes[cl_b2] >= 2 * max_memory && lists[cl_b2].empty() == false) {
+			remove(lists[cl_b2].back());
+		}
+
+		replace(false, size);
+	}
+
+	lists[target].push_front(key);
+
+	list_bytes[target] += size;
+
+	entries.insert({ key, { target, lists[target].begin(), data, tag } });
+}
+
+template <typename K>
+bool arc_cache<K>::forget(const K & key)
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	generation_of(key)++;
+
+	auto it = entries.find(key);
+
+	if (it == entries.end())
+		return false;
+
+	const bool resident = it->second.list == cl_t1 || it->second.list == cl_t2;
+
+	remove(key);
+
+	n_forgotten += resident;
+
+	return resident;
+}
+
+template <typename K>
+size_t arc_cache<K>::forget_if(const std::function<bool(const K & key)> & f)
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	for(auto & g : generations)
+		g++;
+
+	std::vector<K> drop;
+	size_t         n_resident = 0;
+
+	for(auto & e : entries) {
+		if (f(e.first)) {
+			drop.push_back(e.first);
+
+			n_resident += e.second.list == cl_t1 || e.second.list == cl_t2;
+		}
+	}
+
+	for(auto & key : drop)
+		remove(key);
+
+	n_forgotten += n_resident;
+
+	return n_resident;
+}
+
+template <typename K>
+size_t arc_cache<K>::get_n_entries()
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	return entries.size();
+}
+
+template <typename K>
+arc_cache_stats_t arc_cache<K>::get_stats()
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	return { n_hits.load(), n_misses.load(), n_ghost_hits.load(), n_evictions.load(), n_forgotten.load(), lists[cl_t1].size(), lists[cl_t2].size(), lists[cl_b1].size(), lists[cl_b2].size(), list_bytes[cl_t1], list_bytes[cl_t2], p };
+}
+
+// storage_backend_cache
+template class arc_cache<block_nr_t>;
+// dedup_block_cache
+template class arc_cache<std::string>;
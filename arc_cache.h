@@ -0,0 +1,89 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <stdint.h>
+#include <unordered_map>
+
+#include "block.h"
+
+
+typedef struct {
+	uint64_t n_hits;
+	uint64_t n_misses;
+	uint64_t n_ghost_hits;
+	uint64_t n_evictions;
+	uint64_t n_forgotten;  // resident entries dropped by forget()/forget_if()
+	size_t   n_t1, n_t2, n_b1, n_b2;  // entries per list
+	uint64_t bytes_t1, bytes_t2;
+	uint64_t p;            // target size of t1, in bytes
+} arc_cache_stats_t;
+
+// ARC (adaptive replacement cache, Megiddo & Modha) of blocks by key: it
+// keeps both recently and frequently used data and a single sequential scan
+// does not flush the frequently used data. Sizes are counted in bytes so that
+// data that is stored compressed takes less of the budget; a ghost entry
+// counts as 'ghost_size' bytes (the block it stands for). Thread safe.
+// Instantiated (in arc_cache.cpp) for block numbers and hashes.
+template <typename K>
+class arc_cache
+{
+private:
+	typedef enum { cl_t1 = 0, cl_t2, cl_b1, cl_b2 } cache_list_t;  // t = resident, b = ghost
+
+	typedef struct {
+		cache_list_t                  list;
+		typename std::list<K>::iterator it;
+		std::optional<block>          data;  // only for t1/t2
+		bool                          tag;   // as given to insert()
+	} cache_entry_t;
+
+	static constexpr size_t n_generations { 64 };
+
+	const uint64_t         max_memory;  // 'c' of ARC
+	const size_t           ghost_size;
+
+	std::mutex             lock;
+	std::list<K>           lists[4];  // MRU at the front
+	uint64_t               list_bytes[4] { 0 };
+	std::unordered_map<K, cache_entry_t> entries;
+	uint64_t               p { 0 };
+	// per group of keys: incremented by forget() so that an insert() of data
+	// that was retrieved before that is dropped
+	std::array<uint64_t, n_generations> generations { };
+
+	std::atomic_uint64_t   n_hits { 0 };
+	std::atomic_uint64_t   n_misses { 0 };
+	std::atomic_uint64_t   n_ghost_hits { 0 };
+	std::atomic_uint64_t   n_evictions { 0 };
+	std::atomic_uint64_t   n_forgotten { 0 };
+
+	// these expect 'lock' to be locked
+	size_t   entry_size(const cache_entry_t & e) const;
+	void     move_to(const K & key, cache_entry_t & e, const cache_list_t to);
+	void     remove(const K & key);
+	void     replace(const bool in_b2, const size_t incoming);
+	uint64_t & generation_of(const K & key);
+
+public:
+	arc_cache(const uint64_t max_memory, const size_t ghost_size);
+	virtual ~arc_cache();
+
+	// shares the cached buffer, no copy
+	std::optional<block> lookup(const K & key, bool *const tag = nullptr);
+	// to be retrieved before the data that is inserted later, from where
+	// forget() is invoked when it changes
+	uint64_t get_generation(const K & key);
+	// 'data' is kept (not copied); dropped when 'key' was forgotten after 'generation' was retrieved
+	void     insert(const K & key, const block & data, const bool tag, const uint64_t generation);
+	// returns whether resident data was dropped
+	bool     forget(const K & key);
+	// forgets all keys for which 'f' returns true, returns how many had resident data
+	size_t   forget_if(const std::function<bool(const K & key)> & f);
+
+	size_t   get_n_entries();
+	arc_cache_stats_t get_stats();
+};
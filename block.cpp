@@ -1,40 +1,85 @@
 #include <stdlib.h>
 #include <string.h>
+#include <utility>
 #include <vector>
 
 #include "block.h"
+#include "buffer_pool.h"
 #include "str.h"
 
 
-block::block(const uint8_t *const data, const size_t len, const bool do_free) : data(data), len(len), do_free(do_free)
+static void block_free(const uint8_t *const p)
 {
+	pool_free(const_cast<uint8_t *>(p));
 }
 
-block::block(const uint8_t *const data, const size_t len) : data(data), len(len), do_free(true)
+block::block(const std::shared_ptr<const uint8_t> & storage, const uint8_t *const data, const size_t len) : storage(storage), data(data), len(len)
+{
+}
+
+block::block(const uint8_t *const data, const size_t len, const bool do_free) : data(data), len(len)
+{
+	if (do_free && data)
+		storage = std::shared_ptr<const uint8_t>(data, block_free);
+}
+
+block::block(const uint8_t *const data, const size_t len) : block(data, len, true)
 {
 }
 
 // TODO: get rid of this constructor variant (slow & ugly)
-block::block(const std::vector<uint8_t> & data) : data(reinterpret_cast<uint8_t *>(malloc(data.size()))), len(data.size()), do_free(true)
+block::block(const std::vector<uint8_t> & data) : block(std::vector<uint8_t>(data))
+{
+}
+
+block::block(std::vector<uint8_t> && data)
 {
-	if (!this->data)
-		throw myformat("block: cannot allocate %zu bytes of memory", data.size());
+	auto v = std::make_shared<const std::vector<uint8_t> >(std::move(data));
 
-	memcpy(const_cast<uint8_t *>(this->data), data.data(), data.size());
+	this->data = v->data();
+	this->len  = v->size();
+
+	storage = std::shared_ptr<const uint8_t>(v, this->data);
 }
 
-block::block(const block & other) : data(reinterpret_cast<uint8_t *>(malloc(other.get_size()))), len(other.get_size()), do_free(true)
+block::block(const block & other)
 {
-	if (!this->data)
-		throw myformat("block: cannot allocate %zu bytes of memory", other.get_size());
+	*this = other;
+}
 
-	memcpy(const_cast<uint8_t *>(this->data), other.get_data(), other.get_size());
+block::block(block && other) noexcept
+{
+	*this = std::move(other);
 }
-							    
+
 block::~block()
 {
-	if (do_free)
-		free(const_cast<uint8_t *>(data));
+}
+
+block & block::operator=(const block & other)
+{
+	if (this == &other)
+		return *this;
+
+	if (other.storage) {
+		storage = other.storage;
+		data    = other.data;
+		len     = other.len;
+	}
+	else {
+		*this = other.clone();
+	}
+
+	return *this;
+}
+
+block & block::operator=(block && other) noexcept
+{
+	storage = std::move(other.storage);
+	data    = std::exchange(other.data, nullptr);
+	len     = std::exchange(other.len, 0);
+
+	return *this;
 }
 
 bool block::empty() const
@@ -52,6 +97,31 @@ const uint8_t * block::get_data() const
 	return data;
 }
 
+bool block::is_owner() const
+{
+	return storage != nullptr;
+}
+
+block block::slice(const size_t offset, const size_t slice_len) const
+{
+	if (offset + slice_len > len)
+		throw myformat("block::slice: %zu bytes at offset %zu is beyond the end of the block (%zu bytes)", slice_len, offset, len);
+
+	return block(storage, data + offset, slice_len);
+}
+
+block block::clone() const
+{
+	uint8_t *copy = pool_malloc(len);
+
+	if (!copy && len)
+		throw myformat("block: cannot allocate %zu bytes of memory", len);
+
+	memcpy(copy, data, len);
+
+	return block(copy, len);
+}
+
 bool block::operator==(const block & other) const
 {
 	if (other.get_size() != get_size())
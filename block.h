@@ -1,4 +1,5 @@
 #pragma once
+#include <memory>
 #include <stdint.h>
 #include <stdlib.h>
 #include <vector>
@@ -7,19 +8,33 @@
 // This class is a wrapper around a pointer/size pair.
 // The owner ship of the data it wraps is moved to the block class!
 // (unless the not_free constructor is used)
+// Owned data is released with pool_free (which also accepts malloc()ed data).
+//
+// The data is immutable and reference counted: copies and slices of an
+// owning block share the buffer, it is freed when the last one goes away.
+// Copying a non-owning block makes a private (owning) copy of the data as
+// the wrapped memory may not outlive the original. Slices of a non-owning
+// block are views into that same memory.
 class block {
 private:
-	const uint8_t *const data;
-	const size_t         len;
-	const bool           do_free;
+	std::shared_ptr<const uint8_t> storage;  // empty when not owning
+	const uint8_t                 *data { nullptr };
+	size_t                         len { 0 };
+
+	block(const std::shared_ptr<const uint8_t> & storage, const uint8_t *const data, const size_t len);
 
 public:
 	block(const uint8_t *const data, const size_t len, const bool do_free);
 	block(const uint8_t *const data, const size_t len);
 	block(const std::vector<uint8_t> & data);
+	block(std::vector<uint8_t> && data);
 	block(const block & other);
+	block(block && other) noexcept;
 	virtual ~block();
 
+	block & operator=(const block & other);
+	block & operator=(block && other) noexcept;
+
 	bool operator==(const block &other) const;
 
 	bool empty() const;
@@ -27,4 +42,12 @@ public:
 	size_t get_size() const;
 
 	const uint8_t * get_data() const;
+
+	bool is_owner() const;
+
+	// sub-range of this block without copying
+	block slice(const size_t offset, const size_t slice_len) const;
+
+	// a private (owning) copy of the data
+	block clone() const;
 };
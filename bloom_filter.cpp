@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bloom_filter.h"
+#include "hash.h"
+#include "io.h"
+#include "logging.h"
+#include "str.h"
+
+
+typedef struct {
+	char     magic[4];
+	uint32_t n_hashes;
+	uint64_t n_bits;
+	uint64_t n_added;
+	uint64_t tag;
+} bloom_filter_header_t;
+
+static constexpr char bloom_filter_magic[4] { 'M', 'S', 'B', 'F' };
+
+bloom_filter::bloom_filter(const uint64_t n_bits, const int n_hashes) :
+	n_bits(n_bits),
+	n_hashes(n_hashes),
+	bits((n_bits + 63) / 64)
+{
+	if (n_bits == 0 || n_hashes <= 0)
+		throw myformat("bloom_filter: number of bits (%lu) and of hashes (%d) must be > 0", n_bits, n_hashes);
+}
+
+bloom_filter::~bloom_filter()
+{
+}
+
+void bloom_filter::get_hashes(const uint8_t *const key, const size_t len, uint64_t *const h1, uint64_t *const h2) const
+{
+	*h1 = (uint64_t(murmur3_32(key, len, MURMUR3_32_SEED)) << 32) | murmur3_32(key, len, 1);
+	// odd, so that the n_hashes bits differ
+	*h2 = (uint64_t(murmur3_32(key, len, 2)) << 32) | murmur3_32(key, len, 3) | 1;
+}
+
+void bloom_filter::add(const uint8_t *const key, const size_t len)
+{
+	uint64_t h1 = 0, h2 = 0;
+	get_hashes(key, len, &h1, &h2);
+
+	for(int i=0; i<n_hashes; i++) {
+		const uint64_t bit = (h1 + i * h2) % n_bits;
+
+		bits[bit / 64] |= uint64_t(1) << (bit & 63);
+	}
+
+	n_added++;
+}
+
+bool bloom_filter::maybe_contains(const uint8_t *const key, const size_t len) const
+{
+	uint64_t h1 = 0, h2 = 0;
+	get_hashes(key, len, &h1, &h2);
+
+	for(int i=0; i<n_hashes; i++) {
+		const uint64_t bit = (h1 + i * h2) % n_bits;
+
+		if ((bits[bit / 64] & (uint64_t(1) << (bit & 63))) == 0)
+			return false;
+	}
+
+	return true;
+}
+
+void bloom_filter::clear()
+{
+	std::fill(bits.begin(), bits.end(), 0);
+
+	n_added = 0;
+}
+
+uint64_t bloom_filter::get_n_bits() const
+{
+	return n_bits;
+}
+
+uint64_t bloom_filter::get_n_added() const
+{
+	return n_added;
+}
+
+double bloom_filter::get_fill_ratio() const
+{
+	uint64_t n_set = 0;
+
+	for(auto & word : bits)
+		n_set += __builtin_popcountll(word);
+
+	return double(n_set) / n_bits;
+}
+
+bool bloom_filter::save(const std::string & file, const uint64_t tag) const
+{
+	int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		dolog(ll_error, "bloom_filter::save: cannot create \"%s\": %s", file.c_str(), strerror(errno));
+		return false;
+	}
+
+	bloom_filter_header_t header { };
+	memcpy(header.magic, bloom_filter_magic, sizeof header.magic);
+	header.n_hashes = n_hashes;
+	header.n_bits   = n_bits;
+	header.n_added  = n_added;
+	header.tag      = tag;
+
+	const size_t bits_size = bits.size() * sizeof(uint64_t);
+
+	bool ok = WRITE(fd, reinterpret_cast<const uint8_t *>(&header), sizeof header) == sizeof header &&
+		WRITE(fd, reinterpret_cast<const uint8_t *>(bits.data()), bits_size) == ssize_t(bits_size) &&
+		fdatasync(fd) == 0;
+
+	if (!ok)
+		dolog(ll_error, "bloom_filter::save: cannot write to \"%s\": %s", file.c_str(), strerror(errno));
+
+	close(fd);
+
+	if (!ok)
+		unlink(file.c_str());
+
+	return ok;
+}
+
+bool bloom_filter::load(const std::string & file, const uint64_t tag)
+{
+	int fd = open(file.c_str(), O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	bloom_filter_header_t header { };
+
+	const size_t bits_size = bits.size() * sizeof(uint64_t);
+
+	bool ok = READ(fd, reinterpret_cast<uint8_t *>(&header), sizeof header) == sizeof header &&
+		memcmp(header.magic, bloom_filter_magic, sizeof header.magic) == 0 &&
+		header.n_hashes == uint32_t(n_hashes) && header.n_bits == n_bits && header.tag == tag &&
+		READ(fd, reinterpret_cast<uint8_t *>(bits.data()), bits_size) == ssize_t(bits_size);
+
+	close(fd);
+
+	if (ok)
+		n_added = header.n_added;
+	else
+		clear();
+
+	return ok;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+// Set membership with false positives but never false negatives: "not in
+// it" is certain, "maybe in it" must be checked elsewhere. Items cannot be
+// removed; that only makes the false positives a bit more frequent.
+class bloom_filter
+{
+private:
+	const uint64_t       n_bits;
+	const int            n_hashes;
+	std::vector<uint64_t> bits;
+	uint64_t             n_added { 0 };
+
+	// double hashing: bit i of 'key' is (h1 + i * h2) % n_bits
+	void get_hashes(const uint8_t *const key, const size_t len, uint64_t *const h1, uint64_t *const h2) const;
+
+public:
+	bloom_filter(const uint64_t n_bits, const int n_hashes);
+	virtual ~bloom_filter();
+
+	void add(const uint8_t *const key, const size_t len);
+	bool maybe_contains(const uint8_t *const key, const size_t len) const;
+
+	void clear();
+
+	uint64_t get_n_bits() const;
+	uint64_t get_n_added() const;
+	double   get_fill_ratio() const;
+
+	// 'tag' is stored with it and must match when loading (e.g. the
+	// number of records the filter was made for)
+	bool save(const std::string & file, const uint64_t tag) const;
+	bool load(const std::string & file, const uint64_t tag);
+};
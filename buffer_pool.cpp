@@ -0,0 +1,233 @@
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <mutex>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+#include <sys/mman.h>
+
+#include "buffer_pool.h"
+#include "logging.h"
+
+
+#define POOL_MIN_CLASS_BITS   9   // 512 bytes
+#define POOL_MAX_CLASS_BITS  22   // 4MB
+#define POOL_N_CLASSES       (POOL_MAX_CLASS_BITS - POOL_MIN_CLASS_BITS + 1)
+#define POOL_MAX_CLASS_BYTES (4 * 1024 * 1024)  // per thread, per size class
+#define POOL_HUGEPAGE_SIZE   (2 * 1024 * 1024)
+#define POOL_N_SHARDS        64
+
+static std::atomic_bool     pool_hugepages { false };
+static std::atomic_int      pool_max_cached_per_class { 64 };
+
+static std::atomic_uint64_t pool_allocations { 0 };
+static std::atomic_uint64_t pool_cache_hits { 0 };
+static std::atomic_int64_t  pool_in_use { 0 };
+static std::atomic_int64_t  pool_in_use_high_water { 0 };
+static std::atomic_int64_t  pool_cached { 0 };
+
+// the class of each buffer that pool_malloc allocated (also while cached),
+// spread over shards to keep the locks uncontended
+typedef struct {
+	std::mutex                        lock;
+	std::unordered_map<uintptr_t, int> classes;
+} pool_shard_t;
+
+static pool_shard_t pool_shards[POOL_N_SHARDS];
+
+static pool_shard_t & get_shard(const void *const p)
+{
+	// buffers are at least 512 bytes apart
+	return pool_shards[(uintptr_t(p) >> POOL_MIN_CLASS_BITS) % POOL_N_SHARDS];
+}
+
+static void register_buffer(void *const p, const int cls)
+{
+	pool_shard_t & s = get_shard(p);
+
+	std::lock_guard<std::mutex> lck(s.lock);
+
+	s.classes[uintptr_t(p)] = cls;
+}
+
+// class of an allocated buffer, -1 if it was not allocated by pool_malloc
+static int buffer_to_class(void *const p)
+{
+	pool_shard_t & s = get_shard(p);
+
+	std::lock_guard<std::mutex> lck(s.lock);
+
+	auto it = s.classes.find(uintptr_t(p));
+
+	return it == s.classes.end() ? -1 : it->second;
+}
+
+// returns a pool buffer to the system
+static void release_buffer(void *const p)
+{
+	{
+		pool_shard_t & s = get_shard(p);
+
+		std::lock_guard<std::mutex> lck(s.lock);
+
+		s.classes.erase(uintptr_t(p));
+	}
+
+	free(p);
+}
+
+class thread_cache
+{
+public:
+	std::vector<void *> free_list[POOL_N_CLASSES];
+
+	thread_cache() {
+	}
+
+	virtual ~thread_cache() {
+		for(int i=0; i<POOL_N_CLASSES; i++) {
+			for(auto p : free_list[i])
+				release_buffer(p);
+
+			pool_cached -= int64_t(free_list[i].size()) << (i + POOL_MIN_CLASS_BITS);
+		}
+	}
+};
+
+static thread_local thread_cache tc;
+
+// smallest class that fits 'size', -1 if not cached
+static int size_to_class(const size_t size)
+{
+	if (size > (size_t(1) << POOL_MAX_CLASS_BITS))
+		return -1;
+
+	int bits = POOL_MIN_CLASS_BITS;
+	while((size_t(1) << bits) < size)
+		bits++;
+
+	return bits - POOL_MIN_CLASS_BITS;
+}
+
+static void update_high_water(const int64_t in_use)
+{
+	int64_t hw = pool_in_use_high_water;
+
+	while(in_use > hw && !pool_in_use_high_water.compare_exchange_weak(hw, in_use)) {
+	}
+}
+
+uint8_t *pool_malloc(const size_t size)
+{
+	int cls = size_to_class(size);
+	if (cls == -1)
+		return reinterpret_cast<uint8_t *>(malloc(size));
+
+	pool_allocations++;
+
+	const size_t class_size = size_t(1) << (cls + POOL_MIN_CLASS_BITS);
+
+	void *p = nullptr;
+
+	if (tc.free_list[cls].empty() == false) {
+		p = tc.free_list[cls].back();
+		tc.free_list[cls].pop_back();
+
+		pool_cached -= class_size;
+		pool_cache_hits++;
+	}
+	else {
+		const bool   huge      = pool_hugepages && class_size >= POOL_HUGEPAGE_SIZE;
+		const size_t alignment = huge ? POOL_HUGEPAGE_SIZE : std::min(class_size, size_t(4096));
+
+		if (posix_memalign(&p, alignment, class_size))
+			return nullptr;
+
+		if (huge && madvise(p, class_size, MADV_HUGEPAGE) == -1)
+			dolog(ll_debug, "pool_malloc: madvise(MADV_HUGEPAGE) failed: %s", strerror(errno));
+
+		register_buffer(p, cls);
+	}
+
+	update_high_water(pool_in_use += class_size);
+
+	return reinterpret_cast<uint8_t *>(p);
+}
+
+uint8_t *pool_calloc(const size_t size)
+{
+	uint8_t *p = pool_malloc(size);
+
+	if (p)
+		memset(p, 0x00, size);
+
+	return p;
+}
+
+void pool_free(void *const p)
+{
+	if (!p)
+		return;
+
+	int cls = buffer_to_class(p);
+	if (cls == -1) {
+		free(p);
+		return;
+	}
+
+	const size_t class_size = size_t(1) << (cls + POOL_MIN_CLASS_BITS);
+
+	pool_in_use -= class_size;
+
+	size_t max_n = std::min(size_t(pool_max_cached_per_class), std::max(size_t(1), POOL_MAX_CLASS_BYTES / class_size));
+
+	if (tc.free_list[cls].size() >= max_n) {
+		release_buffer(p);
+		return;
+	}
+
+	tc.free_list[cls].push_back(p);
+
+	pool_cached += class_size;
+}
+
+void set_buffer_pool(const bool hugepages, const int max_cached_per_class)
+{
+	pool_hugepages            = hugepages;
+	pool_max_cached_per_class = std::max(0, max_cached_per_class);
+}
+
+bool get_buffer_pool_hugepages()
+{
+	return pool_hugepages;
+}
+
+int get_buffer_pool_max_cached_per_class()
+{
+	return pool_max_cached_per_class;
+}
+
+buffer_pool_stats_t get_buffer_pool_stats()
+{
+	buffer_pool_stats_t s { 0 };
+
+	s.allocations             = pool_allocations;
+	s.cache_hits              = pool_cache_hits;
+	s.in_use_bytes            = std::max(int64_t(0), int64_t(pool_in_use));
+	s.in_use_high_water_bytes = pool_in_use_high_water;
+	s.cached_bytes            = std::max(int64_t(0), int64_t(pool_cached));
+
+	return s;
+}
+
+void dump_buffer_pool_stats()
+{
+	auto s = get_buffer_pool_stats();
+
+	dolog(ll_info, "buffer pool: %lu allocations, %lu served from cache (%.2f%%), in use: %lu bytes (high water: %lu bytes), cached: %lu bytes",
+			s.allocations, s.cache_hits, s.allocations ? s.cache_hits * 100.0 / s.allocations : 0.,
+			s.in_use_bytes, s.in_use_high_water_bytes, s.cached_bytes);
+}
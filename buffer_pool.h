@@ -0,0 +1,32 @@
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+
+// Per-thread caching allocator for (block-size) buffers.
+// Buffers are cached in power-of-2 size classes from 512 bytes to 4MB; other
+// sizes are passed on to the system allocator. A buffer from pool_malloc()
+// must be released with pool_free(), which also accepts malloc()ed data: the
+// pool records which buffers it allocated.
+
+typedef struct {
+	uint64_t allocations;
+	uint64_t cache_hits;
+	uint64_t in_use_bytes;
+	uint64_t in_use_high_water_bytes;
+	uint64_t cached_bytes;
+} buffer_pool_stats_t;
+
+uint8_t *pool_malloc(const size_t size);
+uint8_t *pool_calloc(const size_t size);
+void     pool_free(void *const p);
+
+// hugepages: back buffers of 2MB and more with transparent hugepages
+// max_cached_per_class: how many free buffers each thread keeps per size class
+void set_buffer_pool(const bool hugepages, const int max_cached_per_class);
+bool get_buffer_pool_hugepages();
+int  get_buffer_pool_max_cached_per_class();
+
+buffer_pool_stats_t get_buffer_pool_stats();
+void dump_buffer_pool_stats();
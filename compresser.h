@@ -12,6 +12,7 @@ public:
 
 	virtual std::string get_type() const = 0;
 
+	// '*out' is allocated with pool_malloc(), release it with pool_free()
 	virtual bool compress(const uint8_t *const in, const size_t in_len, uint8_t **const out, size_t *const out_len) = 0;
 	virtual bool decompress(const uint8_t *const in, const size_t in_len, uint8_t **const out, size_t *const out_len) = 0;
 
@@ -1,5 +1,6 @@
 #include <lzo/lzo1.h>
 
+#include "buffer_pool.h"
 #include "compresser_lzo.h"
 #include "error.h"
 #include "logging.h"
@@ -43,7 +44,7 @@ bool compresser_lzo::compress(const uint8_t *const in, const size_t in_len, uint
 	}
 
 	unsigned long temp_len = in_len + 128 /* TODO: what is the maximum overhead for uncompressible data? */ + 4 /* original size storage */;
-	*out = reinterpret_cast<uint8_t *>(malloc(temp_len));
+	*out = pool_malloc(temp_len);
 	if (!*out) {
 		dolog(ll_error, "compresser_lzo::compress: cannot allocate %d bytes of memory", temp_len);
 		return false;
@@ -59,6 +60,7 @@ bool compresser_lzo::compress(const uint8_t *const in, const size_t in_len, uint
         int rc = lzo1_compress(in, in_len, &(*out)[4], out_len, buffer);
         if (rc != LZO_E_OK) {
                 dolog(ll_error, "compresser_lzo::compress: lzo1_compress failed (%d)", rc);
+                pool_free(*out);
                 return false;
         }
 
@@ -76,7 +78,7 @@ bool compresser_lzo::decompress(const uint8_t *const in, const size_t in_len, ui
 
 	*out_len = (in[0] << 24) | (in[1] << 16) | (in[2] << 8) | in[3];
 
-	*out = reinterpret_cast<uint8_t *>(malloc(*out_len));
+	*out = pool_malloc(*out_len);
 	if (!*out) {
 		dolog(ll_error, "compresser_lzo::decompress: cannot allocate %d bytes of memory", *out_len);
 		return false;
@@ -85,7 +87,7 @@ bool compresser_lzo::decompress(const uint8_t *const in, const size_t in_len, ui
 	int rc = lzo1_decompress(&in[4], in_len - 4, *out, out_len, nullptr);
 	if (rc != LZO_E_OK) {
 		dolog(ll_error, "compresser_lzo::decompress: lzo1_compress failed (%d)", rc);
-		free(*out);
+		pool_free(*out);
 		return false;
 	}
 
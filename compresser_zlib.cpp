@@ -1,5 +1,6 @@
 #include <zlib.h>
 
+#include "buffer_pool.h"
 #include "compresser_zlib.h"
 #include "error.h"
 #include "logging.h"
@@ -50,7 +51,7 @@ bool compresser_zlib::compress(const uint8_t *const in, const size_t in_len, uin
 	}
 
 	unsigned long temp_len = compressBound(in_len) + 4 /* original size storage */;
-	*out = reinterpret_cast<uint8_t *>(malloc(temp_len));
+	*out = pool_malloc(temp_len);
         if (!*out) {
                 dolog(ll_error, "compresser_zlib::compress: cannot allocate %d bytes of memory", temp_len);
                 return false;
@@ -66,7 +67,7 @@ bool compresser_zlib::compress(const uint8_t *const in, const size_t in_len, uin
 
 	if (rc != Z_OK) {
 		dolog(ll_error, "compresser_zlib::compress: compress2 failed (%d)", rc);
-		free(*out);
+		pool_free(*out);
 		return false;
 	}
 
@@ -84,7 +85,7 @@ bool compresser_zlib::decompress(const uint8_t *const in, const size_t in_len, u
 
 	*out_len = (in[0] << 24) | (in[1] << 16) | (in[2] << 8) | in[3];
 
-	*out = reinterpret_cast<uint8_t *>(malloc(*out_len));
+	*out = pool_malloc(*out_len);
         if (!*out) {
                 dolog(ll_error, "compresser_zlib::decompress: cannot allocate %d bytes of memory", *out_len);
                 return false;
@@ -96,13 +97,13 @@ bool compresser_zlib::decompress(const uint8_t *const in, const size_t in_len, u
 	int rc = uncompress2(*out, &dest_len, &in[4], &src_len);
 	if (rc != Z_OK) {
 		dolog(ll_error, "compresser_zlib::decompress: uncompress failed (%d)", rc);
-		free(*out);
+		pool_free(*out);
 		return false;
 	}
 
 	if (dest_len != *out_len) {
 		dolog(ll_error, "compresser_zlib::decompress: uncompress failed, unexpected output size");
-		free(*out);
+		pool_free(*out);
 		return false;
 	}
 
@@ -0,0 +1,62 @@
+#include <string.h>
+
+#include "buffer_pool.h"
+#include "dedup_block_cache.h"
+#include "logging.h"
+#include "str.h"
+
+
+dedup_block_cache::dedup_block_cache(const uint64_t max_memory, const int block_size) :
+	max_memory(max_memory),
+	block_size(block_size),
+	arc(max_memory, block_size)
+{
+	if (max_memory < uint64_t(block_size))
+		throw myformat("dedup_block_cache: memory (%lu bytes) must be at least one block (%d bytes)", max_memory, block_size);
+}
+
+dedup_block_cache::~dedup_block_cache()
+{
+}
+
+uint64_t dedup_block_cache::get_max_memory() const
+{
+	return max_memory;
+}
+
+std::optional<block> dedup_block_cache::lookup(const std::string & hash)
+{
+	return arc.lookup(hash);
+}
+
+uint64_t dedup_block_cache::get_generation(const std::string & hash)
+{
+	return arc.get_generation(hash);
+}
+
+void dedup_block_cache::insert(const std::string & hash, const uint8_t *const data, const uint64_t generation)
+{
+	uint8_t *copy = pool_malloc(block_size);
+	if (!copy) {
+		dolog(ll_warning, "dedup_block_cache::insert: cannot allocate %d bytes of memory", block_size);
+		return;
+	}
+
+	memcpy(copy, data, block_size);
+
+	arc.insert(hash, block(copy, block_size), false, generation);
+}
+
+void dedup_block_cache::forget(const std::string & hash)
+{
+	arc.forget(hash);
+}
+
+void dedup_block_cache::dump_stats(const std::string & id)
+{
+	const arc_cache_stats_t s = arc.get_stats();
+
+	dolog(ll_info, "dedup_block_cache(%s): recent: %zu blocks, frequent: %zu blocks, ghosts: %zu/%zu, target recent: %lu blocks", id.c_str(), s.n_t1, s.n_t2, s.n_b1, s.n_b2, s.p / block_size);
+
+	dolog(ll_info, "dedup_block_cache(%s): hits: %lu, misses: %lu (hit ratio %.2f%%), ghost hits: %lu, evictions: %lu", id.c_str(), s.n_hits, s.n_misses, s.n_hits + s.n_misses ? s.n_hits * 100.0 / (s.n_hits + s.n_misses) : 0., s.n_ghost_hits, s.n_evictions);
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <optional>
+#include <stdint.h>
+#include <string>
+
+#include "arc_cache.h"
+#include "block.h"
+
+
+// RAM cache of the (decompressed) data blocks of storage-backend-dedup, by
+// hash: all block numbers with the same data share one entry, so data that
+// many blocks use (e.g. the image that cloned virtual machines boot from) is
+// retrieved from the database and decompressed once.
+// Replacement is ARC, as in storage_backend_cache: data that is used often
+// is not flushed by a scan over data that is used once. Thread safe.
+class dedup_block_cache
+{
+private:
+	const uint64_t          max_memory;
+	const int               block_size;
+
+	arc_cache<std::string>  arc;
+
+public:
+	dedup_block_cache(const uint64_t max_memory, const int block_size);
+	virtual ~dedup_block_cache();
+
+	uint64_t get_max_memory() const;
+
+	// shares the cached buffer, no copy
+	std::optional<block> lookup(const std::string & hash);
+	// to be retrieved before the data of 'hash' is read from the database
+	uint64_t get_generation(const std::string & hash);
+	// 'data' is copied; not when 'hash' was forgotten after 'generation' was retrieved
+	void insert(const std::string & hash, const uint8_t *const data, const uint64_t generation);
+	// after the data of 'hash' was removed from the database
+	void forget(const std::string & hash);
+
+	void dump_stats(const std::string & id);
+};
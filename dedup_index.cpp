@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <unistd.h>
+
+#include "dedup_index.h"
+#include "logging.h"
+#include "str.h"
+#include "yaml-helpers.h"
+
+
+// ~1% false positives at 10 bits per distinct data block
+constexpr int bloom_filter_n_hashes { 7 };
+
+// list node, map node, strings
+constexpr size_t entry_overhead { 128 };
+
+dedup_index::dedup_index(const uint64_t max_memory, const uint64_t bloom_filter_bits, const std::string & bloom_filter_file) :
+	max_memory(max_memory),
+	bloom_filter_file(bloom_filter_file)
+{
+	if (bloom_filter_bits)
+		bf = new bloom_filter(bloom_filter_bits, bloom_filter_n_hashes);
+}
+
+dedup_index::~dedup_index()
+{
+	delete bf;
+}
+
+dedup_index * dedup_index::create_shard(const int shard, const int n_shards) const
+{
+	const uint64_t    shard_bits = bf ? std::max(uint64_t(64), bf->get_n_bits() / n_shards) : 0;
+	const std::string shard_file = bloom_filter_file.empty() ? "" : myformat("%s.%d", bloom_filter_file.c_str(), shard);
+
+	return new dedup_index(max_memory / n_shards, shard_bits, shard_file);
+}
+
+size_t dedup_index::entry_size(const std::string & key, const std::string & value) const
+{
+	return key.size() * 2 + value.size() + entry_overhead;
+}
+
+void dedup_index::remove(const std::unordered_map<std::string, entry_t>::iterator & it)
+{
+	memory_used -= entry_size(it->first, it->second.value);
+
+	lru.erase(it->second.it);
+
+	entries.erase(it);
+}
+
+bool dedup_index::lookup(const std::string & key, std::string *const value, bool *const exists)
+{
+	auto it = entries.find(key);
+
+	if (it == entries.end()) {
+		n_misses++;
+		return false;
+	}
+
+	n_hits++;
+
+	lru.splice(lru.begin(), lru, it->second.it);
+
+	*value  = it->second.value;
+	*exists = it->second.exists;
+
+	return true;
+}
+
+void dedup_index::insert(const std::string & key, const std::string & value, const bool exists)
+{
+	auto it = entries.find(key);
+	if (it != entries.end())
+		remove(it);
+
+	const size_t size = entry_size(key, value);
+	if (size > max_memory)
+		return;
+
+	while(memory_used + size > max_memory) {
+		remove(entries.find(lru.back()));
+
+		n_evictions++;
+	}
+
+	lru.push_front(key);
+
+	entries.insert({ key, { value, exists, lru.begin() } });
+
+	memory_used += size;
+}
+
+void dedup_index::forget_all()
+{
+	lru.clear();
+
+	entries.clear();
+
+	memory_used = 0;
+}
+
+bool dedup_index::has_bloom_filter() const
+{
+	return bf != nullptr;
+}
+
+bool dedup_index::may_have_hash(const std::string & key)
+{
+	if (!bf)
+		return true;
+
+	if (bf->maybe_contains(reinterpret_cast<const uint8_t *>(key.c_str()), key.size()))
+		return true;
+
+	n_bloom_negatives++;
+
+	return false;
+}
+
+void dedup_index::add_hash(const std::string & key)
+{
+	if (bf)
+		bf->add(reinterpret_cast<const uint8_t *>(key.c_str()), key.size());
+}
+
+void dedup_index::bloom_false_positive()
+{
+	n_bloom_false_positives++;
+}
+
+bool dedup_index::load_bloom_filter(const uint64_t tag)
+{
+	if (!bf || bloom_filter_file.empty())
+		return false;
+
+	if (bf->load(bloom_filter_file, tag) == false)
+		return false;
+
+	// when mystorage does not stop cleanly, the file is outdated: it must not be used then
+	if (unlink(bloom_filter_file.c_str()) == -1) {
+		dolog(ll_warning, "dedup_index: cannot remove \"%s\", not using it", bloom_filter_file.c_str());
+
+		bf->clear();
+
+		return false;
+	}
+
+	dolog(ll_info, "dedup_index: Bloom filter loaded from \"%s\" (%lu hashes, %.2f%% of the bits set)", bloom_filter_file.c_str(), bf->get_n_added(), bf->get_fill_ratio() * 100.);
+
+	return true;
+}
+
+void dedup_index::save_bloom_filter(const uint64_t tag)
+{
+	if (bf && bloom_filter_file.empty() == false)
+		bf->save(bloom_filter_file, tag);
+}
+
+void dedup_index::dump_stats(const std::string & id)
+{
+	uint64_t hits = n_hits, misses = n_misses;
+
+	dolog(ll_info, "dedup_index(%s): %zu records cached (%lu bytes), hits: %lu, misses: %lu (hit ratio %.2f%%), evictions: %lu", id.c_str(), entries.size(), memory_used, hits, misses, hits + misses ? hits * 100.0 / (hits + misses) : 0., n_evictions.load());
+
+	if (bf)
+		dolog(ll_info, "dedup_index(%s): Bloom filter: %lu lookups skipped, %lu false positives, %.2f%% of the bits set", id.c_str(), n_bloom_negatives.load(), n_bloom_false_positives.load(), bf->get_fill_ratio() * 100.);
+}
+
+YAML::Node dedup_index::emit_configuration() const
+{
+	YAML::Node out;
+	out["memory"] = max_memory;
+	out["bloom-filter-bits"] = bf ? bf->get_n_bits() : 0;
+	out["bloom-filter-file"] = bloom_filter_file;
+
+	return out;
+}
+
+dedup_index * dedup_index::load_configuration(const YAML::Node & node)
+{
+	dolog(ll_info, " * dedup_index::load_configuration");
+
+	uint64_t max_memory = yaml_get_uint64_t(node, "memory", "how much RAM to use for cached dedup records", true);
+
+	// optional: 0 or not set is no Bloom filter
+	uint64_t bloom_filter_bits = node["bloom-filter-bits"] ? yaml_get_uint64_t(node, "bloom-filter-bits", "size of the Bloom filter in bits (10 per distinct block gives ~1% false positives)", true) : 0;
+
+	// optional: without it, the Bloom filter is rebuilt at every start
+	std::string bloom_filter_file = node["bloom-filter-file"] ? yaml_get_string(node, "bloom-filter-file", "file to save the Bloom filter in at shutdown") : "";
+
+	return new dedup_index(max_memory, bloom_filter_bits, bloom_filter_file);
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <atomic>
+#include <list>
+#include <optional>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <yaml-cpp/yaml.h>
+
+#include "bloom_filter.h"
+
+
+// RAM index in front of the database of storage-backend-dedup:
+// - an LRU cache of its records (block => hash, hash => use count + data),
+//   including the knowledge that a record does not exist; it is write-
+//   through so it never differs from the database
+// - a Bloom filter of the hashes that have a record: for data that was not
+//   seen before (most writes of new data) the lookup of its hash is skipped
+// The Bloom filter is saved at shutdown and loaded at startup. It is only
+// used when it was saved for the same database, else it is rebuilt by
+// scanning the database. Not thread safe: the dedup lock covers it.
+class dedup_index
+{
+private:
+	typedef struct {
+		std::string                      value;
+		bool                             exists;
+		std::list<std::string>::iterator it;
+	} entry_t;
+
+	const uint64_t         max_memory;
+	const std::string      bloom_filter_file;  // optional
+	bloom_filter          *bf { nullptr };
+
+	std::list<std::string> lru;  // MRU at the front
+	std::unordered_map<std::string, entry_t> entries;
+	uint64_t               memory_used { 0 };
+
+	std::atomic_uint64_t   n_hits { 0 };
+	std::atomic_uint64_t   n_misses { 0 };
+	std::atomic_uint64_t   n_evictions { 0 };
+	std::atomic_uint64_t   n_bloom_negatives { 0 };        // lookups skipped
+	std::atomic_uint64_t   n_bloom_false_positives { 0 };
+
+	size_t entry_size(const std::string & key, const std::string & value) const;
+	void   remove(const std::unordered_map<std::string, entry_t>::iterator & it);
+
+public:
+	dedup_index(const uint64_t max_memory, const uint64_t bloom_filter_bits, const std::string & bloom_filter_file);
+	virtual ~dedup_index();
+
+	// the index of shard 'shard' of 'n_shards': an equal part of the memory and of the Bloom filter
+	dedup_index * create_shard(const int shard, const int n_shards) const;
+
+	// true when 'key' is cached; '*exists' is false when it is known not to be in the database
+	bool lookup(const std::string & key, std::string *const value, bool *const exists);
+	void insert(const std::string & key, const std::string & value, const bool exists);
+	// after an aborted transaction, the cache may hold what was not committed
+	void forget_all();
+
+	bool has_bloom_filter() const;
+	// false when the database has no record for 'key' for sure
+	bool may_have_hash(const std::string & key);
+	void add_hash(const std::string & key);
+	void bloom_false_positive();
+	// 'tag' identifies the state of the database (e.g. its number of records)
+	bool load_bloom_filter(const uint64_t tag);
+	void save_bloom_filter(const uint64_t tag);
+
+	void dump_stats(const std::string & id);
+
+	YAML::Node emit_configuration() const;
+	static dedup_index * load_configuration(const YAML::Node & node);
+};
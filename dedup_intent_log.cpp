@@ -0,0 +1,251 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <map>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "dedup_intent_log.h"
+#include "io.h"
+#include "logging.h"
+#include "str.h"
+
+
+// 'I', id (8 bytes), length of the changes (4 bytes), changes
+// each change: shard (4 bytes), 1 when there is a value (1 byte), length of the key (4 bytes), key[, length of the value (4 bytes), value]
+// 'D', id (8 bytes)
+// all little endian
+constexpr char record_changes { 'I' };
+constexpr char record_done    { 'D' };
+
+static void add_uint(std::string *const out, const uint64_t v, const int n_bytes)
+{
+	for(int i=0; i<n_bytes; i++)
+		*out += char(v >> (i * 8));
+}
+
+static bool get_uint(const std::string & in, size_t *const offset, const int n_bytes, uint64_t *const v)
+{
+	if (*offset + n_bytes > in.size())
+		return false;
+
+	*v = 0;
+
+	for(int i=0; i<n_bytes; i++)
+		*v |= uint64_t(uint8_t(in[*offset + i])) << (i * 8);
+
+	*offset += n_bytes;
+
+	return true;
+}
+
+static bool get_string(const std::string & in, size_t *const offset, std::string *const out)
+{
+	uint64_t len = 0;
+	if (get_uint(in, offset, 4, &len) == false || *offset + len > in.size())
+		return false;
+
+	*out = in.substr(*offset, len);
+
+	*offset += len;
+
+	return true;
+}
+
+dedup_intent_log::dedup_intent_log(const std::string & file) : file(file)
+{
+	fd = open(file.c_str(), O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+
+	if (fd == -1)
+		throw myformat("dedup_intent_log: cannot open \"%s\": %s", file.c_str(), strerror(errno));
+}
+
+dedup_intent_log::~dedup_intent_log()
+{
+	close(fd);
+}
+
+bool dedup_intent_log::get_unfinished(std::vector<std::vector<change_t> > *const out)
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	struct stat st { };
+	if (fstat(fd, &st) == -1) {
+		dolog(ll_error, "dedup_intent_log::get_unfinished: cannot stat \"%s\": %s", file.c_str(), strerror(errno));
+		return false;
+	}
+
+	std::string in(st.st_size, 0);
+	if (PREAD(fd, reinterpret_cast<uint8_t *>(in.data()), in.size(), 0) != ssize_t(in.size())) {
+		dolog(ll_error, "dedup_intent_log::get_unfinished: cannot read \"%s\": %s", file.c_str(), strerror(errno));
+		return false;
+	}
+
+	std::map<uint64_t, std::vector<change_t> > unfinished;  // by id: in the order they were logged
+
+	size_t offset = 0;
+
+	while(offset < in.size()) {
+		const char type = in[offset++];
+		uint64_t   id   = 0;
+
+		if (get_uint(in, &offset, 8, &id) == false)
+			break;
+
+		next_id = std::max(next_id, id + 1);
+
+		if (type == record_done) {
+			unfinished.erase(id);
+			continue;
+		}
+
+		uint64_t len = 0;
+		if (type != record_changes || get_uint(in, &offset, 4, &len) == false || offset + len > in.size()) {
+			// the last record may be incomplete: then none of it was applied yet
+			break;
+		}
+
+		const size_t end = offset + len;
+
+		std::vector<change_t> changes;
+
+		while(offset < end) {
+			change_t c;
+			uint64_t shard     = 0;
+			uint64_t has_value = 0;
+
+			if (get_uint(in, &offset, 4, &shard) == false || get_uint(in, &offset, 1, &has_value) == false || get_string(in, &offset, &c.key) == false) {
+				dolog(ll_error, "dedup_intent_log::get_unfinished: \"%s\" is corrupt", file.c_str());
+				return false;
+			}
+
+			c.shard = shard;
+
+			if (has_value) {
+				std::string value;
+				if (get_string(in, &offset, &value) == false) {
+					dolog(ll_error, "dedup_intent_log::get_unfinished: \"%s\" is corrupt", file.c_str());
+					return false;
+				}
+
+				c.value = value;
+			}
+
+			changes.push_back(c);
+		}
+
+		unfinished.insert({ id, changes });
+	}
+
+	out->clear();
+
+	for(auto & u : unfinished)
+		out->push_back(u.second);
+
+	return true;
+}
+
+bool dedup_intent_log::clear()
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	if (ftruncate(fd, 0) == -1) {
+		dolog(ll_error, "dedup_intent_log::clear: cannot truncate \"%s\": %s", file.c_str(), strerror(errno));
+		return false;
+	}
+
+	if (fdatasync(fd) == -1) {
+		dolog(ll_error, "dedup_intent_log::clear: cannot sync \"%s\": %s", file.c_str(), strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+std::optional<uint64_t> dedup_intent_log::log_changes(const std::vector<change_t> & changes)
+{
+	std::string payload;
+
+	for(auto & c : changes) {
+		add_uint(&payload, c.shard, 4);
+		add_uint(&payload, c.value.has_value(), 1);
+		add_uint(&payload, c.key.size(), 4);
+		payload += c.key;
+
+		if (c.value.has_value()) {
+			add_uint(&payload, c.value.value().size(), 4);
+			payload += c.value.value();
+		}
+	}
+
+	std::unique_lock<std::mutex> lck(lock);
+
+	const uint64_t id = next_id++;
+
+	std::string record(1, record_changes);
+	add_uint(&record, id, 8);
+	add_uint(&record, payload.size(), 4);
+	record += payload;
+
+	// one write: a record is either complete or the last (incomplete) one
+	if (WRITE(fd, reinterpret_cast<const uint8_t *>(record.data()), record.size()) != ssize_t(record.size())) {
+		dolog(ll_error, "dedup_intent_log::log_changes: cannot write to \"%s\": %s", file.c_str(), strerror(errno));
+		return { };
+	}
+
+	n_open++;
+
+	// on disk before any shard changes
+	if (fdatasync(fd) == -1) {
+		dolog(ll_error, "dedup_intent_log::log_changes: cannot sync \"%s\": %s", file.c_str(), strerror(errno));
+
+		// the changes will not be applied: they must not be at the next start either
+		finish(id);
+
+		return { };
+	}
+
+	return id;
+}
+
+bool dedup_intent_log::mark_done(const uint64_t id)
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	return finish(id);
+}
+
+bool dedup_intent_log::finish(const uint64_t id)
+{
+	n_open--;
+
+	bool retired = false;
+
+	// nothing is in progress: the log can start over
+	if (n_open == 0) {
+		retired = ftruncate(fd, 0) == 0;
+
+		if (!retired)
+			dolog(ll_warning, "dedup_intent_log::finish: cannot truncate \"%s\": %s", file.c_str(), strerror(errno));
+	}
+
+	if (!retired) {
+		std::string record(1, record_done);
+		add_uint(&record, id, 8);
+
+		if (WRITE(fd, reinterpret_cast<const uint8_t *>(record.data()), record.size()) != ssize_t(record.size())) {
+			dolog(ll_error, "dedup_intent_log::finish: cannot write to \"%s\": %s", file.c_str(), strerror(errno));
+			return false;
+		}
+	}
+
+	// on disk before a later change of the same records can be: else a replay would undo that one
+	if (fdatasync(fd) == -1) {
+		dolog(ll_error, "dedup_intent_log::finish: cannot sync \"%s\": %s", file.c_str(), strerror(errno));
+		return false;
+	}
+
+	return true;
+}
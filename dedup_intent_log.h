@@ -0,0 +1,48 @@
+#pragma once
+#include <mutex>
+#include <optional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+// Log of the changes of storage-backend-dedup that span several shards.
+// They are logged before they are applied to the shards and marked done
+// afterwards: when mystorage stops in between, the shards differ and the
+// changes that were not marked done are applied (again) at the next start.
+// The changes are the new values of the records (not e.g. use count
+// deltas), so applying them twice is harmless.
+class dedup_intent_log
+{
+public:
+	typedef struct {
+		int                        shard;
+		std::string                key;
+		std::optional<std::string> value;  // no value: remove the record
+	} change_t;
+
+private:
+	const std::string file;
+	int               fd { -1 };
+
+	std::mutex        lock;
+	uint64_t          next_id { 0 };
+	uint64_t          n_open { 0 };  // logged but not yet marked done
+
+	bool finish(const uint64_t id);  // 'lock' must be locked
+
+public:
+	dedup_intent_log(const std::string & file);
+	virtual ~dedup_intent_log();
+
+	// what was logged but not marked done, in the order it was logged
+	bool get_unfinished(std::vector<std::vector<change_t> > *const out);
+	// after the unfinished changes were applied and are on disk
+	bool clear();
+
+	// returns when the changes are on disk
+	std::optional<uint64_t> log_changes(const std::vector<change_t> & changes);
+	// also when the changes could not be applied: they are then not applied at the next start either;
+	// returns when that is on disk
+	bool mark_done(const uint64_t id);
+};
@@ -0,0 +1,208 @@
+#include <kcpolydb.h>
+#include <map>
+#include <string.h>
+#include <unistd.h>
+
+#include "dedup_schema.h"
+#include "str.h"
+
+
+std::string dedup_block_key(const uint64_t block_nr)
+{
+	std::string key(1 + sizeof block_nr, 'b');
+
+	for(size_t i=0; i<sizeof block_nr; i++)
+		key[1 + i] = char(block_nr >> (56 - i * 8));
+
+	return key;
+}
+
+std::string dedup_hash_key(const std::string & hash)
+{
+	return 'h' + hash;
+}
+
+int dedup_get_shard_for_block(const uint64_t block_nr, const int n_shards)
+{
+	return block_nr / dedup_shard_blocks % n_shards;
+}
+
+int dedup_get_shard_for_hash(const std::string & hash, const int n_shards)
+{
+	const unsigned prefix = (uint8_t(hash.at(0)) << 8) | uint8_t(hash.at(1));
+
+	return prefix % n_shards;
+}
+
+uint64_t dedup_get_use_count(const uint8_t *const record)
+{
+	uint64_t use_count = 0;
+
+	for(size_t i=0; i<dedup_record_header_size; i++)
+		use_count |= uint64_t(record[i]) << (i * 8);
+
+	return use_count;
+}
+
+void dedup_set_use_count(uint8_t *const record, const uint64_t use_count)
+{
+	for(size_t i=0; i<dedup_record_header_size; i++)
+		record[i] = use_count >> (i * 8);
+}
+
+static bool hex_to_bin(const std::string & hex, std::string *const out)
+{
+	if (hex.size() & 1)
+		return false;
+
+	out->resize(hex.size() / 2);
+
+	for(size_t i=0; i<hex.size(); i++) {
+		const char c = hex[i];
+		int nibble = 0;
+
+		if (c >= '0' && c <= '9')
+			nibble = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			nibble = c - 'a' + 10;
+		else
+			return false;
+
+		if (i & 1)
+			(*out)[i / 2] |= nibble;
+		else
+			(*out)[i / 2] = nibble << 4;
+	}
+
+	return true;
+}
+
+bool dedup_migrate_v1(const std::string & from, const std::string & to, dedup_migrate_result_t *const result, std::string *const error)
+{
+	// v1 keys
+	const std::string block_prefix = "block-to-hash_";
+	const std::string data_prefix  = "data-block_";
+
+	*result = { };
+
+	if (access(to.c_str(), F_OK) == 0) {
+		*error = myformat("\"%s\" already exists", to.c_str());
+		return false;
+	}
+
+	kyotocabinet::PolyDB db_from;
+	if (db_from.open(from, kyotocabinet::PolyDB::OREADER) == false) {
+		*error = myformat("cannot open \"%s\": %s", from.c_str(), db_from.error().message());
+		return false;
+	}
+
+	std::string compressed_value;
+	if (db_from.get("compressed", &compressed_value) == false) {
+		*error = myformat("\"%s\" is not a dedup database", from.c_str());
+		return false;
+	}
+
+	std::string schema_value;
+	if (db_from.get("schema", &schema_value)) {
+		*error = myformat("\"%s\" already has schema %s", from.c_str(), schema_value.c_str());
+		return false;
+	}
+
+	kyotocabinet::PolyDB db_to;
+	if (db_to.open(to, kyotocabinet::PolyDB::OWRITER | kyotocabinet::PolyDB::OCREATE | kyotocabinet::PolyDB::OTRUNCATE) == false) {
+		*error = myformat("cannot create \"%s\": %s", to.c_str(), db_to.error().message());
+		return false;
+	}
+
+	// the stored use counts of v1 cannot be trusted (data of a block that
+	// became unused was never removed): count the mappings instead
+	std::map<std::string, uint64_t> use_counts;  // hex hash -> count
+
+	kyotocabinet::PolyDB::Cursor *cur = db_from.cursor();
+	cur->jump();
+
+	std::string key;
+	std::string value;
+	bool        ok = true;
+
+	while(ok && cur->get(&key, &value, true)) {
+		if (key.compare(0, block_prefix.size(), block_prefix) != 0)
+			continue;
+
+		char    *end      = nullptr;
+		uint64_t block_nr = strtoull(key.c_str() + block_prefix.size(), &end, 10);
+
+		std::string hash;
+		if (*end != 0 || hex_to_bin(value, &hash) == false) {
+			*error = myformat("invalid mapping \"%s\"", key.c_str());
+			ok = false;
+			break;
+		}
+
+		const std::string new_key = dedup_block_key(block_nr);
+
+		if (db_to.set(new_key, hash) == false) {
+			*error = myformat("cannot write to \"%s\": %s", to.c_str(), db_to.error().message());
+			ok = false;
+			break;
+		}
+
+		use_counts[value]++;
+
+		result->n_blocks++;
+	}
+
+	// data that is still used, with its count in front
+	for(auto it = use_counts.begin(); ok && it != use_counts.end(); it++) {
+		std::string data;
+		if (db_from.get(data_prefix + it->first, &data) == false) {
+			result->n_missing++;
+			continue;
+		}
+
+		std::string hash;
+		hex_to_bin(it->first, &hash);
+
+		std::string record(dedup_record_header_size, 0);
+		dedup_set_use_count(reinterpret_cast<uint8_t *>(record.data()), it->second);
+		record += data;
+
+		if (db_to.set(dedup_hash_key(hash), record) == false) {
+			*error = myformat("cannot write to \"%s\": %s", to.c_str(), db_to.error().message());
+			ok = false;
+			break;
+		}
+
+		result->n_records++;
+	}
+
+	if (ok) {
+		cur->jump();
+
+		while(cur->get(&key, &value, true)) {
+			if (key.compare(0, data_prefix.size(), data_prefix) == 0 && use_counts.find(key.substr(data_prefix.size())) == use_counts.end())
+				result->n_unreferenced++;
+		}
+	}
+
+	delete cur;
+
+	// before schema 2 the hash function was always SHA3-384
+	if (ok && (db_to.set("compressed", compressed_value) == false || db_to.set("schema", DEDUP_SCHEMA_VERSION) == false || db_to.set("hash", "hash-sha384") == false)) {
+		*error = myformat("cannot write to \"%s\": %s", to.c_str(), db_to.error().message());
+		ok = false;
+	}
+
+	if (ok && db_to.synchronize(true) == false) {
+		*error = myformat("cannot sync \"%s\": %s", to.c_str(), db_to.error().message());
+		ok = false;
+	}
+
+	db_to.close();
+	db_from.close();
+
+	if (!ok)
+		unlink(to.c_str());
+
+	return ok;
+}
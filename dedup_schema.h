@@ -0,0 +1,46 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+
+
+// Key layout of the database of storage-backend-dedup (schema 2):
+// - 'b' + block number (8 bytes, big endian)  => hash of the data (binary)
+// - 'h' + hash (binary)                        => use count (8 bytes, little endian) + data (compressed when configured)
+// - "compressed"                               => type of the compresser (empty when none)
+// - "schema"                                   => "2"
+// - "hash"                                     => type of the hash function (hash::get_type())
+// - "shards", "shard"                          => number of shards and which one this is (only with more than one)
+// The block numbers are big endian so that consecutive blocks are next to
+// each other in a B+ tree database.
+//
+// A store can be split in shards: files <file>.0 ... <file>.<n - 1>, each
+// with the same keys. The mappings of each dedup_shard_blocks consecutive
+// blocks are in one shard, the record of a hash is in the shard selected by
+// the first two bytes of the hash.
+
+#define DEDUP_SCHEMA_VERSION "2"
+
+constexpr size_t dedup_record_header_size { 8 };
+
+constexpr uint64_t dedup_shard_blocks { 256 };
+
+std::string dedup_block_key(const uint64_t block_nr);
+std::string dedup_hash_key(const std::string & hash);
+
+int dedup_get_shard_for_block(const uint64_t block_nr, const int n_shards);
+int dedup_get_shard_for_hash(const std::string & hash, const int n_shards);
+
+uint64_t dedup_get_use_count(const uint8_t *const record);
+void     dedup_set_use_count(uint8_t *const record, const uint64_t use_count);
+
+typedef struct {
+	uint64_t n_blocks;        // block to hash mappings
+	uint64_t n_records;       // distinct data blocks
+	uint64_t n_unreferenced;  // data blocks that no block used (dropped)
+	uint64_t n_missing;       // hashes without data (kept: reading these blocks fails, as before)
+} dedup_migrate_result_t;
+
+// Converts a database with the string keys of before schema 2 into a new
+// file 'to'. The use counts are recomputed from the block mappings.
+// Returns false (and sets 'error') on failure.
+bool dedup_migrate_v1(const std::string & from, const std::string & to, dedup_migrate_result_t *const result, std::string *const error);
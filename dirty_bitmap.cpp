@@ -0,0 +1,354 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dirty_bitmap.h"
+#include "logging.h"
+#include "str.h"
+#include "time.h"
+#include "yaml-helpers.h"
+
+
+// how long the bit of a region stays set after the last write to it ended
+constexpr uint64_t intent_linger_us { 2000000 };
+
+dirty_bitmap::dirty_bitmap(const std::string & file, const offset_t size, const uint64_t region_size, const uint64_t resync_max_rate) :
+	file(file),
+	region_size(region_size),
+	n_regions(region_size ? (size + region_size - 1) / region_size : 0),
+	resync_max_rate(resync_max_rate)
+{
+	if (region_size == 0)
+		throw myformat("dirty_bitmap(%s): region size must be > 0", file.c_str());
+
+	map_size = std::max(uint64_t(1), (n_regions + 7) / 8);
+
+	fd = open(file.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd == -1)
+		throw myformat("dirty_bitmap(%s): cannot open: %s", file.c_str(), strerror(errno));
+
+	struct stat st { };
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		throw myformat("dirty_bitmap(%s): cannot retrieve file size: %s", file.c_str(), strerror(errno));
+	}
+
+	// made for an other size or region size: the regions it recorded are unknown
+	const bool mismatch = st.st_size != 0 && size_t(st.st_size) != map_size;
+
+	created = st.st_size == 0;
+
+	if (ftruncate(fd, map_size) == -1) {
+		close(fd);
+		throw myformat("dirty_bitmap(%s): cannot resize to %zu bytes: %s", file.c_str(), map_size, strerror(errno));
+	}
+
+	map = reinterpret_cast<uint8_t *>(mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+	if (map == MAP_FAILED) {
+		close(fd);
+		throw myformat("dirty_bitmap(%s): cannot mmap: %s", file.c_str(), strerror(errno));
+	}
+
+	if (mismatch) {
+		dolog(ll_warning, "dirty_bitmap(%s): does not match the size of the mirror, marking everything as dirty", file.c_str());
+
+		memset(map, 0x00, map_size);
+
+		for(uint64_t r=0; r<n_regions; r++)
+			map[r / 8] |= 1 << (r & 7);
+
+		msync(map, map_size, MS_SYNC);
+	}
+
+	for(size_t i=0; i<map_size; i++)
+		n_dirty += __builtin_popcount(map[i]);
+
+	if (n_dirty)
+		dolog(ll_info, "dirty_bitmap(%s): %lu of %lu regions are dirty", file.c_str(), n_dirty, n_regions);
+}
+
+dirty_bitmap::~dirty_bitmap()
+{
+	// no writes are in progress anymore
+	for(auto & i : intents) {
+		if (i.second.dirty == false)
+			unset(i.first);
+	}
+
+	msync(map, map_size, MS_SYNC);
+
+	munmap(map, map_size);
+
+	close(fd);
+}
+
+bool dirty_bitmap::is_set(const uint64_t region) const
+{
+	return map[region / 8] & (1 << (region & 7));
+}
+
+bool dirty_bitmap::set(const uint64_t region)
+{
+	if (is_set(region))
+		return false;
+
+	map[region / 8] |= 1 << (region & 7);
+
+	return true;
+}
+
+void dirty_bitmap::unset(const uint64_t region)
+{
+	map[region / 8] &= ~(1 << (region & 7));
+}
+
+void dirty_bitmap::sync(const uint64_t first, const uint64_t last)
+{
+	// msync wants a page aligned address
+	const long     page_size = sysconf(_SC_PAGESIZE);
+	const uint64_t start     = first / 8 / page_size * page_size;
+
+	if (msync(&map[start], last / 8 + 1 - start, MS_SYNC) == -1)
+		dolog(ll_error, "dirty_bitmap::sync(%s): cannot sync to disk: %s", file.c_str(), strerror(errno));
+}
+
+void dirty_bitmap::mark(const offset_t offset, const uint64_t len)
+{
+	if (len == 0)
+		return;
+
+	const uint64_t first = offset / region_size;
+	const uint64_t last  = std::min((offset + len - 1) / region_size, n_regions - 1);
+
+	std::unique_lock<std::mutex> lck(lock);
+
+	bool changed = false;
+
+	for(uint64_t r=first; r<=last; r++) {
+		auto it = intents.find(r);
+
+		// the bit is set (on disk) already
+		if (it != intents.end()) {
+			if (it->second.dirty == false) {
+				it->second.dirty = true;
+
+				n_dirty++;
+			}
+
+			continue;
+		}
+
+		if (set(r)) {
+			n_dirty++;
+
+			changed = true;
+		}
+	}
+
+	if (changed)
+		sync(first, last);
+}
+
+void dirty_bitmap::clear(const uint64_t region)
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	auto it = intents.find(region);
+
+	// the bit stays until the writes to it have ended a while ago
+	if (it != intents.end()) {
+		if (it->second.dirty) {
+			it->second.dirty = false;
+
+			n_dirty--;
+		}
+
+		return;
+	}
+
+	// not synced right away: at worst a region is copied once more after a crash
+	if (is_set(region)) {
+		unset(region);
+
+		n_dirty--;
+	}
+}
+
+void dirty_bitmap::begin_write(const offset_t offset, const uint64_t len)
+{
+	if (len == 0)
+		return;
+
+	const uint64_t first = offset / region_size;
+	const uint64_t last  = std::min((offset + len - 1) / region_size, n_regions - 1);
+
+	std::unique_lock<std::mutex> lck(lock);
+
+	bool changed = false;
+
+	for(uint64_t r=first; r<=last; r++) {
+		auto it = intents.find(r);
+
+		if (it == intents.end()) {
+			// a bit that is set without writes in progress is a dirty region
+			const bool dirty = is_set(r);
+
+			it = intents.insert({ r, { 0, dirty, 0 } }).first;
+
+			if (!dirty) {
+				set(r);
+
+				changed = true;
+			}
+		}
+
+		it->second.n_writes++;
+	}
+
+	if (changed)
+		sync(first, last);
+}
+
+void dirty_bitmap::end_write(const offset_t offset, const uint64_t len)
+{
+	if (len == 0)
+		return;
+
+	const uint64_t first = offset / region_size;
+	const uint64_t last  = std::min((offset + len - 1) / region_size, n_regions - 1);
+	const uint64_t now   = get_us();
+
+	std::unique_lock<std::mutex> lck(lock);
+
+	for(uint64_t r=first; r<=last; r++) {
+		auto it = intents.find(r);
+
+		if (it == intents.end() || it->second.n_writes == 0) {
+			dolog(ll_error, "dirty_bitmap::end_write(%s): no write to region %lu in progress", file.c_str(), r);
+			continue;
+		}
+
+		if (--it->second.n_writes == 0) {
+			it->second.idle_since = now;
+
+			idle.push_back({ r, now });
+		}
+	}
+
+	clear_idle(now);
+}
+
+void dirty_bitmap::clear_idle(const uint64_t now)
+{
+	while(idle.empty() == false && now - idle.front().second >= intent_linger_us) {
+		auto [r, since] = idle.front();
+
+		idle.pop_front();
+
+		// written again since then
+		auto it = intents.find(r);
+		if (it == intents.end() || it->second.n_writes > 0 || it->second.idle_since != since)
+			continue;
+
+		// not synced right away, as in clear()
+		if (it->second.dirty == false)
+			unset(r);
+
+		intents.erase(it);
+	}
+}
+
+bool dirty_bitmap::is_dirty(const uint64_t region) const
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	auto it = intents.find(region);
+	if (it != intents.end())
+		return it->second.dirty;
+
+	return is_set(region);
+}
+
+std::optional<uint64_t> dirty_bitmap::find_dirty(const uint64_t from) const
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	if (n_dirty == 0)
+		return { };
+
+	for(uint64_t i=0; i<n_regions; i++) {
+		const uint64_t r = (from + i) % n_regions;
+
+		// skip clean bytes at once
+		if ((r & 7) == 0 && r + 8 <= n_regions && map[r / 8] == 0) {
+			i += 7;
+			continue;
+		}
+
+		if (is_set(r) == false)
+			continue;
+
+		// only set for writes in progress
+		auto it = intents.find(r);
+		if (it != intents.end() && it->second.dirty == false)
+			continue;
+
+		return r;
+	}
+
+	return { };
+}
+
+bool dirty_bitmap::was_created() const
+{
+	return created;
+}
+
+uint64_t dirty_bitmap::get_n_dirty() const
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	return n_dirty;
+}
+
+uint64_t dirty_bitmap::get_n_regions() const
+{
+	return n_regions;
+}
+
+uint64_t dirty_bitmap::get_region_size() const
+{
+	return region_size;
+}
+
+uint64_t dirty_bitmap::get_resync_max_rate() const
+{
+	return resync_max_rate;
+}
+
+YAML::Node dirty_bitmap::emit_configuration() const
+{
+	YAML::Node out;
+	out["file"] = file;
+	out["region-size"] = region_size;
+	out["resync-max-rate"] = resync_max_rate;
+
+	return out;
+}
+
+dirty_bitmap * dirty_bitmap::load_configuration(const YAML::Node & node, const offset_t size)
+{
+	dolog(ll_info, " * dirty_bitmap::load_configuration");
+
+	std::string file = yaml_get_string(node, "file", "file to store the dirty-region bitmap in");
+
+	uint64_t region_size = yaml_get_uint64_t(node, "region-size", "how many bytes a bit in the dirty-region bitmap covers", true);
+
+	uint64_t resync_max_rate = yaml_get_uint64_t(node, "resync-max-rate", "maximum number of bytes per second to copy when resynchronising (0: no limit)", true);
+
+	return new dirty_bitmap(file, size, region_size, resync_max_rate);
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <yaml-cpp/yaml.h>
+
+#include "types.h"
+
+
+// One bit per region of a mirror, set when that region may differ from the
+// storage backend it mirrors (e.g. because a write to it failed). It is kept
+// in an mmap()ed file so that it survives a restart; setting a bit is on disk
+// before mark() returns. mirror_resync copies the dirty regions.
+// A bit is also set while a write to the storage backend and the mirror is
+// in progress (begin_write/end_write): when mystorage stops halfway, that
+// region is dirty at the next start. These bits are cleared a while after
+// the last write to the region ended, so that a region that is written to
+// all the time does not need a sync of the bitmap for each write.
+class dirty_bitmap
+{
+private:
+	const std::string  file;
+	const uint64_t     region_size;
+	const uint64_t     n_regions;
+	const uint64_t     resync_max_rate;  // bytes per second, 0 for no limit
+
+	int                fd       { -1 };
+	uint8_t           *map      { nullptr };
+	size_t             map_size { 0 };
+	bool               created  { false };  // the file did not exist (or was empty)
+
+	typedef struct {
+		uint32_t n_writes;    // in progress
+		bool     dirty;       // also dirty regardless of the writes (then counted in n_dirty)
+		uint64_t idle_since;  // when n_writes became 0
+	} intent_t;
+
+	mutable std::mutex lock;
+	uint64_t           n_dirty  { 0 };  // without the bits that are only set for writes in progress
+	std::unordered_map<uint64_t, intent_t> intents;  // by region
+	std::deque<std::pair<uint64_t, uint64_t> > idle;  // region, since: to clear later
+
+	bool is_set(const uint64_t region) const;  // 'lock' must be locked for these
+	bool set(const uint64_t region);  // returns false when it was set already
+	void unset(const uint64_t region);
+	void sync(const uint64_t first, const uint64_t last);
+	void clear_idle(const uint64_t now);
+
+public:
+	dirty_bitmap(const std::string & file, const offset_t size, const uint64_t region_size, const uint64_t resync_max_rate);
+	virtual ~dirty_bitmap();
+
+	void mark(const offset_t offset, const uint64_t len);
+	void clear(const uint64_t region);
+
+	// the bits are on disk before begin_write returns
+	void begin_write(const offset_t offset, const uint64_t len);
+	void end_write(const offset_t offset, const uint64_t len);
+
+	bool     is_dirty(const uint64_t region) const;
+	// first dirty region at or after 'from', wraps around
+	std::optional<uint64_t> find_dirty(const uint64_t from) const;
+
+	// nothing was recorded for this mirror before
+	bool     was_created() const;
+	uint64_t get_n_dirty() const;
+	uint64_t get_n_regions() const;
+	uint64_t get_region_size() const;
+	uint64_t get_resync_max_rate() const;
+
+	YAML::Node emit_configuration() const;
+	static dirty_bitmap * load_configuration(const YAML::Node & node, const offset_t size);
+};
@@ -0,0 +1,261 @@
+#include <algorithm>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "gf256.h"
+
+
+typedef struct {
+	uint8_t exp[512];  // twice, so that exp[log a + log b] needs no modulo
+	uint8_t log[256];
+	uint8_t mul[256][256];
+} gf256_tables_t;
+
+static constexpr gf256_tables_t make_tables()
+{
+	gf256_tables_t t { };
+
+	int x = 1;
+
+	for(int i=0; i<255; i++) {
+		t.exp[i]       = x;
+		t.exp[i + 255] = x;
+		t.log[x]       = i;
+
+		x <<= 1;
+
+		if (x & 0x100)
+			x ^= 0x11d;
+	}
+
+	for(int a=1; a<256; a++) {
+		for(int b=1; b<256; b++)
+			t.mul[a][b] = t.exp[t.log[a] + t.log[b]];
+	}
+
+	return t;
+}
+
+// computed at compile time
+static constexpr gf256_tables_t tables = make_tables();
+
+uint8_t gf256_mul(const uint8_t a, const uint8_t b)
+{
+	return tables.mul[a][b];
+}
+
+uint8_t gf256_inv(const uint8_t a)
+{
+	return tables.exp[255 - tables.log[a]];
+}
+
+static void gf256_mul_add_scalar(uint8_t *const dst, const uint8_t *const src, const uint8_t c, const size_t len)
+{
+	size_t i = 0;
+
+	if (c == 1) {
+		for(; i + 8 <= len; i += 8) {
+			uint64_t a, b;
+			memcpy(&a, &dst[i], sizeof a);
+			memcpy(&b, &src[i], sizeof b);
+
+			a ^= b;
+
+			memcpy(&dst[i], &a, sizeof a);
+		}
+
+		for(; i < len; i++)
+			dst[i] ^= src[i];
+
+		return;
+	}
+
+	const uint8_t *const row = tables.mul[c];
+
+	for(; i < len; i++)
+		dst[i] ^= row[src[i]];
+}
+
+#if defined(__x86_64__)
+// c * x is c * (x & 0x0f) ^ c * (x & 0xf0): two 16 entry tables, looked up with (v)pshufb
+__attribute__((target("ssse3")))
+static void gf256_mul_add_ssse3(uint8_t *const dst, const uint8_t *const src, const uint8_t c, const size_t len)
+{
+	size_t i = 0;
+
+	if (c == 1) {
+		for(; i + 16 <= len; i += 16) {
+			__m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&src[i]));
+			__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&dst[i]));
+
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(&dst[i]), _mm_xor_si128(d, s));
+		}
+
+		for(; i < len; i++)
+			dst[i] ^= src[i];
+
+		return;
+	}
+
+	uint8_t lo[16], hi[16];
+
+	for(int i=0; i<16; i++) {
+		lo[i] = tables.mul[c][i];
+		hi[i] = tables.mul[c][i << 4];
+	}
+
+	const __m128i t_lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lo));
+	const __m128i t_hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(hi));
+	const __m128i mask = _mm_set1_epi8(0x0f);
+
+	for(; i + 16 <= len; i += 16) {
+		__m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&src[i]));
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&dst[i]));
+
+		__m128i p = _mm_xor_si128(_mm_shuffle_epi8(t_lo, _mm_and_si128(s, mask)), _mm_shuffle_epi8(t_hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(&dst[i]), _mm_xor_si128(d, p));
+	}
+
+	const uint8_t *const row = tables.mul[c];
+
+	for(; i < len; i++)
+		dst[i] ^= row[src[i]];
+}
+
+__attribute__((target("avx2")))
+static void gf256_mul_add_avx2(uint8_t *const dst, const uint8_t *const src, const uint8_t c, const size_t len)
+{
+	size_t i = 0;
+
+	if (c == 1) {
+		for(; i + 32 <= len; i += 32) {
+			__m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&src[i]));
+			__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&dst[i]));
+
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(&dst[i]), _mm256_xor_si256(d, s));
+		}
+
+		for(; i < len; i++)
+			dst[i] ^= src[i];
+
+		return;
+	}
+
+	uint8_t lo[16], hi[16];
+
+	for(int i=0; i<16; i++) {
+		lo[i] = tables.mul[c][i];
+		hi[i] = tables.mul[c][i << 4];
+	}
+
+	// vpshufb looks up per 128 bit lane: the same table in both
+	const __m256i t_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(lo)));
+	const __m256i t_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(hi)));
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+
+	for(; i + 32 <= len; i += 32) {
+		__m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&src[i]));
+		__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&dst[i]));
+
+		__m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(t_lo, _mm256_and_si256(s, mask)), _mm256_shuffle_epi8(t_hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(&dst[i]), _mm256_xor_si256(d, p));
+	}
+
+	// not via the ssse3 version, see zero.cpp
+	const uint8_t *const row = tables.mul[c];
+
+	for(; i < len; i++)
+		dst[i] ^= row[src[i]];
+}
+#endif
+
+typedef void (*gf256_mul_add_t)(uint8_t *const dst, const uint8_t *const src, const uint8_t c, const size_t len);
+
+static const char *implementation = "scalar";
+
+static gf256_mul_add_t select_gf256_mul_add()
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		implementation = "avx2";
+		return gf256_mul_add_avx2;
+	}
+
+	if (__builtin_cpu_supports("ssse3")) {
+		implementation = "ssse3";
+		return gf256_mul_add_ssse3;
+	}
+#endif
+
+	return gf256_mul_add_scalar;
+}
+
+static const gf256_mul_add_t gf256_mul_add_selected = select_gf256_mul_add();
+
+void gf256_mul_add(uint8_t *const dst, const uint8_t *const src, const uint8_t c, const size_t len)
+{
+	if (c == 0)
+		return;
+
+	gf256_mul_add_selected(dst, src, c, len);
+}
+
+bool gf256_invert_matrix(std::vector<uint8_t> & m, const int n)
+{
+	// Gauss-Jordan on [m | I]
+	std::vector<uint8_t> inv(n * n);
+
+	for(int i=0; i<n; i++)
+		inv[i * n + i] = 1;
+
+	for(int col=0; col<n; col++) {
+		int pivot = col;
+
+		while(pivot < n && m[pivot * n + col] == 0)
+			pivot++;
+
+		if (pivot == n)
+			return false;
+
+		if (pivot != col) {
+			for(int k=0; k<n; k++) {
+				std::swap(m[pivot * n + k], m[col * n + k]);
+				std::swap(inv[pivot * n + k], inv[col * n + k]);
+			}
+		}
+
+		const uint8_t f = gf256_inv(m[col * n + col]);
+
+		for(int k=0; k<n; k++) {
+			m[col * n + k]   = gf256_mul(m[col * n + k], f);
+			inv[col * n + k] = gf256_mul(inv[col * n + k], f);
+		}
+
+		for(int row=0; row<n; row++) {
+			const uint8_t g = m[row * n + col];
+
+			if (row == col || g == 0)
+				continue;
+
+			for(int k=0; k<n; k++) {
+				m[row * n + k]   ^= gf256_mul(m[col * n + k], g);
+				inv[row * n + k] ^= gf256_mul(inv[col * n + k], g);
+			}
+		}
+	}
+
+	m = inv;
+
+	return true;
+}
+
+const char *get_gf256_implementation()
+{
+	return implementation;
+}
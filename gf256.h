@@ -0,0 +1,21 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+// Arithmetic in GF(2^8) (polynomial 0x11d) for erasure coding. Addition is
+// XOR.
+
+uint8_t gf256_mul(const uint8_t a, const uint8_t b);
+// 'a' must not be 0
+uint8_t gf256_inv(const uint8_t a);
+
+// dst[i] ^= c * src[i] for 'len' bytes; for c == 1 this is a plain XOR
+// uses AVX2 or SSSE3 when the cpu has it (selected at startup)
+void gf256_mul_add(uint8_t *const dst, const uint8_t *const src, const uint8_t c, const size_t len);
+
+// inverts the n x n matrix 'm' (row major) in place, false when it is singular
+bool gf256_invert_matrix(std::vector<uint8_t> & m, const int n);
+
+const char *get_gf256_implementation();
@@ -5,7 +5,10 @@
 #include <crypto++/crc.h>
 
 #include "hash.h"
+#include "hash_blake3.h"
+#include "hash_sha256.h"
 #include "hash_sha384.h"
+#include "hash_xxh128.h"
 #include "logging.h"
 #include "str.h"
 #include "yaml-helpers.h"
@@ -19,6 +22,11 @@ hash::~hash()
 {
 }
 
+bool hash::get_verify_on_match() const
+{
+	return false;
+}
+
 hash * hash::load_configuration(const YAML::Node & node)
 {
 	dolog(ll_info, " * hash::load_configuration");
@@ -28,9 +36,26 @@ hash * hash::load_configuration(const YAML::Node & node)
 	if (type == "hash-sha384")
 		return hash_sha384::load_configuration(node);
 
-	dolog(ll_error, "hash::load_configuration: hash function \"%s\" is not known", type.c_str());
+	if (type == "hash-sha256")
+		return hash_sha256::load_configuration(node);
+
+	if (type == "hash-blake3") {
+#if defined(HAVE_BLAKE3)
+		return hash_blake3::load_configuration(node);
+#else
+		throw myformat("hash::load_configuration: mystorage was built without BLAKE3 (libblake3)");
+#endif
+	}
+
+	if (type == "hash-xxh128") {
+#if defined(HAVE_XXHASH)
+		return hash_xxh128::load_configuration(node);
+#else
+		throw myformat("hash::load_configuration: mystorage was built without xxHash (libxxhash)");
+#endif
+	}
 
-	return nullptr;
+	throw myformat("hash::load_configuration: hash function \"%s\" is not known", type.c_str());
 }
 
 std::optional<std::string> hash::do_hash(const uint8_t *const in, const size_t len)
@@ -12,8 +12,13 @@ public:
 	hash();
 	virtual ~hash();
 
+	virtual std::string get_type() const = 0;
+
 	virtual int get_size() const = 0;
 
+	// not collision resistant: data with the same hash must be compared
+	virtual bool get_verify_on_match() const;
+
 	// return binary
 	virtual void do_hash(const uint8_t *const in, const size_t len, uint8_t **const out) = 0;
 
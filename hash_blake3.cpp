@@ -0,0 +1,56 @@
+#if defined(HAVE_BLAKE3)
+#include <blake3.h>
+
+#include "hash_blake3.h"
+#include "logging.h"
+
+
+hash_blake3::hash_blake3()
+{
+}
+
+hash_blake3::~hash_blake3()
+{
+}
+
+YAML::Node hash_blake3::emit_configuration() const
+{
+	YAML::Node out;
+	out["type"] = get_type();
+
+	return out;
+}
+
+hash_blake3 * hash_blake3::load_configuration(const YAML::Node & node)
+{
+	dolog(ll_info, " * hash_blake3::load_configuration");
+
+	return new hash_blake3();
+}
+
+std::string hash_blake3::get_type() const
+{
+	return "hash-blake3";
+}
+
+int hash_blake3::get_size() const
+{
+	return BLAKE3_OUT_LEN;
+}
+
+void hash_blake3::do_hash(const uint8_t *const in, const size_t len, uint8_t **const out)
+{
+	constexpr int size = BLAKE3_OUT_LEN;
+	*out = reinterpret_cast<uint8_t *>(malloc(size));
+
+	if (*out == nullptr) {
+		dolog(ll_error, "hash_blake3::do_hash: cannot allocate %d bytes of memory", size);
+		return;
+	}
+
+	blake3_hasher hasher;
+	blake3_hasher_init(&hasher);
+	blake3_hasher_update(&hasher, in, len);
+	blake3_hasher_finalize(&hasher, *out, size);
+}
+#endif
@@ -0,0 +1,22 @@
+#pragma once
+#include <yaml-cpp/yaml.h>
+
+#include "hash.h"
+
+
+// needs libblake3 (HAVE_BLAKE3); it selects SSE4.1/AVX2/AVX-512/NEON at runtime
+class hash_blake3 : public hash
+{
+public:
+	hash_blake3();
+	~hash_blake3();
+
+	std::string get_type() const override;
+
+	int get_size() const override;
+
+	void do_hash(const uint8_t *const in, const size_t len, uint8_t **const out) override;
+
+	YAML::Node emit_configuration() const override;
+	static hash_blake3 * load_configuration(const YAML::Node & node);
+};
@@ -0,0 +1,54 @@
+#include <crypto++/sha.h>
+
+#include "hash_sha256.h"
+#include "logging.h"
+
+
+// see hash_sha384.cpp
+#if defined(CRYPTOPP_NO_GLOBAL_BYTE)
+	typedef unsigned char byte;
+#endif
+
+hash_sha256::hash_sha256()
+{
+}
+
+hash_sha256::~hash_sha256()
+{
+}
+
+YAML::Node hash_sha256::emit_configuration() const
+{
+	YAML::Node out;
+	out["type"] = get_type();
+
+	return out;
+}
+
+hash_sha256 * hash_sha256::load_configuration(const YAML::Node & node)
+{
+	dolog(ll_info, " * hash_sha256::load_configuration");
+
+	return new hash_sha256();
+}
+
+std::string hash_sha256::get_type() const
+{
+	return "hash-sha256";
+}
+
+int hash_sha256::get_size() const
+{
+	return CryptoPP::SHA256::DIGESTSIZE;
+}
+
+void hash_sha256::do_hash(const uint8_t *const in, const size_t len, uint8_t **const out)
+{
+	constexpr int size = CryptoPP::SHA256::DIGESTSIZE;
+	*out = reinterpret_cast<uint8_t *>(malloc(size));
+
+	if (*out)
+		CryptoPP::SHA256().CalculateDigest(reinterpret_cast<byte *>(*out), in, len);
+	else
+		dolog(ll_error, "hash_sha256::do_hash: cannot allocate %d bytes of memory", size);
+}
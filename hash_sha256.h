@@ -0,0 +1,22 @@
+#pragma once
+#include <yaml-cpp/yaml.h>
+
+#include "hash.h"
+
+
+// Crypto++ uses the SHA extensions of the cpu (SHA-NI, ARMv8) when it has them
+class hash_sha256 : public hash
+{
+public:
+	hash_sha256();
+	~hash_sha256();
+
+	std::string get_type() const override;
+
+	int get_size() const override;
+
+	void do_hash(const uint8_t *const in, const size_t len, uint8_t **const out) override;
+
+	YAML::Node emit_configuration() const override;
+	static hash_sha256 * load_configuration(const YAML::Node & node);
+};
@@ -20,7 +20,7 @@ hash_sha384::~hash_sha384()
 YAML::Node hash_sha384::emit_configuration() const
 {
         YAML::Node out;
-        out["type"] = "hash-sha384";
+        out["type"] = get_type();
 
         return out;
 }
@@ -32,6 +32,11 @@ hash_sha384 * hash_sha384::load_configuration(const YAML::Node & node)
 	return new hash_sha384();
 }
 
+std::string hash_sha384::get_type() const
+{
+	return "hash-sha384";
+}
+
 int hash_sha384::get_size() const
 {
 	return CryptoPP::SHA3_384::DIGESTSIZE;
@@ -9,6 +9,8 @@ public:
 	hash_sha384();
 	~hash_sha384();
 
+	std::string get_type() const override;
+
 	int get_size() const override;
 
 	void do_hash(const uint8_t *const in, const size_t len, uint8_t **const out) override;
@@ -0,0 +1,67 @@
+#if defined(HAVE_XXHASH)
+#include <xxhash.h>
+
+#include "hash_xxh128.h"
+#include "logging.h"
+#include "yaml-helpers.h"
+
+
+hash_xxh128::hash_xxh128(const bool verify) : verify(verify)
+{
+}
+
+hash_xxh128::~hash_xxh128()
+{
+}
+
+YAML::Node hash_xxh128::emit_configuration() const
+{
+	YAML::Node out;
+	out["type"] = get_type();
+	out["verify"] = verify;
+
+	return out;
+}
+
+hash_xxh128 * hash_xxh128::load_configuration(const YAML::Node & node)
+{
+	dolog(ll_info, " * hash_xxh128::load_configuration");
+
+	// optional: compare the data of blocks with the same hash
+	bool verify = node["verify"] ? yaml_get_bool(node, "verify", "compare the data of blocks with the same hash") : true;
+
+	if (!verify)
+		dolog(ll_warning, "hash_xxh128: xxHash is not collision resistant, without \"verify\" a collision silently corrupts data");
+
+	return new hash_xxh128(verify);
+}
+
+std::string hash_xxh128::get_type() const
+{
+	return "hash-xxh128";
+}
+
+int hash_xxh128::get_size() const
+{
+	return sizeof(XXH128_canonical_t);
+}
+
+bool hash_xxh128::get_verify_on_match() const
+{
+	return verify;
+}
+
+void hash_xxh128::do_hash(const uint8_t *const in, const size_t len, uint8_t **const out)
+{
+	constexpr int size = sizeof(XXH128_canonical_t);
+	*out = reinterpret_cast<uint8_t *>(malloc(size));
+
+	if (*out == nullptr) {
+		dolog(ll_error, "hash_xxh128::do_hash: cannot allocate %d bytes of memory", size);
+		return;
+	}
+
+	// canonical: the same bytes on every platform
+	XXH128_canonicalFromHash(reinterpret_cast<XXH128_canonical_t *>(*out), XXH3_128bits(in, len));
+}
+#endif
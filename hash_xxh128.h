@@ -0,0 +1,29 @@
+#pragma once
+#include <yaml-cpp/yaml.h>
+
+#include "hash.h"
+
+
+// XXH3 128 bit (needs libxxhash, HAVE_XXHASH): many times faster than the
+// cryptographic hashes but not collision resistant. With 'verify' (the
+// default) storage-backend-dedup compares the data when a hash matches.
+class hash_xxh128 : public hash
+{
+private:
+	const bool verify;
+
+public:
+	hash_xxh128(const bool verify);
+	~hash_xxh128();
+
+	std::string get_type() const override;
+
+	int get_size() const override;
+
+	bool get_verify_on_match() const override;
+
+	void do_hash(const uint8_t *const in, const size_t len, uint8_t **const out) override;
+
+	YAML::Node emit_configuration() const override;
+	static hash_xxh128 * load_configuration(const YAML::Node & node);
+};
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -15,7 +16,8 @@ histogram::histogram(const uint64_t max_value, const int n_slots) : n_slots(n_sl
 	if (!counters)
 		throw myformat("histogram: cannot allocate memory for %d counter slots", n_slots);
 
-	divider = (max_value + 1) / n_slots;
+	// at least 1: for max_value < n_slots
+	divider = std::max(uint64_t(1), (max_value + 1) / n_slots);
 }
 
 histogram::~histogram()
@@ -26,7 +28,7 @@ histogram::~histogram()
 void histogram::count(const uint64_t value)
 {
 	// NOT thread-safe
-	counters[value / divider]++;
+	counters[std::min(value / divider, uint64_t(n_slots - 1))]++;
 }
 
 uint64_t histogram::get_count(const int slot) const
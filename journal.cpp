@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "block.h"
+#include "buffer_pool.h"
 #include "hash.h"
 #include "journal.h"
 #include "logging.h"
@@ -52,6 +53,8 @@ journal::journal(const std::string & id, storage_backend *const data, storage_ba
 	if (jm.n_elements == 0)
 		throw myformat("journal(%s): journal of 0 elements in size?", id.c_str());
 
+	zero_block = block(pool_calloc(jm.block_size), jm.block_size);
+
 	dolog(ll_info, "journal(%s): %lu elements total, number filled: %lu", id.c_str(), jm.n_elements, jm.cur_n);
 
 	// load journal in cache
@@ -80,7 +83,7 @@ journal::journal(const std::string & id, storage_backend *const data, storage_ba
 			break;
 		}
 
-		put_in_cache(je);
+		put_in_cache(*b);
 
 		delete b;
 
@@ -157,41 +160,33 @@ bool journal::update_journal_meta_data()
 }
 
 // 'lock' must be locked
-bool journal::put_in_cache(const journal_element_t *const je)
+// 'element' is a complete journal element: journal_element_t followed by the data
+bool journal::put_in_cache(const block & element)
 {
-	dolog(ll_debug, "journal::put_in_cache(%s): put element %ld in cache", id.c_str(), je->target_block);
+	const journal_element_t *const je = reinterpret_cast<const journal_element_t *>(element.get_data());
 
-	auto it = cache.find(je->target_block);
+	dolog(ll_debug, "journal::put_in_cache(%s): put element %ld in cache", id.c_str(), je->target_block);
 
-	uint8_t *data = reinterpret_cast<uint8_t *>(calloc(1, jm.block_size));
-	if (!data) {
-		dolog(ll_error, "journal::put_in_cache(%s): cannot allocate %zu bytes of memory", id.c_str(), jm.block_size);
-		return false;
-	}
+	std::optional<block> data;
 
 	if (je->a == JA_write)
-		memcpy(data, je->data, jm.block_size);
-	else if (je->a == JA_trim || je->a == JA_zero) {
-		// calloc takes care of this
-	}
+		data = element.slice(sizeof(journal_element_t), jm.block_size);
+	else if (je->a == JA_trim || je->a == JA_zero)
+		data = zero_block;
 	else {
 		dolog(ll_error, "journal::put_in_cache(%s): unknown action %d", id.c_str(), je->a);
-		free(data);
 		return false;
 	}
 
-	block b(data, jm.block_size);
-
-	int n = 0;
+	auto it = cache.find(je->target_block);
 
 	if (it != cache.end()) {
-		n = it->second.second;
-		cache.erase(it);
+		it->second.first = data.value();
+		it->second.second++;
+	}
+	else {
+		cache.insert({ je->target_block, { data.value(), 1 } });
 	}
-
-	n++;
-
-	cache.insert({ je->target_block, { b, n } });
 
 	return true;
 }
@@ -227,7 +222,7 @@ bool journal::push_action(const journal_action_t a, const block_nr_t block_nr, c
 	// create element
 	const size_t target_size = sizeof(journal_element_t) + jm.block_size;
 
-	uint8_t *j_element = reinterpret_cast<uint8_t *>(calloc(1, target_size));
+	uint8_t *j_element = pool_calloc(target_size);
 	if (!j_element) {
 		dolog(ll_error, "journal::push_action(%s): cannot allocate %zu bytes of memory", id.c_str(), target_size);
 		return false;
@@ -269,7 +264,7 @@ bool journal::push_action(const journal_action_t a, const block_nr_t block_nr, c
 		return false;
 	}
 
-	put_in_cache(reinterpret_cast<journal_element_t *>(j_element));
+	put_in_cache(b);
 
 	cond_push.notify_all();
 
@@ -494,6 +489,23 @@ bool journal::can_do_multiple_blocks() const
 }
 
 bool journal::get_block(const block_nr_t block_nr, uint8_t **const data)
+{
+	*data = pool_malloc(block_size);
+	if (!*data) {
+		dolog(ll_error, "journal::get_block(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
+		return false;
+	}
+
+	if (get_block_into(block_nr, *data) == false) {
+		pool_free(*data);
+		*data = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+bool journal::get_block_into(const block_nr_t block_nr, uint8_t *const to)
 {
 	bool rc = false;
 
@@ -501,20 +513,16 @@ bool journal::get_block(const block_nr_t block_nr, uint8_t **const data)
 
 	auto it = cache.find(block_nr);
 	if (it != cache.end()) {
-		*data = reinterpret_cast<uint8_t *>(malloc(it->second.first.get_size()));
-		if (!*data)
-			dolog(ll_error, "journal::get_block(%s): cannot allocate %zu bytes of memory", id.c_str(), it->second.first.get_size());
-		else {
-			memcpy(*data, it->second.first.get_data(), it->second.first.get_size());
-			rc = true;
-		}
+		memcpy(to, it->second.first.get_data(), it->second.first.get_size());
+		rc = true;
 	}
 	else {
+		struct iovec iov { to, size_t(block_size) };
 		int err = 0;
-		this->data->get_data(block_nr * block_size, block_size, data, &err);
+		this->data->get_data_into(block_nr * block_size, &iov, 1, &err);
 
 		if (err)
-			dolog(ll_error, "journal::get_block(%s): failed to retrieve block %ld from storage: %s", id.c_str(), block_nr, strerror(errno));
+			dolog(ll_error, "journal::get_block_into(%s): failed to retrieve block %ld from storage: %s", id.c_str(), block_nr, strerror(err));
 		else
 			rc = true;
 	}
@@ -537,14 +545,18 @@ bool journal::put_block(const block_nr_t block_nr, const uint8_t *const data)
 
 bool journal::fsync()
 {
+	stats_timer st(stats, so_fsync, 0);
+
 	return true;
 }
 
 bool journal::trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err)
 {
+	stats_timer st(stats, so_trim, len);
+
 	*err = 0;
 
-	uint8_t *b0x00 = reinterpret_cast<uint8_t *>(calloc(1, block_size));
+	uint8_t *b0x00 = pool_calloc(block_size);
 
 	block empty_block(nullptr, 0);
 
@@ -587,22 +599,25 @@ bool journal::trim_zero(const offset_t offset, const uint32_t len, const bool tr
 			if (!put_block(block_nr, temp)) {
 				dolog(ll_error, "journal::trim_zero(%s): failed to update block %ld", id.c_str(), id.c_str(), block_nr);
 				*err = EIO;
-				free(temp);
+				pool_free(temp);
 				break;
 			}
 
-			free(temp);
+			pool_free(temp);
 		}
 
 		work_offset += current_size;
 		work_size -= current_size;
 	}
 
+	// inside the lock so that the mirrors see the writes to a region in the same order
+	bool mirrors_ok = do_mirror_trim_zero(offset, len, trim);
+
 	lgj.un_lock_block_group(offset, len, block_size, false, false);
 
-	free(b0x00);
+	pool_free(b0x00);
 
-	if (do_mirror_trim_zero(offset, len, trim) == false) {
+	if (mirrors_ok == false) {
 		dolog(ll_error, "journal::trim_zero(%s): failed to send to mirror(s)", id.c_str(), id.c_str());
 		return false;
 	}
@@ -48,7 +48,9 @@ private:
 
 	lock_group             lgj;
 
+	// slices of the journal elements (no copies), count of elements pending
 	std::map<block_nr_t, std::pair<block, int64_t> > cache;
+	block                  zero_block { nullptr, 0, false };  // shared by all trim/zero cache entries
 
 	std::atomic_bool       journal_commit_fatal_error { false };
 
@@ -57,7 +59,7 @@ private:
 
 	bool update_journal_meta_data();
 
-	bool put_in_cache(const journal_element_t *const je);
+	bool put_in_cache(const block & element);
 	bool push_action(const journal_action_t a, const block_nr_t block_nr, const block & data);
 
 	bool transaction_start() override;
@@ -67,6 +69,7 @@ private:
 
 protected:
         bool get_block(const block_nr_t block_nr, uint8_t **const data) override;
+        bool get_block_into(const block_nr_t block_nr, uint8_t *const to) override;
         bool put_block(const block_nr_t block_nr, const uint8_t *const data) override;
 
 	bool can_do_multiple_blocks() const override;
@@ -1,73 +1,132 @@
+#include <algorithm>
+
 #include "lock_group.h"
+#include "logging.h"
+#include "time.h"
 #include "types.h"
 
 
-lock_group::lock_group(const int n_locks)
+lock_group::lock_group()
 {
-	for(int i=0; i<n_locks; i++)
-		locks.push_back(new std::shared_mutex());
 }
 
 lock_group::~lock_group()
 {
-	while(!locks.empty()) {
-		delete locks.at(0);
-
-		locks.erase(locks.begin());
-	}
 }
 
-std::set<uint64_t> lock_group::nrs_to_locks(const std::vector<block_nr_t> & nrs)
+bool lock_group::can_grant(const range_t *const r) const
 {
-	std::set<uint64_t> unique_nrs;
+	// ranges that start before this cannot reach r
+	const block_nr_t from = r->first >= max_len ? r->first - max_len : 0;
 
-	for(auto nr : nrs)
-		unique_nrs.insert(nr % locks.size());
+	for(auto it = ranges.lower_bound(from); it != ranges.end() && it->first <= r->last; it++) {
+		const range_t *const other = it->second.get();
 
-	return unique_nrs;
-}
+		// only those that came earlier count
+		if (other->seq >= r->seq || other->last < r->first)
+			continue;
 
-void lock_group::lock_shared(const std::vector<block_nr_t> & nrs)
-{
-	for(auto nr : nrs_to_locks(nrs))
-		locks.at(nr)->lock_shared();
-}
+		if (!(other->shared && r->shared))
+			return false;
+	}
 
-void lock_group::unlock_shared(const std::vector<block_nr_t> & nrs)
-{
-	for(auto nr : nrs_to_locks(nrs))
-		locks.at(nr)->unlock_shared();
+	return true;
 }
 
-void lock_group::lock_private(const std::vector<block_nr_t> & nrs)
+void lock_group::lock_range(const block_nr_t first, const block_nr_t last, const bool shared)
 {
-	for(auto nr : nrs_to_locks(nrs))
-		locks.at(nr)->lock();
+	std::unique_lock<std::mutex> lck(lock);
+
+	std::shared_ptr<range_t> r = std::make_shared<range_t>();
+	r->first   = first;
+	r->last    = last;
+	r->shared  = shared;
+	r->seq     = seq++;
+	r->granted = false;
+
+	ranges.insert({ first, r });
+
+	lengths.insert(last - first);
+
+	max_len    = *lengths.rbegin();
+	max_queued = std::max(max_queued, uint64_t(ranges.size()));
+
+	n_locks++;
+
+	if (can_grant(r.get())) {
+		r->granted = true;
+		return;
+	}
+
+	n_contended++;
+
+	uint64_t start = get_us();
+
+	while(!r->granted)
+		r->cv.wait(lck);
+
+	wait_us += get_us() - start;
 }
 
-void lock_group::unlock_private(const std::vector<block_nr_t> & nrs)
+void lock_group::unlock_range(const block_nr_t first, const block_nr_t last, const bool shared)
 {
-	for(auto nr : nrs_to_locks(nrs))
-		locks.at(nr)->unlock();
+	std::unique_lock<std::mutex> lck(lock);
+
+	auto range = ranges.equal_range(first);
+
+	auto it = std::find_if(range.first, range.second, [last, shared](const std::pair<const block_nr_t, std::shared_ptr<range_t> > & r) { return r.second->last == last && r.second->shared == shared && r.second->granted; });
+
+	if (it == range.second) {
+		dolog(ll_error, "lock_group::unlock_range: blocks %ld - %ld (%s) are not locked", first, last, shared ? "shared" : "exclusive");
+		return;
+	}
+
+	ranges.erase(it);
+
+	lengths.erase(lengths.find(last - first));
+
+	if (lengths.empty()) {
+		max_len = 0;
+		return;
+	}
+
+	// shrinks again once a long range is gone
+	max_len = *lengths.rbegin();
+
+	// waiters that overlapped the released range may be able to go now (in order)
+	const block_nr_t from = first >= max_len ? first - max_len : 0;
+
+	for(auto cur = ranges.lower_bound(from); cur != ranges.end() && cur->first <= last; cur++) {
+		range_t *const r = cur->second.get();
+
+		if (r->granted || r->last < first)
+			continue;
+
+		if (can_grant(r)) {
+			r->granted = true;
+			r->cv.notify_one();
+		}
+	}
 }
 
 void lock_group::un_lock_block_group(const offset_t offset, const uint32_t size, const int block_size, const bool do_lock, const bool shared)
 {
-	std::vector<block_nr_t> block_nrs;
+	if (size == 0)
+		return;
 
-	for(offset_t o=offset; o<offset + size; o += block_size)
-		block_nrs.push_back(o / block_size);
+	// every block touched by the range, also the last one when 'offset' is not block aligned
+	const block_nr_t first = offset / block_size;
+	const block_nr_t last  = (offset + size - 1) / block_size;
 
-	if (do_lock) {
-		if (shared)
-			lock_shared(block_nrs);
-		else
-			lock_private(block_nrs);
-	}
-	else {
-		if (shared)
-			unlock_shared(block_nrs);
-		else
-			unlock_private(block_nrs);
-	}
+	if (do_lock)
+		lock_range(first, last, shared);
+	else
+		unlock_range(first, last, shared);
+}
+
+lock_group_stats_t lock_group::get_stats()
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	return { n_locks.load(), n_contended.load(), wait_us.load(), max_queued };
 }
@@ -1,27 +1,61 @@
 #pragma once
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <set>
-#include <shared_mutex>
-#include <vector>
 
 #include "types.h"
 
 
+typedef struct {
+	uint64_t n_locks;
+	uint64_t n_contended;  // had to wait
+	uint64_t wait_us;      // total time spent waiting
+	uint64_t max_queued;   // most ranges (held + waiting) at the same time
+} lock_group_stats_t;
+
+// Locks ranges of blocks, shared (readers) or exclusive (writers).
+// Requests are granted in arrival order: one that overlaps an earlier
+// (held or waiting) request in a conflicting mode waits for it, so writers
+// are not starved by a stream of readers. Requests for ranges that do not
+// overlap never wait for each other.
 class lock_group
 {
 private:
-	std::vector<std::shared_mutex *> locks;
-
-	std::set<uint64_t> nrs_to_locks(const std::vector<block_nr_t> & nrs);
+	typedef struct {
+		block_nr_t              first;
+		block_nr_t              last;
+		bool                    shared;
+		uint64_t                seq;
+		bool                    granted;
+		std::condition_variable cv;
+	} range_t;
+
+	std::mutex                          lock;
+	// by first block; shared_ptr: a waiter that was granted a range may not
+	// have woken up yet when an identical range (that may be this entry)
+	// is unlocked
+	std::multimap<block_nr_t, std::shared_ptr<range_t> > ranges;
+	std::multiset<block_nr_t>           lengths;        // of the ranges in 'ranges'
+	block_nr_t                          max_len { 0 };  // longest range in 'ranges' (last of 'lengths'), to bound searches
+	uint64_t                            seq { 0 };
+
+	std::atomic_uint64_t                n_locks { 0 };
+	std::atomic_uint64_t                n_contended { 0 };
+	std::atomic_uint64_t                wait_us { 0 };
+	uint64_t                            max_queued { 0 };
+
+	bool can_grant(const range_t *const r) const;  // 'lock' must be locked
+	void lock_range(const block_nr_t first, const block_nr_t last, const bool shared);
+	void unlock_range(const block_nr_t first, const block_nr_t last, const bool shared);
 
 public:
-	lock_group(const int n_locks = 128);
+	lock_group();
 	virtual ~lock_group();
 
-	void lock_shared(const std::vector<block_nr_t> & nrs);
-	void unlock_shared(const std::vector<block_nr_t> & nrs);
-
-	void lock_private(const std::vector<block_nr_t> & nrs);
-	void unlock_private(const std::vector<block_nr_t> & nrs);
-
 	void un_lock_block_group(const offset_t offset, const uint32_t size, const int block_size, const bool do_lock, const bool shared);
+
+	lock_group_stats_t get_stats();
 };
@@ -9,6 +9,7 @@
 #include <vector>
 #include <yaml-cpp/yaml.h>
 
+#include "buffer_pool.h"
 #include "logging.h"
 #include "str.h"
 #include "yaml-helpers.h"
@@ -47,13 +48,22 @@ int main(int argc, char *argv[])
 
 		dolog(ll_info, "MyStorage terminating");
 
+		for(auto st : modules["stats"])
+			delete st;
+
 		for(auto srv : modules["servers"])
 			delete srv;
 
+		// copies between storage backends
+		for(auto rs : modules["resync"])
+			delete rs;
+
 		for(auto sb : modules["storage"]) {
 			dynamic_cast<storage_backend *>(sb)->dump_stats("./s-");
 			delete sb;
 		}
+
+		dump_buffer_pool_stats();
 	}
 	catch(const std::string & err) {
 		dolog(ll_error, "main: caught exception \"%s\"", err.c_str());
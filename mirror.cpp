@@ -1,17 +1,133 @@
+#include <algorithm>
 #include <yaml-cpp/yaml.h>
 
 #include "logging.h"
 #include "mirror.h"
+#include "mirror_async.h"
 #include "mirror_storage_backend.h"
 #include "str.h"
+#include "time.h"
 
 
-mirror::mirror(const std::string & id) : base(id)
+mirror::mirror(const std::string & id, const bool serve_reads, dirty_bitmap *const bitmap) : base(id), bitmap(bitmap), serve_reads(serve_reads), stats("mirror", id)
 {
+	// without a bitmap it is not known after a restart whether the mirror missed writes
+	if (serve_reads && bitmap == nullptr)
+		throw myformat("mirror(%s): serve-reads requires a dirty-bitmap", id.c_str());
+
+	if (bitmap) {
+		// a mirror that was attached just now may contain anything: it is
+		// not read from before mirror_resync copied all of it
+		if (serve_reads && bitmap->was_created())
+			bitmap->mark(0, bitmap->get_n_regions() * bitmap->get_region_size());
+
+		if (bitmap->get_n_dirty())
+			set_in_sync(false);
+
+		stats.add_gauge("dirty_bytes", [bitmap] { return double(bitmap->get_n_dirty() * bitmap->get_region_size()); });
+	}
 }
 
 mirror::~mirror()
 {
+	stats.remove_gauges();
+
+	delete bitmap;
+}
+
+void mirror::mark_dirty(const offset_t offset, const uint64_t len)
+{
+	std::unique_lock<std::mutex> lck(dirty_lock);
+
+	if (bitmap)
+		bitmap->mark(offset, len);
+
+	set_in_sync(false);
+}
+
+void mirror::mark_clean(const uint64_t region)
+{
+	std::unique_lock<std::mutex> lck(dirty_lock);
+
+	bitmap->clear(region);
+
+	if (bitmap->get_n_dirty() == 0)
+		set_in_sync(true);
+}
+
+void mirror::begin_write(const offset_t offset, const uint64_t len)
+{
+	if (bitmap)
+		bitmap->begin_write(offset, len);
+}
+
+void mirror::end_write(const offset_t offset, const uint64_t len)
+{
+	if (bitmap)
+		bitmap->end_write(offset, len);
+}
+
+dirty_bitmap * mirror::get_dirty_bitmap() const
+{
+	return bitmap;
+}
+
+void mirror::set_in_sync(const bool state)
+{
+	if (in_sync.exchange(state) != state)
+		dolog(state ? ll_info : ll_warning, "mirror::set_in_sync(%s): mirror is now %s", id.c_str(), state ? "in sync" : "out of sync");
+}
+
+bool mirror::is_in_sync() const
+{
+	return in_sync;
+}
+
+bool mirror::can_serve_reads() const
+{
+	constexpr uint64_t retry_after = 5000000;  // us
+
+	const uint64_t failed_at = read_failed_at;
+
+	return serve_reads && in_sync && (failed_at == 0 || get_us() - failed_at >= retry_after);
+}
+
+uint64_t mirror::get_read_cost() const
+{
+	return (n_outstanding + 1) * std::max(uint64_t(1), read_latency.load());
+}
+
+bool mirror::get_data_int(const offset_t offset, const struct iovec *const iov, const int iov_n)
+{
+	dolog(ll_error, "mirror::get_data_int(%s): this mirror type cannot serve reads", id.c_str());
+
+	return false;
+}
+
+bool mirror::get_data(const offset_t offset, const struct iovec *const iov, const int iov_n)
+{
+	n_outstanding++;
+
+	const uint64_t start = get_us();
+
+	bool rc = get_data_int(offset, iov, iov_n);
+
+	const uint64_t took = get_us() - start;
+
+	n_outstanding--;
+
+	if (rc) {
+		// 1/8 new, 7/8 old
+		const uint64_t prev = read_latency;
+		read_latency = prev ? (prev * 7 + took) / 8 : took;
+	}
+	else {
+		dolog(ll_warning, "mirror::get_data(%s): read failed, not reading from this mirror for a while", id.c_str());
+
+		read_failed_at = std::max(uint64_t(1), get_us());
+	}
+
+	return rc;
 }
 
 mirror * mirror::load_configuration(const YAML::Node & node)
@@ -22,6 +138,8 @@ mirror * mirror::load_configuration(const YAML::Node & node)
 
 	if (type == "mirror-storage-backend")
 		return mirror_storage_backend::load_configuration(node);
+	else if (type == "mirror-async")
+		return mirror_async::load_configuration(node);
 
 	dolog(ll_error, "mirror::load_configuration: mirror type \"%s\" is not known", type.c_str());
 
@@ -1,20 +1,64 @@
 #pragma once
+#include <atomic>
 #include <string>
+#include <sys/uio.h>
 #include <yaml-cpp/yaml.h>
 
 #include "base.h"
 #include "block.h"
+#include "dirty_bitmap.h"
+#include "stats.h"
 #include "types.h"
 
 
 class mirror : public base
 {
+private:
+	std::atomic_bool     in_sync        { true };
+	std::atomic_int      n_outstanding  { 0 };
+	std::atomic_uint64_t read_latency   { 0 };  // in us, moving average
+	std::atomic_uint64_t read_failed_at { 0 };
+
+	dirty_bitmap *const  bitmap;  // optional
+	std::mutex           dirty_lock;
+
+protected:
+	const bool serve_reads;
+	io_stats   stats;  // implementations record put_block, trim_zero and sync in this
+
+	// only invoked when the mirror was configured to serve reads
+	virtual bool get_data_int(const offset_t offset, const struct iovec *const iov, const int iov_n);
+
 public:
-	mirror(const std::string & id);
+	mirror(const std::string & id, const bool serve_reads, dirty_bitmap *const bitmap);
 	virtual ~mirror();
 
 	virtual offset_t get_size() const = 0;
 
+	// a mirror that failed a write (or trim) is out of sync and won't be read from
+	void set_in_sync(const bool state);
+	bool is_in_sync() const;
+
+	// [offset, offset + len) may now differ from the storage backend: without
+	// a dirty-region bitmap that makes the whole mirror out of sync, with one
+	// it is until mirror_resync has copied the dirty regions
+	void mark_dirty(const offset_t offset, const uint64_t len);
+	// a region of the bitmap was copied
+	void mark_clean(const uint64_t region);
+	// a write to the storage backend and this mirror is in progress: the
+	// region is dirty after a crash (no-op without a bitmap)
+	void begin_write(const offset_t offset, const uint64_t len);
+	void end_write(const offset_t offset, const uint64_t len);
+	dirty_bitmap * get_dirty_bitmap() const;
+
+	// configured to serve reads, in sync and no failed read recently
+	bool can_serve_reads() const;
+	// estimated time (in us) a read would take now, based on the number of
+	// outstanding reads and the latency of previous ones
+	uint64_t get_read_cost() const;
+	// fills the caller-owned buffers in 'iov', bookkeeps the above
+	bool get_data(const offset_t offset, const struct iovec *const iov, const int iov_n);
+
 	virtual bool put_block(const offset_t o, const block & b) = 0;
 
 	// used for async mirrors
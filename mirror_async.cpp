@@ -0,0 +1,446 @@
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+
+#include "buffer_pool.h"
+#include "logging.h"
+#include "mirror_async.h"
+#include "str.h"
+#include "time.h"
+#include "yaml-helpers.h"
+
+
+mirror_async::write_intent::write_intent(mirror *const m, const offset_t offset, const uint64_t len) : m(m), offset(offset), len(len)
+{
+	m->begin_write(offset, len);
+}
+
+mirror_async::write_intent::~write_intent()
+{
+	m->end_write(offset, len);
+}
+
+mirror_async::mirror_async(const std::string & id, storage_backend *const sb, const uint64_t max_queue, const int n_threads, dirty_bitmap *const bitmap) :
+	mirror(id, false, bitmap),
+	sb(sb),
+	max_queue(max_queue),
+	n_threads(n_threads)
+{
+	if (n_threads < 1)
+		throw myformat("mirror_async(%s): at least 1 thread is required", id.c_str());
+
+	if (bitmap == nullptr)
+		dolog(ll_warning, "mirror_async(%s): without a dirty-bitmap, what is still queued when mystorage stops is not copied to the mirror later", id.c_str());
+
+	sb->acquire(this);
+
+	stats.add_gauge("replication_lag_bytes",   [this] { return double(get_lag_bytes()); });
+	stats.add_gauge("replication_lag_seconds", [this] { return get_lag_seconds(); });
+
+	for(int i=0; i<n_threads; i++)
+		threads.push_back(new std::thread(&mirror_async::sender, this));
+}
+
+mirror_async::~mirror_async()
+{
+	stats.remove_gauges();
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		// the senders first empty the queue
+		stop = true;
+
+		cond.notify_all();
+	}
+
+	for(auto th : threads) {
+		th->join();
+
+		delete th;
+	}
+
+	dolog(ll_info, "mirror_async(%s): %lu batches sent, %lu writes were combined with an other, %lu bytes were overwritten before they were sent", id.c_str(), n_batches, n_coalesced, n_superseded);
+
+	sb->release(this);
+
+	if (sb->obj_in_use_by().empty())
+		delete sb;
+}
+
+YAML::Node mirror_async::emit_configuration() const
+{
+	YAML::Node out_cfg;
+	out_cfg["id"] = id;
+	out_cfg["storage-backend"] = sb->emit_configuration();
+	out_cfg["max-queue"] = max_queue;
+	out_cfg["threads"] = n_threads;
+	if (get_dirty_bitmap())
+		out_cfg["dirty-bitmap"] = get_dirty_bitmap()->emit_configuration();
+
+	YAML::Node out;
+	out["type"] = "mirror-async";
+	out["cfg"] = out_cfg;
+
+	return out;
+}
+
+mirror_async * mirror_async::load_configuration(const YAML::Node & node)
+{
+	dolog(ll_info, " * mirror_async::load_configuration");
+
+	const YAML::Node cfg = yaml_get_yaml_node(node, "cfg", "mirror configuration");
+
+	std::string id = yaml_get_string(cfg, "id", "module id");
+
+	storage_backend *sb = storage_backend::load_configuration(cfg["storage-backend"], { }, { });
+
+	uint64_t max_queue = yaml_get_uint64_t(cfg, "max-queue", "how many bytes may be waiting to be sent to the mirror", true);
+
+	int n_threads = yaml_get_int(cfg, "threads", "number of threads sending to the mirror");
+
+	// optional
+	dirty_bitmap *bitmap = cfg["dirty-bitmap"] ? dirty_bitmap::load_configuration(cfg["dirty-bitmap"], sb->get_size()) : nullptr;
+
+	return new mirror_async(id, sb, max_queue, n_threads, bitmap);
+}
+
+offset_t mirror_async::get_size() const
+{
+	return sb->get_size();
+}
+
+void mirror_async::supersede(const offset_t offset, entry_t & e_new)
+{
+	const offset_t start = offset;
+	const offset_t end   = offset + e_new.len;
+
+	auto it = queue.lower_bound(start);
+
+	if (it != queue.begin()) {
+		auto prev = std::prev(it);
+
+		if (prev->first + prev->second.len > start)
+			it = prev;
+	}
+
+	while(it != queue.end() && it->first < end) {
+		const offset_t e_start = it->first;
+		const offset_t e_end   = e_start + it->second.len;
+
+		entry_t e = std::move(it->second);
+
+		it = queue.erase(it);
+
+		if (e.data.has_value())
+			queued_bytes -= e.len;
+
+		n_superseded += std::min(e_end, end) - std::max(e_start, start);
+
+		e_new.seq       = std::min(e_new.seq, e.seq);
+		e_new.queued_at = std::min(e_new.queued_at, e.queued_at);
+
+		// what is not overwritten stays
+		if (e_start < start) {
+			entry_t left = e;
+			left.len = start - e_start;
+
+			if (e.data.has_value()) {
+				left.data = e.data.value().slice(0, left.len);
+				queued_bytes += left.len;
+			}
+
+			queue.insert({ e_start, left });
+		}
+
+		if (e_end > end) {
+			entry_t right = e;
+			right.len = e_end - end;
+
+			if (e.data.has_value()) {
+				right.data = e.data.value().slice(end - e_start, right.len);
+				queued_bytes += right.len;
+			}
+
+			// it->first >= end from here on, so the loop ends
+			it = queue.insert({ end, right }).first;
+		}
+	}
+}
+
+bool mirror_async::overlaps_in_flight(const offset_t start, const offset_t end) const
+{
+	auto it = in_flight.lower_bound(end);
+
+	if (it == in_flight.begin())
+		return false;
+
+	return std::prev(it)->second.end > start;
+}
+
+std::map<offset_t, mirror_async::entry_t>::iterator mirror_async::find_sendable()
+{
+	// elevator-like: from where the previous batch ended, then wrap around
+	for(auto it = queue.lower_bound(cursor); it != queue.end(); it++) {
+		if (overlaps_in_flight(it->first, it->first + it->second.len) == false)
+			return it;
+	}
+
+	for(auto it = queue.begin(); it != queue.end() && it->first < cursor; it++) {
+		if (overlaps_in_flight(it->first, it->first + it->second.len) == false)
+			return it;
+	}
+
+	return queue.end();
+}
+
+uint64_t mirror_async::get_oldest_seq() const
+{
+	uint64_t oldest = UINT64_MAX;
+
+	for(auto & e : queue)
+		oldest = std::min(oldest, e.second.seq);
+
+	for(auto & f : in_flight)
+		oldest = std::min(oldest, f.second.seq);
+
+	return oldest;
+}
+
+uint64_t mirror_async::get_oldest_queued_at() const
+{
+	uint64_t oldest = UINT64_MAX;
+
+	for(auto & e : queue)
+		oldest = std::min(oldest, e.second.queued_at);
+
+	for(auto & f : in_flight)
+		oldest = std::min(oldest, f.second.queued_at);
+
+	return oldest;
+}
+
+uint64_t mirror_async::get_lag_bytes() const
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	return queued_bytes;
+}
+
+double mirror_async::get_lag_seconds() const
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	const uint64_t oldest = get_oldest_queued_at();
+
+	if (oldest == UINT64_MAX)
+		return 0.;
+
+	const uint64_t now = get_us();
+
+	return now > oldest ? (now - oldest) / 1000000. : 0.;
+}
+
+void mirror_async::enqueue(const offset_t offset, entry_t && e)
+{
+	// on disk before the write is acknowledged
+	if (get_dirty_bitmap())
+		e.intent = std::make_shared<write_intent>(this, offset, e.len);
+
+	std::unique_lock<std::mutex> lck(lock);
+
+	const uint64_t bytes = e.data.has_value() ? e.len : 0;
+
+	// a single request that is larger than the queue is accepted when the queue is empty
+	while(queued_bytes > 0 && queued_bytes + bytes > max_queue && !stop)
+		cond.wait(lck);
+
+	e.seq       = ++seq;
+	e.queued_at = get_us();
+
+	supersede(offset, e);
+
+	queue.insert({ offset, std::move(e) });
+
+	queued_bytes += bytes;
+
+	cond.notify_all();
+}
+
+bool mirror_async::put_block(const offset_t o, const block & b)
+{
+	stats_timer st(stats, so_put, b.get_size());
+
+	if (b.get_size() == 0)
+		return true;
+
+	// a copy of a block that does not own its data makes a private copy
+	entry_t e { b, uint32_t(b.get_size()), false, 0, 0, nullptr };
+
+	enqueue(o, std::move(e));
+
+	return true;
+}
+
+bool mirror_async::trim_zero(const offset_t offset, const uint32_t len, const bool trim)
+{
+	stats_timer st(stats, so_trim, len);
+
+	if (len == 0)
+		return true;
+
+	entry_t e { { }, len, trim, 0, 0, nullptr };
+
+	enqueue(offset, std::move(e));
+
+	return true;
+}
+
+bool mirror_async::sync()
+{
+	stats_timer st(stats, so_fsync, 0);
+
+	bool ok = true;
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		const uint64_t target = seq;
+
+		// what is queued later does not need to be waited for
+		while(get_oldest_seq() <= target)
+			cond.wait(lck);
+
+		if (failed) {
+			ok     = false;
+			failed = false;
+		}
+	}
+
+	if (sb->fsync() == false) {
+		dolog(ll_error, "mirror_async::sync(%s): cannot fsync", id.c_str());
+		ok = false;
+	}
+
+	return ok;
+}
+
+bool mirror_async::send(const offset_t offset, const std::vector<entry_t> & batch)
+{
+	int err = 0;
+
+	if (batch.at(0).data.has_value()) {
+		if (batch.size() == 1) {
+			sb->put_data(offset, batch.at(0).data.value(), &err);
+		}
+		else {
+			uint64_t len = 0;
+			for(auto & e : batch)
+				len += e.len;
+
+			uint8_t *buffer = pool_malloc(len);
+			if (!buffer) {
+				dolog(ll_error, "mirror_async::send(%s): cannot allocate %lu bytes of memory", id.c_str(), len);
+				return false;
+			}
+
+			uint64_t o = 0;
+
+			for(auto & e : batch) {
+				memcpy(&buffer[o], e.data.value().get_data(), e.len);
+
+				o += e.len;
+			}
+
+			sb->put_data(offset, block(buffer, len), &err);
+		}
+	}
+	else {
+		uint32_t len = 0;
+		for(auto & e : batch)
+			len += e.len;
+
+		if (sb->trim_zero(offset, len, batch.at(0).trim, &err) == false && err == 0)
+			err = EIO;
+	}
+
+	if (err) {
+		dolog(ll_error, "mirror_async::send(%s): failed to send %zu requests at offset %lu: %s", id.c_str(), batch.size(), offset, strerror(err));
+		return false;
+	}
+
+	return true;
+}
+
+void mirror_async::sender()
+{
+	dolog(ll_info, "mirror_async(%s): sender thread started", id.c_str());
+
+	std::unique_lock<std::mutex> lck(lock);
+
+	for(;;) {
+		auto it = find_sendable();
+
+		if (it == queue.end()) {
+			if (stop && queue.empty())
+				break;
+
+			cond.wait(lck);
+
+			continue;
+		}
+
+		// collect the adjacent requests of the same type
+		const offset_t start = it->first;
+		offset_t       end   = start;
+
+		std::vector<entry_t> batch;
+		in_flight_t          f { 0, 0, UINT64_MAX, UINT64_MAX };
+
+		while(it != queue.end() && it->first == end && (batch.empty() || (it->second.data.has_value() == batch.at(0).data.has_value() && it->second.trim == batch.at(0).trim && end - start + it->second.len <= max_batch && overlaps_in_flight(end, end + it->second.len) == false))) {
+			end += it->second.len;
+
+			if (it->second.data.has_value())
+				f.bytes += it->second.len;
+
+			f.seq       = std::min(f.seq, it->second.seq);
+			f.queued_at = std::min(f.queued_at, it->second.queued_at);
+
+			batch.push_back(std::move(it->second));
+
+			it = queue.erase(it);
+		}
+
+		f.end = end;
+
+		in_flight.insert({ start, f });
+
+		cursor = end;
+
+		n_batches++;
+		n_coalesced += batch.size() - 1;
+
+		lck.unlock();
+
+		bool ok = send(start, batch);
+
+		// before the write intents are released
+		if (!ok)
+			mark_dirty(start, end - start);
+
+		batch.clear();  // frees the data (if not shared) and ends the write intents
+
+		lck.lock();
+
+		if (!ok)
+			failed = true;
+
+		in_flight.erase(start);
+
+		queued_bytes -= f.bytes;
+
+		cond.notify_all();
+	}
+
+	dolog(ll_info, "mirror_async(%s): sender thread terminating", id.c_str());
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <yaml-cpp/yaml.h>
+
+#include "block.h"
+#include "mirror.h"
+#include "storage_backend.h"
+#include "types.h"
+
+
+// Mirror that does not make the writer wait: writes and trims are queued
+// (in memory, up to 'max_queue' bytes; when full, writers wait) and sent to
+// the storage backend by background threads. A write to a region that is
+// still queued replaces (that part of) the queued data, adjacent queued
+// writes are sent as one. sync() waits until everything that was queued
+// before it has been sent.
+// With a dirty bitmap, the regions of a queued write are marked in it until
+// the write was sent (or overwritten): what was still queued when mystorage
+// stopped is copied by mirror_resync at the next start.
+class mirror_async : public mirror
+{
+private:
+	// begin_write() on the regions of a queued write, end_write() when the
+	// last part of it is gone from the queue
+	class write_intent
+	{
+	private:
+		mirror *const  m;
+		const offset_t offset;
+		const uint64_t len;
+
+	public:
+		write_intent(mirror *const m, const offset_t offset, const uint64_t len);
+		virtual ~write_intent();
+	};
+
+	typedef struct {
+		std::optional<block> data;  // not set for a trim/zero
+		uint32_t             len;
+		bool                 trim;
+		uint64_t             seq;
+		uint64_t             queued_at;  // us
+		std::shared_ptr<write_intent> intent;  // shared by the parts of a superseded write, not set without a dirty bitmap
+	} entry_t;
+
+	typedef struct {
+		offset_t end;
+		uint64_t bytes;      // counted in queued_bytes
+		uint64_t seq;        // lowest in the batch
+		uint64_t queued_at;  // oldest in the batch
+	} in_flight_t;
+
+	static constexpr uint32_t max_batch { 1024 * 1024 };
+
+	storage_backend *const      sb;
+	const uint64_t              max_queue;
+	const int                   n_threads;
+
+	mutable std::mutex          lock;
+	std::condition_variable     cond;
+	std::map<offset_t, entry_t> queue;      // the entries do not overlap
+	// neither do these, but a queued entry can overlap one of them (a newer
+	// write to what is being sent): it is not sent before that batch is done
+	std::map<offset_t, in_flight_t> in_flight;
+	uint64_t                    queued_bytes { 0 };  // data in 'queue' and 'in_flight'
+	uint64_t                    seq          { 0 };
+	offset_t                    cursor       { 0 };  // where the next sender starts looking
+	bool                        failed       { false };  // since the previous sync()
+	bool                        stop         { false };
+	std::vector<std::thread *>  threads;
+
+	uint64_t                    n_superseded { 0 };  // bytes that were replaced before they were sent
+	uint64_t                    n_batches    { 0 };
+	uint64_t                    n_coalesced  { 0 };  // entries that were sent together with an other
+
+	// these expect 'lock' to be locked
+	// removes what 'e' overwrites from the queue; 'e' inherits the seq and
+	// queued_at of that when these are older, so that a write that keeps
+	// getting overwritten still counts for sync() and the lag
+	void supersede(const offset_t offset, entry_t & e);
+	bool overlaps_in_flight(const offset_t start, const offset_t end) const;
+	std::map<offset_t, entry_t>::iterator find_sendable();
+	uint64_t get_oldest_seq() const;
+	uint64_t get_oldest_queued_at() const;
+
+	void enqueue(const offset_t offset, entry_t && e);
+	bool send(const offset_t offset, const std::vector<entry_t> & batch);
+	void sender();
+
+public:
+	mirror_async(const std::string & id, storage_backend *const sb, const uint64_t max_queue, const int n_threads, dirty_bitmap *const bitmap);
+	virtual ~mirror_async();
+
+	offset_t get_size() const override;
+
+	bool put_block(const offset_t o, const block & b) override;
+
+	bool sync() override;
+
+	bool trim_zero(const offset_t offset, const uint32_t len, const bool trim) override;
+
+	// how far the mirror is behind
+	uint64_t get_lag_bytes() const;
+	double   get_lag_seconds() const;
+
+	YAML::Node emit_configuration() const override;
+	static mirror_async * load_configuration(const YAML::Node & node);
+};
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <vector>
+
+#include "dirty_bitmap.h"
+#include "logging.h"
+#include "mirror_resync.h"
+#include "storage_backend.h"
+#include "time.h"
+
+
+std::mutex                  mirror_resync::registry_lock;
+std::set<storage_backend *> mirror_resync::registry;
+
+// how long a storage backend must have been idle before a region is copied
+constexpr uint64_t idle_us     { 10000 };
+// longest time to give way to foreground I/O: else a busy storage backend would never get in sync
+constexpr uint64_t max_yield_us { 1000000 };
+// when there is nothing to do or after a failure
+constexpr uint64_t retry_us    { 1000000 };
+constexpr uint64_t progress_us { 5000000 };
+
+mirror_resync::mirror_resync() : base("resync")
+{
+	th = new std::thread(std::ref(*this));
+}
+
+mirror_resync::~mirror_resync()
+{
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		stop_flag = true;
+
+		cond.notify_all();
+	}
+
+	if (th) {
+		th->join();
+		delete th;
+	}
+
+	dolog(ll_info, "mirror_resync: %lu regions copied, %lu failed", n_copied, n_failed);
+}
+
+void mirror_resync::register_backend(storage_backend *const sb)
+{
+	std::unique_lock<std::mutex> lck(registry_lock);
+
+	registry.insert(sb);
+}
+
+void mirror_resync::unregister_backend(storage_backend *const sb)
+{
+	// waits for a copy in progress
+	std::unique_lock<std::mutex> lck(registry_lock);
+
+	registry.erase(sb);
+}
+
+bool mirror_resync::has_backends()
+{
+	std::unique_lock<std::mutex> lck(registry_lock);
+
+	return registry.empty() == false;
+}
+
+void mirror_resync::pause(const uint64_t us)
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	if (!stop_flag)
+		cond.wait_for(lck, std::chrono::microseconds(us));
+}
+
+uint64_t mirror_resync::step()
+{
+	std::unique_lock<std::mutex> lck(registry_lock);
+
+	std::vector<std::pair<storage_backend *, mirror *> > todo;
+
+	for(auto sb : registry) {
+		for(auto m : sb->get_mirrors()) {
+			if (m->get_dirty_bitmap() && m->get_dirty_bitmap()->get_n_dirty() > 0)
+				todo.push_back({ sb, m });
+		}
+	}
+
+	if (todo.empty())
+		return retry_us;
+
+	auto [sb, m] = todo.at(next++ % todo.size());
+
+	const uint64_t now     = get_us();
+	const uint64_t last_io = sb->get_last_io();
+
+	if (now - std::min(now, last_io) < idle_us) {
+		if (yielding_since == 0)
+			yielding_since = now;
+
+		if (now - yielding_since < max_yield_us)
+			return idle_us;
+	}
+
+	yielding_since = 0;
+
+	dirty_bitmap *const bitmap = m->get_dirty_bitmap();
+
+	auto region = bitmap->find_dirty(cursors[m]);
+	if (region.has_value() == false)
+		return 0;
+
+	if (sb->resync_region(m, region.value()) == false) {
+		dolog(ll_warning, "mirror_resync: failed to copy region %lu to mirror %s, will retry", region.value(), m->get_id().c_str());
+
+		n_failed++;
+
+		return retry_us;
+	}
+
+	n_copied++;
+
+	cursors[m] = region.value() + 1;
+
+	if (bitmap->get_n_dirty() == 0)
+		dolog(ll_info, "mirror_resync: mirror %s of %s is in sync again", m->get_id().c_str(), sb->get_id().c_str());
+
+	const uint64_t max_rate = bitmap->get_resync_max_rate();
+	if (max_rate == 0)
+		return 0;
+
+	// the time it should have taken minus what it did
+	const uint64_t should_take = bitmap->get_region_size() * 1000000 / max_rate;
+	const uint64_t took        = get_us() - now;
+
+	return should_take > took ? should_take - took : 0;
+}
+
+void mirror_resync::operator()()
+{
+	dolog(ll_info, "mirror_resync: thread started");
+
+	uint64_t prev_progress = get_us();
+
+	while(!stop_flag) {
+		const uint64_t wait = step();
+
+		const uint64_t now = get_us();
+
+		if (now - prev_progress >= progress_us) {
+			prev_progress = now;
+
+			std::unique_lock<std::mutex> lck(registry_lock);
+
+			for(auto sb : registry) {
+				for(auto m : sb->get_mirrors()) {
+					dirty_bitmap *const bitmap = m->get_dirty_bitmap();
+
+					if (bitmap && bitmap->get_n_dirty() > 0)
+						dolog(ll_info, "mirror_resync: mirror %s of %s: %lu of %lu regions left to copy", m->get_id().c_str(), sb->get_id().c_str(), bitmap->get_n_dirty(), bitmap->get_n_regions());
+				}
+			}
+		}
+
+		if (wait)
+			pause(wait);
+	}
+
+	dolog(ll_info, "mirror_resync: thread terminating");
+}
+
+YAML::Node mirror_resync::emit_configuration() const
+{
+	// not configured: it is there when a mirror has a dirty-region bitmap
+	return YAML::Node();
+}
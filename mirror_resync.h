@@ -0,0 +1,53 @@
+#pragma once
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdint.h>
+#include <thread>
+#include <yaml-cpp/yaml.h>
+
+#include "base.h"
+#include "mirror.h"
+
+
+class storage_backend;
+
+// Copies the regions that are marked in the dirty-region bitmaps of mirrors
+// from the storage backend they mirror, one region at a time and round-robin
+// over the mirrors. It gives way to foreground I/O on that storage backend
+// (but copies a region at least every second) and limits itself to the
+// 'resync-max-rate' of the bitmap.
+// The storage backends with such mirrors register themselves; this object
+// must be deleted before them.
+class mirror_resync : public base
+{
+private:
+	static std::mutex                   registry_lock;
+	static std::set<storage_backend *>  registry;
+
+	std::mutex                          lock;
+	std::condition_variable             cond;  // for stopping
+	std::map<mirror *, uint64_t>        cursors;  // where to continue per mirror
+	uint64_t                            next      { 0 };
+	uint64_t                            n_copied  { 0 };  // regions
+	uint64_t                            n_failed  { 0 };
+	uint64_t                            yielding_since { 0 };  // 0: not giving way to foreground I/O
+	std::thread                        *th        { nullptr };
+
+	// returns how long to wait (in us) before the next step
+	uint64_t step();
+	void     pause(const uint64_t us);
+
+public:
+	mirror_resync();
+	virtual ~mirror_resync();
+
+	static void register_backend(storage_backend *const sb);
+	static void unregister_backend(storage_backend *const sb);
+	static bool has_backends();
+
+	void operator()();
+
+	YAML::Node emit_configuration() const override;
+};
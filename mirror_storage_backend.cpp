@@ -3,11 +3,12 @@
 #include "logging.h"
 #include "mirror_storage_backend.h"
 #include "storage_backend.h"
+#include "str.h"
 #include "types.h"
 #include "yaml-helpers.h"
 
 
-mirror_storage_backend::mirror_storage_backend(const std::string & id, storage_backend *const sb) : mirror(id), sb(sb)
+mirror_storage_backend::mirror_storage_backend(const std::string & id, storage_backend *const sb, const bool serve_reads, dirty_bitmap *const bitmap) : mirror(id, serve_reads, bitmap), sb(sb)
 {
 	sb->acquire(this);
 }
@@ -25,6 +26,9 @@ YAML::Node mirror_storage_backend::emit_configuration() const
 	YAML::Node out_cfg;
 	out_cfg["id"] = id;
 	out_cfg["storage-backend"] = sb->emit_configuration();
+	out_cfg["serve-reads"] = serve_reads;
+	if (get_dirty_bitmap())
+		out_cfg["dirty-bitmap"] = get_dirty_bitmap()->emit_configuration();
 
 	YAML::Node out;
 	out["type"] = "mirror-storage-backend";
@@ -41,9 +45,18 @@ mirror_storage_backend * mirror_storage_backend::load_configuration(const YAML::
 
 	std::string id = yaml_get_string(cfg, "id", "module id");
 
+	// optional
+	bool serve_reads = cfg["serve-reads"] ? yaml_get_bool(cfg, "serve-reads", "whether reads may be balanced over the storage-backend and this mirror") : false;
+
+	if (serve_reads && !cfg["dirty-bitmap"])
+		throw myformat("mirror_storage_backend(%s): serve-reads requires a dirty-bitmap", id.c_str());
+
 	storage_backend *sb = storage_backend::load_configuration(cfg["storage-backend"], { }, { });
 
-	return new mirror_storage_backend(id, sb);
+	// optional
+	dirty_bitmap *bitmap = cfg["dirty-bitmap"] ? dirty_bitmap::load_configuration(cfg["dirty-bitmap"], sb->get_size()) : nullptr;
+
+	return new mirror_storage_backend(id, sb, serve_reads, bitmap);
 }
 
 offset_t mirror_storage_backend::get_size() const
@@ -51,8 +64,29 @@ offset_t mirror_storage_backend::get_size() const
 	return sb->get_size();
 }
 
+bool mirror_storage_backend::get_data_int(const offset_t offset, const struct iovec *const iov, const int iov_n)
+{
+	uint64_t len = 0;
+	for(int i=0; i<iov_n; i++)
+		len += iov[i].iov_len;
+
+	stats_timer st(stats, so_get, len);
+
+	int err = 0;
+	sb->get_data_into(offset, iov, iov_n, &err);
+
+	if (err) {
+		dolog(ll_error, "mirror_storage_backend::get_data_int(%s): cannot read %lu bytes at offset %lu, reason: %s", id.c_str(), len, offset, strerror(err));
+		return false;
+	}
+
+	return true;
+}
+
 bool mirror_storage_backend::put_block(const offset_t o, const block & b)
 {
+	stats_timer st(stats, so_put, b.get_size());
+
 	int err = 0;
 	sb->put_data(o, b, &err);
 
@@ -66,6 +100,8 @@ bool mirror_storage_backend::put_block(const offset_t o, const block & b)
 
 bool mirror_storage_backend::sync()
 {
+	stats_timer st(stats, so_fsync, 0);
+
 	if (sb->fsync() == false) {
 		dolog(ll_error, "mirror_storage_backend::put_block(%s): cannot fsync", id.c_str());
 		return false;
@@ -76,6 +112,8 @@ bool mirror_storage_backend::sync()
 
 bool mirror_storage_backend::trim_zero(const offset_t offset, const uint32_t len, const bool trim)
 {
+	stats_timer st(stats, so_trim, len);
+
 	int err = 0;
 	if (sb->trim_zero(offset, len, trim, &err) == false) {
 		dolog(ll_error, "mirror_storage_backend::trim_zero(%s): failed: %s", id.c_str(), strerror(err));
@@ -13,8 +13,11 @@ class mirror_storage_backend : public mirror
 private:
 	storage_backend *const sb;
 
+protected:
+	bool get_data_int(const offset_t offset, const struct iovec *const iov, const int iov_n) override;
+
 public:
-	mirror_storage_backend(const std::string & id, storage_backend *const sb);
+	mirror_storage_backend(const std::string & id, storage_backend *const sb, const bool serve_reads, dirty_bitmap *const bitmap);
 	virtual ~mirror_storage_backend();
 
 	offset_t get_size() const override;
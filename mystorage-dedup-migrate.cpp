@@ -0,0 +1,57 @@
+// converts the database of a storage-backend-dedup to the current key schema
+#include <stdio.h>
+#include <string>
+#include <unistd.h>
+
+#include "dedup_schema.h"
+
+
+void help()
+{
+	printf("-i x  database to convert (it is not changed)\n");
+	printf("-o x  file to write the converted database to (must not exist)\n");
+	printf("\n");
+	printf("mystorage must not be running on the database while converting\n");
+	printf("afterwards, point \"file\" of the storage-backend-dedup to the new file\n");
+}
+
+int main(int argc, char *argv[])
+{
+	std::string from;
+	std::string to;
+
+	int c = -1;
+	while((c = getopt(argc, argv, "i:o:h")) != -1) {
+		if (c == 'i')
+			from = optarg;
+		else if (c == 'o')
+			to = optarg;
+		else {
+			help();
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (from.empty() || to.empty()) {
+		help();
+		return 1;
+	}
+
+	dedup_migrate_result_t result { };
+	std::string            error;
+
+	if (dedup_migrate_v1(from, to, &result, &error) == false) {
+		fprintf(stderr, "conversion failed: %s\n", error.c_str());
+		return 1;
+	}
+
+	printf("%lu blocks, %lu data blocks\n", result.n_blocks, result.n_records);
+
+	if (result.n_unreferenced)
+		printf("%lu data blocks were not used anymore and are left out\n", result.n_unreferenced);
+
+	if (result.n_missing)
+		printf("WARNING: %lu data blocks are missing, reading the blocks that use them will fail\n", result.n_missing);
+
+	return 0;
+}
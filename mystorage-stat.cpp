@@ -0,0 +1,218 @@
+// shows the statistics that mystorage serves on its stats-socket, iostat-like
+#include <algorithm>
+#include <errno.h>
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <yaml-cpp/yaml.h>
+
+
+typedef struct {
+	uint64_t                     n;
+	uint64_t                     bytes;
+	uint64_t                     sum_us;
+	std::map<uint64_t, uint64_t> histogram;  // upper bound (us) -> count
+} op_t;
+
+typedef std::map<std::string, std::map<std::string, op_t> > sample_t;  // "kind id" -> op name -> numbers
+
+static const char *const op_names[] = { "get", "put", "trim", "fsync" };
+
+std::string request(const std::string & path, const std::string & what)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		fprintf(stderr, "cannot create socket: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	struct sockaddr_un addr { 0 };
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof addr) == -1) {
+		fprintf(stderr, "cannot connect to \"%s\": %s\n", path.c_str(), strerror(errno));
+		exit(1);
+	}
+
+	const std::string line = what + "\n";
+
+	if (write(fd, line.c_str(), line.size()) != ssize_t(line.size())) {
+		fprintf(stderr, "cannot send request: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	std::string out;
+
+	for(;;) {
+		char buffer[65536];
+		ssize_t rc = read(fd, buffer, sizeof buffer);
+		if (rc <= 0)
+			break;
+
+		out += std::string(buffer, rc);
+	}
+
+	close(fd);
+
+	return out;
+}
+
+sample_t get_sample(const std::string & path)
+{
+	sample_t out;
+
+	// JSON is a subset of YAML
+	YAML::Node all = YAML::Load(request(path, "json"));
+
+	for(const auto & object : all) {
+		const std::string name = object["kind"].as<std::string>() + " " + object["id"].as<std::string>();
+
+		for(auto op_name : op_names) {
+			const YAML::Node o = object["ops"][op_name];
+
+			op_t op;
+			op.n      = o["n"].as<uint64_t>();
+			op.bytes  = o["bytes"].as<uint64_t>();
+			op.sum_us = o["sum_us"].as<uint64_t>();
+
+			for(const auto & bucket : o["histogram"])
+				op.histogram[bucket[0].as<uint64_t>()] = bucket[1].as<uint64_t>();
+
+			out[name][op_name] = op;
+		}
+	}
+
+	return out;
+}
+
+// of the requests between two samples
+uint64_t percentile(const op_t & cur, const op_t *const prev, const double fraction)
+{
+	const uint64_t n = cur.n - (prev ? prev->n : 0);
+
+	if (n == 0)
+		return 0;
+
+	const uint64_t target = std::max(uint64_t(1), uint64_t(n * fraction + 0.5));
+
+	uint64_t count = 0;
+
+	for(auto & bucket : cur.histogram) {
+		uint64_t before = 0;
+
+		if (prev) {
+			auto it = prev->histogram.find(bucket.first);
+
+			if (it != prev->histogram.end())
+				before = it->second;
+		}
+
+		count += bucket.second - before;
+
+		if (count >= target)
+			return bucket.first;
+	}
+
+	return 0;
+}
+
+void show(const sample_t & cur, const sample_t & prev, const double interval)
+{
+	printf("%-32s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n", "object", "r/s", "rMB/s", "r_await", "r_p99", "w/s", "wMB/s", "w_await", "w_p99", "trim/s", "flush/s");
+
+	for(auto & object : cur) {
+		auto it_prev = prev.find(object.first);
+
+		double n[4]     { 0 };
+		double mb[4]    { 0 };
+		double await[4] { 0 };
+		uint64_t p99[4] { 0 };
+
+		for(int i=0; i<4; i++) {
+			const op_t & c = object.second.at(op_names[i]);
+			const op_t *p  = it_prev != prev.end() ? &it_prev->second.at(op_names[i]) : nullptr;
+
+			const uint64_t d_n      = c.n      - (p ? p->n      : 0);
+			const uint64_t d_bytes  = c.bytes  - (p ? p->bytes  : 0);
+			const uint64_t d_sum_us = c.sum_us - (p ? p->sum_us : 0);
+
+			n[i]     = d_n / interval;
+			mb[i]    = d_bytes / interval / 1048576.;
+			await[i] = d_n ? d_sum_us / 1000. / d_n : 0.;
+			p99[i]   = percentile(c, p, 0.99);
+		}
+
+		printf("%-32s %8.1f %8.2f %8.2f %8.2f %8.1f %8.2f %8.2f %8.2f %8.1f %8.1f\n", object.first.c_str(), n[0], mb[0], await[0], p99[0] / 1000., n[1], mb[1], await[1], p99[1] / 1000., n[2], n[3]);
+	}
+
+	printf("\n");
+}
+
+void help()
+{
+	printf("-s x  path of the stats-socket (\"stats: socket:\" in the mystorage configuration)\n");
+	printf("-i x  interval in seconds (default 1)\n");
+	printf("-n x  number of reports (default: until interrupted)\n");
+	printf("-j    show the raw JSON output and exit\n");
+	printf("-p    show the raw Prometheus output and exit\n");
+	printf("\n");
+	printf("every report is about the requests of the last interval\n");
+	printf("latencies (await, p99) are in milliseconds\n");
+}
+
+int main(int argc, char *argv[])
+{
+	std::string path     = "/tmp/mystorage-stats.sock";
+	double      interval = 1.;
+	int         count    = -1;
+
+	int c = -1;
+	while((c = getopt(argc, argv, "s:i:n:jph")) != -1) {
+		if (c == 's')
+			path = optarg;
+		else if (c == 'i')
+			interval = atof(optarg);
+		else if (c == 'n')
+			count = atoi(optarg);
+		else if (c == 'j' || c == 'p') {
+			printf("%s", request(path, c == 'j' ? "json" : "prometheus").c_str());
+			return 0;
+		}
+		else {
+			help();
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (interval <= 0.) {
+		fprintf(stderr, "interval must be > 0\n");
+		return 1;
+	}
+
+	try {
+		sample_t prev = get_sample(path);
+
+		for(int i=0; count == -1 || i<count; i++) {
+			usleep(useconds_t(interval * 1000000));
+
+			sample_t cur = get_sample(path);
+
+			show(cur, prev, interval);
+
+			prev = cur;
+		}
+	}
+	catch(const YAML::Exception & e) {
+		fprintf(stderr, "cannot parse the statistics: %s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -7,7 +7,7 @@
 #include "str.h"
 
 
-server::server(const std::string & id) : base(id)
+server::server(const std::string & id) : base(id), stats("server", id)
 {
 }
 
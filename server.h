@@ -4,11 +4,15 @@
 #include <yaml-cpp/yaml.h>
 
 #include "base.h"
+#include "stats.h"
 #include "storage_backend.h"
 
 
 class server : public base
 {
+protected:
+	io_stats stats;  // per request, as seen by the clients
+
 public:
 	server(const std::string & id);
 	virtual ~server();
@@ -360,9 +360,17 @@ void aoe::worker_thread(aoe_path_t & ap)
 
 				dolog(ll_debug, "aoe::operator(%s): CommandATA: ReadSector(s) (%d) from LBA %llu", id.c_str(), out[26], lba);
 
+				const size_t n_bytes = out[26] * 512;
+				out.resize(36 + n_bytes);  // drop any extra data & make room: the sectors are read in-place
+
 				int err = 0;
-				block *b = nullptr;
-			 	sb->get_data(lba * 512, out[26] * 512, &b, &err);  // TODO range check
+				struct iovec iov { out.data() + 36, n_bytes };
+
+				{
+					stats_timer st(stats, so_get, n_bytes);
+
+					sb->get_data_into(lba * 512, &iov, 1, &err);  // TODO range check
+				}
 
 				if (err) {
 					dolog(ll_error, "aoe::operator(%s): failed to retrieve data from storage backend: %s", id.c_str(), strerror(err));
@@ -370,18 +378,12 @@ void aoe::worker_thread(aoe_path_t & ap)
 				}
 				else {
 					out[27] = 64;  // DRDY set
-					out.resize(36);  // move any extra data
-
-					out.resize(36 + b->get_size());  // make room
-					memcpy(out.data() + 36, b->get_data(), b->get_size());
 
 					if (write(ap.fd, out.data(), out.size()) != ssize_t(out.size())) {
 						dolog(ll_error, "aoe::operator(%s): failed to transmit Ethernet frame: %s (%zu bytes, ReadSector)", id.c_str(), strerror(errno), out.size());
 						break;
 					}
 				}
-
-				delete b;
 			}
 			else if (out[27] == 0x30 || out[27] == 0x34) {  // write sectors, max 28bit/48bit
 				lba &= out[27] == 0x30 ? 0x0fffffff : 0x0000ffffffffffffll;
@@ -391,7 +393,12 @@ void aoe::worker_thread(aoe_path_t & ap)
 				block b(&out[36], out[26] * 512, false);  // TODO range check
 
 				int err = 0;
-				sb->put_data(lba * 512, b, &err);
+
+				{
+					stats_timer st(stats, so_put, b.get_size());
+
+					sb->put_data(lba * 512, b, &err);
+				}
 
 				if (err) {
 					dolog(ll_error, "aoe::operator(%s): failed to write data to storage backend: %s", id.c_str(), strerror(err));
@@ -4,6 +4,8 @@
 #include <unistd.h>
 #include <vector>
 
+#include "block.h"
+#include "buffer_pool.h"
 #include "error.h"
 #include "io.h"
 #include "logging.h"
@@ -14,6 +16,7 @@
 #include "socket_listener.h"
 #include "storage_backend.h"
 #include "str.h"
+#include "time.h"
 #include "yaml-helpers.h"
 
 
@@ -226,6 +229,8 @@ void nbd::handle_client(const int fd, std::atomic_bool *const thread_stopped)
 	size_t current_sb = 0;
 	bool use_0x00_padding = true;
 
+	std::vector<uint8_t> read_buffer;  // re-used for all NBD_CMD_READs of this connection
+
 	for(;state != nbd_st_terminate && !stop_flag;) {
 		dolog(ll_debug, "nbd::handle_client: state: \"%s\" (%d)", nbd_st_strings[state], state);
 
@@ -291,16 +296,27 @@ void nbd::handle_client(const int fd, std::atomic_bool *const thread_stopped)
 			switch(option.value())  {
 				case NBD_OPT_EXPORT_NAME:
 					{
-						auto sel_sb = find_storage_backend_by_id(uint_vector_to_string(option_data.value()));
+						std::string name_str = option_data.has_value() ? uint_vector_to_string(option_data.value()) : "";
+						auto sel_sb = find_storage_backend_by_id(name_str);
 
+						// there's no option reply for NBD_OPT_EXPORT_NAME: the server either
+						// disconnects or sends the export size & flags
 						if (sel_sb.has_value() == false) {
-							send_option_reply(fd, option.value(), NBD_REP_ERR_UNSUP, { });
+							dolog(ll_info, "nbd::handle_client: export %s not known", name_str.c_str());
+							state = nbd_st_terminate;
 						}
 						else {
 							current_sb = sel_sb.value();
 
-							if (send_option_reply(fd, option.value(), NBD_REP_ACK, { }) == false) {
-								dolog(ll_info, "nbd::handle_client: failed transmitting NBD_REP_ACK");
+							std::vector<uint8_t> msg;
+							add_uint64(msg, storage_backends.at(current_sb)->get_size());
+							add_uint16(msg, NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_TRIM | NBD_FLAG_CAN_MULTI_CONN | NBD_FLAG_SEND_WRITE_ZEROES);
+
+							if (use_0x00_padding)
+								msg.resize(msg.size() + 124);
+
+							if (WRITE(fd, msg.data(), msg.size()) != ssize_t(msg.size())) {
+								dolog(ll_info, "nbd::handle_client: failed transmitting export size & flags");
 								state = nbd_st_terminate;
 								break;
 							}
@@ -427,25 +443,37 @@ void nbd::handle_client(const int fd, std::atomic_bool *const thread_stopped)
 				break;
 			}
 
-			std::optional<std::vector<uint8_t> > data;
+			// received straight into the buffer that goes down the storage stack
+			std::optional<block> data;
 			if (type == NBD_CMD_WRITE) {
-				data = receive_n_uint8(fd, length.value());
+				uint8_t *buffer = pool_malloc(length.value());
 
-				if (!data.has_value()) {
+				if (!buffer || READ(fd, buffer, length.value()) != ssize_t(length.value())) {
 					dolog(ll_info, "nbd::handle_client: receive fail (data)");
+					pool_free(buffer);
 					break;
 				}
+
+				data.emplace(buffer, length.value());
 			}
 
 			dolog(ll_debug, "nbd::handle_client: command, flags: %x, type: %s (%d), offset: %lu, length: %u", flags.value(), nbd_cmd_names[type.value()], type.value(), offset.value(), length.value());  // TODO length of nbd_cmd_names array indexing check
 
 			std::vector<uint8_t> reply;
-			block *b = nullptr;
 			int err = 0;
 
+			const uint64_t start = get_us();
+
 			switch(type.value()) {
 				case NBD_CMD_READ:
-					storage_backends.at(current_sb)->get_data(offset.value(), length.value(), &b, &err);
+					{
+						if (read_buffer.size() < length.value())
+							read_buffer.resize(length.value());
+
+						struct iovec iov { read_buffer.data(), length.value() };
+						storage_backends.at(current_sb)->get_data_into(offset.value(), &iov, 1, &err);
+					}
+
 					add_uint32(reply, 0x67446698);  // magic
 					add_uint32(reply, err);  // error
 					add_uint64(reply, handle.value());
@@ -453,20 +481,17 @@ void nbd::handle_client(const int fd, std::atomic_bool *const thread_stopped)
 					if (WRITE(fd, reply.data(), reply.size()) != ssize_t(reply.size())) {
 						dolog(ll_info, "nbd::handle_client: failed transmitting NBD_CMD_READ header");
 						state = nbd_st_terminate;
-						delete b;
 						break;
 					}
 
 					if (err == 0) {
-						if (WRITE(fd, b->get_data(), b->get_size()) != ssize_t(b->get_size())) {
+						if (WRITE(fd, read_buffer.data(), length.value()) != ssize_t(length.value())) {
 							dolog(ll_info, "nbd::handle_client: failed transmitting NBD_CMD_READ data");
 							state = nbd_st_terminate;
-							delete b;
 							break;
 						}
 					}
 
-					delete b;
 					break;
 
 				case NBD_CMD_WRITE:
@@ -537,6 +562,17 @@ void nbd::handle_client(const int fd, std::atomic_bool *const thread_stopped)
 					state = nbd_st_terminate;
 				}
 			}
+
+			const uint64_t took = get_us() - start;
+
+			if (type.value() == NBD_CMD_READ)
+				stats.record(so_get, length.value(), took);
+			else if (type.value() == NBD_CMD_WRITE)
+				stats.record(so_put, length.value(), took);
+			else if (type.value() == NBD_CMD_FLUSH)
+				stats.record(so_fsync, 0, took);
+			else if (type.value() == NBD_CMD_TRIM || type.value() == NBD_CMD_WRITE_ZEROES)
+				stats.record(so_trim, length.value(), took);
 		}
 	}
 
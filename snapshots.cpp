@@ -15,12 +15,14 @@
 #include "snapshots.h"
 #include "str.h"
 #include "yaml-helpers.h"
+#include "zero.h"
 
 
 snapshot_state::snapshot_state(storage_backend *const src, const std::string & complete_filename, const int block_size, const bool sparse_files) :
 	src(src),
 	complete_filename(complete_filename),
-	block_size(block_size)
+	block_size(block_size),
+	sparse_files(sparse_files)
 {
 	// target file
 	fd = open(complete_filename.c_str(), O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
@@ -37,9 +39,10 @@ snapshot_state::snapshot_state(storage_backend *const src, const std::string & c
 	if (bitmap == nullptr)
 		throw myformat("snapshot_state(%s): failed to allocate bitmap memory: %s", complete_filename.c_str(), strerror(errno));
 
-	// sparse files helper block
-	if (sparse_files)
-		sparse_block_compare = reinterpret_cast<uint8_t *>(calloc(1, block_size));
+	// buffer for copy_block (always used with 'lock' held)
+	copy_buffer = reinterpret_cast<uint8_t *>(malloc(block_size));
+	if (copy_buffer == nullptr)
+		throw myformat("snapshot_state(%s): failed to allocate copy buffer: %s", complete_filename.c_str(), strerror(errno));
 
 	n_blocks = (src->get_size() + block_size - 1) / block_size;
 
@@ -55,7 +58,7 @@ snapshot_state::~snapshot_state()
 		delete th;
 	}
 
-	free(sparse_block_compare);
+	free(copy_buffer);
 
 	free(bitmap);
 }
@@ -96,44 +99,29 @@ bool snapshot_state::copy_block(const block_nr_t block_nr)
 {
 	offset_t off = block_nr * block_size;
 
-	int      err = 0;
-	block   *b = nullptr;
-	src->get_data(off, block_size, &b, &err);
+	struct iovec iov { copy_buffer, size_t(block_size) };
+	int err = 0;
+	src->get_data_into(off, &iov, 1, &err);
 
 	if (err) {
-		dolog(ll_error, "snapshot_state::copy_block(%s): failed to get block (get_data) from source: %s", complete_filename.c_str(), strerror(errno));
+		dolog(ll_error, "snapshot_state::copy_block(%s): failed to get block (get_data_into) from source: %s", complete_filename.c_str(), strerror(err));
 		return false;
 	}
 
-	const uint8_t *p = b->get_data();
-	size_t         todo = b->get_size();
-
-	if (sparse_block_compare && memcmp(sparse_block_compare, p, block_size) == 0) {
-		delete b;
+	if (sparse_files && is_all_zero(copy_buffer, block_size))
 		return true;
-	}
 
-	if (todo != size_t(block_size)) {
-		dolog(ll_error, "snapshot_state::copy_block(%s): data-block is %ld bytes, expecting %d", complete_filename.c_str(), todo, block_size);
-		delete b;
-		return false;
-	}
-
-	ssize_t rc = PWRITE(fd, p, todo, off);
+	ssize_t rc = PWRITE(fd, copy_buffer, block_size, off);
 
 	if (rc == -1) {
 		dolog(ll_error, "snapshot_state::copy_block(%s): failed to write block to snapshot: %s", complete_filename.c_str(), strerror(errno));
-		delete b;
 		return false;
 	}
 	else if (rc == 0) {
 		dolog(ll_error, "snapshot_state::copy_block(%s): write 0 bytes to snapshot: disk full?", complete_filename.c_str());
-		delete b;
 		return false;
 	}
 
-	delete b;
-
 	return true;
 }
 
@@ -253,6 +241,11 @@ bool snapshots::get_block(const block_nr_t block_nr, uint8_t **const data)
 	return sb->get_block(block_nr, data);
 }
 
+bool snapshots::get_block_into(const block_nr_t block_nr, uint8_t *const to)
+{
+	return sb->get_block_into(block_nr, to);
+}
+
 bool snapshots::put_block(const block_nr_t block_nr, const uint8_t *const data)
 {
 	if (trigger_range(block_nr * sb->get_block_size(), sb->get_block_size()) == false) {
@@ -270,11 +263,15 @@ offset_t snapshots::get_size() const
 
 bool snapshots::fsync()
 {
+	stats_timer st(stats, so_fsync, 0);
+
 	return sb->fsync();
 }
 
 bool snapshots::trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err)
 {
+	stats_timer st(stats, so_trim, len);
+
 	if (trigger_range(offset, len) == false) {
 		dolog(ll_error, "snapshots::trim_zero(%s): failed to write block %ld to snapshot", id.c_str(), offset);
 		return false;
@@ -285,6 +282,8 @@ bool snapshots::trim_zero(const offset_t offset, const uint32_t len, const bool
 
 void snapshots::put_data(const offset_t offset, const block & b, int *const err)
 {
+	stats_timer st(stats, so_put, b.get_size());
+
 	if (trigger_range(offset, b.get_size()) == false) {
 		dolog(ll_error, "snapshots::put_data(%s): failed to write block %ld to snapshot", id.c_str(), offset);
 		*err = EIO;
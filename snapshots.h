@@ -22,7 +22,8 @@ private:
 	std::thread      *th { nullptr };
 	std::atomic_bool  stop_flag { false };
 	std::atomic_bool  copy_finished { false };
-	uint8_t          *sparse_block_compare { nullptr };
+	const bool        sparse_files { false };
+	uint8_t          *copy_buffer { nullptr };
 	block_nr_t        block_working_on { 0 };
 	block_nr_t        n_blocks { 0 };
 
@@ -62,6 +63,7 @@ protected:
 	bool can_do_multiple_blocks() const override;
 
         bool get_block(const block_nr_t block_nr, uint8_t **const data) override;
+        bool get_block_into(const block_nr_t block_nr, uint8_t *const to) override;
         bool put_block(const block_nr_t block_nr, const uint8_t *const data) override;
 
 public:
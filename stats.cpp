@@ -0,0 +1,314 @@
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include "stats.h"
+#include "str.h"
+#include "time.h"
+
+
+static std::mutex           registry_lock;
+static std::set<io_stats *> registry;
+
+static std::atomic_int      shard_counter { 0 };
+
+const char *stats_op_name(const stats_op_t op)
+{
+	static const char *const names[] = { "get", "put", "trim", "fsync" };
+
+	return names[op];
+}
+
+int latency_histogram::value_to_bucket(const uint64_t value)
+{
+	if (value < (1 << sub_bits))
+		return value;
+
+	const int msb   = 63 - __builtin_clzll(value);
+	const int shift = msb - sub_bits;
+
+	return ((shift + 1) << sub_bits) + ((value >> shift) & ((1 << sub_bits) - 1));
+}
+
+uint64_t latency_histogram::bucket_upper_bound(const int bucket)
+{
+	if (bucket < (1 << sub_bits))
+		return bucket;
+
+	const int      shift = (bucket >> sub_bits) - 1;
+	const uint64_t sub   = (1 << sub_bits) + (bucket & ((1 << sub_bits) - 1));
+
+	return ((sub + 1) << shift) - 1;
+}
+
+uint64_t stats_percentile(const stats_op_snapshot_t & s, const double fraction)
+{
+	if (s.n == 0)
+		return 0;
+
+	const uint64_t target = std::max(uint64_t(1), uint64_t(s.n * fraction + 0.5));
+
+	uint64_t count = 0;
+
+	for(int i=0; i<latency_histogram::n_buckets; i++) {
+		count += s.buckets[i];
+
+		if (count >= target)
+			return std::min(latency_histogram::bucket_upper_bound(i), s.max_us);
+	}
+
+	return s.max_us;
+}
+
+io_stats::io_stats(const std::string & kind, const std::string & id) : kind(kind), id(id)
+{
+	shards = new shard_t[n_shards * so__n];
+
+	std::unique_lock<std::mutex> lck(registry_lock);
+
+	registry.insert(this);
+}
+
+io_stats::~io_stats()
+{
+	{
+		std::unique_lock<std::mutex> lck(registry_lock);
+
+		registry.erase(this);
+	}
+
+	delete [] shards;
+}
+
+void io_stats::record(const stats_op_t op, const uint64_t bytes, const uint64_t latency_us)
+{
+	thread_local const int shard = shard_counter++ % n_shards;
+
+	shard_t & s = shards[shard * so__n + op];
+
+	s.n.fetch_add(1, std::memory_order_relaxed);
+	s.bytes.fetch_add(bytes, std::memory_order_relaxed);
+	s.sum_us.fetch_add(latency_us, std::memory_order_relaxed);
+	s.buckets[latency_histogram::value_to_bucket(latency_us)].fetch_add(1, std::memory_order_relaxed);
+
+	uint64_t cur_max = s.max_us.load(std::memory_order_relaxed);
+	while(latency_us > cur_max && !s.max_us.compare_exchange_weak(cur_max, latency_us, std::memory_order_relaxed)) {
+	}
+}
+
+void io_stats::add_gauge(const std::string & name, std::function<double()> get_value)
+{
+	std::unique_lock<std::mutex> lck(gauges_lock);
+
+	gauges.push_back({ name, get_value });
+}
+
+void io_stats::remove_gauges()
+{
+	std::unique_lock<std::mutex> lck(gauges_lock);
+
+	gauges.clear();
+}
+
+stats_snapshot_t io_stats::get() const
+{
+	stats_snapshot_t out;
+	out.kind = kind;
+	out.id   = id;
+
+	for(int op=0; op<so__n; op++) {
+		stats_op_snapshot_t & o = out.ops[op];
+		o.n      = 0;
+		o.bytes  = 0;
+		o.sum_us = 0;
+		o.max_us = 0;
+		o.buckets.resize(latency_histogram::n_buckets);
+
+		for(int i=0; i<n_shards; i++) {
+			const shard_t & s = shards[i * so__n + op];
+
+			o.n      += s.n.load(std::memory_order_relaxed);
+			o.bytes  += s.bytes.load(std::memory_order_relaxed);
+			o.sum_us += s.sum_us.load(std::memory_order_relaxed);
+			o.max_us  = std::max(o.max_us, s.max_us.load(std::memory_order_relaxed));
+
+			for(int b=0; b<latency_histogram::n_buckets; b++)
+				o.buckets[b] += s.buckets[b].load(std::memory_order_relaxed);
+		}
+	}
+
+	std::unique_lock<std::mutex> lck(gauges_lock);
+
+	for(auto & g : gauges)
+		out.gauges.push_back({ g.first, g.second() });
+
+	return out;
+}
+
+stats_timer::stats_timer(io_stats & s, const stats_op_t op, const uint64_t bytes) : s(s), op(op), bytes(bytes), start(get_us())
+{
+}
+
+stats_timer::~stats_timer()
+{
+	s.record(op, bytes, get_us() - start);
+}
+
+std::vector<stats_snapshot_t> stats_get_all()
+{
+	std::vector<stats_snapshot_t> out;
+
+	std::unique_lock<std::mutex> lck(registry_lock);
+
+	for(auto & s : registry)
+		out.push_back(s->get());
+
+	std::sort(out.begin(), out.end(), [](const stats_snapshot_t & a, const stats_snapshot_t & b) { return a.kind < b.kind || (a.kind == b.kind && a.id < b.id); });
+
+	return out;
+}
+
+static std::string escape(const std::string & in)
+{
+	std::string out;
+
+	for(auto c : in) {
+		if (c == '"' || c == '\\')
+			out += '\\';
+
+		if (c == '\n')
+			out += "\\n";
+		else
+			out += c;
+	}
+
+	return out;
+}
+
+static std::string op_labels(const stats_snapshot_t & s, const int op)
+{
+	return myformat("kind=\"%s\",id=\"%s\",op=\"%s\"", escape(s.kind).c_str(), escape(s.id).c_str(), stats_op_name(stats_op_t(op)));
+}
+
+std::string stats_emit_prometheus()
+{
+	auto all = stats_get_all();
+
+	std::string out;
+
+	// each family in one piece, below its HELP- and TYPE-lines
+	out += "# HELP mystorage_ops_total Number of requests.\n";
+	out += "# TYPE mystorage_ops_total counter\n";
+
+	for(auto & s : all) {
+		for(int op=0; op<so__n; op++)
+			out += myformat("mystorage_ops_total{%s} %lu\n", op_labels(s, op).c_str(), s.ops[op].n);
+	}
+
+	out += "# HELP mystorage_bytes_total Number of bytes transferred.\n";
+	out += "# TYPE mystorage_bytes_total counter\n";
+
+	for(auto & s : all) {
+		for(int op=0; op<so__n; op++)
+			out += myformat("mystorage_bytes_total{%s} %lu\n", op_labels(s, op).c_str(), s.ops[op].bytes);
+	}
+
+	out += "# HELP mystorage_latency_us Request latency in microseconds.\n";
+	out += "# TYPE mystorage_latency_us histogram\n";
+
+	for(auto & s : all) {
+		for(int op=0; op<so__n; op++) {
+			const stats_op_snapshot_t & o = s.ops[op];
+
+			const std::string labels = op_labels(s, op);
+
+			// cumulative, per power of two (the sub-buckets would be too much); always
+			// all of them so that every scrape has the same series, the last
+			// bucket_upper_bound() is UINT64_MAX which is +Inf
+			uint64_t count = 0;
+			int      b     = 0;
+
+			for(int k=0; k<63; k++) {
+				const uint64_t le = (uint64_t(2) << k) - 1;  // 1, 3, 7, ...
+
+				while(b < latency_histogram::n_buckets && latency_histogram::bucket_upper_bound(b) <= le)
+					count += o.buckets[b++];
+
+				out += myformat("mystorage_latency_us_bucket{%s,le=\"%lu\"} %lu\n", labels.c_str(), le, count);
+			}
+
+			out += myformat("mystorage_latency_us_bucket{%s,le=\"+Inf\"} %lu\n", labels.c_str(), o.n);
+			out += myformat("mystorage_latency_us_sum{%s} %lu\n", labels.c_str(), o.sum_us);
+			out += myformat("mystorage_latency_us_count{%s} %lu\n", labels.c_str(), o.n);
+		}
+	}
+
+	// grouped by name as each metric gets one TYPE-line
+	std::map<std::string, std::string> gauges;
+
+	for(auto & s : all) {
+		for(auto & g : s.gauges)
+			gauges[g.first] += myformat("mystorage_%s{kind=\"%s\",id=\"%s\"} %f\n", g.first.c_str(), escape(s.kind).c_str(), escape(s.id).c_str(), g.second);
+	}
+
+	for(auto & g : gauges)
+		out += myformat("# TYPE mystorage_%s gauge\n", g.first.c_str()) + g.second;
+
+	return out;
+}
+
+std::string stats_emit_json()
+{
+	auto all = stats_get_all();
+
+	std::string out = "[";
+
+	for(size_t i=0; i<all.size(); i++) {
+		const stats_snapshot_t & s = all.at(i);
+
+		if (i)
+			out += ",";
+
+		out += myformat("{\"kind\":\"%s\",\"id\":\"%s\",\"ops\":{", escape(s.kind).c_str(), escape(s.id).c_str());
+
+		for(int op=0; op<so__n; op++) {
+			const stats_op_snapshot_t & o = s.ops[op];
+
+			if (op)
+				out += ",";
+
+			out += myformat("\"%s\":{\"n\":%lu,\"bytes\":%lu,\"sum_us\":%lu,\"max_us\":%lu,\"p50_us\":%lu,\"p99_us\":%lu,\"p999_us\":%lu,\"histogram\":[", stats_op_name(stats_op_t(op)), o.n, o.bytes, o.sum_us, o.max_us, stats_percentile(o, 0.5), stats_percentile(o, 0.99), stats_percentile(o, 0.999));
+
+			// only the buckets that were used: [upper bound, count]
+			bool first = true;
+
+			for(int b=0; b<latency_histogram::n_buckets; b++) {
+				if (o.buckets[b] == 0)
+					continue;
+
+				if (!first)
+					out += ",";
+
+				out += myformat("[%lu,%lu]", latency_histogram::bucket_upper_bound(b), o.buckets[b]);
+
+				first = false;
+			}
+
+			out += "]}";
+		}
+
+		out += "},\"gauges\":{";
+
+		for(size_t g=0; g<s.gauges.size(); g++)
+			out += myformat("%s\"%s\":%f", g ? "," : "", escape(s.gauges.at(g).first).c_str(), s.gauges.at(g).second);
+
+		out += "}}";
+	}
+
+	out += "]\n";
+
+	return out;
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+typedef enum { so_get = 0, so_put, so_trim, so_fsync, so__n } stats_op_t;
+
+const char *stats_op_name(const stats_op_t op);
+
+// Latency histogram with HDR-style buckets: every power of two is split in 8
+// linear sub-buckets, so a value is known within 12.5% over the whole range
+// of uint64_t.
+class latency_histogram
+{
+public:
+	static constexpr int sub_bits  { 3 };
+	static constexpr int n_buckets { (64 - sub_bits + 1) << sub_bits };
+
+	static int      value_to_bucket(const uint64_t value);
+	static uint64_t bucket_upper_bound(const int bucket);  // inclusive
+};
+
+typedef struct {
+	uint64_t              n;
+	uint64_t              bytes;
+	uint64_t              sum_us;
+	uint64_t              max_us;
+	std::vector<uint64_t> buckets;  // latency_histogram::n_buckets
+} stats_op_snapshot_t;
+
+typedef struct {
+	std::string         kind;
+	std::string         id;
+	stats_op_snapshot_t ops[so__n];
+	std::vector<std::pair<std::string, double> > gauges;
+} stats_snapshot_t;
+
+uint64_t stats_percentile(const stats_op_snapshot_t & s, const double fraction);
+
+// Op counts, bytes and latencies of one storage_backend, mirror or server.
+// Recording is lock-free: each thread counts in one of a few shards (so that
+// threads do not fight over cache lines), get() merges them.
+// Every instance is listed by stats_get_all() during its lifetime.
+class io_stats
+{
+private:
+	static constexpr int n_shards { 4 };
+
+	typedef struct alignas(64) {
+		std::atomic_uint64_t n      { 0 };
+		std::atomic_uint64_t bytes  { 0 };
+		std::atomic_uint64_t sum_us { 0 };
+		std::atomic_uint64_t max_us { 0 };
+		std::atomic_uint64_t buckets[latency_histogram::n_buckets] { };
+	} shard_t;
+
+	const std::string kind;
+	const std::string id;
+	shard_t          *shards { nullptr };  // [n_shards][so__n]
+
+	mutable std::mutex gauges_lock;
+	std::vector<std::pair<std::string, std::function<double()> > > gauges;
+
+public:
+	io_stats(const std::string & kind, const std::string & id);
+	virtual ~io_stats();
+
+	io_stats(const io_stats &) = delete;
+	io_stats & operator=(const io_stats &) = delete;
+
+	void record(const stats_op_t op, const uint64_t bytes, const uint64_t latency_us);
+
+	// a value that is sampled by get(), e.g. the length of a queue
+	void add_gauge(const std::string & name, std::function<double()> get_value);
+	// must be called before what the gauges use goes away
+	void remove_gauges();
+
+	stats_snapshot_t get() const;
+};
+
+// records the time between construction and destruction
+class stats_timer
+{
+private:
+	io_stats        &s;
+	const stats_op_t op;
+	const uint64_t   bytes;
+	const uint64_t   start;
+
+public:
+	stats_timer(io_stats & s, const stats_op_t op, const uint64_t bytes);
+	~stats_timer();
+};
+
+std::vector<stats_snapshot_t> stats_get_all();
+
+std::string stats_emit_prometheus();
+std::string stats_emit_json();
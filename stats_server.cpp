@@ -0,0 +1,107 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "io.h"
+#include "logging.h"
+#include "stats.h"
+#include "stats_server.h"
+#include "str.h"
+#include "yaml-helpers.h"
+
+
+stats_server::stats_server(const std::string & path) : base("stats")
+{
+	sl = new socket_listener_unixdomain(path);
+
+	if (!sl->begin()) {
+		delete sl;
+
+		throw myformat("stats_server: cannot setup socket-listener for \"%s\"", path.c_str());
+	}
+
+	th = new std::thread(std::ref(*this));
+}
+
+stats_server::~stats_server()
+{
+	stop_flag = true;
+
+	if (th) {
+		th->join();
+		delete th;
+	}
+
+	unlink(sl->get_listen_address().c_str());
+
+	delete sl;
+}
+
+void stats_server::handle_client(const int fd)
+{
+	// one request line, the client gets a second to send it
+	std::string request;
+
+	struct pollfd fds[] = { { fd, POLLIN, 0 } };
+
+	while(request.find('\n') == std::string::npos && request.size() < 64) {
+		if (poll(fds, 1, 1000) != 1)
+			break;
+
+		char buffer[64] { 0 };
+		ssize_t rc = read(fd, buffer, sizeof buffer);
+		if (rc <= 0)
+			break;
+
+		request += std::string(buffer, rc);
+	}
+
+	request = request.substr(0, request.find_first_of("\r\n"));
+
+	std::string reply;
+
+	if (request == "prometheus")
+		reply = stats_emit_prometheus();
+	else if (request == "json")
+		reply = stats_emit_json();
+	else
+		reply = "unknown request: use \"prometheus\" or \"json\"\n";
+
+	if (WRITE(fd, reinterpret_cast<const uint8_t *>(reply.c_str()), reply.size()) != ssize_t(reply.size()))
+		dolog(ll_info, "stats_server: failed to send statistics (%zu bytes): %s", reply.size(), strerror(errno));
+}
+
+void stats_server::operator()()
+{
+	dolog(ll_info, "stats_server: thread started");
+
+	while(!stop_flag) {
+		int fd = sl->wait_for_client(&stop_flag);
+		if (fd == -1)
+			continue;
+
+		handle_client(fd);
+
+		close(fd);
+	}
+
+	dolog(ll_info, "stats_server: thread terminating");
+}
+
+YAML::Node stats_server::emit_configuration() const
+{
+	YAML::Node out;
+	out["socket"] = sl->get_listen_address();
+
+	return out;
+}
+
+stats_server * stats_server::load_configuration(const YAML::Node & node)
+{
+	dolog(ll_info, " * stats_server::load_configuration");
+
+	std::string path = yaml_get_string(node, "socket", "path of the unix domain socket to serve statistics on");
+
+	return new stats_server(path);
+}
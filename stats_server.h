@@ -0,0 +1,30 @@
+#pragma once
+#include <string>
+#include <thread>
+#include <yaml-cpp/yaml.h>
+
+#include "base.h"
+#include "socket_listener_unixdomain.h"
+
+
+// Serves the statistics of all storage backends, mirrors and servers on a
+// unix domain socket: a client sends "prometheus" or "json" (followed by a
+// newline) and gets the current numbers in that format, after which the
+// connection is closed. See mystorage-stat for a client.
+class stats_server : public base
+{
+private:
+	socket_listener_unixdomain *sl { nullptr };
+	std::thread                *th { nullptr };
+
+	void handle_client(const int fd);
+
+public:
+	stats_server(const std::string & path);
+	virtual ~stats_server();
+
+	void operator()();
+
+	YAML::Node emit_configuration() const override;
+	static stats_server * load_configuration(const YAML::Node & node);
+};
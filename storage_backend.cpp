@@ -1,28 +1,54 @@
+#include <algorithm>
+#include <string.h>
+
+#include "buffer_pool.h"
 #include "journal.h"
 #include "logging.h"
+#include "mirror_resync.h"
 #include "snapshots.h"
 #include "storage_backend.h"
 #include "storage_backend_aoe.h"
+#include "storage_backend_cache.h"
 #include "storage_backend_compressed_dir.h"
 #include "storage_backend_dedup.h"
 #include "storage_backend_file.h"
 #include "storage_backend_nbd.h"
+#include "storage_backend_parity.h"
+#include "storage_backend_readahead.h"
+#include "storage_backend_stripe.h"
 #include "str.h"
 #include "storage_backend_tiering.h"
+#include "storage_backend_write_merge.h"
+#include "storage_backend_writeback.h"
+#include "thread_pool.h"
+#include "time.h"
 #include "types.h"
+#include "zero.h"
 
 
 storage_backend::storage_backend(const std::string & id, const int block_size, const std::vector<mirror *> & mirrors) :
 	base(id),
 	block_size(block_size),
-	mirrors(mirrors)
+	mirrors(mirrors),
+	stats("storage-backend", id)
 {
 	for(auto m : mirrors)
 		m->acquire(this);
+
+	// enough for as many writes at the same time as the shared pool does
+	if (mirrors.empty() == false)
+		mirror_tp = new thread_pool(std::max(4u, std::thread::hardware_concurrency()) * mirrors.size());
+
+	if (std::any_of(mirrors.begin(), mirrors.end(), [](mirror *const m) { return m->get_dirty_bitmap() != nullptr; }))
+		mirror_resync::register_backend(this);
 }
 
 storage_backend::~storage_backend()
 {
+	mirror_resync::unregister_backend(this);
+
+	delete mirror_tp;
+
 	for(auto m : mirrors) {
 		m->release(this);
 
@@ -61,6 +87,18 @@ storage_backend * storage_backend::load_configuration(const YAML::Node & node, c
 		return snapshots::load_configuration(node, size, block_size);
 	else if (type == "storage-backend-tiering")
 		return storage_backend_tiering::load_configuration(node, size, block_size);
+	else if (type == "storage-backend-cache")
+		return storage_backend_cache::load_configuration(node, size, block_size);
+	else if (type == "storage-backend-write-merge")
+		return storage_backend_write_merge::load_configuration(node, size, block_size);
+	else if (type == "storage-backend-writeback")
+		return storage_backend_writeback::load_configuration(node, size, block_size);
+	else if (type == "storage-backend-readahead")
+		return storage_backend_readahead::load_configuration(node, size, block_size);
+	else if (type == "storage-backend-stripe")
+		return storage_backend_stripe::load_configuration(node, size, block_size);
+	else if (type == "storage-backend-parity")
+		return storage_backend_parity::load_configuration(node, size, block_size);
 
 	dolog(ll_error, "storage_backend::load_configuration: storage type \"%s\" is not known", type.c_str());
 
@@ -72,6 +110,66 @@ int storage_backend::get_block_size() const
 	return block_size;
 }
 
+const std::vector<mirror *> & storage_backend::get_mirrors() const
+{
+	return mirrors;
+}
+
+uint64_t storage_backend::get_last_io() const
+{
+	return last_io;
+}
+
+bool storage_backend::resync_region(mirror *const m, const uint64_t region)
+{
+	const uint64_t region_size = m->get_dirty_bitmap()->get_region_size();
+	const offset_t offset      = region * region_size;
+	const offset_t size        = get_size();
+
+	// the mirror may be larger than this backend
+	if (offset >= size) {
+		m->mark_clean(region);
+		return true;
+	}
+
+	const uint32_t len = std::min(region_size, size - offset);
+
+	uint8_t *buffer = pool_malloc(len);
+	if (!buffer) {
+		dolog(ll_error, "storage_backend::resync_region(%s): cannot allocate %u bytes of memory", id.c_str(), len);
+		return false;
+	}
+
+	block b(buffer, len);
+
+	// writes to the region wait until it is copied, else these could be overwritten by older data
+	lg.un_lock_block_group(offset, len, block_size, true, true);
+
+	struct iovec iov { buffer, len };
+
+	int  err = 0;
+	bool ok  = true;
+
+	get_data_into_int(offset, &iov, 1, len, &err);
+
+	if (err) {
+		dolog(ll_error, "storage_backend::resync_region(%s): cannot read %u bytes at offset %lu: %s", id.c_str(), len, offset, strerror(err));
+		ok = false;
+	}
+	// the sync makes sure that the data is on the mirror (also for asynchronous mirrors) before the region is marked clean
+	else if (m->put_block(offset, b) == false || m->sync() == false) {
+		dolog(ll_error, "storage_backend::resync_region(%s): cannot copy %u bytes at offset %lu to mirror %s", id.c_str(), len, offset, m->get_id().c_str());
+		ok = false;
+	}
+	else {
+		m->mark_clean(region);
+	}
+
+	lg.un_lock_block_group(offset, len, block_size, false, true);
+
+	return ok;
+}
+
 bool storage_backend::verify_mirror_sizes()
 {
 	for(auto m : mirrors) {
@@ -84,46 +182,168 @@ bool storage_backend::verify_mirror_sizes()
 	return true;
 }
 
-bool storage_backend::do_mirror(const offset_t offset, const block & b)
+std::shared_ptr<storage_backend::mirror_requests_t> storage_backend::start_mirrors(std::function<bool(mirror *const m)> f)
 {
-	bool ok = true;
+	std::shared_ptr<mirror_requests_t> r = std::make_shared<mirror_requests_t>();
+	r->left = mirrors.size();
+	r->ok.resize(mirrors.size());
 
-	for(auto m : mirrors) {
-		if (m->put_block(offset, b) == false) {
-			ok = false;
-			dolog(ll_error, "storage_backend::do_mirror(%s): failed writing to mirror %s", id.c_str(), m->get_id().c_str());
-		}
+	for(size_t i=0; i<mirrors.size(); i++) {
+		mirror_tp->enqueue([this, r, i, f] {
+			bool ok = f(mirrors.at(i));
+
+			std::unique_lock<std::mutex> lck(r->lock);
+
+			r->ok.at(i) = ok;
+			r->left--;
+
+			r->cond.notify_all();
+		});
 	}
 
-	return ok;
+	return r;
 }
 
-bool storage_backend::do_sync_mirrors()
+bool storage_backend::wait_mirrors(const std::shared_ptr<mirror_requests_t> & r, const char *const what, const offset_t offset, const uint64_t len)
 {
+	std::unique_lock<std::mutex> lck(r->lock);
+
+	while(r->left > 0)
+		r->cond.wait(lck);
+
 	bool ok = true;
 
-	for(auto m : mirrors) {
-		if (m->sync() == false) {
-			ok = false;
-			dolog(ll_error, "storage_backend::do_sync_mirrors(%s): failed syncing mirror %s", id.c_str(), m->get_id().c_str());
-		}
+	for(size_t i=0; i<mirrors.size(); i++) {
+		if (r->ok.at(i))
+			continue;
+
+		ok = false;
+
+		dolog(ll_error, "storage_backend::wait_mirrors(%s): failed to %s mirror %s", id.c_str(), what, mirrors.at(i)->get_id().c_str());
+
+		if (len)
+			mirrors.at(i)->mark_dirty(offset, len);
 	}
 
 	return ok;
 }
 
+bool storage_backend::do_sync_mirrors()
+{
+	if (mirrors.empty())
+		return true;
+
+	return wait_mirrors(start_mirrors([](mirror *const m) { return m->sync(); }), "sync", 0, 0);
+}
+
 bool storage_backend::do_mirror_trim_zero(const offset_t offset, const uint32_t size, const bool trim)
 {
-	bool ok = true;
+	if (mirrors.empty())
+		return true;
+
+	return wait_mirrors(start_mirrors([offset, size, trim](mirror *const m) { return m->trim_zero(offset, size, trim); }), "trim/zero", offset, size);
+}
+
+mirror * storage_backend::select_read_mirror()
+{
+	// now and then each of them is tried, else the latency of one that was
+	// slow once would never be measured again
+	constexpr uint64_t probe_interval = 16;
+
+	const uint64_t nr = n_balanced_reads++;
+
+	if (nr % probe_interval == probe_interval - 1) {
+		size_t n_candidates = 1;
+
+		for(auto m : mirrors)
+			n_candidates += m->can_serve_reads();
+
+		size_t pick = nr / probe_interval % n_candidates;
+
+		for(auto m : mirrors) {
+			if (pick > 0 && m->can_serve_reads() && --pick == 0)
+				return m;
+		}
+
+		return nullptr;
+	}
+
+	uint64_t best_cost = (n_outstanding_reads + 1) * std::max(uint64_t(1), read_latency.load());
+	mirror  *best      = nullptr;
 
 	for(auto m : mirrors) {
-		if (m->trim_zero(offset, size, trim) == false) {
-			ok = false;
-			dolog(ll_error, "storage_backend::do_mirror_trim_zero(%s): failed trim/zero mirror %s", id.c_str(), m->get_id().c_str());
+		if (m->can_serve_reads() == false)
+			continue;
+
+		uint64_t cost = m->get_read_cost();
+
+		if (cost < best_cost) {
+			best_cost = cost;
+			best      = m;
 		}
 	}
 
-	return ok;
+	return best;
+}
+
+async_done_t storage_backend::stats_wrap(const stats_op_t op, const uint64_t bytes, async_done_t done)
+{
+	const uint64_t start = get_us();
+
+	return [this, op, bytes, start, done](const int err) {
+		stats.record(op, bytes, get_us() - start);
+
+		done(err);
+	};
+}
+
+async_done_t storage_backend::unlock_wrap(const offset_t offset, const uint32_t len, const bool shared, async_done_t done)
+{
+	return [this, offset, len, shared, done](const int err) {
+		lg.un_lock_block_group(offset, len, block_size, false, shared);
+
+		done(err);
+	};
+}
+
+void storage_backend::submit_get_data(const offset_t offset, const struct iovec *const iov, const int iov_n, async_done_t done)
+{
+	std::vector<struct iovec> iov_copy(iov, iov + iov_n);
+
+	get_shared_thread_pool()->enqueue([this, offset, iov_copy, done] {
+			int err = 0;
+			get_data_into(offset, iov_copy.data(), iov_copy.size(), &err);
+
+			done(err);
+		});
+}
+
+void storage_backend::submit_put_data(const offset_t offset, const block & b, async_done_t done)
+{
+	get_shared_thread_pool()->enqueue([this, offset, b, done] {
+			int err = 0;
+			put_data(offset, b, &err);
+
+			done(err);
+		});
+}
+
+void storage_backend::submit_trim_zero(const offset_t offset, const uint32_t len, const bool trim, async_done_t done)
+{
+	get_shared_thread_pool()->enqueue([this, offset, len, trim, done] {
+			int err = 0;
+			if (trim_zero(offset, len, trim, &err) == false && err == 0)
+				err = EIO;
+
+			done(err);
+		});
+}
+
+void storage_backend::submit_fsync(async_done_t done)
+{
+	get_shared_thread_pool()->enqueue([this, done] {
+			done(fsync() ? 0 : EIO);
+		});
 }
 
 void storage_backend::put_data(const offset_t offset, const std::vector<uint8_t> & d, int *const err)
@@ -150,122 +370,324 @@ bool storage_backend::get_multiple_blocks(const block_nr_t block_nr, const block
 	return false;
 }
 
+bool storage_backend::get_block_into(const block_nr_t block_nr, uint8_t *const to)
+{
+	uint8_t *temp = nullptr;
+
+	if (!get_block(block_nr, &temp))
+		return false;
+
+	if (temp) {
+		memcpy(to, temp, block_size);
+
+		pool_free(temp);
+	}
+	else {
+		memset(to, 0, block_size);
+	}
+
+	return true;
+}
+
 void storage_backend::get_data(const offset_t offset, const uint32_t size, uint8_t **const out, int *const err)
+{
+	*out = pool_malloc(size);
+	if (!*out) {
+		dolog(ll_error, "storage_backend::get_data(%s): cannot allocate %u bytes of memory", id.c_str(), size);
+		*err = ENOMEM;
+		return;
+	}
+
+	struct iovec iov { *out, size };
+	get_data_into(offset, &iov, 1, err);
+
+	if (*err) {
+		pool_free(*out);
+		*out = nullptr;
+	}
+}
+
+void storage_backend::get_data_into(const offset_t offset, const struct iovec *const iov, const int iov_n, int *const err)
 {
 	*err = 0;
-	*out = nullptr;
+
+	size_t size = 0;
+	for(int i=0; i<iov_n; i++)
+		size += iov[i].iov_len;
+
+	stats_timer st(stats, so_get, size);
 
 	lg.un_lock_block_group(offset, size, block_size, true, true);
 
-	*out = nullptr;
-	uint32_t out_size = 0;
+	const bool balance = mirrors.empty() == false;
+
+	if (balance) {
+		last_io = get_us();
+
+		mirror *m = select_read_mirror();
+
+		if (m && m->get_data(offset, iov, iov_n)) {
+			n_mirror_reads++;
+
+			lg.un_lock_block_group(offset, size, block_size, false, true);
+
+			return;
+		}
+
+		// else read it here
+		n_outstanding_reads++;
+	}
+
+	const uint64_t start = balance ? get_us() : 0;
+
+	get_data_into_int(offset, iov, iov_n, size, err);
+
+	if (balance) {
+		n_outstanding_reads--;
+
+		if (*err == 0) {
+			const uint64_t took = get_us() - start;
+			const uint64_t prev = read_latency;
+
+			// 1/8 new, 7/8 old
+			read_latency = prev ? (prev * 7 + took) / 8 : took;
+		}
+	}
+
+	lg.un_lock_block_group(offset, size, block_size, false, true);
+}
+
+void storage_backend::get_data_into_int(const offset_t offset, const struct iovec *const iov, const int iov_n, const size_t size, int *const err)
+{
+	uint8_t *bounce = nullptr;  // only for blocks that are partially requested or that straddle two iovecs
+
+	int    iov_idx = 0;
+	size_t iov_offset = 0;
 
 	offset_t work_offset = offset;
-	uint32_t work_size = size;
+	size_t   work_size = size;
 
 	while(work_size > 0) {
+		while(iov_offset == iov[iov_idx].iov_len) {
+			iov_idx++;
+			iov_offset = 0;
+		}
+
 		block_nr_t block_nr = work_offset / block_size;
 		uint32_t block_offset = work_offset % block_size;
-		block_nr_t blocks_to_do = work_size / block_size;
 
-		uint32_t current_size = 0;
+		uint8_t *const target = reinterpret_cast<uint8_t *>(iov[iov_idx].iov_base) + iov_offset;
+		// how many whole blocks fit in the current iovec
+		block_nr_t blocks_contiguous = std::min(work_size, iov[iov_idx].iov_len - iov_offset) / block_size;
 
-		if (block_offset == 0 && can_do_multiple_blocks() == true && blocks_to_do >= 2) {
+		size_t current_size = 0;
+
+		if (block_offset == 0 && can_do_multiple_blocks() == true && blocks_contiguous >= 2) {
 			// TODO limit to what server can handle
-			current_size = blocks_to_do * block_size;
+			if (!get_multiple_blocks(block_nr, blocks_contiguous, target)) {
+				dolog(ll_error, "storage_backend::get_data_into(%s): failed to retrieve %ld blocks starting at %ld", id.c_str(), blocks_contiguous, block_nr);
+				*err = EINVAL;
+				break;
+			}
 
-			*out = reinterpret_cast<uint8_t *>(realloc(*out, out_size + current_size));
+			current_size = blocks_contiguous * block_size;
 
-			if (!get_multiple_blocks(block_nr, blocks_to_do, &(*out)[out_size])) {
-				dolog(ll_error, "storage_backend::get_data(%s): failed to retrieve %ld blocks starting at %ld", id.c_str(), blocks_to_do, block_nr);
+			iov_offset += current_size;
+		}
+		else if (block_offset == 0 && blocks_contiguous >= 1) {
+			if (!get_block_into(block_nr, target)) {
+				dolog(ll_error, "storage_backend::get_data_into(%s): failed to retrieve block %ld", id.c_str(), block_nr);
 				*err = EINVAL;
-				free(out);
 				break;
 			}
 
-			out_size += current_size;
+			current_size = block_size;
+
+			iov_offset += current_size;
 		}
 		else {
-			uint8_t *temp = nullptr;
-
-			current_size = std::min(work_size, block_size - block_offset);
+			if (!bounce) {
+				bounce = pool_malloc(block_size);
+
+				if (!bounce) {
+					dolog(ll_error, "storage_backend::get_data_into(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
+					*err = ENOMEM;
+					break;
+				}
+			}
 
-			if (!get_block(block_nr, &temp)) {
-				dolog(ll_error, "storage_backend::get_data(%s): failed to retrieve block %ld", id.c_str(), block_nr);
+			if (!get_block_into(block_nr, bounce)) {
+				dolog(ll_error, "storage_backend::get_data_into(%s): failed to retrieve block %ld", id.c_str(), block_nr);
 				*err = EINVAL;
-				free(*out);
 				break;
 			}
 
-			*out = reinterpret_cast<uint8_t *>(realloc(*out, out_size + current_size));
+			current_size = std::min(work_size, size_t(block_size - block_offset));
 
-			if (temp) {
-				memcpy(&(*out)[out_size], &temp[block_offset], current_size);
+			// scatter over the iovec(s)
+			size_t copied = 0;
 
-				free(temp);
-			}
-			else {
-				memset(&(*out)[out_size], 0, current_size);
-			}
+			while(copied < current_size) {
+				while(iov_offset == iov[iov_idx].iov_len) {
+					iov_idx++;
+					iov_offset = 0;
+				}
+
+				size_t n = std::min(current_size - copied, iov[iov_idx].iov_len - iov_offset);
 
-			out_size += current_size;
+				memcpy(reinterpret_cast<uint8_t *>(iov[iov_idx].iov_base) + iov_offset, &bounce[block_offset + copied], n);
+
+				copied += n;
+				iov_offset += n;
+			}
 		}
 
 		work_offset += current_size;
 		work_size -= current_size;
 	}
 
-	lg.un_lock_block_group(offset, size, block_size, false, true);
+	pool_free(bounce);
 }
 
 void storage_backend::put_data(const offset_t offset, const block & b, int *const err)
+{
+	stats_timer st(stats, so_put, b.get_size());
+
+	*err = 0;
+
+	const offset_t end         = offset + b.get_size();
+	const offset_t first_whole = (offset + block_size - 1) / block_size * block_size;
+
+	// look for runs of whole blocks with only 0x00 in them
+	std::vector<std::pair<offset_t, offset_t> > zero_runs;  // start, end
+
+	for(offset_t o=first_whole; o + block_size <= end; o += block_size) {
+		if (is_all_zero(b.get_data() + o - offset, block_size) == false)
+			continue;
+
+		if (zero_runs.empty() == false && zero_runs.back().second == o)
+			zero_runs.back().second = o + block_size;
+		else
+			zero_runs.push_back({ o, o + block_size });
+	}
+
+	// one request: the zero runs are written under the same lock and in the same transaction as the rest
+	put_data_int(offset, b, zero_runs, err);
+}
+
+bool storage_backend::zero_blocks(const block_nr_t block_nr, const block_nr_t n_blocks)
+{
+	uint8_t *zero = pool_calloc(block_size);
+	if (!zero) {
+		dolog(ll_error, "storage_backend::zero_blocks(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
+		return false;
+	}
+
+	bool ok = true;
+
+	for(block_nr_t nr=block_nr; nr<block_nr + n_blocks && ok; nr++)
+		ok = put_block(nr, zero);
+
+	pool_free(zero);
+
+	return ok;
+}
+
+void storage_backend::put_data_int(const offset_t offset, const block & b, int *const err)
+{
+	put_data_int(offset, b, { }, err);
+}
+
+void storage_backend::put_data_int(const offset_t offset, const block & b, const std::vector<std::pair<offset_t, offset_t> > & zero_runs, int *const err)
 {
 	*err = 0;
 
 	if (transaction_start() == false) {
-		dolog(ll_error, "storage_backend::put_data(%s): failed to start transaction", id.c_str());
+		dolog(ll_error, "storage_backend::put_data_int(%s): failed to start transaction", id.c_str());
 		*err = EINVAL;
 		return;
 	}
 
 	lg.un_lock_block_group(offset, b.get_size(), block_size, true, false);
 
+	// The mirrors are written while this backend is. This is within the lock
+	// so that writes to a region are applied in the same order everywhere.
+	// When this backend fails the write, the region is undefined (as with
+	// any failed write) and may differ between here and the mirrors.
+	std::shared_ptr<mirror_requests_t> mr;
+
+	if (mirrors.empty() == false) {
+		// a crash before both sides are written leaves them different
+		for(auto m : mirrors)
+			m->begin_write(offset, b.get_size());
+
+		mr = start_mirrors([offset, &b](mirror *const m) { return m->put_block(offset, b); });
+
+		last_io = get_us();
+	}
+
 	offset_t work_offset = offset;
 
 	const uint8_t *input = b.get_data();
 	size_t work_size = b.get_size();
 
+	auto zero_run = zero_runs.begin();
+
 	while(work_size > 0) {
 		block_nr_t block_nr = work_offset / block_size;
 		uint32_t block_offset = work_offset % block_size;
 
-		int current_size = std::min(work_size, size_t(block_size - block_offset));
+		if (zero_run != zero_runs.end() && zero_run->first == work_offset) {
+			const offset_t run_size = zero_run->second - zero_run->first;
+
+			if (!zero_blocks(block_nr, run_size / block_size)) {
+				dolog(ll_error, "storage_backend::put_data_int(%s): failed to zero %lu bytes at offset %lu", id.c_str(), run_size, work_offset);
+				*err = EINVAL;
+				break;
+			}
 
-		uint8_t *temp = nullptr;
+			work_offset += run_size;
+			work_size -= run_size;
+			input += run_size;
 
-		if (block_offset == 0 && current_size == block_size)
-			temp = reinterpret_cast<uint8_t *>(malloc(block_size));
+			zero_run++;
+
+			continue;
+		}
+
+		int current_size = std::min(work_size, size_t(block_size - block_offset));
+
+		if (block_offset == 0 && current_size == block_size) {
+			// whole block: no need for a temporary copy
+			if (!put_block(block_nr, input)) {
+				dolog(ll_error, "storage_backend::put_data_int(%s): failed to update block %ld", id.c_str(), block_nr);
+				*err = EINVAL;
+				break;
+			}
+		}
 		else {
+			uint8_t *temp = nullptr;
+
 			if (!get_block(block_nr, &temp)) {
-				dolog(ll_error, "storage_backend::put_data(%s): failed to retrieve block %ld", id.c_str(), block_nr);
+				dolog(ll_error, "storage_backend::put_data_int(%s): failed to retrieve block %ld", id.c_str(), block_nr);
 				*err = EINVAL;
 				break;
 			}
 
 			if (!temp)  // e.g. when new block
-				temp = reinterpret_cast<uint8_t *>(calloc(1, block_size));
-		}
+				temp = pool_calloc(block_size);
 
-		memcpy(&temp[block_offset], input, current_size);
+			memcpy(&temp[block_offset], input, current_size);
 
-		if (!put_block(block_nr, temp)) {
-			dolog(ll_error, "storage_backend::put_data(%s): failed to update block %ld", id.c_str(), block_nr);
-			*err = EINVAL;
-			free(temp);
-			break;
-		}
+			if (!put_block(block_nr, temp)) {
+				dolog(ll_error, "storage_backend::put_data_int(%s): failed to update block %ld", id.c_str(), block_nr);
+				*err = EINVAL;
+				pool_free(temp);
+				break;
+			}
 
-		free(temp);
+			pool_free(temp);
+		}
 
 		work_offset += current_size;
 		work_size -= current_size;
@@ -273,16 +695,29 @@ void storage_backend::put_data(const offset_t offset, const block & b, int *cons
 	}
 
 	if (transaction_end() == false) {
-		dolog(ll_error, "storage_backend::put_data(%s): failed to end transaction", id.c_str());
+		dolog(ll_error, "storage_backend::put_data_int(%s): failed to end transaction", id.c_str());
 		*err = EINVAL;
 	}
 
-	lg.un_lock_block_group(offset, b.get_size(), block_size, false, false);
+	// also when this backend failed: 'b' is in use until then
+	if (mr) {
+		const bool failed_here = *err != 0;
+
+		if (wait_mirrors(mr, "write to", offset, b.get_size()) == false && *err == 0) {
+			*err = EIO;
+			dolog(ll_error, "storage_backend::put_data_int(%s): failed to send block (%zu bytes) to mirror(s) at offset %lu", id.c_str(), b.get_size(), offset);
+		}
 
-	if (*err == 0 && do_mirror(offset, b) == false) {
-		*err = EIO;
-		dolog(ll_error, "storage_backend::put_data(%s): failed to send block (%zu bytes) to mirror(s) at offset %lu", id.c_str(), b.get_size(), offset);
+		for(auto m : mirrors) {
+			// the mirrors have data that is not here; mirror_resync makes them equal again
+			if (failed_here && m->get_dirty_bitmap())
+				m->mark_dirty(offset, b.get_size());
+
+			m->end_write(offset, b.get_size());
+		}
 	}
+
+	lg.un_lock_block_group(offset, b.get_size(), block_size, false, false);
 }
 
 int storage_backend::get_maximum_transaction_size() const
@@ -302,4 +737,10 @@ bool storage_backend::transaction_end()
 
 void storage_backend::dump_stats(const std::string & base_filename)
 {
+	auto s = lg.get_stats();
+
+	dolog(ll_info, "storage_backend(%s): %lu range locks, %lu waited (%.3f ms in total), at most %lu at the same time", id.c_str(), s.n_locks, s.n_contended, s.wait_us / 1000., s.max_queued);
+
+	if (mirrors.empty() == false)
+		dolog(ll_info, "storage_backend(%s): %lu reads were served by a mirror", id.c_str(), n_mirror_reads.load());
 }
@@ -1,21 +1,60 @@
 #pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <stdint.h>
 #include <string>
 #include <vector>
+#include <sys/uio.h>
 #include <yaml-cpp/yaml.h>
 
 #include "base.h"
 #include "block.h"
 #include "lock_group.h"
 #include "mirror.h"
+#include "stats.h"
+#include "thread_pool.h"
 #include "types.h"
 
 
+// completion of an asynchronous request: 'err' is 0 on success, an errno value otherwise
+typedef std::function<void(const int err)> async_done_t;
+
 class storage_backend : public base
 {
 private:
-	bool do_mirror(const offset_t offset, const block & b);
+	// for balancing reads over this backend and its mirrors
+	std::atomic_int      n_outstanding_reads { 0 };
+	std::atomic_uint64_t read_latency        { 0 };  // in us, moving average
+	std::atomic_uint64_t n_mirror_reads      { 0 };
+	std::atomic_uint64_t n_balanced_reads    { 0 };
+
+	// when the most recent read or write with mirrors started (us), mirror_resync yields to these
+	std::atomic_uint64_t last_io             { 0 };
+
+	// the mirrors are written, trimmed and synced in parallel, using this
+	thread_pool         *mirror_tp           { nullptr };
+
+	typedef struct {
+		std::mutex              lock;
+		std::condition_variable cond;
+		size_t                  left;
+		std::vector<bool>       ok;  // for each mirror
+	} mirror_requests_t;
+
+	// invokes 'f' for each mirror in the background
+	std::shared_ptr<mirror_requests_t> start_mirrors(std::function<bool(mirror *const m)> f);
+	// returns false when 'f' failed for one or more mirrors; these are
+	// logged and [offset, offset + len) is marked dirty on them (if len > 0)
+	bool wait_mirrors(const std::shared_ptr<mirror_requests_t> & r, const char *const what, const offset_t offset, const uint64_t len);
+	// nullptr when this backend is expected to be the fastest
+	mirror * select_read_mirror();
+
+	// get_data_into without locking, statistics and read balancing
+	void get_data_into_int(const offset_t offset, const struct iovec *const iov, const int iov_n, const size_t size, int *const err);
 
 protected:
 	friend class snapshots;
@@ -23,6 +62,7 @@ protected:
 	const int                   block_size { 4096 };
 	const std::vector<mirror *> mirrors;
 	lock_group                  lg;
+	io_stats                    stats;  // implementations of put_data, trim_zero and fsync record in this
 
 	bool do_sync_mirrors();
 	bool verify_mirror_sizes();
@@ -31,9 +71,29 @@ protected:
 	virtual bool can_do_multiple_blocks() const = 0;
 	virtual bool get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *const to);
 
+	// *data is allocated with pool_malloc() (release with pool_free()), it may be
+	// set to nullptr for a block that contains only 0x00
         virtual bool get_block(const block_nr_t block_nr, uint8_t **const data) = 0;
+	// same as get_block but into a caller-provided buffer of block_size bytes
+	virtual bool get_block_into(const block_nr_t block_nr, uint8_t *const to);
         virtual bool put_block(const block_nr_t block_nr, const uint8_t *const data) = 0;
 
+	// put_data without the zero-block detection, for trim_zero implementations that write zeros
+	void put_data_int(const offset_t offset, const block & b, int *const err);
+	// 'zero_runs' (start, end): whole blocks in 'b' with only 0x00, these go to zero_blocks
+	void put_data_int(const offset_t offset, const block & b, const std::vector<std::pair<offset_t, offset_t> > & zero_runs, int *const err);
+	// makes blocks read as 0x00; called by put_data_int with the range locked
+	// and in its transaction, the mirrors are not involved. The default
+	// writes blocks of 0x00 with put_block.
+	virtual bool zero_blocks(const block_nr_t block_nr, const block_nr_t n_blocks);
+
+	// for native submit_* implementations: records the request in 'stats' when it completes
+	async_done_t stats_wrap(const stats_op_t op, const uint64_t bytes, async_done_t done);
+	// for native submit_* implementations: [offset, offset + len) must have
+	// been locked in 'lg' (like the synchronous calls do), this unlocks it
+	// when the request completes, before invoking 'done'
+	async_done_t unlock_wrap(const offset_t offset, const uint32_t len, const bool shared, async_done_t done);
+
 	// used by put_data
 	virtual bool transaction_start();
 	virtual bool transaction_end();
@@ -50,8 +110,17 @@ public:
 
 	virtual int get_maximum_transaction_size() const;
 
+	const std::vector<mirror *> & get_mirrors() const;
+	uint64_t get_last_io() const;
+	// copies region 'region' of the dirty-region bitmap of 'm' from this
+	// backend to 'm' and marks it clean (used by mirror_resync)
+	bool resync_region(mirror *const m, const uint64_t region);
+
+	// scatter-gather read: fills the caller-owned buffers in 'iov' (in order) starting at 'offset'
+	void get_data_into(const offset_t offset, const struct iovec *const iov, const int iov_n, int *const err);
 	void get_data(const offset_t offset, const uint32_t size, uint8_t **const d, int *const err);
 	void get_data(const offset_t offset, const uint32_t size, block **const b, int *const err);
+	// whole blocks containing only 0x00 are passed to zero_blocks instead
 	virtual void put_data(const offset_t offset, const block & b, int *const err);
 	virtual void put_data(const offset_t offset, const std::vector<uint8_t> & d, int *const err);
 
@@ -59,5 +128,16 @@ public:
 
 	virtual bool trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err) = 0;
 
+	// Asynchronous variants of the above: these return right away and invoke 'done'
+	// when the request has finished (from an other thread, maybe even before the
+	// submit-call returns). The memory the iovecs point to must stay valid until
+	// then, the iovec-array itself and 'b' are copied. No ordering is guaranteed
+	// between requests that are in flight at the same time.
+	// The defaults run the synchronous call in the shared thread pool.
+	virtual void submit_get_data(const offset_t offset, const struct iovec *const iov, const int iov_n, async_done_t done);
+	virtual void submit_put_data(const offset_t offset, const block & b, async_done_t done);
+	virtual void submit_trim_zero(const offset_t offset, const uint32_t len, const bool trim, async_done_t done);
+	virtual void submit_fsync(async_done_t done);
+
 	static storage_backend * load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, std::optional<int> block_size);
 };
@@ -8,6 +8,7 @@
 #include <arpa/inet.h>
 
 #include "aoe-common.h"
+#include "buffer_pool.h"
 #include "error.h"
 #include "logging.h"
 #include "mirror.h"
@@ -335,15 +336,26 @@ offset_t storage_backend_aoe::get_size() const
 
 bool storage_backend_aoe::get_block(const block_nr_t block_nr, uint8_t **const data)
 {
-	*data = reinterpret_cast<uint8_t *>(malloc(block_size));
+	*data = pool_malloc(block_size);
 	if (!*data) {
 		dolog(ll_error, "storage_backend_aoe::get_block(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
 		return false;
 	}
 
+	if (get_block_into(block_nr, *data) == false) {
+		pool_free(*data);
+		*data = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+bool storage_backend_aoe::get_block_into(const block_nr_t block_nr, uint8_t *const to)
+{
 	block_nr_t work_block_nr = block_nr;
 	uint32_t work_size       = block_size;
-	uint8_t  *work_buffer    = *data;
+	uint8_t  *work_buffer    = to;
 
 	aoe_ata_t aa { 0 };
 
@@ -389,10 +401,8 @@ bool storage_backend_aoe::get_block(const block_nr_t block_nr, uint8_t **const d
 		work_buffer += 512;
 	}
 
-	if (err)
-		free(*data);
-	else
-		assert(work_buffer - *data == block_size);
+	if (err == 0)
+		assert(work_buffer - to == block_size);
 
 	return err == 0;
 }
@@ -452,6 +462,8 @@ bool storage_backend_aoe::put_block(const block_nr_t block_nr, const uint8_t *co
 
 bool storage_backend_aoe::fsync()
 {
+	stats_timer st(stats, so_fsync, 0);
+
 	dolog(ll_debug, "storage_backend_aoe::fsync(%s): flush cache", id.c_str());
 
 	aoe_ata_t aa { 0 };
@@ -588,6 +600,8 @@ bool storage_backend_aoe::do_ata_command(aoe_ata_t *const aa_in, const int len,
 
 bool storage_backend_aoe::trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err)
 {
+	stats_timer st(stats, so_trim, len);
+
 	*err = 0;
 
 	if (offset & 511) {
@@ -663,9 +677,9 @@ bool storage_backend_aoe::trim_zero(const offset_t offset, const uint32_t len, c
 	else {
 		dolog(ll_debug, "storage_backend_aoe::trim_zero(%s): write %d zeros to offset %lld", id.c_str(), len, offset);
 
-		uint8_t *data0x00 = reinterpret_cast<uint8_t *>(calloc(1, len));
+		uint8_t *data0x00 = pool_calloc(len);
 
-		put_data(offset, block(data0x00, len), err);
+		put_data_int(offset, block(data0x00, len), err);
 
 		if (do_mirror_trim_zero(offset, len, trim) == false) {
 			dolog(ll_error, "storage_backend_aoe::trim_zero(%s): failed to send to mirror(s)", id.c_str());
@@ -0,0 +1,284 @@
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+
+#include "buffer_pool.h"
+#include "logging.h"
+#include "str.h"
+#include "storage_backend_cache.h"
+#include "yaml-helpers.h"
+
+
+storage_backend_cache::storage_backend_cache(const std::string & id, storage_backend *const sb, const uint64_t max_memory, compresser *const c) :
+	storage_backend(id, sb->get_block_size(), { }),
+	sb(sb),
+	max_memory(max_memory),
+	c(c),
+	arc(max_memory, sb->get_block_size())
+{
+	if (max_memory < uint64_t(block_size))
+		throw myformat("storage_backend_cache(%s): memory (%lu bytes) must be at least one block (%d bytes)", id.c_str(), max_memory, block_size);
+
+	dolog(ll_debug, "storage_backend_cache(%s): %lu bytes of cache (%s)", id.c_str(), max_memory, c ? c->get_type().c_str() : "not compressed");
+}
+
+storage_backend_cache::~storage_backend_cache()
+{
+	delete sb;
+	delete c;
+}
+
+offset_t storage_backend_cache::get_size() const
+{
+	return sb->get_size();
+}
+
+bool storage_backend_cache::lookup(const block_nr_t block_nr, uint8_t *const to)
+{
+	bool compressed = false;
+
+	std::optional<block> data = arc.lookup(block_nr, &compressed);  // shares the buffer, no copy
+
+	if (data.has_value() == false)
+		return false;
+
+	if (compressed) {
+		uint8_t *out = nullptr;
+		size_t out_len = 0;
+
+		if (c->decompress(data.value().get_data(), data.value().get_size(), &out, &out_len) == false || out_len != size_t(block_size)) {
+			dolog(ll_error, "storage_backend_cache::lookup(%s): failed to decompress block %ld", id.c_str(), block_nr);
+			pool_free(out);
+			return false;
+		}
+
+		memcpy(to, out, block_size);
+
+		pool_free(out);
+	}
+	else {
+		memcpy(to, data.value().get_data(), block_size);
+	}
+
+	n_hits++;
+
+	return true;
+}
+
+void storage_backend_cache::insert(const block_nr_t block_nr, const uint8_t *const data, const uint64_t generation)
+{
+	std::optional<block> stored;
+	bool compressed = false;
+
+	if (c) {
+		uint8_t *out = nullptr;
+		size_t out_len = 0;
+
+		if (c->compress(data, block_size, &out, &out_len) && out_len < size_t(block_size)) {
+			stored.emplace(out, out_len);
+			compressed = true;
+		}
+		else {
+			pool_free(out);
+		}
+	}
+
+	if (!compressed) {
+		uint8_t *copy = pool_malloc(block_size);
+		if (!copy) {
+			dolog(ll_warning, "storage_backend_cache::insert(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
+			return;
+		}
+
+		memcpy(copy, data, block_size);
+
+		stored.emplace(copy, block_size);
+	}
+
+	arc.insert(block_nr, stored.value(), compressed, generation);
+}
+
+void storage_backend_cache::invalidate(const offset_t offset, const uint32_t len)
+{
+	if (len == 0)
+		return;
+
+	const block_nr_t first = offset / block_size;
+	const block_nr_t last  = (offset + len - 1) / block_size;
+
+	if (last - first + 1 > arc.get_n_entries()) {
+		arc.forget_if([first, last](const block_nr_t & nr) { return nr >= first && nr <= last; });
+	}
+	else {
+		for(block_nr_t nr=first; nr<=last; nr++)
+			arc.forget(nr);
+	}
+}
+
+bool storage_backend_cache::can_do_multiple_blocks() const
+{
+	return true;
+}
+
+bool storage_backend_cache::get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *const to)
+{
+	block_nr_t i = 0;
+
+	while(i < blocks_to_do) {
+		if (lookup(block_nr + i, &to[i * block_size])) {
+			i++;
+			continue;
+		}
+
+		// retrieve a run of missing blocks in one go
+		block_nr_t j = i + 1;
+		bool next_is_hit = false;
+
+		while(j < blocks_to_do) {
+			if (lookup(block_nr + j, &to[j * block_size])) {
+				next_is_hit = true;
+				break;
+			}
+
+			j++;
+		}
+
+		// a write that invalidates these while they are retrieved wins
+		std::vector<uint64_t> generations;
+		for(block_nr_t k=i; k<j; k++)
+			generations.push_back(arc.get_generation(block_nr + k));
+
+		struct iovec iov { &to[i * block_size], size_t((j - i) * block_size) };
+		int err = 0;
+		sb->get_data_into((block_nr + i) * block_size, &iov, 1, &err);
+
+		if (err) {
+			dolog(ll_error, "storage_backend_cache::get_multiple_blocks(%s): failed to retrieve %ld blocks starting at %ld from %s", id.c_str(), j - i, block_nr + i, sb->get_id().c_str());
+			return false;
+		}
+
+		for(block_nr_t k=i; k<j; k++)
+			insert(block_nr + k, &to[k * block_size], generations.at(k - i));
+
+		n_misses += j - i;
+
+		i = next_is_hit ? j + 1 : j;
+	}
+
+	return true;
+}
+
+bool storage_backend_cache::get_block_into(const block_nr_t block_nr, uint8_t *const to)
+{
+	return get_multiple_blocks(block_nr, 1, to);
+}
+
+bool storage_backend_cache::get_block(const block_nr_t block_nr, uint8_t **const data)
+{
+	*data = pool_malloc(block_size);
+	if (!*data) {
+		dolog(ll_error, "storage_backend_cache::get_block(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
+		return false;
+	}
+
+	if (!get_block_into(block_nr, *data)) {
+		pool_free(*data);
+		*data = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+bool storage_backend_cache::put_block(const block_nr_t block_nr, const uint8_t *const data)
+{
+	invalidate(block_nr * block_size, block_size);
+
+	int err = 0;
+	sb->put_data(block_nr * block_size, block(data, block_size, false), &err);
+
+	return err == 0;
+}
+
+void storage_backend_cache::put_data(const offset_t offset, const block & b, int *const err)
+{
+	stats_timer st(stats, so_put, b.get_size());
+
+	// exclusive: no reader can put the old contents back in the cache while this runs
+	lg.un_lock_block_group(offset, b.get_size(), block_size, true, false);
+
+	invalidate(offset, b.get_size());
+
+	sb->put_data(offset, b, err);
+
+	lg.un_lock_block_group(offset, b.get_size(), block_size, false, false);
+}
+
+bool storage_backend_cache::fsync()
+{
+	stats_timer st(stats, so_fsync, 0);
+
+	return sb->fsync();
+}
+
+bool storage_backend_cache::trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err)
+{
+	stats_timer st(stats, so_trim, len);
+
+	lg.un_lock_block_group(offset, len, block_size, true, false);
+
+	invalidate(offset, len);
+
+	bool rc = sb->trim_zero(offset, len, trim, err);
+
+	lg.un_lock_block_group(offset, len, block_size, false, false);
+
+	return rc;
+}
+
+void storage_backend_cache::dump_stats(const std::string & base_filename)
+{
+	uint64_t hits = n_hits, misses = n_misses;
+
+	const arc_cache_stats_t s = arc.get_stats();
+
+	dolog(ll_info, "storage_backend_cache(%s): recent: %zu blocks (%lu bytes), frequent: %zu blocks (%lu bytes), ghosts: %zu/%zu, target recent: %lu bytes", id.c_str(), s.n_t1, s.bytes_t1, s.n_t2, s.bytes_t2, s.n_b1, s.n_b2, s.p);
+
+	dolog(ll_info, "storage_backend_cache(%s): hits: %lu, misses: %lu (hit ratio %.2f%%), ghost hits: %lu, evictions: %lu, invalidations: %lu", id.c_str(), hits, misses, hits + misses ? hits * 100.0 / (hits + misses) : 0., s.n_ghost_hits, s.n_evictions, s.n_forgotten);
+
+	sb->dump_stats(base_filename);
+}
+
+YAML::Node storage_backend_cache::emit_configuration() const
+{
+	YAML::Node out_cfg;
+	out_cfg["id"] = id;
+	out_cfg["storage-backend"] = sb->emit_configuration();
+	out_cfg["memory"] = max_memory;
+	if (c)
+		out_cfg["compresser"] = c->emit_configuration();
+
+	YAML::Node out;
+	out["type"] = "storage-backend-cache";
+	out["cfg"] = out_cfg;
+
+	return out;
+}
+
+storage_backend_cache * storage_backend_cache::load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, std::optional<int> block_size)
+{
+	dolog(ll_info, " * storage_backend_cache::load_configuration");
+
+	const YAML::Node cfg = yaml_get_yaml_node(node, "cfg", "storage-backend-cache configuration");
+
+	std::string id = yaml_get_string(cfg, "id", "module id");
+
+	storage_backend *sb = storage_backend::load_configuration(cfg["storage-backend"], size, block_size);
+
+	uint64_t max_memory = yaml_get_uint64_t(cfg, "memory", "how much RAM to use for cached blocks", true);
+
+	// optional: store cached blocks compressed
+	compresser *c = cfg["compresser"] ? compresser::load_configuration(cfg["compresser"]) : nullptr;
+
+	return new storage_backend_cache(id, sb, max_memory, c);
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <atomic>
+#include <optional>
+
+#include "arc_cache.h"
+#include "compresser.h"
+#include "storage_backend.h"
+
+
+// RAM read cache in front of an other storage backend.
+// Replacement is ARC (see arc_cache.h): a single sequential scan does not
+// flush the frequently used blocks. Blocks can be stored compressed
+// (optional), these take less of the budget.
+// Writes and trims go straight to the underlying backend, the blocks they
+// touch are dropped from the cache.
+class storage_backend_cache : public storage_backend
+{
+private:
+	storage_backend *const  sb;
+	const uint64_t          max_memory;
+	compresser      *const  c;  // optional
+
+	// 'tag' of an entry: whether the data is compressed
+	arc_cache<block_nr_t>   arc;
+
+	std::atomic_uint64_t    n_hits { 0 };
+	std::atomic_uint64_t    n_misses { 0 };
+
+	bool lookup(const block_nr_t block_nr, uint8_t *const to);
+	void insert(const block_nr_t block_nr, const uint8_t *const data, const uint64_t generation);
+	void invalidate(const offset_t offset, const uint32_t len);
+
+protected:
+	bool can_do_multiple_blocks() const override;
+	bool get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *const to) override;
+
+	bool get_block(const block_nr_t block_nr, uint8_t **const data) override;
+	bool get_block_into(const block_nr_t block_nr, uint8_t *const to) override;
+	bool put_block(const block_nr_t block_nr, const uint8_t *const data) override;
+
+public:
+	storage_backend_cache(const std::string & id, storage_backend *const sb, const uint64_t max_memory, compresser *const c);
+	virtual ~storage_backend_cache();
+
+	offset_t get_size() const override;
+
+	void put_data(const offset_t offset, const block & b, int *const err) override;
+	using storage_backend::put_data;
+
+	bool fsync() override;
+
+	bool trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err) override;
+
+	void dump_stats(const std::string & base_filename) override;
+
+	YAML::Node emit_configuration() const override;
+	static storage_backend_cache * load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, std::optional<int> block_size);
+};
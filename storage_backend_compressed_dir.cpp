@@ -7,6 +7,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "buffer_pool.h"
 #include "compresser.h"
 #include "error.h"
 #include "io.h"
@@ -106,7 +107,7 @@ bool storage_backend_compressed_dir::get_block(const block_nr_t block_nr, uint8_
 	if (fd == -1) {
 		// a block that does not exist only contains 0x00
 		if (errno == ENOENT) {
-			*data = reinterpret_cast<uint8_t *>(calloc(1, block_size));
+			*data = pool_calloc(block_size);
 			return true;
 		}
 
@@ -121,7 +122,7 @@ bool storage_backend_compressed_dir::get_block(const block_nr_t block_nr, uint8_
 		return false;
 	}
 
-	uint8_t *temp = reinterpret_cast<uint8_t *>(malloc(st.st_size));
+	uint8_t *temp = pool_malloc(st.st_size);
 	if (!temp) {
 		dolog(ll_error, "storage_backend_compressed_dir::get_block(%s): cannot allocate %ld bytes or memory: %s", id.c_str(), st.st_size, strerror(errno));
 		close(fd);
@@ -131,6 +132,7 @@ bool storage_backend_compressed_dir::get_block(const block_nr_t block_nr, uint8_
 	if (READ(fd, temp, st.st_size) != st.st_size) {
 		dolog(ll_error, "storage_backend_compressed_dir::get_block(%s): short read on \"%s\"", id.c_str(), file.c_str());
 		close(fd);
+		pool_free(temp);
 		return false;
 	}
 
@@ -138,7 +140,7 @@ bool storage_backend_compressed_dir::get_block(const block_nr_t block_nr, uint8_
 	bool rc = c->decompress(temp, st.st_size, data, &out_len);
 
 	close(fd);
-	free(temp);
+	pool_free(temp);
 
 	if (rc == false) {
 		dolog(ll_error, "storage_backend_compressed_dir::get_block(%s): failed to decompress block \"%s\"", id.c_str(), file.c_str());
@@ -147,12 +149,10 @@ bool storage_backend_compressed_dir::get_block(const block_nr_t block_nr, uint8_
 
 	if (out_len != size_t(block_size)) {
 		dolog(ll_error, "storage_backend_compressed_dir::get_block(%s): failed to decompress block \"%s\": output size (%zu) incorrect", id.c_str(), file.c_str(), out_len);
-		free(*data);
+		pool_free(*data);
 		return false;
 	}
 
-	close(fd);
-
 	return true;
 }
 
@@ -179,12 +179,12 @@ bool storage_backend_compressed_dir::put_block(const block_nr_t block_nr, const
 
 	if (WRITE(fd, data_out, out_len) != ssize_t(out_len)) {
 		dolog(ll_error, "storage_backend_compressed_dir::put_block(%s): failed to write to \"%s\": %s", id.c_str(), file.c_str(), strerror(errno));
-		free(data_out);
+		pool_free(data_out);
 		close(fd);
 		return false;
 	}
 
-	free(data_out);
+	pool_free(data_out);
 
 	close(fd);
 
@@ -193,6 +193,8 @@ bool storage_backend_compressed_dir::put_block(const block_nr_t block_nr, const
 
 bool storage_backend_compressed_dir::fsync()
 {
+	stats_timer st(stats, so_fsync, 0);
+
 	if (::fsync(dir_fd) == -1) {
 		dolog(ll_error, "storage_backend_compressed_dir::fsync(%s): fsync callf failed on directory \"%s\": %s", id.c_str(), dir.c_str(), strerror(errno));
 		return false;
@@ -208,6 +210,8 @@ bool storage_backend_compressed_dir::fsync()
 
 bool storage_backend_compressed_dir::trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err)
 {
+	stats_timer st(stats, so_trim, len);
+
 	*err = 0;
 
 	lg.un_lock_block_group(offset, len, block_size, true, false);
@@ -247,20 +251,23 @@ bool storage_backend_compressed_dir::trim_zero(const offset_t offset, const uint
 			if (!put_block(block_nr, temp)) {
 				dolog(ll_error, "storage_backend_compressed_dir::trim_zero(%s): failed to update block %ld", id.c_str(), block_nr);
 				*err = EINVAL;
-				free(temp);
+				pool_free(temp);
 				break;
 			}
 
-			free(temp);
+			pool_free(temp);
 		}
 
 		work_offset += current_size;
 		work_size -= current_size;
 	}
 
+	// inside the lock so that the mirrors see the writes to a region in the same order
+	bool mirrors_ok = do_mirror_trim_zero(offset, len, trim);
+
 	lg.un_lock_block_group(offset, len, block_size, false, false);
 
-	if (do_mirror_trim_zero(offset, len, trim) == false) {
+	if (mirrors_ok == false) {
 		dolog(ll_error, "storage_backend_compressed_dir::trim_zero(%s): failed to send to mirror(s)", id.c_str());
 		return false;
 	}
@@ -1,59 +1,203 @@
-/*
- * - hash => data
- * - hash => use_count
- * - block => hash
- */
+// see dedup_schema.h for the layout of the database
+#include <algorithm>
+#include <chrono>
 #include <fcntl.h>
 #include <kcpolydb.h>
 #include <optional>
+#include <set>
+#include <string.h>
+#include <thread>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "buffer_pool.h"
+#include "dedup_schema.h"
 #include "error.h"
 #include "io.h"
 #include "logging.h"
 #include "storage_backend_dedup.h"
 #include "str.h"
+#include "time.h"
 #include "yaml-helpers.h"
+#include "zero.h"
 
 
-storage_backend_dedup::storage_backend_dedup(const std::string & id, const std::string & file, hash *const h, compresser *const c, const std::vector<mirror *> & mirrors, const offset_t size, const int block_size) :
+// a change that spans shards and failed is tried again this often before the store goes read-only
+constexpr int n_apply_retries { 3 };
+
+
+storage_backend_dedup::storage_backend_dedup(const std::string & id, const std::string & file, hash *const h, const dedup_options_t & options, const std::vector<mirror *> & mirrors, const offset_t size, const int block_size) :
 	storage_backend(id, block_size, mirrors),
-	h(h), c(c),
+	h(h), c(options.c), index(options.index), block_cache(options.block_cache),
 	size(size),
+	n_threads(options.n_threads),
 	file(file)
 {
 	if (!verify_mirror_sizes())
 		throw myformat("storage_backend_dedup(%s): mirrors sanity check failed", file.c_str());
 
-	if (db.open(myformat("%s#*", file.c_str()), kyotocabinet::PolyDB::OWRITER | kyotocabinet::PolyDB::OCREATE) == false)
-		throw myformat("storage_backend_dedup: failed to access DB-file \"%s\": %s", file.c_str(), db.error().message());
+	const int n_shards = options.n_shards;
 
-	const std::string compressed_key = "compressed";
+	if (n_shards < 1 || n_shards > 65536)
+		throw myformat("storage_backend_dedup(%s): number of shards (%d) must be 1...65536", file.c_str(), n_shards);
 
-	std::string compressed_value;
-	if (db.get(compressed_key, &compressed_value) == false) {
-		dolog(ll_info, "storage_backend_dedup(%s): NEW database file", file.c_str());
+	// a store keeps the number of shards it was created with
+	const std::string other = n_shards == 1 ? file + ".0" : file;
+	if (access(other.c_str(), F_OK) == 0)
+		throw myformat("storage_backend_dedup(%s): \"%s\" exists: the store was created with %s shards", file.c_str(), other.c_str(), n_shards == 1 ? "multiple" : "no");
 
-		if (db.set(compressed_key, c ? c->get_type() : "") == false)
-			throw myformat("storage_backend_dedup(%s): cannot write to database", file.c_str());
+	for(int i=0; i<n_shards; i++) {
+		shard_t *s = new shard_t();
+		s->file  = n_shards == 1 ? file : myformat("%s.%d", file.c_str(), i);
+		s->index = index && n_shards > 1 ? index->create_shard(i, n_shards) : index;
+
+		shards.push_back(s);
 	}
-	else {
-		if ((c != nullptr && compressed_value != c->get_type()) || (c == nullptr && compressed_value.empty() == false))
-			throw myformat("storage_backend_dedup(%s): compression setting mismatch", file.c_str());
+
+	for(int i=0; i<n_shards; i++)
+		open_shard(shards.at(i), i);
+
+	if (n_shards > 1) {
+		intent_log = new dedup_intent_log(file + ".intent");
+
+		replay_intent_log();
+	}
+
+	for(auto s : shards) {
+		if (s->index && s->index->has_bloom_filter() && s->index->load_bloom_filter(s->db.count()) == false)
+			fill_bloom_filter(s);
 	}
+
+	// not the shared pool: put_data itself may run in that one
+	if (n_threads > 0)
+		tp = new thread_pool(n_threads);
 }
 
 storage_backend_dedup::~storage_backend_dedup()
 {
-	db.close();
+	delete tp;
+
+	for(auto s : shards) {
+		if (s->index)
+			s->index->save_bloom_filter(s->db.count());
+
+		s->db.close();
+
+		if (s->index != index)
+			delete s->index;
+
+		delete s;
+	}
+
+	delete intent_log;
+
+	delete block_cache;
+
+	delete index;
 
 	delete h;
 
 	dolog(ll_info, "~storage_backend_dedup: database closed");
 }
 
+void storage_backend_dedup::open_shard(shard_t *const s, const int nr)
+{
+	const std::string n_shards = myformat("%zu", shards.size());
+	const std::string shard_nr = myformat("%d", nr);
+
+	if (s->db.open(myformat("%s#*", s->file.c_str()), kyotocabinet::PolyDB::OWRITER | kyotocabinet::PolyDB::OCREATE) == false)
+		throw myformat("storage_backend_dedup: failed to access DB-file \"%s\": %s", s->file.c_str(), s->db.error().message());
+
+	const std::string compressed_key = "compressed";
+	const std::string schema_key     = "schema";
+	const std::string hash_key       = "hash";
+	const std::string shards_key     = "shards";
+	const std::string shard_key      = "shard";
+
+	std::string compressed_value;
+	if (s->db.get(compressed_key, &compressed_value) == false) {
+		dolog(ll_info, "storage_backend_dedup(%s): NEW database file", s->file.c_str());
+
+		if (s->db.set(compressed_key, c ? c->get_type() : "") == false || s->db.set(schema_key, DEDUP_SCHEMA_VERSION) == false || s->db.set(hash_key, h->get_type()) == false)
+			throw myformat("storage_backend_dedup(%s): cannot write to database", s->file.c_str());
+
+		if (shards.size() > 1 && (s->db.set(shards_key, n_shards) == false || s->db.set(shard_key, shard_nr) == false))
+			throw myformat("storage_backend_dedup(%s): cannot write to database", s->file.c_str());
+
+		return;
+	}
+
+	std::string schema_value;
+	if (s->db.get(schema_key, &schema_value) == false)
+		throw myformat("storage_backend_dedup(%s): database uses the old key schema, convert it with mystorage-dedup-migrate", s->file.c_str());
+
+	if (schema_value != DEDUP_SCHEMA_VERSION)
+		throw myformat("storage_backend_dedup(%s): unknown database schema \"%s\"", s->file.c_str(), schema_value.c_str());
+
+	if ((c != nullptr && compressed_value != c->get_type()) || (c == nullptr && compressed_value.empty() == false))
+		throw myformat("storage_backend_dedup(%s): compression setting mismatch", s->file.c_str());
+
+	// databases from before the hash function was recorded all used SHA3-384
+	std::string hash_value;
+	if (s->db.get(hash_key, &hash_value) == false) {
+		hash_value = "hash-sha384";
+
+		if (s->db.set(hash_key, hash_value) == false)
+			throw myformat("storage_backend_dedup(%s): cannot write to database", s->file.c_str());
+	}
+
+	if (hash_value != h->get_type())
+		throw myformat("storage_backend_dedup(%s): hash function setting mismatch (database: %s, configuration: %s)", s->file.c_str(), hash_value.c_str(), h->get_type().c_str());
+
+	// not set in an unsharded store
+	std::string shards_value = "1";
+	std::string shard_value  = "0";
+	s->db.get(shards_key, &shards_value);
+	s->db.get(shard_key, &shard_value);
+
+	if (shards_value != n_shards || shard_value != shard_nr)
+		throw myformat("storage_backend_dedup(%s): database is shard %s of %s, expected shard %s of %s", s->file.c_str(), shard_value.c_str(), shards_value.c_str(), shard_nr.c_str(), n_shards.c_str());
+}
+
+void storage_backend_dedup::replay_intent_log()
+{
+	std::vector<std::vector<dedup_intent_log::change_t> > unfinished;
+
+	if (intent_log->get_unfinished(&unfinished) == false)
+		throw myformat("storage_backend_dedup(%s): cannot read the intent log", file.c_str());
+
+	if (unfinished.empty() == false) {
+		dolog(ll_warning, "storage_backend_dedup(%s): applying %zu unfinished transaction(s) from the intent log", file.c_str(), unfinished.size());
+
+		for(auto & changes : unfinished) {
+			std::vector<int> involved;
+
+			for(auto & change : changes) {
+				if (change.shard < 0 || change.shard >= int(shards.size()))
+					throw myformat("storage_backend_dedup(%s): intent log refers to shard %d", file.c_str(), change.shard);
+
+				involved.push_back(change.shard);
+			}
+
+			std::sort(involved.begin(), involved.end());
+			involved.erase(std::unique(involved.begin(), involved.end()), involved.end());
+
+			if (apply_changes(involved, changes) == false)
+				throw myformat("storage_backend_dedup(%s): cannot apply the intent log", file.c_str());
+		}
+
+		// before the log is gone
+		for(auto s : shards) {
+			if (s->db.synchronize(true) == false)
+				throw myformat("storage_backend_dedup(%s): cannot sync \"%s\": %s", file.c_str(), s->file.c_str(), s->db.error().message());
+		}
+	}
+
+	if (intent_log->clear() == false)
+		throw myformat("storage_backend_dedup(%s): cannot clear the intent log", file.c_str());
+}
+
 storage_backend_dedup * storage_backend_dedup::load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, std::optional<int> block_size)
 {
 	dolog(ll_info, " * socket_backend_dedup::load_configuration");
@@ -73,11 +217,25 @@ storage_backend_dedup * storage_backend_dedup::load_configuration(const YAML::No
 
 	int final_block_size = block_size.has_value() ? block_size.value() : yaml_get_int(cfg, "block-size", "block size of store (bigger is faster, smaller is better de-duplication)");
 
-	compresser *c = compresser::load_configuration(yaml_get_yaml_node(cfg, "compresser", "compression schema"));
+	dedup_options_t options;
+
+	options.c = compresser::load_configuration(yaml_get_yaml_node(cfg, "compresser", "compression schema"));
 
 	hash *h = hash::load_configuration(yaml_get_yaml_node(cfg, "hash", "hash-function selection"));
 
-	return new storage_backend_dedup(id, file, h, c, mirrors, final_size, final_block_size);
+	// optional: RAM cache of records and Bloom filter of hashes
+	options.index = cfg["index"] ? dedup_index::load_configuration(cfg["index"]) : nullptr;
+
+	// optional: RAM cache of decompressed data blocks, by hash
+	options.block_cache = cfg["block-cache"] ? new dedup_block_cache(yaml_get_uint64_t(cfg, "block-cache", "how much RAM to use for cached (decompressed) data blocks", true), final_block_size) : nullptr;
+
+	// optional: 0 hashes and compresses in line
+	options.n_threads = cfg["threads"] ? yaml_get_int(cfg, "threads", "number of threads that hash and compress blocks") : std::thread::hardware_concurrency();
+
+	// optional: 1 is a single database file
+	options.n_shards = cfg["shards"] ? yaml_get_int(cfg, "shards", "number of database files the store is split in") : 1;
+
+	return new storage_backend_dedup(id, file, h, options, mirrors, final_size, final_block_size);
 }
 
 YAML::Node storage_backend_dedup::emit_configuration() const
@@ -94,6 +252,12 @@ YAML::Node storage_backend_dedup::emit_configuration() const
 	out_cfg["block-size"] = block_size;
 	out_cfg["hash"] = h->emit_configuration();
 	out_cfg["compresser"] = c->emit_configuration();
+	if (index)
+		out_cfg["index"] = index->emit_configuration();
+	if (block_cache)
+		out_cfg["block-cache"] = block_cache->get_max_memory();
+	out_cfg["threads"] = n_threads;
+	out_cfg["shards"] = shards.size();
 
 	YAML::Node out;
 	out["type"] = "storage-backend-dedup";
@@ -112,418 +276,812 @@ offset_t storage_backend_dedup::get_size() const
 	return size;
 }
 
-// key for hash -> use_count
-std::string storage_backend_dedup::get_usecount_key_for_hash(const std::string & hash)
+storage_backend_dedup::shard_t * storage_backend_dedup::get_shard_for_block(const block_nr_t block_nr) const
 {
-	return myformat("use-count_%s", hash.c_str());
+	return shards.at(dedup_get_shard_for_block(block_nr, shards.size()));
 }
 
-// key for block_nr -> hash
-std::string storage_backend_dedup::get_hashforblocknr_key_for_blocknr(const block_nr_t block_nr)
+storage_backend_dedup::shard_t * storage_backend_dedup::get_shard_for_hash(const std::string & hash) const
 {
-	return myformat("block-to-hash_%lu", block_nr);
+	return shards.at(dedup_get_shard_for_hash(hash, shards.size()));
 }
 
-// key for hash -> data_block
-std::string storage_backend_dedup::get_data_key_for_hash(const std::string & hash)
+void storage_backend_dedup::fill_bloom_filter(shard_t *const s)
 {
-	return myformat("data-block_%s", hash.c_str());
-}
+	const uint64_t start_ts = get_us();
 
-bool storage_backend_dedup::put_key_value(const std::string & key, const uint8_t *const value, const int value_len)
-{
-	if (db.set(key.c_str(), key.size(), reinterpret_cast<const char *>(value), value_len) == false) {
-		dolog(ll_error, "storage_backend_dedup::put_key_value(%s): failed to retrieve value for key \"%s\": %s", id.c_str(), key.c_str(), db.error().message());
-		return false;
+	// the hash records: 'h' + hash
+	const size_t hash_key_size = 1 + h->get_size();
+
+	kyotocabinet::PolyDB::Cursor *cur = s->db.cursor();
+	cur->jump();
+
+	std::string key;
+	std::string value;
+	uint64_t    n = 0;
+
+	while(cur->get(&key, &value, true)) {
+		if (key.size() == hash_key_size && key[0] == 'h') {
+			s->index->add_hash(key);
+			n++;
+		}
 	}
 
-	return true;
+	delete cur;
+
+	dolog(ll_info, "storage_backend_dedup(%s): Bloom filter rebuilt from %lu records in %.3f s", s->file.c_str(), n, (get_us() - start_ts) / 1000000.);
 }
 
-bool storage_backend_dedup::get_key_value(const std::string & key, uint8_t *const value, const int value_len, bool *const not_found)
+bool storage_backend_dedup::get_record(shard_t *const s, const std::string & key, std::string *const value, bool *const found)
 {
-	int rc = db.get(key.c_str(), key.size(), reinterpret_cast<char *>(value), value_len);
+	if (s->index && s->index->lookup(key, value, found))
+		return true;
 
-	if (rc == -1) {
-		if (db.error().code() == kyotocabinet::BasicDB::Error::Code::NOREC) {
-			*not_found = true;
-			return true;
+	*found = s->db.get(key, value);
+
+	if (*found == false) {
+		if (s->db.error().code() != kyotocabinet::BasicDB::Error::Code::NOREC) {
+			dolog(ll_error, "storage_backend_dedup::get_record(%s): failed to retrieve value for key %s: %s", id.c_str(), bin_to_text(reinterpret_cast<const uint8_t *>(key.c_str()), key.size()).c_str(), s->db.error().message());
+			return false;
 		}
 
-		dolog(ll_error, "storage_backend_dedup::get_key_value(%s): failed to retrieve value for key \"%s\": %s", id.c_str(), key.c_str(), db.error().message());
-		return false;
+		value->clear();
 	}
 
-	if (rc != value_len) {
-		dolog(ll_error, "storage_backend_dedup::get_key_value(%s): value for key \"%s\" is not expected (%d) size (%d): %s", id.c_str(), key.c_str(), value_len, rc, db.error().message());
-		return false;
-	}
+	if (s->index)
+		s->index->insert(key, *value, *found);
 
 	return true;
 }
 
-bool storage_backend_dedup::decrease_use_count(const std::string block_hash, int64_t *const new_count)
+bool storage_backend_dedup::set_record(shard_t *const s, const std::string & key, const std::string & value)
 {
-	bool not_found = false;
-	if (get_key_value(block_hash, reinterpret_cast<uint8_t *>(new_count), sizeof(*new_count), &not_found) == false || not_found) {
-		dolog(ll_error, "storage_backend_dedup::decrease_use_count(%s): failed to retrieve use count for hash \"%s\": %s", id.c_str(), block_hash.c_str(), db.error().message());
+	if (s->db.set(key, value) == false) {
+		dolog(ll_error, "storage_backend_dedup::set_record(%s): failed to store value for key %s: %s", id.c_str(), bin_to_text(reinterpret_cast<const uint8_t *>(key.c_str()), key.size()).c_str(), s->db.error().message());
 		return false;
 	}
 
-	(*new_count)--;
+	if (s->index)
+		s->index->insert(key, value, true);
+
+	return true;
+}
 
-	if (put_key_value(block_hash, reinterpret_cast<const uint8_t *>(new_count), sizeof(*new_count)) == false) {
-		dolog(ll_error, "storage_backend_dedup::decrease_use_count(%s): failed to update use count for hash \"%s\": %s", id.c_str(), block_hash.c_str(), db.error().message());
+bool storage_backend_dedup::remove_record(shard_t *const s, const std::string & key)
+{
+	// not there is fine: e.g. a block that was never written is trimmed, or the intent log is applied again
+	if (s->db.remove(key) == false && s->db.error().code() != kyotocabinet::BasicDB::Error::Code::NOREC) {
+		dolog(ll_error, "storage_backend_dedup::remove_record(%s): failed to delete key %s: %s", id.c_str(), bin_to_text(reinterpret_cast<const uint8_t *>(key.c_str()), key.size()).c_str(), s->db.error().message());
 		return false;
 	}
 
+	if (s->index)
+		s->index->insert(key, "", false);
+
 	return true;
 }
 
-bool storage_backend_dedup::get_use_count(const std::string block_hash, int64_t *const new_count)
+std::optional<std::string> storage_backend_dedup::calc_hash(const uint8_t *const data)
 {
-	bool not_found = false;
-	if (get_key_value(block_hash, reinterpret_cast<uint8_t *>(new_count), sizeof(*new_count), &not_found) == false) {
-		if (not_found) {
-			*new_count = 0;
-			return true;
-		}
+	uint8_t *new_hash = nullptr;
+	h->do_hash(data, block_size, &new_hash);
 
-		dolog(ll_error, "storage_backend_dedup::get_use_count(%s): failed to retrieve use count for hash \"%s\": %s", id.c_str(), block_hash.c_str(), db.error().message());
-		return false;
-	}
+	if (!new_hash)
+		return { };
 
-	return true;
+	std::string out(reinterpret_cast<const char *>(new_hash), h->get_size());
+
+	free(new_hash);
+
+	return out;
 }
 
-bool storage_backend_dedup::set_use_count(const std::string block_hash, const int64_t new_count)
+std::optional<std::string> storage_backend_dedup::get_hash_for_block(const block_nr_t block_nr)
 {
-	if (put_key_value(block_hash, reinterpret_cast<const uint8_t *>(&new_count), sizeof(new_count)) == false) {
-		dolog(ll_error, "storage_backend_dedup::set_use_count(%s): failed to update use count for hash \"%s\": %s", id.c_str(), block_hash.c_str(), db.error().message());
-		return false;
+	shard_t    *s = get_shard_for_block(block_nr);
+	std::string block_hash;
+	bool        found = false;
+	bool        ok    = false;
+
+	{
+		std::lock_guard<std::mutex> lck(s->lock);
+
+		ok = get_record(s, dedup_block_key(block_nr), &block_hash, &found);
 	}
 
-	return true;
+	if (ok == false) {
+		dolog(ll_error, "storage_backend_dedup::get_hash_for_block(%s): failed to retrieve, number %ld", id.c_str(), block_nr);
+		return { };
+	}
+
+	if (!found)
+		return "";
+
+	if (block_hash.size() != size_t(h->get_size())) {
+		dolog(ll_error, "storage_backend_dedup::get_hash_for_block(%s): hash of block %ld has an unexpected size (%zu)", id.c_str(), block_nr, block_hash.size());
+		return { };
+	}
+
+	return block_hash;
 }
 
-bool storage_backend_dedup::delete_block_counter_by_hash(const std::string block_hash)
+bool storage_backend_dedup::get_block(const block_nr_t block_nr, uint8_t **const data)
 {
-	if (db.remove(block_hash) == false) {
-		dolog(ll_error, "storage_backend_dedup::delete_block_counter_by_hash(%s): failed to delete counter by hash \"%s\": %s", id.c_str(), block_hash.c_str(), db.error().message());
+	// hash for block
+	auto hfb = get_hash_for_block(block_nr);
+	if (hfb.has_value() == false) {
+		dolog(ll_error, "storage_backend_dedup::get_block(%s): failed to retrieve hash for block %ld", id.c_str(), block_nr);
 		return false;
 	}
 
-	return true;
-}
+	// block does not exist yet, return 0x00
+	if (hfb.value().empty()) {
+		*data = pool_calloc(block_size);
 
-bool storage_backend_dedup::delete_block_by_hash(const std::string block_hash)
-{
-	if (db.remove(block_hash) == false) {
-		dolog(ll_error, "storage_backend_dedup::delete_block_by_hash(%s): failed to delete block by hash \"%s\": %s", id.c_str(), block_hash.c_str(), db.error().message());
+		if (!*data) {
+			dolog(ll_error, "storage_backend_dedup::get_block(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
+			return false;
+		}
+
+		return true;
+	}
+
+	// data that many blocks have is cached once
+	if (block_cache) {
+		auto cached = block_cache->lookup(hfb.value());
+
+		if (cached.has_value()) {
+			*data = pool_malloc(block_size);
+			if (!*data) {
+				dolog(ll_error, "storage_backend_dedup::get_block(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
+				return false;
+			}
+
+			memcpy(*data, cached.value().get_data(), block_size);
+
+			return true;
+		}
+	}
+
+	// a batch that removes this data while it is retrieved wins
+	const uint64_t generation = block_cache ? block_cache->get_generation(hfb.value()) : 0;
+
+	// use count + data
+	shard_t    *s = get_shard_for_hash(hfb.value());
+	std::string record;
+	bool        found = false;
+	bool        ok    = false;
+
+	{
+		std::lock_guard<std::mutex> lck(s->lock);
+
+		ok = get_record(s, dedup_hash_key(hfb.value()), &record, &found);
+	}
+
+	if (ok == false || !found) {
+		dolog(ll_error, "storage_backend_dedup::get_block(%s): failed to retrieve block data for hash %s", id.c_str(), bin_to_text(reinterpret_cast<const uint8_t *>(hfb.value().c_str()), hfb.value().size()).c_str());
+		return false;
+	}
+
+	if (record.size() < dedup_record_header_size) {
+		dolog(ll_error, "storage_backend_dedup::get_block(%s): record for block %ld has an unexpected size (%zu)", id.c_str(), block_nr, record.size());
 		return false;
 	}
 
+	// decompressing is done without the lock
+	const uint8_t *const data_in  = reinterpret_cast<const uint8_t *>(record.data()) + dedup_record_header_size;
+	const size_t         data_len = record.size() - dedup_record_header_size;
+
+	if (c) {
+		size_t data_out_len = 0;
+		if (c->decompress(data_in, data_len, data, &data_out_len) == false) {
+			dolog(ll_error, "storage_backend_dedup::get_block(%s): failed to decompress block %ld", id.c_str(), block_nr);
+			return false;
+		}
+
+		if (data_out_len != size_t(block_size)) {
+			dolog(ll_error, "storage_backend_dedup::get_block(%s): failed to decompress block; size (%zu) mismatch (expected: %d)", id.c_str(), data_out_len, block_size);
+			pool_free(*data);
+			return false;
+		}
+	}
+	else {
+		if (data_len != size_t(block_size)) {
+			dolog(ll_error, "storage_backend_dedup::get_block(%s): block %ld has an unexpected size (%zu)", id.c_str(), block_nr, data_len);
+			return false;
+		}
+
+		*data = pool_malloc(block_size);
+		if (!*data) {
+			dolog(ll_error, "storage_backend_dedup::get_block(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
+			return false;
+		}
+
+		memcpy(*data, data_in, block_size);
+	}
+
+	if (block_cache)
+		block_cache->insert(hfb.value(), *data, generation);
+
 	return true;
 }
 
-bool storage_backend_dedup::increase_use_count(const std::string block_hash, int64_t *const new_count)
+bool storage_backend_dedup::is_same_data(const std::string & stored, const uint8_t *const data)
 {
-	bool not_found = false;
-	if (get_key_value(block_hash, reinterpret_cast<uint8_t *>(new_count), sizeof(*new_count), &not_found) == false || not_found) {
-		dolog(ll_error, "storage_backend_dedup::increase_use_count(%s): failed to retrieve use count for hash \"%s\": %s", id.c_str(), block_hash.c_str(), db.error().message());
+	if (!c)
+		return stored.size() == size_t(block_size) && memcmp(stored.data(), data, block_size) == 0;
+
+	uint8_t *temp     = nullptr;
+	size_t   temp_len = 0;
+	if (c->decompress(reinterpret_cast<const uint8_t *>(stored.data()), stored.size(), &temp, &temp_len) == false) {
+		dolog(ll_error, "storage_backend_dedup::is_same_data(%s): failed to decompress", id.c_str());
 		return false;
 	}
 
-	(*new_count)++;
+	bool rc = temp_len == size_t(block_size) && memcmp(temp, data, block_size) == 0;
+
+	pool_free(temp);
+
+	return rc;
+}
 
-	if (put_key_value(block_hash, reinterpret_cast<const uint8_t *>(new_count), sizeof(*new_count)) == false) {
-		dolog(ll_error, "storage_backend_dedup::increase_use_count(%s): failed to update use count for hash \"%s\": %s", id.c_str(), block_hash.c_str(), db.error().message());
+bool storage_backend_dedup::add_reference(batch_t *const batch, const prepared_block_t & prepared, const uint8_t *const data_in)
+{
+	const std::string & hash = prepared.hash;
+
+	record_change_t & rc = batch->records[hash];
+
+	bool stored_here = false;
+
+	// first time this batch sees the hash
+	if (rc.data.empty()) {
+		shard_t          *s   = get_shard_for_hash(hash);
+		const std::string key = dedup_hash_key(hash);
+
+		std::string record;
+		bool        found = false;
+
+		{
+			std::lock_guard<std::mutex> lck(s->lock);
+
+			// new data is not in the Bloom filter: no need to look for it
+			if (s->index == nullptr || s->index->may_have_hash(key)) {
+				if (get_record(s, key, &record, &found) == false)
+					return false;
+
+				if (!found && s->index && s->index->has_bloom_filter())
+					s->index->bloom_false_positive();
+			}
+		}
+
+		if (found) {
+			if (record.size() < dedup_record_header_size) {
+				dolog(ll_error, "storage_backend_dedup::add_reference(%s): record for hash %s is too small, dataset is corrupt!", id.c_str(), bin_to_text(reinterpret_cast<const uint8_t *>(hash.c_str()), hash.size()).c_str());
+				return false;
+			}
+
+			// kept: an other batch may remove the record before this one ends
+			rc.data = record.substr(dedup_record_header_size);
+		}
+		else if (prepared.compressed) {
+			rc.data.assign(reinterpret_cast<const char *>(prepared.compressed), prepared.compressed_len);
+			stored_here = true;
+		}
+		else if (c) {
+			uint8_t *data_compressed = nullptr;
+			size_t   data_len        = 0;
+
+			if (c->compress(data_in, block_size, &data_compressed, &data_len) == false) {
+				dolog(ll_error, "storage_backend_dedup::add_reference(%s): failed to compress data with hash %s", id.c_str(), bin_to_text(reinterpret_cast<const uint8_t *>(hash.c_str()), hash.size()).c_str());
+				return false;
+			}
+
+			rc.data.assign(reinterpret_cast<const char *>(data_compressed), data_len);
+			stored_here = true;
+
+			pool_free(data_compressed);
+		}
+		else {
+			rc.data.assign(reinterpret_cast<const char *>(data_in), block_size);
+			stored_here = true;
+		}
+	}
+
+	if (!stored_here && h->get_verify_on_match() && is_same_data(rc.data, data_in) == false) {
+		dolog(ll_error, "storage_backend_dedup::add_reference(%s): hash collision: other data has hash %s, not storing it", id.c_str(), bin_to_text(reinterpret_cast<const uint8_t *>(hash.c_str()), hash.size()).c_str());
 		return false;
 	}
 
+	// written once at the end of the batch
+	rc.change++;
+
 	return true;
 }
 
-std::optional<std::string> storage_backend_dedup::get_hash_for_block(const block_nr_t block_nr)
+void storage_backend_dedup::abort_transaction(shard_t *const s)
 {
-	// block-to-hash key
-	std::string bth_key = get_hashforblocknr_key_for_blocknr(block_nr);
+	// the index may have records that are rolled back now
+	if (s->index)
+		s->index->forget_all();
+
+	if (s->db.end_transaction(false) == false)
+		dolog(ll_error, "storage_backend_dedup::abort_transaction(%s): failed aborting transaction: %s", id.c_str(), s->db.error().message());
+}
 
-	int bh_size = h->get_size() * 2;
-	uint8_t *block_hash = reinterpret_cast<uint8_t *>(calloc(1, bh_size));  // is/will be a plain ascii string
+bool storage_backend_dedup::apply_changes(const std::vector<int> & involved, const std::vector<dedup_intent_log::change_t> & changes)
+{
+	// a transaction per shard
+	for(int nr : involved) {
+		shard_t *s = shards.at(nr);
 
-	bool not_found = false;
-	if (get_key_value(bth_key, block_hash, bh_size, &not_found) == false) {
-		free(block_hash);
+		if (s->db.begin_transaction() == false) {
+			dolog(ll_error, "storage_backend_dedup::apply_changes(%s): failed starting transaction: %s", id.c_str(), s->db.error().message());
+			return false;
+		}
 
-		dolog(ll_error, "storage_backend_dedup::get_hash_for_block(%s): failed to retrieve, number %ld: %s", id.c_str(), block_nr, db.error().message());
-		return { };
-	}
-	
-	if (not_found) {
-		free(block_hash);
-		return "";
+		bool ok = true;
+
+		for(auto it = changes.begin(); ok && it != changes.end(); it++) {
+			if (it->shard != nr)
+				continue;
+
+			if (it->value.has_value())
+				ok = set_record(s, it->key, it->value.value());
+			else
+				ok = remove_record(s, it->key);
+		}
+
+		if (!ok) {
+			abort_transaction(s);
+			return false;
+		}
+
+		if (s->db.end_transaction(true) == false) {
+			if (s->index)
+				s->index->forget_all();
+
+			dolog(ll_error, "storage_backend_dedup::apply_changes(%s): failed committing transaction: %s", id.c_str(), s->db.error().message());
+			return false;
+		}
 	}
 
-	return std::string(reinterpret_cast<const char *>(block_hash), bh_size);
+	return true;
 }
 
-bool storage_backend_dedup::get_block(const block_nr_t block_nr, uint8_t **const data)
+storage_backend_dedup::batch_t * storage_backend_dedup::get_batch()
 {
-	std::lock_guard<std::mutex> lck(lock);
+	std::lock_guard<std::mutex> lck(batches_lock);
 
-	bool rc = get_block_int(block_nr, data);
+	auto it = batches.find(std::this_thread::get_id());
+	if (it == batches.end())
+		return nullptr;
 
-	return rc;
+	return it->second;
 }
 
-bool storage_backend_dedup::get_block_int(const block_nr_t block_nr, uint8_t **const data)
+bool storage_backend_dedup::batch_end(batch_t *const batch)
 {
-	// hash for block
-	auto hfb = get_hash_for_block(block_nr);
-	if (hfb.has_value() == false) {
-		dolog(ll_error, "storage_backend_dedup::get_block_int(%s): failed to retrieve hash for block %ld: %s", id.c_str(), block_nr, db.error().message());
+	// also after a failure: the workers use the entries
+	publish_blocks(batch, 0);
+
+	// nothing was written yet
+	if (batch->failed)
 		return false;
-	}
 
-	size_t temp_size = c ? block_size * 2 + 128 : block_size;
-	uint8_t *temp = reinterpret_cast<uint8_t *>(calloc(1, temp_size));
-	if (!temp) {
-		dolog(ll_error, "storage_backend_dedup::get_block_int(%s): cannot allocate %lu bytes of memory", id.c_str(), temp_size);
+	if (read_only) {
+		dolog(ll_error, "storage_backend_dedup::batch_end(%s): store is read-only after a failure to update its shards", id.c_str());
 		return false;
 	}
 
-	// block does not exist yet, return 0x00
-	if (hfb.value().empty())
+	const int n_shards = shards.size();
+
+	std::set<int> involved;
+
+	for(auto & m : batch->mappings)
+		involved.insert(dedup_get_shard_for_block(m.first, n_shards));
+
+	for(auto & r : batch->records) {
+		if (r.second.change)
+			involved.insert(dedup_get_shard_for_hash(r.first, n_shards));
+	}
+
+	if (involved.empty())
 		return true;
 
-	// hash-to-data key
-	std::string htd_key = get_data_key_for_hash(hfb.value().c_str());
+	// always in the same order: batches that share shards cannot deadlock
+	std::vector<std::unique_lock<std::mutex> > locks;
+	for(int nr : involved)
+		locks.emplace_back(shards.at(nr)->lock);
 
-	int rc2 = db.get(htd_key.c_str(), htd_key.size(), reinterpret_cast<char *>(temp), temp_size);
+	// the new values; other batches may have changed use counts since they were looked up
+	std::vector<dedup_intent_log::change_t> changes;
+	std::vector<std::pair<shard_t *, std::string> > new_hashes;
+	std::vector<std::string> removed_hashes;
 
-	if (rc2 == -1) {
-		dolog(ll_error, "storage_backend_dedup::get_block_int(%s): failed to retrieve block data for hash \"%s\": %s", id.c_str(), htd_key.c_str(), db.error().message());
-		free(temp);
-		return false;
+	for(auto & r : batch->records) {
+		if (r.second.change == 0)
+			continue;
+
+		const int         nr  = dedup_get_shard_for_hash(r.first, n_shards);
+		shard_t          *s   = shards.at(nr);
+		const std::string key = dedup_hash_key(r.first);
+
+		std::string record;
+		bool        found = false;
+
+		if (get_record(s, key, &record, &found) == false)
+			return false;
+
+		int64_t use_count = r.second.change;
+
+		if (found) {
+			if (record.size() < dedup_record_header_size) {
+				dolog(ll_error, "storage_backend_dedup::batch_end(%s): record for hash %s is too small, dataset is corrupt!", id.c_str(), bin_to_text(reinterpret_cast<const uint8_t *>(r.first.c_str()), r.first.size()).c_str());
+				return false;
+			}
+
+			use_count += dedup_get_use_count(reinterpret_cast<const uint8_t *>(record.data()));
+		}
+		else {
+			record = std::string(dedup_record_header_size, 0) + r.second.data;
+
+			new_hashes.push_back({ s, key });
+		}
+
+		if (use_count < 0) {
+			dolog(ll_error, "storage_backend_dedup::batch_end(%s): use count of hash %s would become %ld, dataset is corrupt!", id.c_str(), bin_to_text(reinterpret_cast<const uint8_t *>(r.first.c_str()), r.first.size()).c_str(), use_count);
+			return false;
+		}
+
+		// no block uses it anymore: the data goes as well
+		if (use_count == 0) {
+			changes.push_back({ nr, key, { } });
+			removed_hashes.push_back(r.first);
+			continue;
+		}
+
+		dedup_set_use_count(reinterpret_cast<uint8_t *>(record.data()), use_count);
+
+		changes.push_back({ nr, key, record });
 	}
 
-	if (c) {
-		size_t data_out_len = 0;
-		if (c->decompress(temp, rc2, data, &data_out_len) == false) {
-			dolog(ll_error, "storage_backend_dedup::get_block_int(%s): failed to decompress block \"%s\"", id.c_str(), htd_key.c_str());
-			free(temp);
+	for(auto & m : batch->mappings) {
+		const int nr = dedup_get_shard_for_block(m.first, n_shards);
+
+		// unmapped reads as 0x00
+		if (m.second.empty())
+			changes.push_back({ nr, dedup_block_key(m.first), { } });
+		else
+			changes.push_back({ nr, dedup_block_key(m.first), m.second });
+	}
+
+	// the shards commit one after the other: when mystorage stops in between,
+	// the intent log brings the others up to date at the next start
+	std::optional<uint64_t> intent_id;
+
+	if (involved.size() > 1) {
+		intent_id = intent_log->log_changes(changes);
+
+		if (intent_id.has_value() == false)
+			return false;
+
+		n_cross_shard_batches++;
+	}
+
+	const std::vector<int> involved_list(involved.begin(), involved.end());
+
+	if (apply_changes(involved_list, changes) == false) {
+		// one shard: its transaction was rolled back, nothing changed
+		if (intent_id.has_value() == false)
 			return false;
+
+		// the others may have committed already; the changes are new values: applying them again is harmless
+		bool ok = false;
+
+		for(int i=0; i<n_apply_retries && !ok; i++) {
+			dolog(ll_warning, "storage_backend_dedup::batch_end(%s): retrying to apply changes to %zu shards", id.c_str(), involved_list.size());
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+			ok = apply_changes(involved_list, changes);
 		}
 
-		if (data_out_len != size_t(block_size)) {
-			dolog(ll_error, "storage_backend_dedup::get_block_int(%s): failed to decompress block; size (%zu) mismatch (expected: %zu)", id.c_str(), data_out_len, block_size);
-			free(*data);
-			free(temp);
+		if (!ok) {
+			// when applied at the next start, these values would overwrite later changes
+			intent_log->mark_done(intent_id.value());
+
+			read_only = true;
+
+			dolog(ll_error, "storage_backend_dedup::batch_end(%s): cannot apply changes to %zu shards, they may be inconsistent; the store is read-only now", id.c_str(), involved_list.size());
+
 			return false;
 		}
+	}
 
-		free(temp);
+	for(auto & n : new_hashes) {
+		if (n.first->index)
+			n.first->index->add_hash(n.second);
 	}
-	else {
-		*data = temp;
+
+	// other data may get that hash later (when it is not collision resistant)
+	if (block_cache) {
+		for(auto & hash : removed_hashes)
+			block_cache->forget(hash);
+	}
+
+	// a change that stays in the log would be applied again, over later ones, at the next start
+	if (intent_id.has_value() && intent_log->mark_done(intent_id.value()) == false) {
+		read_only = true;
+
+		dolog(ll_error, "storage_backend_dedup::batch_end(%s): cannot mark changes as done in the intent log; the store is read-only now", id.c_str());
+
+		return false;
 	}
 
 	return true;
 }
 
-bool storage_backend_dedup::map_blocknr_to_hash(const block_nr_t block_nr, const std::string & new_block_hash)
+bool storage_backend_dedup::transaction_start()
 {
-	return put_key_value(get_hashforblocknr_key_for_blocknr(block_nr), reinterpret_cast<const uint8_t *>(new_block_hash.c_str()), new_block_hash.size());
-}
+	batch_t *batch = new batch_t();
 
-#define ABORT_TRANSACTION(db, where) 				\
-	do {							\
-		if ((db).end_transaction(false) == false) {	\
-			dolog(ll_error, "%s failed aborting transaction: %s", where.c_str(), db.error().message()); \
-			return false;				\
-		}						\
-	}							\
-	while(0)
+	{
+		std::lock_guard<std::mutex> lck(batches_lock);
 
+		batches.insert({ std::this_thread::get_id(), batch });
+	}
 
-bool storage_backend_dedup::put_block(const block_nr_t block_nr, const uint8_t *const data)
+	n_batches++;
+
+	return true;
+}
+
+bool storage_backend_dedup::transaction_end()
 {
-	std::lock_guard<std::mutex> lck(lock);
+	batch_t *batch = nullptr;
+
+	{
+		std::lock_guard<std::mutex> lck(batches_lock);
+
+		auto it = batches.find(std::this_thread::get_id());
+		if (it == batches.end()) {
+			dolog(ll_error, "storage_backend_dedup::transaction_end(%s): no transaction in progress", id.c_str());
+			return false;
+		}
+
+		batch = it->second;
+
+		batches.erase(it);
+	}
 
-	bool rc = put_block_int(block_nr, data);
+	bool rc = batch_end(batch);
+
+	delete batch;
 
 	return rc;
 }
 
-bool storage_backend_dedup::put_block_int(const block_nr_t block_nr, const uint8_t *const data_in)
+bool storage_backend_dedup::put_block(const block_nr_t block_nr, const uint8_t *const data)
 {
-	if (db.begin_transaction() == false) {
-		ABORT_TRANSACTION(db, myformat("storage_backend_dedup::put_block_int(%s):", id.c_str()));
+	batch_t *batch = get_batch();
+
+	if (!batch)
+		return put_block_int(block_nr, data);
+
+	if (batch->failed)
 		return false;
+
+	n_batch_blocks++;
+
+	if (!tp) {
+		if (update_block(batch, block_nr, data) == false) {
+			batch->failed = true;
+			return false;
+		}
+
+		return true;
 	}
 
-	// get hash for block (get_hash_for_block())
-	auto cur_hash_for_blocknr = get_hash_for_block(block_nr);
-	if (cur_hash_for_blocknr.has_value() == false) {
-		ABORT_TRANSACTION(db, myformat("storage_backend_dedup::put_block_int(%s):", id.c_str()));
+	return queue_block(batch, block_nr, data);
+}
+
+bool storage_backend_dedup::queue_block(batch_t *const batch, const block_nr_t block_nr, const uint8_t *const data)
+{
+	// 'data' may be gone when this returns
+	uint8_t *copy = pool_malloc(block_size);
+	if (!copy) {
+		dolog(ll_error, "storage_backend_dedup::queue_block(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
 
-		dolog(ll_error, "storage_backend_dedup::put_block_int(%s): failed to get hash for blocknr %ld", id.c_str(), block_nr);
+		batch->failed = true;
 
 		return false;
 	}
 
-	// - overwriting a block? (hash.empty() == false)
-	if (cur_hash_for_blocknr.has_value() && cur_hash_for_blocknr.value().empty() == false) {
-		// - decrease use count
-		int64_t new_use_count = 0;
-		if (decrease_use_count(cur_hash_for_blocknr.value(), &new_use_count) == false) {
-			ABORT_TRANSACTION(db, myformat("storage_backend_dedup::put_block_int(%s):", id.c_str()));
+	memcpy(copy, data, block_size);
 
-			dolog(ll_error, "storage_backend_dedup::put_block_int(%s): failed to retrieve use-count for hash \"%s\"", id.c_str(), cur_hash_for_blocknr.value().c_str());
+	pipeline_entry_t *e = new pipeline_entry_t { block_nr, copy, { }, false, false };
 
-			return false;
-		}
+	batch->pipeline.push_back(e);
 
-		// - if use count is 0:
-		if (new_use_count == 0) {
-			// - delete block for that hash
-			if (delete_block_by_hash(cur_hash_for_blocknr.value()) == false) {
-				ABORT_TRANSACTION(db, myformat("storage_backend_dedup::put_block_int(%s):", id.c_str()));
+	// most blocks of a write are new data: compressing them here gets that out of the lock too
+	tp->enqueue([this, e] {
+		bool ok = prepare_block(e->data, &e->prepared, true);
 
-				dolog(ll_error, "storage_backend_dedup::put_block_int(%s): failed to delete block for hash \"%s\"", id.c_str(), cur_hash_for_blocknr.value().c_str());
+		std::unique_lock<std::mutex> lck(pipeline_lock);
 
-				return false;
-			}
+		e->ok   = ok;
+		e->done = true;
 
-			// delete counter
-			if (delete_block_counter_by_hash(get_hashforblocknr_key_for_blocknr(block_nr)) == false) {
-				ABORT_TRANSACTION(db, myformat("storage_backend_dedup::put_block_int(%s):", id.c_str()));
+		pipeline_cond.notify_all();
+	});
 
-				dolog(ll_error, "storage_backend_dedup::put_block_int(%s): failed to delete counter for hash \"%s\"", id.c_str(), cur_hash_for_blocknr.value().c_str());
+	// enough in flight to keep all workers busy
+	return publish_blocks(batch, n_threads * 2);
+}
 
-				return false;
-			}
-		}
-		else if (new_use_count < 0) {
-			ABORT_TRANSACTION(db, myformat("storage_backend_dedup::put_block_int(%s):", id.c_str()));
+bool storage_backend_dedup::publish_blocks(batch_t *const batch, const size_t max_pending)
+{
+	while(batch->pipeline.empty() == false) {
+		pipeline_entry_t *e = batch->pipeline.front();
 
+		{
+			std::unique_lock<std::mutex> lck(pipeline_lock);
 
-			dolog(ll_error, "storage_backend_dedup::put_block_int(%s): new_use_count < 0! (%ld) dataset is corrupt!", id.c_str(), new_use_count);
-			return false;
+			if (e->done == false && batch->pipeline.size() <= max_pending)
+				break;
+
+			while(e->done == false)
+				pipeline_cond.wait(lck);
 		}
-	}
 
-	// - calc hash over new-block
-	auto new_block_hash = h->do_hash(data_in, block_size);
-	if (!new_block_hash.has_value()) {
-		ABORT_TRANSACTION(db, myformat("storage_backend_dedup::put_block_int(%s):", id.c_str()));
+		batch->pipeline.pop_front();
+
+		if (batch->failed == false && (e->ok == false || update_block(batch, e->block_nr, e->data, e->prepared) == false)) {
+			dolog(ll_error, "storage_backend_dedup::publish_blocks(%s): failed to update block %ld", id.c_str(), e->block_nr);
+			batch->failed = true;
+		}
 
-		dolog(ll_error, "storage_backend_dedup::put_block_int(%s): cannot calculate hash", id.c_str());
+		pool_free(e->prepared.compressed);
+		pool_free(e->data);
 
-		return false;
+		delete e;
 	}
 
-	int64_t new_block_use_count = 0;
-	if (get_use_count(new_block_hash.value(), &new_block_use_count) == false) {
-		ABORT_TRANSACTION(db, myformat("storage_backend_dedup::put_block_int(%s):", id.c_str()));
+	return !batch->failed;
+}
+
+bool storage_backend_dedup::zero_blocks(const block_nr_t block_nr, const block_nr_t n_blocks)
+{
+	batch_t *batch = get_batch();
 
-		dolog(ll_error, "storage_backend_dedup::put_block_int(%s): failed to retrieve use-count for hash \"%s\"", id.c_str(), new_block_hash.value().c_str());
+	if (!batch)
+		return storage_backend::zero_blocks(block_nr, n_blocks);
 
+	if (batch->failed)
 		return false;
-	}
 
-	// - new-block-hash exists? (count > 0)
-	if (new_block_use_count > 0) {
-		// - increase count for new-block-hash
-		int64_t temp = 0;
-		if (increase_use_count(new_block_hash.value(), &temp) == false) {
-			ABORT_TRANSACTION(db, myformat("storage_backend_dedup::put_block_int(%s):", id.c_str()));
+	// no hash: the blocks only lose their mapping; the other blocks of
+	// the write that may still be in the pipeline are different ones
+	const prepared_block_t unmapped;
 
-			dolog(ll_error, "storage_backend_dedup::put_block_int(%s): failed to increase use-count for data block with hash \"%s\"", id.c_str(), new_block_hash.value().c_str());
+	n_batch_blocks += n_blocks;
 
+	for(block_nr_t nr=block_nr; nr<block_nr + n_blocks; nr++) {
+		if (update_block(batch, nr, nullptr, unmapped) == false) {
+			dolog(ll_error, "storage_backend_dedup::zero_blocks(%s): failed to update block %ld", id.c_str(), nr);
+			batch->failed = true;
 			return false;
 		}
+	}
 
-		if (temp != new_block_use_count + 1) {
-			ABORT_TRANSACTION(db, myformat("storage_backend_dedup::put_block_int(%s):", id.c_str()));
+	return true;
+}
 
-			dolog(ll_error, "storage_backend_dedup::put_block_int(%s): new count (%ld) not as expected (%ld) hash \"%s\"", id.c_str(), temp, new_block_use_count + 1, new_block_hash.value().c_str());
+bool storage_backend_dedup::put_block_int(const block_nr_t block_nr, const uint8_t *const data_in)
+{
+	batch_t batch;
 
-			return false;
-		}
-	}
-	else {  // new block
-		// - count == 0:
-		//   - set count to 1
-		if (set_use_count(new_block_hash.value(), 1) == false) {
-			ABORT_TRANSACTION(db, myformat("storage_backend_dedup::put_block_int(%s):", id.c_str()));
+	n_batches++;
+	n_batch_blocks++;
 
-			dolog(ll_error, "storage_backend_dedup::put_block_int(%s): failed to set use-count for data block with hash \"%s\" to 1", id.c_str(), new_block_hash.value().c_str());
+	if (update_block(&batch, block_nr, data_in) == false)
+		batch.failed = true;
 
-			return false;
-		}
+	return batch_end(&batch);
+}
 
-		if (c) {
-			// compress data
-			uint8_t *data_compressed = nullptr;
-			size_t data_compressed_size = 0;
-			if (c->compress(data_in, block_size, &data_compressed, &data_compressed_size) == false) {
-				ABORT_TRANSACTION(db, myformat("storage_backend_dedup::put_block_int(%s):", id.c_str()));
+bool storage_backend_dedup::prepare_block(const uint8_t *const data, prepared_block_t *const out, const bool compress)
+{
+	// not hashed nor stored: the block gets unmapped
+	if (is_all_zero(data, block_size)) {
+		out->hash.clear();
+		return true;
+	}
 
-				dolog(ll_error, "storage_backend_dedup::put_block_int(%s): failed to compress data with hash \"%s\"", id.c_str(), new_block_hash.value().c_str());
+	// - calc hash over new-block
+	auto new_block_hash = calc_hash(data);
+	if (!new_block_hash.has_value()) {
+		dolog(ll_error, "storage_backend_dedup::prepare_block(%s): cannot calculate hash", id.c_str());
+		return false;
+	}
 
-				return false;
-			}
+	out->hash = new_block_hash.value();
 
-			// - put block
-			if (put_key_value(get_data_key_for_hash(new_block_hash.value()), data_compressed, data_compressed_size) == false) {
-				ABORT_TRANSACTION(db, myformat("storage_backend_dedup::put_block_int(%s):", id.c_str()));
+	if (compress && c && c->compress(data, block_size, &out->compressed, &out->compressed_len) == false) {
+		dolog(ll_error, "storage_backend_dedup::prepare_block(%s): failed to compress data", id.c_str());
+		out->compressed = nullptr;
+		return false;
+	}
 
-				free(data_compressed);
+	return true;
+}
 
-				dolog(ll_error, "storage_backend_dedup::put_block_int(%s): failed to store data block with hash \"%s\"", id.c_str(), new_block_hash.value().c_str());
+bool storage_backend_dedup::update_block(batch_t *const batch, const block_nr_t block_nr, const uint8_t *const data_in)
+{
+	// in line: only new data is compressed (by add_reference)
+	prepared_block_t prepared;
 
-				return false;
-			}
+	if (prepare_block(data_in, &prepared, false) == false)
+		return false;
 
-			free(data_compressed);
-		}
-		else {
-			// - put block
-			if (put_key_value(get_data_key_for_hash(new_block_hash.value()), data_in, block_size) == false) {
-				ABORT_TRANSACTION(db, myformat("storage_backend_dedup::put_block_int(%s):", id.c_str()));
+	return update_block(batch, block_nr, data_in, prepared);
+}
 
-				dolog(ll_error, "storage_backend_dedup::put_block_int(%s): failed to store data block with hash \"%s\"", id.c_str(), new_block_hash.value().c_str());
+bool storage_backend_dedup::update_block(batch_t *const batch, const block_nr_t block_nr, const uint8_t *const data_in, const prepared_block_t & prepared)
+{
+	const std::string & new_block_hash = prepared.hash;
 
-				return false;
-			}
+	// get hash for block (get_hash_for_block()), unless this batch changed it already
+	std::string cur_hash_for_blocknr;
+
+	auto it = batch->mappings.find(block_nr);
+	if (it != batch->mappings.end())
+		cur_hash_for_blocknr = it->second;
+	else {
+		auto hfb = get_hash_for_block(block_nr);
+		if (hfb.has_value() == false) {
+			dolog(ll_error, "storage_backend_dedup::update_block(%s): failed to get hash for blocknr %ld", id.c_str(), block_nr);
+			return false;
 		}
+
+		cur_hash_for_blocknr = hfb.value();
 	}
 
-	// - put mapping blocknr to new-block-hash
-	if (map_blocknr_to_hash(block_nr, new_block_hash.value()) == false) {
-		ABORT_TRANSACTION(db, myformat("storage_backend_dedup::put_block_int(%s):", id.c_str()));
+	// - same data as what is there: nothing changes
+	if (cur_hash_for_blocknr == new_block_hash)
+		return true;
 
-		dolog(ll_error, "storage_backend_dedup::put_block_int(%s): failed to map blocknr %ld to hash \"%s\"", id.c_str(), block_nr, new_block_hash.value().c_str());
+	// - overwriting a block? (hash.empty() == false)
+	if (cur_hash_for_blocknr.empty() == false)
+		batch->records[cur_hash_for_blocknr].change--;
 
-		return false;
+	// - only 0x00: remove the mapping
+	if (new_block_hash.empty()) {
+		batch->mappings[block_nr] = new_block_hash;
+		return true;
 	}
 
-	// commit
-	if (db.end_transaction(true) == false) {
-		dolog(ll_error, "storage_backend_dedup::put_block_int(%s): failed committing transaction: %s", db.error().message());
+	// - increase count for new-block-hash or store the new data
+	if (add_reference(batch, prepared, data_in) == false) {
+		dolog(ll_error, "storage_backend_dedup::update_block(%s): failed to store data of block %ld", id.c_str(), block_nr);
 		return false;
 	}
 
+	// - put mapping blocknr to new-block-hash
+	batch->mappings[block_nr] = new_block_hash;
+
 	return true;
 }
 
 bool storage_backend_dedup::fsync()
 {
-	if (db.synchronize(true) == false) {
-		dolog(ll_error, "storage_backend_dedup::fsync(%s): failed to kyotocabinet store to disk", id.c_str());
-		return false;
+	stats_timer st(stats, so_fsync, 0);
+
+	for(auto s : shards) {
+		if (s->db.synchronize(true) == false) {
+			dolog(ll_error, "storage_backend_dedup::fsync(%s): failed to kyotocabinet store to disk", id.c_str());
+			return false;
+		}
 	}
 
 	if (do_sync_mirrors() == false) {
@@ -536,11 +1094,19 @@ bool storage_backend_dedup::fsync()
 
 bool storage_backend_dedup::trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err)
 {
+	stats_timer st(stats, so_trim, len);
+
 	*err = 0;
 
-	uint8_t *b0x00 = reinterpret_cast<uint8_t *>(calloc(1, block_size));
+	// no hash: whole blocks only lose their mapping
+	const prepared_block_t unmapped;
+
+	// writes to these blocks wait; all blocks in one batch
+	lg.un_lock_block_group(offset, len, block_size, true, false);
+
+	batch_t batch;
 
-	std::lock_guard<std::mutex> lck(lock);
+	n_batches++;
 
 	offset_t work_offset = offset;
 	size_t work_size = len;
@@ -551,12 +1117,19 @@ bool storage_backend_dedup::trim_zero(const offset_t offset, const uint32_t len,
 
 		int current_size = std::min(work_size, size_t(block_size - block_offset));
 
-		if (current_size == block_size)
-			put_block_int(block_nr, b0x00);
+		n_batch_blocks++;
+
+		if (current_size == block_size) {
+			if (!update_block(&batch, block_nr, nullptr, unmapped)) {
+				dolog(ll_error, "storage_backend_dedup::trim_zero(%s): failed to update block %ld", id.c_str(), block_nr);
+				*err = EINVAL;
+				break;
+			}
+		}
 		else {
 			uint8_t *temp = nullptr;
 
-			if (!get_block_int(block_nr, &temp)) {
+			if (!get_block(block_nr, &temp)) {
 				dolog(ll_error, "storage_backend_dedup::trim_zero(%s): failed to retrieve block %ld", id.c_str(), block_nr);
 				*err = EINVAL;
 				break;
@@ -564,26 +1137,60 @@ bool storage_backend_dedup::trim_zero(const offset_t offset, const uint32_t len,
 
 			memset(&temp[block_offset], 0x00, current_size);
 
-			if (!put_block_int(block_nr, temp)) {
+			if (!update_block(&batch, block_nr, temp)) {
 				dolog(ll_error, "storage_backend_dedup::trim_zero(%s): failed to update block %ld", id.c_str(), block_nr);
 				*err = EINVAL;
-				free(temp);
+				pool_free(temp);
 				break;
 			}
 
-			free(temp);
+			pool_free(temp);
 		}
 
 		work_offset += current_size;
 		work_size -= current_size;
 	}
 
-	free(b0x00);
+	if (*err)
+		batch.failed = true;
+
+	if (batch_end(&batch) == false && *err == 0)
+		*err = EIO;
+
+	// inside the lock so that the mirrors see the writes to a region in the same order
+	bool mirrors_ok = do_mirror_trim_zero(offset, len, trim);
+
+	lg.un_lock_block_group(offset, len, block_size, false, false);
 
-	if (do_mirror_trim_zero(offset, len, trim) == false) {
+	if (mirrors_ok == false) {
 		dolog(ll_error, "storage_backend_dedup::trim_zero(%s): failed to send to mirror(s)", id.c_str());
 		return false;
 	}
 
 	return *err == 0;
 }
+
+void storage_backend_dedup::dump_stats(const std::string & base_filename)
+{
+	const uint64_t batches = n_batches;
+
+	dolog(ll_info, "storage_backend_dedup(%s): %lu transactions, %.1f blocks per transaction on average", id.c_str(), batches, batches ? double(n_batch_blocks) / batches : 0.);
+
+	if (shards.size() > 1)
+		dolog(ll_info, "storage_backend_dedup(%s): %zu shards, %lu transactions spanned more than one", id.c_str(), shards.size(), n_cross_shard_batches.load());
+
+	for(size_t i=0; i<shards.size(); i++) {
+		shard_t *s = shards.at(i);
+
+		if (s->index) {
+			std::lock_guard<std::mutex> lck(s->lock);
+
+			s->index->dump_stats(shards.size() > 1 ? myformat("%s/%zu", id.c_str(), i) : id);
+		}
+	}
+
+	if (block_cache)
+		block_cache->dump_stats(id);
+
+	storage_backend::dump_stats(base_filename);
+}
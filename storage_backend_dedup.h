@@ -1,55 +1,152 @@
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <kcpolydb.h>
+#include <map>
 #include <mutex>
 #include <optional>
 #include <stdint.h>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <yaml-cpp/yaml.h>
 
 #include "block.h"
 #include "compresser.h"
+#include "dedup_block_cache.h"
+#include "dedup_index.h"
+#include "dedup_intent_log.h"
 #include "hash.h"
 #include "lock_group.h"
 #include "storage_backend.h"
+#include "thread_pool.h"
 
 
+// the optional parts of a dedup store, the store takes ownership of the objects
+typedef struct {
+	compresser        *c           { nullptr };  // nullptr: blocks are stored uncompressed
+	dedup_index       *index       { nullptr };
+	dedup_block_cache *block_cache { nullptr };
+	int                n_threads   { 0 };        // 0: hashing and compressing in line
+	int                n_shards    { 1 };        // 1: a single database file
+} dedup_options_t;
+
 class storage_backend_dedup : public storage_backend
 {
 private:
+	// what can be calculated of a block without a lock
+	typedef struct {
+		std::string hash;                       // binary, empty for a block of only 0x00 (not stored)
+		uint8_t    *compressed     { nullptr };  // pool_malloc()ed, nullptr when not (yet) compressed
+		size_t      compressed_len { 0 };
+	} prepared_block_t;
+
+	typedef struct {
+		block_nr_t       block_nr;
+		uint8_t         *data;  // copy, pool_malloc()ed
+		prepared_block_t prepared;
+		bool             ok;
+		bool             done;  // set by the worker
+	} pipeline_entry_t;
+
+	// a part of the database with its own lock (see dedup_schema.h)
+	typedef struct {
+		std::string           file;
+		kyotocabinet::PolyDB  db;
+		std::mutex            lock;
+		dedup_index          *index;  // optional
+	} shard_t;
+
+	typedef struct {
+		int64_t     change { 0 };  // of the use count
+		std::string data;          // stored form (compressed when configured), empty when not looked up yet
+	} record_change_t;
+
+	// one put_data (or trim_zero): the changes are applied to the shards
+	// when it ends, the use counts it changes are written once
+	typedef struct {
+		bool                                             failed { false };
+		std::map<block_nr_t, std::string>                mappings;  // block -> hash, empty: unmap
+		std::unordered_map<std::string, record_change_t> records;   // hash -> change
+		std::deque<pipeline_entry_t *>                   pipeline;
+	} batch_t;
+
 	hash          *const h { nullptr };
 	compresser    *const c { nullptr };
+	dedup_index   *const index { nullptr };  // optional, with multiple shards each has its own (made from this one)
+	dedup_block_cache *const block_cache { nullptr };  // optional
 	offset_t             size { 0 };
-	std::mutex           lock;
-	kyotocabinet::PolyDB db;
+	std::vector<shard_t *> shards;
+	// changes that span more than one shard are logged before they are applied
+	dedup_intent_log    *intent_log { nullptr };  // only with multiple shards
+	// set when such a change could only be applied to some of the shards: no more writes
+	std::atomic_bool     read_only { false };
+	std::mutex           batches_lock;
+	std::map<std::thread::id, batch_t *> batches;  // put_data in progress, by thread
+	std::atomic_uint64_t n_batches { 0 };
+	std::atomic_uint64_t n_batch_blocks { 0 };
+	std::atomic_uint64_t n_cross_shard_batches { 0 };
+	// within a batch, blocks are hashed and compressed by 'tp' while the
+	// next ones come in; they are added to the batch in order
+	const int            n_threads;
+	thread_pool         *tp { nullptr };  // nullptr when n_threads is 0: all in line
+	std::mutex           pipeline_lock;
+	std::condition_variable pipeline_cond;
 	const std::string    file;
 
-	bool get_block(const block_nr_t block_nr, uint8_t **const data) override;  // with locking
-	bool get_block_int(const block_nr_t block_nr, uint8_t **const data);  // without locking
-	bool put_block(const block_nr_t block_nr, const uint8_t *const data_in) override;  // with locking
-	bool put_block_int(const block_nr_t block_nr, const uint8_t *const data_in);  // without locking
+	bool get_block(const block_nr_t block_nr, uint8_t **const data) override;
+	bool put_block(const block_nr_t block_nr, const uint8_t *const data_in) override;
+	bool put_block_int(const block_nr_t block_nr, const uint8_t *const data_in);  // in its own batch
+	bool update_block(batch_t *const batch, const block_nr_t block_nr, const uint8_t *const data_in);
+	bool update_block(batch_t *const batch, const block_nr_t block_nr, const uint8_t *const data_in, const prepared_block_t & prepared);
+
+	// no locking needed; 'compress' is for data that is probably new
+	bool prepare_block(const uint8_t *const data, prepared_block_t *const out, const bool compress);
+	bool queue_block(batch_t *const batch, const block_nr_t block_nr, const uint8_t *const data);
+	// adds the blocks that are done in the pipeline to the batch, waits for the oldest while more than 'max_pending' are in it
+	bool publish_blocks(batch_t *const batch, const size_t max_pending);
+
+	batch_t *get_batch();  // of the calling thread, nullptr when none
+	bool batch_end(batch_t *const batch);
+	// 'changes' go to the shards in 'involved' which must be locked
+	bool apply_changes(const std::vector<int> & involved, const std::vector<dedup_intent_log::change_t> & changes);
 
 	void un_lock_block_group(const offset_t offset, const uint32_t size, const bool do_lock, const bool shared);
 
-	bool put_key_value(const std::string & key, const uint8_t *const value, const int value_len);
-	bool get_key_value(const std::string & key, uint8_t *const value, const int value_len, bool *const not_found);
+	void open_shard(shard_t *const s, const int nr);
+	void replay_intent_log();
+
+	shard_t *get_shard_for_block(const block_nr_t block_nr) const;
+	shard_t *get_shard_for_hash(const std::string & hash) const;
+
+	// the lock of the shard must be locked for these, they go via its index (when configured)
+	bool get_record(shard_t *const s, const std::string & key, std::string *const value, bool *const found);
+	bool set_record(shard_t *const s, const std::string & key, const std::string & value);
+	bool remove_record(shard_t *const s, const std::string & key);
+	void abort_transaction(shard_t *const s);
 
-	std::string get_usecount_key_for_hash(const std::string & hash);
-	std::string get_hashforblocknr_key_for_blocknr(const block_nr_t block_nr);
-	std::string get_data_key_for_hash(const std::string & hash);
+	void fill_bloom_filter(shard_t *const s);
 
+	// binary
+	std::optional<std::string> calc_hash(const uint8_t *const data);
+	// empty string when the block was never written
 	std::optional<std::string> get_hash_for_block(const block_nr_t block_nr);
-	bool get_use_count(const std::string block_hash, int64_t *const new_count);
-	bool set_use_count(const std::string block_hash, const int64_t new_count);
-	bool increase_use_count(const std::string block_hash, int64_t *const new_count);
-	bool decrease_use_count(const std::string block_hash, int64_t *const new_count);
-	bool delete_block_by_hash(const std::string block_hash);
-	bool delete_block_counter_by_hash(const std::string block_hash);
-	bool map_blocknr_to_hash(const block_nr_t block_nr, const std::string & new_block_hash);
+	// for hash functions that are not collision resistant; 'stored' is the data as in a record
+	bool is_same_data(const std::string & stored, const uint8_t *const data);
+	// one more block has the data with 'prepared.hash', stores it when it is new
+	bool add_reference(batch_t *const batch, const prepared_block_t & prepared, const uint8_t *const data_in);
 
 protected:
 	bool can_do_multiple_blocks() const override;
 
+	bool transaction_start() override;
+	bool transaction_end() override;
+
+	bool zero_blocks(const block_nr_t block_nr, const block_nr_t n_blocks) override;
+
 public:
-	storage_backend_dedup(const std::string & id, const std::string & file, hash *const h, compresser *const c, const std::vector<mirror *> & mirrors, const offset_t size, const int block_size);
+	storage_backend_dedup(const std::string & id, const std::string & file, hash *const h, const dedup_options_t & options, const std::vector<mirror *> & mirrors, const offset_t size, const int block_size);
 	virtual ~storage_backend_dedup();
 
 	offset_t get_size() const override;
@@ -58,6 +155,8 @@ public:
 
 	bool trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err) override;
 
+	void dump_stats(const std::string & base_filename) override;
+
 	static storage_backend_dedup * load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, std::optional<int> block_size);
 	YAML::Node emit_configuration() const override;
 };
@@ -1,3 +1,4 @@
+#include <chrono>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
@@ -7,6 +8,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "buffer_pool.h"
 #include "error.h"
 #include "io.h"
 #include "logging.h"
@@ -16,6 +18,11 @@
 #include "yaml-helpers.h"
 
 
+#if defined(HAVE_LIBURING)
+constexpr unsigned uring_queue_depth = 256;
+#endif
+
+
 storage_backend_file::storage_backend_file(const std::string & id, const std::string & file, const offset_t size, const int block_size, const bool is_block_dev, const std::vector<mirror *> & mirrors) :
 	storage_backend(id, block_size, mirrors),
 	size(size),
@@ -45,10 +52,36 @@ storage_backend_file::storage_backend_file(const std::string & id, const std::st
 
 	if (!verify_mirror_sizes())
 		throw myformat("storage_backend_compressed_dir(%s): mirrors sanity check failed", id.c_str());
+
+#if defined(HAVE_LIBURING)
+	int rc = io_uring_queue_init(uring_queue_depth, &ring, 0);
+
+	if (rc < 0)
+		dolog(ll_warning, "storage_backend_file(%s): io_uring not available (%s), using the thread pool for asynchronous I/O", id.c_str(), strerror(-rc));
+	else {
+		ring_ok = true;
+
+		th = new std::thread(&storage_backend_file::uring_completions, this);
+	}
+#endif
 }
 
 storage_backend_file::~storage_backend_file()
 {
+#if defined(HAVE_LIBURING)
+	if (ring_ok) {
+		stop_flag = true;
+
+		// wake-up the completion thread
+		uring_submit(nullptr, [](struct io_uring_sqe *const sqe) { io_uring_prep_nop(sqe); });
+
+		th->join();
+		delete th;
+
+		io_uring_queue_exit(&ring);
+	}
+#endif
+
 	close(fd);
 }
 
@@ -145,25 +178,35 @@ bool storage_backend_file::get_multiple_blocks(const block_nr_t block_nr, const
 	return true;
 }
 
-bool storage_backend_file::get_block(const block_nr_t block_nr, uint8_t **const data)
+bool storage_backend_file::get_block_into(const block_nr_t block_nr, uint8_t *const to)
 {
 	const offset_t offset = block_nr * block_size;
 
 	if (offset + block_size > this->size) {
-		dolog(ll_error, "storage_backend_file::get_data(%s): this read would be beyond the device size (%ld > %ld)", id.c_str(), offset + block_size, this->size);
+		dolog(ll_error, "storage_backend_file::get_block_into(%s): this read would be beyond the device size (%ld > %ld)", id.c_str(), offset + block_size, this->size);
 		return false;
 	}
 
-	*data = static_cast<uint8_t *>(malloc(block_size));
+	int rc = PREAD(fd, to, block_size, offset);
+	if (rc != block_size) {
+		dolog(ll_error, "storage_backend_file::get_block_into(%s): failed to read from file at offset %ld: expected %d, got %d (%d - %s)", id.c_str(), offset, block_size, rc, errno, strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+bool storage_backend_file::get_block(const block_nr_t block_nr, uint8_t **const data)
+{
+	*data = pool_malloc(block_size);
 	if (!*data) {
 		dolog(ll_error, "storage_backend_file::get_block(%s): cannot allocated %u bytes of memory", id.c_str(), size);
 		return false;
 	}
 
-	int rc = PREAD(fd, *data, block_size, offset);
-	if (rc != block_size) {
-		free(*data);
-		dolog(ll_error, "storage_backend_file::get_block(%s): failed to read from file at offset %ld: expected %d, got %d (%d - %s)", id.c_str(), offset, block_size, rc, errno, strerror(errno));
+	if (!get_block_into(block_nr, *data)) {
+		pool_free(*data);
+		*data = nullptr;
 		return false;
 	}
 
@@ -184,6 +227,8 @@ bool storage_backend_file::put_block(const block_nr_t block_nr, const uint8_t *c
 
 bool storage_backend_file::fsync()
 {
+	stats_timer st(stats, so_fsync, 0);
+
 	if (fdatasync(fd) == -1) {
 		dolog(ll_error, "storage_backend_file::fsync(%s): failed to sync data to disk", id.c_str());
 		return false;
@@ -197,22 +242,28 @@ bool storage_backend_file::fsync()
 	return true;
 }
 
-bool storage_backend_file::trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err)
+bool storage_backend_file::zero_blocks(const block_nr_t block_nr, const block_nr_t n_blocks)
 {
-	*err = 0;
+	int err = 0;
+
+	return trim_zero_int(block_nr * block_size, n_blocks * block_size, false, &err);
+}
 
+bool storage_backend_file::trim_zero_int(const offset_t offset, const uint64_t len, const bool trim, int *const err)
+{
 #ifdef linux
 	if (fallocate(fd, (trim ? FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE) | FALLOC_FL_KEEP_SIZE, offset, len) == -1) {
 		dolog(ll_error, "storage_backend_file::trim(%s): failed to trim (%zu bytes) at offset %lu", id.c_str(), len, offset);
 		*err = errno;
+		return false;
 	}
 #else
 	uint8_t buffer[4096] { 0 };
 
-	uint32_t work_len = len;
+	uint64_t work_len = len;
 	offset_t current_offset = offset;
 	while(work_len > 0) {
-		uint32_t current_len = std::min(uint32_t(sizeof buffer), work_len);
+		uint32_t current_len = std::min(uint64_t(sizeof buffer), work_len);
 
 		ssize_t rc = PWRITE(fd, buffer, current_len, current_offset);
 
@@ -232,10 +283,199 @@ bool storage_backend_file::trim_zero(const offset_t offset, const uint32_t len,
 	}
 #endif
 
-	if (do_mirror_trim_zero(offset, len, trim) == false) {
+	return true;
+}
+
+bool storage_backend_file::trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err)
+{
+	stats_timer st(stats, so_trim, len);
+
+	*err = 0;
+
+	// a concurrent read-modify-write of a partial block must not undo this
+	lg.un_lock_block_group(offset, len, block_size, true, false);
+
+	bool ok = trim_zero_int(offset, len, trim, err);
+
+	// inside the lock so that the mirrors see the writes to a region in the same order
+	if (ok && do_mirror_trim_zero(offset, len, trim) == false) {
 		dolog(ll_error, "storage_backend_file::trim_zero(%s): failed to send to mirror(s)", id.c_str());
-		return false;
+		ok = false;
+	}
+
+	lg.un_lock_block_group(offset, len, block_size, false, false);
+
+	return ok;
+}
+
+#if defined(HAVE_LIBURING)
+bool storage_backend_file::uring_submit(uring_request_t *const r, std::function<void(struct io_uring_sqe *const sqe)> prep)
+{
+	std::unique_lock<std::mutex> lck(ring_lock);
+
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+
+	if (!sqe) {
+		// submission queue is full: hand what's queued to the kernel and try again
+		int rc = io_uring_submit(&ring);
+
+		if (rc < 0)
+			dolog(ll_warning, "storage_backend_file::uring_submit(%s): io_uring_submit failed: %s", id.c_str(), strerror(-rc));
+
+		sqe = io_uring_get_sqe(&ring);
+
+		if (!sqe)
+			return false;  // nothing was queued: 'r' is still of the caller
+	}
+
+	prep(sqe);
+
+	io_uring_sqe_set_data(sqe, r);
+
+	// the sqe is in the ring now: from here on 'r' is of uring_completions(), also when submitting fails
+	for(;;) {
+		int rc = io_uring_submit(&ring);
+
+		if (rc >= 0)
+			break;
+
+		// short of resources or the completion queue is full: uring_completions() makes room
+		if (rc == -EAGAIN || rc == -EBUSY || rc == -EINTR) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+
+		dolog(ll_error, "storage_backend_file::uring_submit(%s): io_uring_submit failed: %s", id.c_str(), strerror(-rc));
+
+		// it goes to the kernel with a later submit, as a no-op that fails the request
+		io_uring_prep_nop(sqe);
+		io_uring_sqe_set_data(sqe, r);
+
+		if (r)  // nullptr is the wake-up of uring_completions(), that is a no-op already
+			r->err = -rc;
+
+		break;
 	}
 
 	return true;
 }
+
+void storage_backend_file::uring_completions()
+{
+	dolog(ll_info, "storage_backend_file::uring_completions(%s): thread started", id.c_str());
+
+	for(;;) {
+		struct io_uring_cqe *cqe = nullptr;
+
+		int rc = io_uring_wait_cqe(&ring, &cqe);
+
+		if (rc < 0) {
+			if (rc == -EINTR)
+				continue;
+
+			dolog(ll_error, "storage_backend_file::uring_completions(%s): io_uring_wait_cqe failed: %s", id.c_str(), strerror(-rc));
+			break;
+		}
+
+		uring_request_t *r = reinterpret_cast<uring_request_t *>(io_uring_cqe_get_data(cqe));
+		int res = cqe->res;
+
+		io_uring_cqe_seen(&ring, cqe);
+
+		if (!r) {  // wake-up
+			if (stop_flag)
+				break;
+
+			continue;
+		}
+
+		int err = r->err;  // when set, submitting failed and 'res' is of a no-op
+
+		if (err == 0 && res < 0)
+			err = -res;
+		else if (err == 0 && size_t(res) != r->expected)
+			err = EIO;
+
+		if (err)
+			dolog(ll_error, "storage_backend_file::uring_completions(%s): request failed: %s", id.c_str(), strerror(err));
+
+		r->done(err);
+
+		delete r;
+	}
+
+	dolog(ll_debug, "storage_backend_file::uring_completions(%s): thread terminating", id.c_str());
+}
+
+void storage_backend_file::submit_get_data(const offset_t offset, const struct iovec *const iov, const int iov_n, async_done_t done)
+{
+	// reads are only balanced over the mirrors by the synchronous path
+	if (!ring_ok || !mirrors.empty())
+		return storage_backend::submit_get_data(offset, iov, iov_n, done);
+
+	uring_request_t *r = new uring_request_t();
+	r->iov.assign(iov, iov + iov_n);
+	r->expected = 0;
+
+	for(auto & v : r->iov)
+		r->expected += v.iov_len;
+
+	if (offset + r->expected > size) {
+		dolog(ll_error, "storage_backend_file::submit_get_data(%s): this read would be beyond the device size (%ld > %ld)", id.c_str(), offset + r->expected, size);
+		delete r;
+		done(EINVAL);
+		return;
+	}
+
+	lg.un_lock_block_group(offset, r->expected, block_size, true, true);
+
+	r->done     = unlock_wrap(offset, r->expected, true, stats_wrap(so_get, r->expected, done));
+
+	if (uring_submit(r, [r, offset, this](struct io_uring_sqe *const sqe) { io_uring_prep_readv(sqe, fd, r->iov.data(), r->iov.size(), offset); }) == false) {
+		lg.un_lock_block_group(offset, r->expected, block_size, false, true);
+		delete r;
+		storage_backend::submit_get_data(offset, iov, iov_n, done);
+	}
+}
+
+void storage_backend_file::submit_put_data(const offset_t offset, const block & b, async_done_t done)
+{
+	// the mirrors are only fed by the synchronous path
+	if (!ring_ok || !mirrors.empty())
+		return storage_backend::submit_put_data(offset, b, done);
+
+	if (offset + b.get_size() > size) {
+		dolog(ll_error, "storage_backend_file::submit_put_data(%s): this write would be beyond the device size (%ld > %ld)", id.c_str(), offset + b.get_size(), size);
+		done(EINVAL);
+		return;
+	}
+
+	lg.un_lock_block_group(offset, b.get_size(), block_size, true, false);
+
+	uring_request_t *r = new uring_request_t();
+	r->data     = b;
+	r->done     = unlock_wrap(offset, b.get_size(), false, stats_wrap(so_put, b.get_size(), done));
+	r->expected = b.get_size();
+
+	if (uring_submit(r, [r, offset, this](struct io_uring_sqe *const sqe) { io_uring_prep_write(sqe, fd, r->data.get_data(), r->expected, offset); }) == false) {
+		lg.un_lock_block_group(offset, b.get_size(), block_size, false, false);
+		delete r;
+		storage_backend::submit_put_data(offset, b, done);
+	}
+}
+
+void storage_backend_file::submit_fsync(async_done_t done)
+{
+	if (!ring_ok || !mirrors.empty())
+		return storage_backend::submit_fsync(done);
+
+	uring_request_t *r = new uring_request_t();
+	r->done     = stats_wrap(so_fsync, 0, done);
+	r->expected = 0;
+
+	if (uring_submit(r, [this](struct io_uring_sqe *const sqe) { io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC); }) == false) {
+		delete r;
+		storage_backend::submit_fsync(done);
+	}
+}
+#endif
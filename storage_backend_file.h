@@ -1,6 +1,11 @@
 #include <stdint.h>
 #include <string>
 #include <yaml-cpp/yaml.h>
+#if defined(HAVE_LIBURING)
+#include <liburing.h>
+#include <mutex>
+#include <thread>
+#endif
 
 #include "block.h"
 #include "storage_backend.h"
@@ -14,9 +19,33 @@ private:
 	offset_t          size { 0 };
 	const std::string file;
 
+	// fallocate (or writing 0x00), no locking, no mirrors
+	bool trim_zero_int(const offset_t offset, const uint64_t len, const bool trim, int *const err);
+
+#if defined(HAVE_LIBURING)
+	typedef struct {
+		size_t                    expected;  // number of bytes
+		std::vector<struct iovec> iov;
+		block                     data { nullptr, 0, false };  // kept alive until written
+		async_done_t              done;
+		int                       err { 0 };  // set when it could not be submitted
+	} uring_request_t;
+
+	struct io_uring   ring;
+	bool              ring_ok { false };
+	std::mutex        ring_lock;  // submission side
+	std::thread      *th { nullptr };  // completion side
+
+	// false: nothing was queued, the caller keeps 'r'
+	bool uring_submit(uring_request_t *const r, std::function<void(struct io_uring_sqe *const sqe)> prep);
+	void uring_completions();
+#endif
+
 protected:
 	bool get_block(const block_nr_t block_nr, uint8_t **const data) override;
+	bool get_block_into(const block_nr_t block_nr, uint8_t *const to) override;
 	bool put_block(const block_nr_t block_nr, const uint8_t *const data) override;
+	bool zero_blocks(const block_nr_t block_nr, const block_nr_t n_blocks) override;
 
 	bool can_do_multiple_blocks() const override;
 	bool get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *const to) override;
@@ -31,6 +60,12 @@ public:
 
 	bool trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err) override;
 
+#if defined(HAVE_LIBURING)
+	void submit_get_data(const offset_t offset, const struct iovec *const iov, const int iov_n, async_done_t done) override;
+	void submit_put_data(const offset_t offset, const block & b, async_done_t done) override;
+	void submit_fsync(async_done_t done) override;
+#endif
+
 	static storage_backend_file * load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, std::optional<int> block_size);
 	YAML::Node emit_configuration() const override;
 };
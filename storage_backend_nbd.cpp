@@ -1,12 +1,17 @@
+#include <chrono>
 #include <errno.h>
 #include <fcntl.h>
+#include <future>
+#include <memory>
 #include <string>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <vector>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 
+#include "buffer_pool.h"
 #include "error.h"
 #include "io.h"
 #include "logging.h"
@@ -28,11 +33,28 @@ storage_backend_nbd::storage_backend_nbd(const std::string & id, socket_client *
 	if (!verify_mirror_sizes())
 		throw myformat("storage_backend_nbd(%s): mirrors sanity check failed", id.c_str());
 
-	reconnect();
+	fd = reconnect();  // when that failed, the receiver thread retries
+
+	th = new std::thread(std::ref(*this));
 }
 
 storage_backend_nbd::~storage_backend_nbd()
 {
+	stop_flag = true;
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		if (fd != -1)
+			shutdown(fd, SHUT_RDWR);
+	}
+
+	if (th) {
+		th->join();
+		delete th;
+	}
+
+	drop_connection();
 }
 
 storage_backend_nbd * storage_backend_nbd::load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, std::optional<int> block_size)
@@ -110,45 +132,54 @@ typedef struct __attribute__((packed)) {
 	uint8_t  data[0];
 } server_command_reply_t;
 
-bool storage_backend_nbd::reconnect()
+int storage_backend_nbd::reconnect()
 {
 	enum sbn_state_t { SBN_connect, SBN_init, SBN_options, SBN_options_recv, SBN_go };
 	constexpr const char *const sbn_state_str[] = { "connect", "init", "options", "options_recv", "go" };
 
 	sbn_state_t state = SBN_connect;
 
+	int new_fd = -1;
+
+	auto failed = [&new_fd] {
+		if (new_fd != -1)
+			close(new_fd);
+
+		return -1;
+	};
+
 	for(;!stop_flag;) {
 		dolog(ll_info, "storage_backend_nbd::reconnect(%s): state: \"%s\"", export_name.c_str(), sbn_state_str[state]);
 
 		if (state == SBN_connect) {
-			fd = sc->connect();
+			new_fd = sc->connect();
 
-			if (fd != -1)
+			if (new_fd != -1)
 				state = SBN_init;
 		}
 		else if (state == SBN_init) {
 			handshake_server_t hs { 0 };
 
-			if (READ(fd, reinterpret_cast<uint8_t *>(&hs), sizeof(hs)) != sizeof(hs)) {
+			if (READ(new_fd, reinterpret_cast<uint8_t *>(&hs), sizeof(hs)) != sizeof(hs)) {
 				dolog(ll_info, "storage_backend_nbd::reconnect(%s): negotiation failed while receiving server message: %s", export_name.c_str(), strerror(errno));
-				return false;
+				return failed();
 			}
 
 			if (memcmp(hs.magic_name, "NBDMAGIC", 8) != 0) {
 				dolog(ll_info, "storage_backend_nbd::reconnect(%s): server send invalid handshake", export_name.c_str());
-				return false;
+				return failed();
 			}
 
 			if (memcmp(hs.magic_opt, "IHAVEOPT", 8) != 0) {
 				dolog(ll_info, "storage_backend_nbd::reconnect(%s): server send invalid magic name", export_name.c_str());
-				return false;
+				return failed();
 			}
 
 			uint32_t client_flags = htonl(NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES);
 
-			if (WRITE(fd, reinterpret_cast<uint8_t *>(&client_flags), sizeof(client_flags)) != sizeof(client_flags)) {
+			if (WRITE(new_fd, reinterpret_cast<uint8_t *>(&client_flags), sizeof(client_flags)) != sizeof(client_flags)) {
 				dolog(ll_info, "storage_backend_nbd::reconnect(%s): negotiation failed while transmitting client flags: %s", export_name.c_str(), strerror(errno));
-				return false;
+				return failed();
 			}
 
 			state = SBN_options;
@@ -158,7 +189,7 @@ bool storage_backend_nbd::reconnect()
 			client_option_t *co = reinterpret_cast<client_option_t *>(calloc(1, command_size));
 			if (!co) {
 				dolog(ll_info, "storage_backend_nbd::reconnect(%s): failed allocating NBD_OPT_EXPORT_NAME request: %s", export_name.c_str(), strerror(errno));
-				return false;
+				return failed();
 			}
 
 			memcpy(co->magic_opt, "IHAVEOPT", 8);
@@ -166,9 +197,9 @@ bool storage_backend_nbd::reconnect()
 			co->data_len = htonl(export_name.size());
 			memcpy(co->data, export_name.c_str(), export_name.size());
 
-			if (WRITE(fd, reinterpret_cast<uint8_t *>(co), command_size) != ssize_t(command_size)) {
+			if (WRITE(new_fd, reinterpret_cast<uint8_t *>(co), command_size) != ssize_t(command_size)) {
 				dolog(ll_info, "storage_backend_nbd::reconnect(%s): negotiation failed while transmitting option request: %s", export_name.c_str(), strerror(errno));
-				return false;
+				return failed();
 			}
 
 			free(co);
@@ -176,104 +207,262 @@ bool storage_backend_nbd::reconnect()
 			state = SBN_options_recv;
 		}
 		else if (state == SBN_options_recv) {
-			auto size = receive_uint64(fd);
+			auto size = receive_uint64(new_fd);
 			if (size.has_value() == false) {
 				dolog(ll_info, "storage_backend_nbd::reconnect(%s): \"size\" receiving error", export_name.c_str(), strerror(errno));
-				return false;
+				return failed();
 			}
 
-			auto flags = receive_uint16(fd);
+			auto flags = receive_uint16(new_fd);
 			if (flags.has_value() == false) {
 				dolog(ll_info, "storage_backend_nbd::reconnect(%s): \"flags\" receiving error", export_name.c_str(), strerror(errno));
-				return false;
+				return failed();
 			}
 
 			this->size = size.value();
+			transmission_flags = flags.value();
 			dolog(ll_info, "storage_backend_nbd::reconnect(%s): size is %ld bytes", export_name.c_str(), this->size);
 
 			state = SBN_go;
 		}
 		else if (state == SBN_go) {
 			dolog(ll_info, "storage_backend_nbd::reconnect(%s): connection set-up", export_name.c_str(), strerror(errno));
-			return true;
+			return new_fd;
 		}
 		else {
 			dolog(ll_info, "storage_backend_nbd::reconnect(%s): unknown internal state %d", export_name.c_str(), state, strerror(errno));
-			return false;
+			return failed();
 		}
 	}
 
-	return false;
+	return failed();
 }
 
-bool storage_backend_nbd::can_do_multiple_blocks() const
+void storage_backend_nbd::drop_connection()
 {
+	if (fd != -1) {
+		close(fd);
+		fd = -1;
+	}
+}
+
+bool storage_backend_nbd::send_request(const uint64_t handle, const nbd_request_t *const r)
+{
+	client_command_t cc { 0 };
+	cc.magic  = htonl(0x25609513);
+	cc.type   = htons(r->type);
+	cc.handle = handle;  // htonl not required(!)
+	cc.offset = HTONLL(r->offset);
+	cc.length = htonl(r->length);
+
+	if (WRITE(fd, reinterpret_cast<const uint8_t *>(&cc), sizeof cc) != sizeof(cc)) {
+		dolog(ll_info, "storage_backend_nbd::send_request(%s): problem transmitting NBD_CMD_%s", export_name.c_str(), nbd_cmd_names[r->type]);
+		return false;
+	}
+
+	if (r->type == NBD_CMD_WRITE && WRITE(fd, r->data.get_data(), r->length) != ssize_t(r->length)) {
+		dolog(ll_info, "storage_backend_nbd::send_request(%s): problem transmitting NBD_CMD_WRITE data", export_name.c_str());
+		return false;
+	}
+
 	return true;
 }
 
-bool storage_backend_nbd::get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *to)
+void storage_backend_nbd::submit(nbd_request_t *const r)
 {
-	seq_nr++;
+	std::unique_lock<std::mutex> lck(lock);
 
-	dolog(ll_debug, "storage_backend_nbd::get_multiple_block(%s): requesting %ld blocks starting at %ld, handle: %x", export_name.c_str(), blocks_to_do, block_nr, seq_nr);
+	if (stop_flag) {
+		lck.unlock();
 
-	bool do_reconnect = false;
+		r->done(ESHUTDOWN);
 
-	for(;!stop_flag;) {
-		if (do_reconnect) {
-			do_reconnect = false;
-			reconnect();
+		delete r;
+
+		return;
+	}
+
+	uint64_t handle = ++seq_nr;
+
+	dolog(ll_debug, "storage_backend_nbd::submit(%s): NBD_CMD_%s for %u bytes at offset %ld, handle: %lx", export_name.c_str(), nbd_cmd_names[r->type], r->length, r->offset, handle);
+
+	in_flight.insert({ handle, r });
+
+	// when not connected, the receiver thread sends it after reconnecting
+	if (fd != -1 && send_request(handle, r) == false)
+		shutdown(fd, SHUT_RDWR);  // makes the receiver thread reconnect
+}
+
+int storage_backend_nbd::execute(nbd_request_t *const r)
+{
+	auto result = std::make_shared<std::promise<int> >();
+	auto f      = result->get_future();
+
+	r->done = [result](const int err) { result->set_value(err); };
+
+	submit(r);
+
+	return f.get();
+}
+
+void storage_backend_nbd::operator()()
+{
+	dolog(ll_info, "storage_backend_nbd::operator(%s): thread started", export_name.c_str());
+
+	while(!stop_flag) {
+		int cur_fd = -1;
+
+		{
+			std::unique_lock<std::mutex> lck(lock);
+
+			cur_fd = fd;
 		}
 
-		client_command_t cc { 0 };
-		cc.magic  = htonl(0x25609513);
-		cc.type   = htons(NBD_CMD_READ);
-		cc.handle = seq_nr;  // htonl not required(!)
-		cc.offset = HTONLL(block_nr * block_size);
-		size_t size_to_get = block_size * blocks_to_do;
-		cc.length = htonl(size_to_get);
-
-		if (WRITE(fd, reinterpret_cast<const uint8_t *>(&cc), sizeof cc) != sizeof(cc)) {
-			dolog(ll_info, "storage_backend_nbd::get_block(%s): problem transmitting NBD_CMD_READ", export_name.c_str());
-			do_reconnect = true;
-			continue;
+		if (cur_fd == -1) {
+			// without the lock: submit() queues requests in in_flight meanwhile
+			int new_fd = reconnect();
+
+			if (new_fd == -1) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lck(lock);
+
+			// the destructor did not see it to shut it down
+			if (stop_flag) {
+				close(new_fd);
+				break;
+			}
+
+			fd = new_fd;
+
+			// everything that got no reply over the previous connection
+			for(auto & r : in_flight) {
+				if (send_request(r.first, r.second) == false) {
+					shutdown(fd, SHUT_RDWR);
+					break;
+				}
+			}
+
+			cur_fd = fd;
 		}
 
 		server_command_reply_t scr { 0 };
 
-		if (READ(fd, reinterpret_cast<uint8_t *>(&scr), sizeof(scr)) != sizeof(scr)) {
-			dolog(ll_info, "storage_backend_nbd::get_block(%s): problem receiving NBD_CMD_READ reply", export_name.c_str());
-			do_reconnect = true;
+		if (READ(cur_fd, reinterpret_cast<uint8_t *>(&scr), sizeof(scr)) != sizeof(scr)) {
+			if (!stop_flag)
+				dolog(ll_info, "storage_backend_nbd::operator(%s): problem receiving reply, reconnecting", export_name.c_str());
+
+			std::unique_lock<std::mutex> lck(lock);
+			drop_connection();
+
 			continue;
 		}
 
 		if (ntohl(scr.magic) != 0x67446698) {
-			dolog(ll_info, "storage_backend_nbd::get_block(%s): magic (%lx) mismatch", export_name.c_str(), scr.magic);
-			do_reconnect = true;
-			continue;
-		}
+			dolog(ll_info, "storage_backend_nbd::operator(%s): magic (%x) mismatch", export_name.c_str(), ntohl(scr.magic));
+
+			std::unique_lock<std::mutex> lck(lock);
+			drop_connection();
 
-		if (scr.handle != cc.handle) {
-			dolog(ll_info, "storage_backend_nbd::get_block(%s): handle (%lx) mismatch (expected %lx)", export_name.c_str(), scr.handle, cc.handle);
-			do_reconnect = true;
 			continue;
 		}
 
-		if (scr.error != 0) {
-			dolog(ll_info, "storage_backend_nbd::get_block(%s): NBD server indicated error %d", export_name.c_str(), ntohl(scr.error));
-			return false;
+		const uint64_t handle = scr.handle;
+
+		nbd_request_t *r = nullptr;
+
+		{
+			std::unique_lock<std::mutex> lck(lock);
+
+			auto it = in_flight.find(handle);
+
+			if (it == in_flight.end()) {
+				dolog(ll_info, "storage_backend_nbd::operator(%s): reply for unknown handle %lx", export_name.c_str(), handle);
+				drop_connection();
+
+				continue;
+			}
+
+			r = it->second;
+
+			in_flight.erase(it);
 		}
 
-		if (READ(fd, to, size_to_get) != ssize_t(size_to_get)) {
-			dolog(ll_info, "storage_backend_nbd::get_block(%s): problem receiving NBD_CMD_READ data", export_name.c_str());
-			do_reconnect = true;
-			continue;
+		int err = ntohl(scr.error);
+
+		if (err)
+			dolog(ll_info, "storage_backend_nbd::operator(%s): NBD server indicated error %d for NBD_CMD_%s", export_name.c_str(), err, nbd_cmd_names[r->type]);
+		else if (r->type == NBD_CMD_READ) {
+			bool ok = true;
+
+			for(auto & v : r->iov) {
+				if (READ(cur_fd, reinterpret_cast<uint8_t *>(v.iov_base), v.iov_len) != ssize_t(v.iov_len)) {
+					ok = false;
+					break;
+				}
+			}
+
+			if (!ok) {
+				dolog(ll_info, "storage_backend_nbd::operator(%s): problem receiving NBD_CMD_READ data", export_name.c_str());
+
+				// retry it over a new connection
+				std::unique_lock<std::mutex> lck(lock);
+				in_flight.insert({ handle, r });
+				drop_connection();
+
+				continue;
+			}
 		}
 
-		return true;
+		r->done(err);
+
+		delete r;
 	}
 
-	return false;
+	std::vector<nbd_request_t *> left;
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		for(auto & r : in_flight)
+			left.push_back(r.second);
+
+		in_flight.clear();
+	}
+
+	for(auto r : left) {
+		r->done(ESHUTDOWN);
+
+		delete r;
+	}
+
+	dolog(ll_debug, "storage_backend_nbd::operator(%s): thread terminating", export_name.c_str());
+}
+
+bool storage_backend_nbd::can_do_multiple_blocks() const
+{
+	return true;
+}
+
+bool storage_backend_nbd::get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *to)
+{
+	nbd_request_t *r = new nbd_request_t();
+	r->type   = NBD_CMD_READ;
+	r->offset = block_nr * block_size;
+	r->length = block_size * blocks_to_do;
+	r->iov.push_back({ to, r->length });
+
+	int err = execute(r);
+
+	if (err) {
+		dolog(ll_info, "storage_backend_nbd::get_multiple_blocks(%s): failed to retrieve %ld blocks starting at %ld: %s", export_name.c_str(), blocks_to_do, block_nr, strerror(err));
+		return false;
+	}
+
+	return true;
 }
 
 offset_t storage_backend_nbd::get_size() const
@@ -281,13 +470,27 @@ offset_t storage_backend_nbd::get_size() const
 	return size;
 }
 
+bool storage_backend_nbd::get_block_into(const block_nr_t block_nr, uint8_t *const to)
+{
+	if (get_multiple_blocks(block_nr, 1, to) == false) {
+		dolog(ll_info, "storage_backend_nbd::get_block_into(%s): failed for block %ld", export_name.c_str(), block_nr);
+		return false;
+	}
+
+	return true;
+}
+
 bool storage_backend_nbd::get_block(const block_nr_t block_nr, uint8_t **const data)
 {
-	*data = reinterpret_cast<uint8_t *>(malloc(block_size));
+	*data = pool_malloc(block_size);
+	if (!*data) {
+		dolog(ll_error, "storage_backend_nbd::get_block(%s): cannot allocate %d bytes of memory", export_name.c_str(), block_size);
+		return false;
+	}
 
-	if (get_multiple_blocks(block_nr, 1, *data) == false) {
-		free(*data);
-		dolog(ll_info, "storage_backend_nbd::get_block(%s): failed for block %ld", export_name.c_str(), block_nr);
+	if (get_block_into(block_nr, *data) == false) {
+		pool_free(*data);
+		*data = nullptr;
 		return false;
 	}
 
@@ -296,177 +499,192 @@ bool storage_backend_nbd::get_block(const block_nr_t block_nr, uint8_t **const d
 
 bool storage_backend_nbd::put_block(const block_nr_t block_nr, const uint8_t *const data)
 {
-	seq_nr++;
+	nbd_request_t *r = new nbd_request_t();
+	r->type   = NBD_CMD_WRITE;
+	r->offset = block_nr * block_size;
+	r->length = block_size;
+	r->data   = block(data, block_size, false);  // not copied: execute() waits for the reply
 
-	dolog(ll_debug, "storage_backend_nbd::put_block(%s): writing block %ld, handle: %x", export_name.c_str(), block_nr, seq_nr);
+	int err = execute(r);
 
-	bool do_reconnect = false;
+	if (err) {
+		dolog(ll_info, "storage_backend_nbd::put_block(%s): failed to write block %ld: %s", export_name.c_str(), block_nr, strerror(err));
+		return false;
+	}
 
-	for(;!stop_flag;) {
-		if (do_reconnect) {
-			do_reconnect = false;
-			reconnect();
-		}
+	return true;
+}
 
-		size_t command_size = sizeof(client_command_t) + block_size;
-		client_command_t *cc = reinterpret_cast<client_command_t *>(calloc(1, command_size));
-		if (!cc) {
-			dolog(ll_info, "storage_backend_nbd::put_block(%s): problem allocating %zu bytes of memory", export_name.c_str(), command_size);
-			return false;
-		}
+bool storage_backend_nbd::zero_blocks(const block_nr_t block_nr, const block_nr_t n_blocks)
+{
+	if ((transmission_flags & NBD_FLAG_SEND_WRITE_ZEROES) == 0)
+		return storage_backend::zero_blocks(block_nr, n_blocks);
 
-		cc->magic  = htonl(0x25609513);
-		cc->type   = htons(NBD_CMD_WRITE);
-		cc->handle = seq_nr;  // htonl not required(!)
-		cc->offset = HTONLL(block_nr * block_size);
-		cc->length = htonl(block_size);
-		memcpy(cc->data, data, block_size);
-
-		if (WRITE(fd, reinterpret_cast<const uint8_t *>(cc), command_size) != ssize_t(command_size)) {
-			free(cc);
-			dolog(ll_info, "storage_backend_nbd::put_block(%s): problem transmitting NBD_CMD_WRITE", export_name.c_str());
-			do_reconnect = true;
-			continue;
-		}
+	nbd_request_t *r = new nbd_request_t();
+	r->type   = NBD_CMD_WRITE_ZEROES;
+	r->offset = block_nr * block_size;
+	r->length = n_blocks * block_size;
 
-		server_command_reply_t scr { 0 };
+	int err = execute(r);
 
-		if (READ(fd, reinterpret_cast<uint8_t *>(&scr), sizeof scr) != sizeof(scr)) {
-			dolog(ll_info, "storage_backend_nbd::put_block(%s): problem receiving NBD_CMD_WRITE reply", export_name.c_str());
-			free(cc);
-			do_reconnect = true;
-			continue;
-		}
+	if (err) {
+		dolog(ll_info, "storage_backend_nbd::zero_blocks(%s): failed to zero %ld blocks at block %ld: %s", export_name.c_str(), n_blocks, block_nr, strerror(err));
+		return false;
+	}
 
-		if (scr.handle != cc->handle) {
-			dolog(ll_info, "storage_backend_nbd::put_block(%s): handle (%lx) mismatch (expected %lx)", export_name.c_str(), scr.handle, cc->handle);
-			free(cc);
-			do_reconnect = true;
-			continue;
-		}
+	return true;
+}
 
-		free(cc);
+bool storage_backend_nbd::fsync()
+{
+	stats_timer st(stats, so_fsync, 0);
 
-		if (scr.error != 0) {
-			dolog(ll_info, "storage_backend_nbd::put_block(%s): NBD server indicated error %d", export_name.c_str(), ntohl(scr.error));
-			return false;
-		}
+	nbd_request_t *r = new nbd_request_t();
+	r->type = NBD_CMD_FLUSH;
+
+	int err = execute(r);
 
-		return true;
+	if (err) {
+		dolog(ll_info, "storage_backend_nbd::fsync(%s): NBD_CMD_FLUSH failed: %s", export_name.c_str(), strerror(err));
+		return false;
 	}
 
-	return false;
+	if (do_sync_mirrors() == false) {
+		dolog(ll_error, "storage_backend_nbd::fsync(%s): failed to sync data to mirror(s)", id.c_str());
+		return false;
+	}
+
+	return true;
 }
 
-bool storage_backend_nbd::fsync()
+bool storage_backend_nbd::trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err)
 {
-	seq_nr++;
+	stats_timer st(stats, so_trim, len);
 
-	dolog(ll_debug, "storage_backend_nbd::put_block(%s): fsyn, handle: %x", export_name.c_str(), seq_nr);
-	bool do_reconnect = false;
-	
-	for(;!stop_flag;) {
-		if (do_reconnect) {
-			do_reconnect = false;
-			reconnect();
+	// server cannot zero: send the zeros (put_data would turn them into a trim_zero again)
+	if (!trim && (transmission_flags & NBD_FLAG_SEND_WRITE_ZEROES) == 0) {
+		uint8_t *data0x00 = pool_calloc(len);
+		if (!data0x00) {
+			*err = ENOMEM;
+			return false;
 		}
 
-		client_command_t cc { 0 };
-		cc.magic  = htonl(0x25609513);
-		cc.type   = htons(NBD_CMD_FLUSH);
-		cc.handle = seq_nr;  // htonl not required(!)
-		cc.offset = 0;
-		cc.length = 0;
+		put_data_int(offset, block(data0x00, len), err);
 
-		if (WRITE(fd, reinterpret_cast<uint8_t *>(&cc), sizeof(cc)) != sizeof(cc)) {
-			dolog(ll_info, "storage_backend_nbd::fsync(%s): problem transmitting NBD_CMD_FLUSH", export_name.c_str());
-			do_reconnect = true;
-			continue;
-		}
+		return *err == 0;
+	}
 
-		server_command_reply_t scr { 0 };
+	nbd_request_t *r = new nbd_request_t();
+	r->type   = trim ? NBD_CMD_TRIM : NBD_CMD_WRITE_ZEROES;
+	r->offset = offset;
+	r->length = len;
 
-		if (READ(fd, reinterpret_cast<uint8_t *>(&scr), sizeof scr) != sizeof(scr)) {
-			dolog(ll_info, "storage_backend_nbd::fsync(%s): problem receiving NBD_CMD_FLUSH reply", export_name.c_str());
-			do_reconnect = true;
-			continue;
-		}
+	// the mirrors are written to in the same order as the server
+	lg.un_lock_block_group(offset, len, block_size, true, false);
 
-		if (scr.handle != cc.handle) {
-			dolog(ll_info, "storage_backend_nbd::fsync(%s): handle (%x) mismatch (expected %x)", export_name.c_str(), scr.handle, cc.handle);
-			do_reconnect = true;
-			continue;
-		}
+	*err = execute(r);
 
-		if (scr.error != 0) {
-			dolog(ll_info, "storage_backend_nbd::fsync(%s): NBD server indicated error %d", export_name.c_str(), ntohl(scr.error));
-			return false;
-		}
+	if (*err) {
+		lg.un_lock_block_group(offset, len, block_size, false, false);
 
-		return true;
+		dolog(ll_info, "storage_backend_nbd::trim_zero(%s): failed to %s %u bytes at offset %ld: %s", export_name.c_str(), trim ? "trim" : "zero", len, offset, strerror(*err));
+		return false;
 	}
 
-        if (do_sync_mirrors() == false) {
-                dolog(ll_error, "storage_backend_nbd::fsync(%s): failed to sync data to mirror(s)", id.c_str());
-                return false;
-        }
+	bool mirrors_ok = do_mirror_trim_zero(offset, len, trim);
+
+	lg.un_lock_block_group(offset, len, block_size, false, false);
+
+	if (mirrors_ok == false) {
+		dolog(ll_error, "storage_backend_nbd::trim_zero(%s): failed to send to mirror(s)", id.c_str());
+		return false;
+	}
 
-	return false;
+	return true;
 }
 
-bool storage_backend_nbd::trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err)
+void storage_backend_nbd::submit_get_data(const offset_t offset, const struct iovec *const iov, const int iov_n, async_done_t done)
 {
-	seq_nr++;
-
-	dolog(ll_debug, "storage_backend_nbd::put_block(%s): %s offset %ld, len %d, handle: %x", export_name.c_str(), trim ? "trim" : "zero", offset, len, seq_nr);
+	// reads are only balanced over the mirrors by the synchronous path
+	if (!mirrors.empty())
+		return storage_backend::submit_get_data(offset, iov, iov_n, done);
+
+	nbd_request_t *r = new nbd_request_t();
+	r->type   = NBD_CMD_READ;
+	r->offset = offset;
+	r->iov.assign(iov, iov + iov_n);
+
+	for(auto & v : r->iov)
+		r->length += v.iov_len;
+
+	if (offset + r->length > get_size()) {
+		dolog(ll_error, "storage_backend_nbd::submit_get_data(%s): this read would be beyond the device size (%ld > %ld)", id.c_str(), offset + r->length, get_size());
+		delete r;
+		done(EINVAL);
+		return;
+	}
 
-	bool do_reconnect = false;
+	lg.un_lock_block_group(offset, r->length, block_size, true, true);
 
-	for(;!stop_flag;) {
-		if (do_reconnect) {
-			do_reconnect = false;
-			reconnect();
-		}
+	r->done   = unlock_wrap(offset, r->length, true, stats_wrap(so_get, r->length, done));
 
-		client_command_t cc { 0 };
-		cc.magic  = htonl(0x25609513);
-		cc.type   = htons(trim ? NBD_CMD_TRIM : NBD_CMD_WRITE_ZEROES);
-		cc.handle = seq_nr;  // htonl not required(!)
-		cc.offset = 0;
-		cc.length = 0;
+	submit(r);
+}
 
-		if (WRITE(fd, reinterpret_cast<uint8_t *>(&cc), sizeof(cc)) != sizeof(cc)) {
-			dolog(ll_info, "storage_backend_nbd::trim_zero(%s): problem transmitting NBD_CMD_FLUSH", export_name.c_str());
-			do_reconnect = true;
-			continue;
-		}
+void storage_backend_nbd::submit_put_data(const offset_t offset, const block & b, async_done_t done)
+{
+	// the mirrors are only fed by the synchronous path
+	if (!mirrors.empty())
+		return storage_backend::submit_put_data(offset, b, done);
+
+	if (offset + b.get_size() > get_size()) {
+		dolog(ll_error, "storage_backend_nbd::submit_put_data(%s): this write would be beyond the device size (%ld > %ld)", id.c_str(), offset + b.get_size(), get_size());
+		done(EINVAL);
+		return;
+	}
 
-		server_command_reply_t scr { 0 };
+	lg.un_lock_block_group(offset, b.get_size(), block_size, true, false);
 
-		if (READ(fd, reinterpret_cast<uint8_t *>(&scr), sizeof scr) != sizeof(scr)) {
-			dolog(ll_info, "storage_backend_nbd::trim_zero(%s): problem receiving NBD_CMD_FLUSH reply", export_name.c_str());
-			do_reconnect = true;
-			continue;
-		}
+	nbd_request_t *r = new nbd_request_t();
+	r->type   = NBD_CMD_WRITE;
+	r->offset = offset;
+	r->length = b.get_size();
+	r->data   = b;
+	r->done   = unlock_wrap(offset, b.get_size(), false, stats_wrap(so_put, b.get_size(), done));
 
-		if (scr.handle != cc.handle) {
-			dolog(ll_info, "storage_backend_nbd::trim_zero(%s): handle (%x) mismatch (expected %x)", export_name.c_str(), scr.handle, cc.handle);
-			do_reconnect = true;
-			continue;
-		}
+	submit(r);
+}
 
-		if (scr.error != 0) {
-			dolog(ll_info, "storage_backend_nbd::trim_zero(%s): NBD server indicated error %d", export_name.c_str(), ntohl(scr.error));
-			return false;
-		}
+void storage_backend_nbd::submit_trim_zero(const offset_t offset, const uint32_t len, const bool trim, async_done_t done)
+{
+	if (!mirrors.empty() || (!trim && (transmission_flags & NBD_FLAG_SEND_WRITE_ZEROES) == 0))
+		return storage_backend::submit_trim_zero(offset, len, trim, done);
 
-		return true;
+	if (offset + len > get_size()) {
+		dolog(ll_error, "storage_backend_nbd::submit_trim_zero(%s): this request would be beyond the device size (%ld > %ld)", id.c_str(), offset + len, get_size());
+		done(EINVAL);
+		return;
 	}
 
-	if (do_mirror_trim_zero(offset, len, trim) == false) {
-		dolog(ll_error, "storage_backend_dedup::trim_zero(%s): failed to send to mirror(s)", id.c_str());
-		return false;
-	}
+	lg.un_lock_block_group(offset, len, block_size, true, false);
+
+	nbd_request_t *r = new nbd_request_t();
+	r->type   = trim ? NBD_CMD_TRIM : NBD_CMD_WRITE_ZEROES;
+	r->offset = offset;
+	r->length = len;
+	r->done   = unlock_wrap(offset, len, false, stats_wrap(so_trim, len, done));
+
+	submit(r);
+}
+
+void storage_backend_nbd::submit_fsync(async_done_t done)
+{
+	if (!mirrors.empty())
+		return storage_backend::submit_fsync(done);
+
+	nbd_request_t *r = new nbd_request_t();
+	r->type = NBD_CMD_FLUSH;
+	r->done = stats_wrap(so_fsync, 0, done);
 
-	return false;
+	submit(r);
 }
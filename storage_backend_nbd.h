@@ -1,5 +1,9 @@
+#include <map>
+#include <mutex>
 #include <stdint.h>
 #include <string>
+#include <thread>
+#include <vector>
 #include <yaml-cpp/yaml.h>
 
 #include "block.h"
@@ -10,19 +14,40 @@
 class storage_backend_nbd : public storage_backend
 {
 private:
+	typedef struct {
+		uint16_t                  type { 0 };  // NBD_CMD_...
+		offset_t                  offset { 0 };
+		uint32_t                  length { 0 };
+		std::vector<struct iovec> iov;  // NBD_CMD_READ: where the reply goes
+		block                     data { nullptr, 0, false };  // NBD_CMD_WRITE
+		async_done_t              done;
+	} nbd_request_t;
+
 	int                  fd { -1 };
 	offset_t             size { 0 };
+	uint16_t             transmission_flags { 0 };
 	socket_client *const sc { nullptr };
 	const std::string    export_name;
+
+	// requests are pipelined, the thread receives the replies and matches them by handle
+	std::mutex           lock;  // for the socket (sending, replacing it) and in_flight
 	uint64_t             seq_nr { 0 };
+	std::map<uint64_t, nbd_request_t *> in_flight;
+	std::thread         *th { nullptr };
 
-	bool reconnect();
+	int  reconnect();  // a new connection (or -1), does not touch 'fd'
+	void drop_connection();
+	bool send_request(const uint64_t handle, const nbd_request_t *const r);
+	void submit(nbd_request_t *const r);
+	int  execute(nbd_request_t *const r);
 
 protected:
 	bool get_block(const block_nr_t block_nr, uint8_t **const data) override;
+	bool get_block_into(const block_nr_t block_nr, uint8_t *const to) override;
 	bool get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *to) override;
 
 	bool put_block(const block_nr_t block_nr, const uint8_t *const data) override;
+	bool zero_blocks(const block_nr_t block_nr, const block_nr_t n_blocks) override;
 
 	bool can_do_multiple_blocks() const override;
 
@@ -36,6 +61,13 @@ public:
 
 	bool trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err) override;
 
+	void submit_get_data(const offset_t offset, const struct iovec *const iov, const int iov_n, async_done_t done) override;
+	void submit_put_data(const offset_t offset, const block & b, async_done_t done) override;
+	void submit_trim_zero(const offset_t offset, const uint32_t len, const bool trim, async_done_t done) override;
+	void submit_fsync(async_done_t done) override;
+
+	void operator()();
+
 	static storage_backend_nbd * load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, const std::optional<int> block_size);
 	YAML::Node emit_configuration() const override;
 };
@@ -0,0 +1,818 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "buffer_pool.h"
+#include "gf256.h"
+#include "io.h"
+#include "logging.h"
+#include "str.h"
+#include "storage_backend_parity.h"
+#include "yaml-helpers.h"
+
+
+storage_backend_parity::storage_backend_parity(const std::string & id, const std::vector<storage_backend *> & sbs, const int n_parity, const uint64_t stripe_size, const std::string & state_file) :
+	storage_backend(id, sbs.empty() ? 4096 : sbs.at(0)->get_block_size(), { }),
+	sbs(sbs),
+	n_parity(n_parity),
+	n_data(int(sbs.size()) - n_parity),
+	stripe_size(stripe_size),
+	row_size(n_data > 0 ? n_data * stripe_size : 0),
+	failed(sbs.size()),
+	state_file(state_file)
+{
+	if (n_parity < 1 || n_data < 1)
+		throw myformat("storage_backend_parity(%s): at least 1 storage-backend for data and 1 for parity are required (got %zu storage-backends and %d parity)", id.c_str(), sbs.size(), n_parity);
+
+	if (sbs.size() > 255)
+		throw myformat("storage_backend_parity(%s): at most 255 storage-backends are supported", id.c_str());
+
+	if (stripe_size == 0 || stripe_size % block_size)
+		throw myformat("storage_backend_parity(%s): stripe-size (%lu) must be a multiple of the block size (%d)", id.c_str(), stripe_size, block_size);
+
+	offset_t smallest = sbs.at(0)->get_size();
+
+	for(auto sb : sbs) {
+		if (sb->get_block_size() != block_size)
+			throw myformat("storage_backend_parity(%s): %s has a different block size (%d) than %s (%d)", id.c_str(), sb->get_id().c_str(), sb->get_block_size(), sbs.at(0)->get_id().c_str(), block_size);
+
+		smallest = std::min(smallest, sb->get_size());
+	}
+
+	size = smallest / stripe_size * row_size;
+
+	if (size == 0)
+		throw myformat("storage_backend_parity(%s): the storage-backends are smaller than the stripe-size (%lu)", id.c_str(), stripe_size);
+
+	// A Cauchy matrix, 1 / (x_j + y_d) with x_j = n_data + j and y_d = d, has
+	// only invertible square sub-matrices: any n_data of the units of a row
+	// suffice to recover its data. Dividing each column by its first element
+	// keeps that property and makes the first parity unit the XOR of the data.
+	coefficients.resize(n_parity * n_data);
+
+	for(int j=0; j<n_parity; j++) {
+		for(int d=0; d<n_data; d++)
+			coefficients.at(j * n_data + d) = gf256_mul(gf256_inv((n_data + j) ^ d), n_data ^ d);
+	}
+
+	load_state();
+
+	// a row touches at most one unit per backend: two rows can be worked on at the same time
+	tp = new thread_pool(sbs.size() * 2);
+}
+
+storage_backend_parity::~storage_backend_parity()
+{
+	delete tp;
+
+	for(auto sb : sbs)
+		delete sb;
+}
+
+offset_t storage_backend_parity::get_size() const
+{
+	return size;
+}
+
+storage_backend * storage_backend_parity::get_sb(const uint64_t row, const int unit) const
+{
+	return sbs.at((row + unit) % sbs.size());
+}
+
+bool storage_backend_parity::is_failed(const uint64_t row, const int unit) const
+{
+	std::unique_lock<std::mutex> lck(failed_lock);
+
+	return failed.at((row + unit) % sbs.size());
+}
+
+bool storage_backend_parity::set_failed(const uint64_t row, const int unit)
+{
+	std::unique_lock<std::mutex> lck(failed_lock);
+
+	const size_t idx = (row + unit) % sbs.size();
+
+	if (failed.at(idx) == false) {
+		failed.at(idx) = true;
+
+		dolog(ll_error, "storage_backend_parity(%s): storage-backend %s failed, it is not used anymore", id.c_str(), sbs.at(idx)->get_id().c_str());
+
+		// else it would be read again (with what it missed) after a restart
+		if (save_state() == false)
+			return false;
+	}
+
+	return is_lost() == false;
+}
+
+bool storage_backend_parity::is_lost() const
+{
+	return std::count(failed.begin(), failed.end(), true) > n_parity;
+}
+
+void storage_backend_parity::load_state()
+{
+	int fd = open(state_file.c_str(), O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)  // none failed yet
+			return;
+
+		throw myformat("storage_backend_parity(%s): cannot open \"%s\": %s", id.c_str(), state_file.c_str(), strerror(errno));
+	}
+
+	struct stat st { };
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		throw myformat("storage_backend_parity(%s): cannot retrieve size of \"%s\": %s", id.c_str(), state_file.c_str(), strerror(errno));
+	}
+
+	std::string contents(st.st_size, 0);
+	bool ok = READ(fd, reinterpret_cast<uint8_t *>(contents.data()), contents.size()) == ssize_t(contents.size());
+
+	close(fd);
+
+	if (!ok)
+		throw myformat("storage_backend_parity(%s): cannot read \"%s\": %s", id.c_str(), state_file.c_str(), strerror(errno));
+
+	for(auto & failed_id : split(contents, "\n")) {
+		if (failed_id.empty())
+			continue;
+
+		auto it = std::find_if(sbs.begin(), sbs.end(), [&failed_id](const storage_backend *const sb) { return sb->get_id() == failed_id; });
+
+		if (it == sbs.end())
+			throw myformat("storage_backend_parity(%s): \"%s\" refers to unknown storage-backend \"%s\"", id.c_str(), state_file.c_str(), failed_id.c_str());
+
+		failed.at(it - sbs.begin()) = true;
+
+		dolog(ll_warning, "storage_backend_parity(%s): storage-backend %s failed before, it is not used", id.c_str(), failed_id.c_str());
+	}
+}
+
+bool storage_backend_parity::save_state() const
+{
+	std::string contents;
+
+	for(size_t i=0; i<sbs.size(); i++) {
+		if (failed.at(i))
+			contents += sbs.at(i)->get_id() + "\n";
+	}
+
+	// replaced at once: a crash leaves either the old or the new state
+	const std::string temp_file = state_file + ".new";
+
+	int fd = open(temp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		dolog(ll_error, "storage_backend_parity::save_state(%s): cannot create \"%s\": %s", id.c_str(), temp_file.c_str(), strerror(errno));
+		return false;
+	}
+
+	bool ok = WRITE(fd, reinterpret_cast<const uint8_t *>(contents.data()), contents.size()) == ssize_t(contents.size()) && fdatasync(fd) == 0;
+
+	close(fd);
+
+	if (ok)
+		ok = rename(temp_file.c_str(), state_file.c_str()) == 0;
+
+	if (!ok) {
+		dolog(ll_error, "storage_backend_parity::save_state(%s): cannot write \"%s\": %s", id.c_str(), state_file.c_str(), strerror(errno));
+		unlink(temp_file.c_str());
+	}
+
+	return ok;
+}
+
+uint8_t storage_backend_parity::get_coefficient(const int parity_unit, const int data_unit) const
+{
+	return coefficients.at(parity_unit * n_data + data_unit);
+}
+
+std::vector<storage_backend_parity::piece_t> storage_backend_parity::split_row(const uint64_t offset, const uint64_t len, uint8_t *const data) const
+{
+	std::vector<piece_t> out;
+
+	uint64_t work_offset = offset;
+	uint64_t work_len    = len;
+	uint8_t *p           = data;
+
+	while(work_len > 0) {
+		const uint32_t in_unit = work_offset % stripe_size;
+		const uint32_t n       = std::min(stripe_size - in_unit, work_len);
+
+		out.push_back({ int(work_offset / stripe_size), in_unit, n, p });
+
+		work_offset += n;
+		work_len    -= n;
+		p           += n;
+	}
+
+	return out;
+}
+
+int storage_backend_parity::read_unit(const uint64_t row, const int unit, const uint32_t offset, const uint32_t len, uint8_t *const to)
+{
+	if (is_failed(row, unit) == false) {
+		struct iovec iov { to, len };
+		int err = 0;
+		get_sb(row, unit)->get_data_into(row * stripe_size + offset, &iov, 1, &err);
+
+		if (err == 0)
+			return 0;
+
+		dolog(ll_warning, "storage_backend_parity::read_unit(%s): failed to read %u bytes from %s, reconstructing them: %s", id.c_str(), len, get_sb(row, unit)->get_id().c_str(), strerror(err));
+	}
+
+	return reconstruct(row, unit, offset, len, to);
+}
+
+int storage_backend_parity::reconstruct(const uint64_t row, const int unit, const uint32_t offset, const uint32_t len, uint8_t *const to)
+{
+	n_reconstructed++;
+
+	uint8_t *buffer = pool_malloc(size_t(n_data) * len);
+	if (!buffer) {
+		dolog(ll_error, "storage_backend_parity::reconstruct(%s): cannot allocate %lu bytes of memory", id.c_str(), uint64_t(n_data) * len);
+		return ENOMEM;
+	}
+
+	// any n_data of the other units will do; sequential as this may run in 'tp'
+	std::vector<int> units;
+
+	for(int u=0; u<int(sbs.size()) && int(units.size()) < n_data; u++) {
+		if (u == unit || is_failed(row, u))
+			continue;
+
+		struct iovec iov { &buffer[units.size() * len], len };
+		int err = 0;
+		get_sb(row, u)->get_data_into(row * stripe_size + offset, &iov, 1, &err);
+
+		if (err == 0)
+			units.push_back(u);
+	}
+
+	if (int(units.size()) < n_data) {
+		dolog(ll_error, "storage_backend_parity::reconstruct(%s): not enough storage-backends left to reconstruct %u bytes of row %lu", id.c_str(), len, row);
+		pool_free(buffer);
+		return EIO;
+	}
+
+	// how each of these units was computed from the data units
+	std::vector<uint8_t> m(n_data * n_data);
+
+	for(int i=0; i<n_data; i++) {
+		const int u = units.at(i);
+
+		for(int d=0; d<n_data; d++)
+			m.at(i * n_data + d) = u < n_data ? u == d : get_coefficient(u - n_data, d);
+	}
+
+	if (gf256_invert_matrix(m, n_data) == false) {
+		dolog(ll_error, "storage_backend_parity::reconstruct(%s): matrix is not invertible", id.c_str());
+		pool_free(buffer);
+		return EIO;
+	}
+
+	memset(to, 0x00, len);
+
+	for(int i=0; i<n_data; i++)
+		gf256_mul_add(to, &buffer[i * len], m.at(unit * n_data + i), len);
+
+	pool_free(buffer);
+
+	return 0;
+}
+
+int storage_backend_parity::write_unit(const uint64_t row, const int unit, const uint32_t offset, const block & b)
+{
+	if (is_failed(row, unit))
+		return 0;
+
+	int err = 0;
+	get_sb(row, unit)->put_data(row * stripe_size + offset, b, &err);
+
+	if (err == 0)
+		return 0;
+
+	dolog(ll_error, "storage_backend_parity::write_unit(%s): failed to write %zu bytes to %s: %s", id.c_str(), b.get_size(), get_sb(row, unit)->get_id().c_str(), strerror(err));
+
+	// what it should have had can be reconstructed from the others
+	return set_failed(row, unit) ? 0 : EIO;
+}
+
+int storage_backend_parity::trim_zero_unit(const uint64_t row, const int unit, const uint32_t offset, const uint32_t len, const bool trim)
+{
+	if (is_failed(row, unit))
+		return 0;
+
+	int err = 0;
+	if (get_sb(row, unit)->trim_zero(row * stripe_size + offset, len, trim, &err))
+		return 0;
+
+	dolog(ll_error, "storage_backend_parity::trim_zero_unit(%s): failed to trim/zero %u bytes on %s: %s", id.c_str(), len, get_sb(row, unit)->get_id().c_str(), strerror(err ? err : EIO));
+
+	return set_failed(row, unit) ? 0 : EIO;
+}
+
+void storage_backend_parity::compute_parity(const uint8_t *const *const data, const uint32_t len, uint8_t *const *const parity) const
+{
+	for(int j=0; j<n_parity; j++) {
+		memset(parity[j], 0x00, len);
+
+		for(int d=0; d<n_data; d++)
+			gf256_mul_add(parity[j], data[d], get_coefficient(j, d), len);
+	}
+}
+
+int storage_backend_parity::read(const offset_t offset, const uint64_t len, uint8_t *const to)
+{
+	if (len == 0)
+		return 0;
+
+	const uint64_t first_row = offset / row_size;
+	const uint64_t last_row  = (offset + len - 1) / row_size;
+
+	row_lg.un_lock_block_group(first_row, last_row - first_row + 1, 1, true, true);
+
+	std::vector<std::function<int()> > work;
+
+	offset_t work_offset = offset;
+	const offset_t end   = offset + len;
+
+	while(work_offset < end) {
+		const uint64_t row    = work_offset / row_size;
+		const uint64_t in_row = work_offset % row_size;
+		const uint64_t n      = std::min(row_size - in_row, end - work_offset);
+
+		for(auto & p : split_row(in_row, n, to + work_offset - offset))
+			work.push_back([this, row, p] { return read_unit(row, p.unit, p.offset, p.len, p.data); });
+
+		work_offset += n;
+	}
+
+	int err = tp->run_all(work);
+
+	row_lg.un_lock_block_group(first_row, last_row - first_row + 1, 1, false, true);
+
+	return err;
+}
+
+int storage_backend_parity::write_full_rows(const uint64_t first_row, const uint64_t n_rows, const uint8_t *const data)
+{
+	n_full_row_writes += n_rows;
+
+	const size_t parity_size = n_rows * n_parity * stripe_size;
+
+	uint8_t *parity = pool_malloc(parity_size);
+	if (!parity) {
+		dolog(ll_error, "storage_backend_parity::write_full_rows(%s): cannot allocate %zu bytes of memory", id.c_str(), parity_size);
+		return ENOMEM;
+	}
+
+	// no need to read anything: the parity follows from the new data
+	std::vector<const uint8_t *> d(n_data);
+	std::vector<uint8_t *>       p(n_parity);
+
+	for(uint64_t r=0; r<n_rows; r++) {
+		for(int u=0; u<n_data; u++)
+			d.at(u) = &data[r * row_size + u * stripe_size];
+
+		for(int j=0; j<n_parity; j++)
+			p.at(j) = &parity[(r * n_parity + j) * stripe_size];
+
+		compute_parity(d.data(), stripe_size, p.data());
+	}
+
+	auto unit_data = [&](const uint64_t r, const int u) {
+		return u < n_data ? &data[r * row_size + u * stripe_size] : &parity[(r * n_parity + u - n_data) * stripe_size];
+	};
+
+	// the units of consecutive rows on a storage-backend are consecutive on it
+	std::vector<std::function<int()> > work;
+
+	for(size_t i=0; i<sbs.size(); i++) {
+		work.push_back([this, i, first_row, n_rows, &unit_data] {
+			const int first_unit = (i + sbs.size() - first_row % sbs.size()) % sbs.size();
+
+			if (n_rows == 1)
+				return write_unit(first_row, first_unit, 0, block(unit_data(0, first_unit), stripe_size, false));
+
+			uint8_t *buffer = pool_malloc(n_rows * stripe_size);
+			if (!buffer) {
+				dolog(ll_error, "storage_backend_parity::write_full_rows(%s): cannot allocate %lu bytes of memory", id.c_str(), n_rows * stripe_size);
+				return ENOMEM;
+			}
+
+			for(uint64_t r=0; r<n_rows; r++) {
+				const int u = (i + sbs.size() - (first_row + r) % sbs.size()) % sbs.size();
+
+				memcpy(&buffer[r * stripe_size], unit_data(r, u), stripe_size);
+			}
+
+			return write_unit(first_row, first_unit, 0, block(buffer, n_rows * stripe_size));
+		});
+	}
+
+	int err = tp->run_all(work);
+
+	pool_free(parity);
+
+	return err;
+}
+
+int storage_backend_parity::write_partial_row(const uint64_t row, const uint64_t offset, const uint64_t len, const uint8_t *const data)
+{
+	n_rmw_writes++;
+
+	auto pieces = split_row(offset, len, const_cast<uint8_t *>(data));
+
+	uint32_t lo = UINT32_MAX;
+	uint32_t hi = 0;
+
+	for(auto & p : pieces) {
+		lo = std::min(lo, p.offset);
+		hi = std::max(hi, p.offset + p.len);
+	}
+
+	const uint32_t width = hi - lo;
+
+	uint8_t *parity = pool_malloc(n_parity * width);
+	uint8_t *old    = pool_malloc(std::max(uint64_t(n_data) * width, len));
+
+	if (!parity || !old) {
+		dolog(ll_error, "storage_backend_parity::write_partial_row(%s): cannot allocate %lu bytes of memory", id.c_str(), n_parity * width + std::max(uint64_t(n_data) * width, len));
+		pool_free(parity);
+		pool_free(old);
+		return ENOMEM;
+	}
+
+	// a data unit that cannot be read (to compute the difference with), or a
+	// parity unit that cannot be read (to apply it to): recompute all parity
+	bool recompute = std::any_of(pieces.begin(), pieces.end(), [this, row](const piece_t & p) { return is_failed(row, p.unit); });
+
+	if (!recompute) {
+		std::vector<std::function<int()> > work;
+
+		for(auto & p : pieces) {
+			uint8_t *to = &old[p.data - data];
+
+			work.push_back([this, row, p, to] { return read_unit(row, p.unit, p.offset, p.len, to); });
+		}
+
+		for(int j=0; j<n_parity; j++) {
+			if (is_failed(row, n_data + j))
+				continue;
+
+			work.push_back([this, row, j, lo, width, parity] {
+				struct iovec iov { &parity[j * width], width };
+				int err = 0;
+				get_sb(row, n_data + j)->get_data_into(row * stripe_size + lo, &iov, 1, &err);
+
+				return err;
+			});
+		}
+
+		if (tp->run_all(work))
+			recompute = true;
+	}
+
+	int err = 0;
+
+	std::vector<std::function<int()> > work;
+
+	if (recompute) {
+		// from all (other) data units in the row
+		std::vector<std::function<int()> > read_work;
+
+		for(int u=0; u<n_data; u++)
+			read_work.push_back([this, row, u, lo, width, old] { return read_unit(row, u, lo, width, &old[u * width]); });
+
+		err = tp->run_all(read_work);
+
+		if (err == 0) {
+			std::vector<const uint8_t *> d(n_data);
+			std::vector<uint8_t *>       p(n_parity);
+
+			for(auto & piece : pieces)
+				memcpy(&old[piece.unit * width + piece.offset - lo], piece.data, piece.len);
+
+			for(int u=0; u<n_data; u++)
+				d.at(u) = &old[u * width];
+
+			for(int j=0; j<n_parity; j++)
+				p.at(j) = &parity[j * width];
+
+			compute_parity(d.data(), width, p.data());
+		}
+	}
+	else {
+		// parity ^= coefficient * (old ^ new)
+		for(auto & p : pieces) {
+			uint8_t *delta = &old[p.data - data];
+
+			gf256_mul_add(delta, p.data, 1, p.len);
+
+			for(int j=0; j<n_parity; j++)
+				gf256_mul_add(&parity[j * width + p.offset - lo], delta, get_coefficient(j, p.unit), p.len);
+		}
+	}
+
+	if (err == 0) {
+		for(auto & p : pieces)
+			work.push_back([this, row, p] { return write_unit(row, p.unit, p.offset, block(p.data, p.len, false)); });
+
+		for(int j=0; j<n_parity; j++)
+			work.push_back([this, row, j, lo, width, parity] { return write_unit(row, n_data + j, lo, block(&parity[j * width], width, false)); });
+
+		err = tp->run_all(work);
+	}
+
+	pool_free(old);
+	pool_free(parity);
+
+	return err;
+}
+
+bool storage_backend_parity::can_do_multiple_blocks() const
+{
+	return true;
+}
+
+bool storage_backend_parity::get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *const to)
+{
+	int err = read(block_nr * block_size, blocks_to_do * block_size, to);
+
+	if (err) {
+		dolog(ll_error, "storage_backend_parity::get_multiple_blocks(%s): failed to read %ld blocks starting at %ld: %s", id.c_str(), blocks_to_do, block_nr, strerror(err));
+		return false;
+	}
+
+	return true;
+}
+
+bool storage_backend_parity::get_block_into(const block_nr_t block_nr, uint8_t *const to)
+{
+	int err = read(block_nr * block_size, block_size, to);
+
+	if (err) {
+		dolog(ll_error, "storage_backend_parity::get_block_into(%s): failed to read block %ld: %s", id.c_str(), block_nr, strerror(err));
+		return false;
+	}
+
+	return true;
+}
+
+bool storage_backend_parity::get_block(const block_nr_t block_nr, uint8_t **const data)
+{
+	*data = pool_malloc(block_size);
+	if (!*data) {
+		dolog(ll_error, "storage_backend_parity::get_block(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
+		return false;
+	}
+
+	if (!get_block_into(block_nr, *data)) {
+		pool_free(*data);
+		*data = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+bool storage_backend_parity::put_block(const block_nr_t block_nr, const uint8_t *const data)
+{
+	int err = 0;
+	put_data(block_nr * block_size, block(data, block_size, false), &err);
+
+	return err == 0;
+}
+
+void storage_backend_parity::put_data(const offset_t offset, const block & b, int *const err)
+{
+	stats_timer st(stats, so_put, b.get_size());
+
+	*err = 0;
+
+	if (b.get_size() == 0)
+		return;
+
+	if (offset + b.get_size() > size) {
+		dolog(ll_error, "storage_backend_parity::put_data(%s): this write would be beyond the device size (%ld > %ld)", id.c_str(), offset + b.get_size(), size);
+		*err = EINVAL;
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> lck(failed_lock);
+
+		if (is_lost()) {
+			dolog(ll_error, "storage_backend_parity::put_data(%s): too many storage-backends failed", id.c_str());
+			*err = EIO;
+			return;
+		}
+	}
+
+	const offset_t end       = offset + b.get_size();
+	const uint64_t first_row = offset / row_size;
+	const uint64_t last_row  = (end - 1) / row_size;
+
+	row_lg.un_lock_block_group(first_row, last_row - first_row + 1, 1, true, false);
+
+	offset_t work_offset = offset;
+
+	while(work_offset < end && *err == 0) {
+		const uint64_t row    = work_offset / row_size;
+		const uint64_t in_row = work_offset % row_size;
+		const uint8_t *data   = b.get_data() + work_offset - offset;
+
+		if (in_row == 0 && end - work_offset >= row_size) {
+			const uint64_t n_rows = (end - work_offset) / row_size;
+
+			*err = write_full_rows(row, n_rows, data);
+
+			work_offset += n_rows * row_size;
+		}
+		else {
+			const uint64_t n = std::min(row_size - in_row, end - work_offset);
+
+			*err = write_partial_row(row, in_row, n, data);
+
+			work_offset += n;
+		}
+	}
+
+	row_lg.un_lock_block_group(first_row, last_row - first_row + 1, 1, false, false);
+
+	if (*err)
+		dolog(ll_error, "storage_backend_parity::put_data(%s): failed to write %zu bytes at offset %ld: %s", id.c_str(), b.get_size(), offset, strerror(*err));
+}
+
+bool storage_backend_parity::fsync()
+{
+	stats_timer st(stats, so_fsync, 0);
+
+	std::vector<std::function<int()> > work;
+
+	for(size_t i=0; i<sbs.size(); i++) {
+		// unit 0 of row i is on storage-backend i
+		if (is_failed(i, 0) == false)
+			work.push_back([this, i] { return sbs.at(i)->fsync() ? 0 : EIO; });
+	}
+
+	if (tp->run_all(work)) {
+		dolog(ll_error, "storage_backend_parity::fsync(%s): failed to sync one or more storage-backends", id.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool storage_backend_parity::trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err)
+{
+	stats_timer st(stats, so_trim, len);
+
+	*err = 0;
+
+	if (len == 0)
+		return true;
+
+	if (offset + len > size) {
+		dolog(ll_error, "storage_backend_parity::trim_zero(%s): this trim would be beyond the device size (%ld > %ld)", id.c_str(), offset + len, size);
+		*err = EINVAL;
+		return false;
+	}
+
+	const offset_t end       = offset + len;
+	const uint64_t first_row = offset / row_size;
+	const uint64_t last_row  = (end - 1) / row_size;
+
+	row_lg.un_lock_block_group(first_row, last_row - first_row + 1, 1, true, false);
+
+	offset_t work_offset = offset;
+
+	while(work_offset < end && *err == 0) {
+		const uint64_t row    = work_offset / row_size;
+		const uint64_t in_row = work_offset % row_size;
+
+		if (in_row == 0 && end - work_offset >= row_size) {
+			// the parity of zeros is zeros: all units of these rows can be
+			// zeroed; not trimmed, trimmed ranges need not read back as zeros
+			const uint64_t n_rows = (end - work_offset) / row_size;
+
+			std::vector<std::function<int()> > work;
+
+			for(size_t i=0; i<sbs.size(); i++) {
+				const int unit = (i + sbs.size() - row % sbs.size()) % sbs.size();
+
+				work.push_back([this, row, unit, n_rows] { return trim_zero_unit(row, unit, 0, n_rows * stripe_size, false); });
+			}
+
+			*err = tp->run_all(work);
+
+			n_full_row_writes += n_rows;
+
+			work_offset += n_rows * row_size;
+		}
+		else {
+			const uint64_t n = std::min(row_size - in_row, end - work_offset);
+
+			uint8_t *zeros = pool_calloc(n);
+			if (!zeros) {
+				dolog(ll_error, "storage_backend_parity::trim_zero(%s): cannot allocate %lu bytes of memory", id.c_str(), n);
+				*err = ENOMEM;
+				break;
+			}
+
+			*err = write_partial_row(row, in_row, n, zeros);
+
+			pool_free(zeros);
+
+			work_offset += n;
+		}
+	}
+
+	row_lg.un_lock_block_group(first_row, last_row - first_row + 1, 1, false, false);
+
+	if (*err) {
+		dolog(ll_error, "storage_backend_parity::trim_zero(%s): failed to trim/zero %u bytes at offset %ld: %s", id.c_str(), len, offset, strerror(*err));
+		return false;
+	}
+
+	return true;
+}
+
+void storage_backend_parity::dump_stats(const std::string & base_filename)
+{
+	size_t n_failed = 0;
+
+	{
+		std::unique_lock<std::mutex> lck(failed_lock);
+
+		n_failed = std::count(failed.begin(), failed.end(), true);
+	}
+
+	dolog(ll_info, "storage_backend_parity(%s): %lu whole rows written, %lu partial rows written (read-modify-write), %lu reads reconstructed from parity, %zu of %zu storage-backends failed, GF(2^8) arithmetic: %s", id.c_str(), n_full_row_writes.load(), n_rmw_writes.load(), n_reconstructed.load(), n_failed, sbs.size(), get_gf256_implementation());
+
+	for(auto sb : sbs)
+		sb->dump_stats(base_filename);
+}
+
+YAML::Node storage_backend_parity::emit_configuration() const
+{
+	std::vector<YAML::Node> out_sbs;
+	for(auto sb : sbs)
+		out_sbs.push_back(sb->emit_configuration());
+
+	YAML::Node out_cfg;
+	out_cfg["id"] = id;
+	out_cfg["storage-backends"] = out_sbs;
+	out_cfg["parity"] = n_parity;
+	out_cfg["stripe-size"] = stripe_size;
+	out_cfg["state-file"] = state_file;
+
+	YAML::Node out;
+	out["type"] = "storage-backend-parity";
+	out["cfg"] = out_cfg;
+
+	return out;
+}
+
+storage_backend_parity * storage_backend_parity::load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, std::optional<int> block_size)
+{
+	dolog(ll_info, " * storage_backend_parity::load_configuration");
+
+	const YAML::Node cfg = yaml_get_yaml_node(node, "cfg", "storage-backend-parity configuration");
+
+	std::string id = yaml_get_string(cfg, "id", "module id");
+
+	uint64_t stripe_size = yaml_get_uint64_t(cfg, "stripe-size", "how many bytes go to a storage-backend before switching to the next", true);
+
+	int n_parity = yaml_get_int(cfg, "parity", "how many of the storage-backends may fail (that much of the capacity is used for parity)");
+
+	std::string state_file = yaml_get_string(cfg, "state-file", "file that records which storage-backends failed");
+
+	const YAML::Node y_sbs = yaml_get_yaml_node(cfg, "storage-backends", "the storage-backends to spread the data and parity over");
+
+	// each holds a part of the total
+	std::optional<uint64_t> sb_size;
+	if (size.has_value() && int(y_sbs.size()) > n_parity)
+		sb_size = size.value() / (y_sbs.size() - n_parity);
+
+	std::vector<storage_backend *> sbs;
+	for(YAML::const_iterator it = y_sbs.begin(); it != y_sbs.end(); it++) {
+		storage_backend *sb = storage_backend::load_configuration(it->as<YAML::Node>(), sb_size, block_size);
+
+		if (!sb) {
+			for(auto s : sbs)
+				delete s;
+
+			throw myformat("storage_backend_parity::load_configuration(%s): failed to configure a storage-backend", id.c_str());
+		}
+
+		sbs.push_back(sb);
+	}
+
+	return new storage_backend_parity(id, sbs, n_parity, stripe_size, state_file);
+}
@@ -0,0 +1,112 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "lock_group.h"
+#include "storage_backend.h"
+#include "thread_pool.h"
+
+
+// RAID-5/6 like: the address space is cut in rows of 'k' units of
+// 'stripe_size' bytes of data, k being the number of storage-backends minus
+// 'parity'. Each row also has 'parity' units of parity (the first is the XOR
+// of the data, the others are Reed-Solomon over GF(2^8)) so that the data
+// survives the loss of any 'parity' storage-backends. Unit u of row r is at
+// offset r * stripe_size on backend (r + u) % n: the parity rotates.
+// A write of whole rows computes the parity from the new data; other writes
+// read the old data and parity and apply the difference. A storage-backend
+// that fails a write is not used anymore: what is on it is reconstructed from
+// the others when read. That is recorded in 'state_file' before the write
+// completes, so that it is not used after a restart either (its data is
+// stale).
+// The units of a row are written in parallel, not atomically: when mystorage
+// stops halfway, the data and parity of that row may not match (the "write
+// hole" of RAID-5/6). Nothing detects that; it only matters when a
+// storage-backend fails before that row is written again.
+class storage_backend_parity : public storage_backend
+{
+private:
+	typedef struct {
+		int      unit;    // data unit in the row
+		uint32_t offset;  // in the unit
+		uint32_t len;
+		uint8_t *data;    // in the request
+	} piece_t;
+
+	const std::vector<storage_backend *> sbs;
+	const int                            n_parity;
+	const int                            n_data;
+	const uint64_t                       stripe_size;
+	const uint64_t                       row_size;  // data only
+	offset_t                             size { 0 };
+	// n_parity x n_data; the first row is all 1s
+	std::vector<uint8_t>                 coefficients;
+
+	mutable std::mutex                   failed_lock;
+	std::vector<bool>                    failed;
+	const std::string                    state_file;  // ids of the failed storage-backends, one per line
+
+	// the parity of a row depends on all its units: a write locks all rows it touches
+	lock_group                           row_lg;
+
+	// the units of a row are read and written in parallel via tp->run_all()
+	thread_pool                         *tp { nullptr };
+
+	std::atomic_uint64_t                 n_full_row_writes { 0 };
+	std::atomic_uint64_t                 n_rmw_writes { 0 };
+	std::atomic_uint64_t                 n_reconstructed { 0 };  // units (or parts of these) that were read via the parity
+
+	storage_backend * get_sb(const uint64_t row, const int unit) const;
+	bool is_failed(const uint64_t row, const int unit) const;
+	// returns false when more storage-backends failed than there is parity
+	bool set_failed(const uint64_t row, const int unit);
+	// more storage-backends failed than there is parity; 'failed_lock' must be locked
+	bool is_lost() const;
+	void load_state();
+	bool save_state() const;  // 'failed_lock' must be locked
+	uint8_t get_coefficient(const int parity_unit, const int data_unit) const;
+
+	// for a piece of a row: the pieces of the units it covers
+	std::vector<piece_t> split_row(const uint64_t offset, const uint64_t len, uint8_t *const data) const;
+
+	int  read_unit(const uint64_t row, const int unit, const uint32_t offset, const uint32_t len, uint8_t *const to);
+	int  reconstruct(const uint64_t row, const int unit, const uint32_t offset, const uint32_t len, uint8_t *const to);
+	int  write_unit(const uint64_t row, const int unit, const uint32_t offset, const block & b);
+	int  trim_zero_unit(const uint64_t row, const int unit, const uint32_t offset, const uint32_t len, const bool trim);
+	// parity from the data of the n_data units in 'data' ('len' bytes each)
+	void compute_parity(const uint8_t *const *const data, const uint32_t len, uint8_t *const *const parity) const;
+
+	int  read(const offset_t offset, const uint64_t len, uint8_t *const to);
+	int  write_full_rows(const uint64_t first_row, const uint64_t n_rows, const uint8_t *const data);
+	int  write_partial_row(const uint64_t row, const uint64_t offset, const uint64_t len, const uint8_t *const data);
+
+protected:
+	bool can_do_multiple_blocks() const override;
+	bool get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *const to) override;
+
+	bool get_block(const block_nr_t block_nr, uint8_t **const data) override;
+	bool get_block_into(const block_nr_t block_nr, uint8_t *const to) override;
+	bool put_block(const block_nr_t block_nr, const uint8_t *const data) override;
+
+public:
+	storage_backend_parity(const std::string & id, const std::vector<storage_backend *> & sbs, const int n_parity, const uint64_t stripe_size, const std::string & state_file);
+	virtual ~storage_backend_parity();
+
+	offset_t get_size() const override;
+
+	void put_data(const offset_t offset, const block & b, int *const err) override;
+	using storage_backend::put_data;
+
+	bool fsync() override;
+
+	bool trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err) override;
+
+	void dump_stats(const std::string & base_filename) override;
+
+	YAML::Node emit_configuration() const override;
+	static storage_backend_parity * load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, std::optional<int> block_size);
+};
@@ -0,0 +1,543 @@
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+
+#include "buffer_pool.h"
+#include "logging.h"
+#include "str.h"
+#include "storage_backend_readahead.h"
+#include "yaml-helpers.h"
+
+
+storage_backend_readahead::storage_backend_readahead(const std::string & id, storage_backend *const sb, const uint64_t max_memory, const uint64_t min_window, const uint64_t max_window) :
+	storage_backend(id, sb->get_block_size(), { }),
+	sb(sb),
+	max_memory(max_memory),
+	min_window(std::max(uint64_t(1), min_window / sb->get_block_size())),
+	max_window(max_window / sb->get_block_size())
+{
+	if (this->max_window < this->min_window)
+		throw myformat("storage_backend_readahead(%s): max-window must be at least min-window and one block (%d bytes)", id.c_str(), block_size);
+
+	if (max_memory < this->max_window * block_size)
+		throw myformat("storage_backend_readahead(%s): max-memory (%lu bytes) must be at least max-window (%lu bytes)", id.c_str(), max_memory, max_window);
+
+	tp = new thread_pool(n_prefetch_threads);
+}
+
+storage_backend_readahead::~storage_backend_readahead()
+{
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		// the completion handlers refer to 'this'
+		while(n_in_flight > 0)
+			cond.wait(lck);
+
+		buffered.clear();
+		fifo.clear();
+	}
+
+	delete tp;
+
+	delete sb;
+}
+
+offset_t storage_backend_readahead::get_size() const
+{
+	return sb->get_size();
+}
+
+void storage_backend_readahead::forget(const std::shared_ptr<prefetch_t> & pf)
+{
+	pf->valid = false;
+
+	for(block_nr_t nr=pf->first; nr<pf->first + pf->n; nr++) {
+		auto it = buffered.find(nr);
+
+		if (it != buffered.end() && it->second == pf)
+			buffered.erase(it);
+	}
+
+	auto it = std::find(fifo.begin(), fifo.end(), pf);
+
+	if (it != fifo.end()) {
+		fifo.erase(it);
+
+		n_buffered -= pf->n;
+	}
+
+	// the buffer is freed when the last reference (maybe the completion
+	// handler) goes away
+}
+
+void storage_backend_readahead::evict(const block_nr_t room_for)
+{
+	while(!fifo.empty() && (n_buffered + room_for) * block_size > max_memory) {
+		std::shared_ptr<prefetch_t> pf = fifo.front();
+
+		if (pf->done && pf->err == 0) {
+			const block_nr_t unused = std::count(pf->used.begin(), pf->used.end(), false);
+
+			n_wasted += unused;
+
+			// read too far ahead for this stream
+			if (unused > pf->n / 2 && pf->stream < streams.size()) {
+				stream_t & s = streams.at(pf->stream);
+
+				s.window = std::max(min_window, s.window / 2);
+			}
+		}
+
+		forget(pf);
+	}
+}
+
+std::shared_ptr<storage_backend_readahead::prefetch_t> storage_backend_readahead::prepare_prefetch(const size_t stream, block_nr_t first, block_nr_t n)
+{
+	const block_nr_t total = sb->get_size() / block_size;
+
+	if (first >= total)
+		return nullptr;
+
+	n = std::min(n, total - first);
+
+	// a block maps to one read-ahead only
+	while(n > 0 && buffered.find(first) != buffered.end()) {
+		first++;
+		n--;
+	}
+
+	auto next = buffered.lower_bound(first);
+
+	if (next != buffered.end() && next->first < first + n)
+		n = next->first - first;
+
+	if (n * block_size > max_memory)
+		n = max_memory / block_size;
+
+	if (n == 0)
+		return nullptr;
+
+	// would be outdated before it arrives
+	for(auto & w : active_writes) {
+		if (w.first <= first + n - 1 && w.second >= first)
+			return nullptr;
+	}
+
+	evict(n);
+
+	uint8_t *buffer = pool_malloc(n * block_size);
+	if (!buffer) {
+		dolog(ll_warning, "storage_backend_readahead::prepare_prefetch(%s): cannot allocate %ld bytes of memory", id.c_str(), n * block_size);
+		return nullptr;
+	}
+
+	std::shared_ptr<prefetch_t> pf = std::make_shared<prefetch_t>();
+	pf->first  = first;
+	pf->n      = n;
+	pf->data   = block(buffer, n * block_size);
+	pf->used.resize(n, false);
+	pf->stream = stream;
+	pf->done   = false;
+	pf->valid  = true;
+	pf->err    = 0;
+
+	for(block_nr_t nr=first; nr<first + n; nr++)
+		buffered[nr] = pf;
+
+	fifo.push_back(pf);
+
+	n_buffered += n;
+
+	n_in_flight++;
+
+	n_prefetched += n;
+
+	return pf;
+}
+
+void storage_backend_readahead::submit_prefetch(const std::shared_ptr<prefetch_t> & pf)
+{
+	tp->enqueue([this, pf] {
+		// the only writer of this buffer, readers wait for 'done'
+		struct iovec iov { const_cast<uint8_t *>(pf->data.value().get_data()), size_t(pf->n * block_size) };
+
+		int err = 0;
+		sb->get_data_into(pf->first * block_size, &iov, 1, &err);
+
+		std::unique_lock<std::mutex> lck(lock);
+
+		pf->done = true;
+		pf->err  = err;
+
+		if (err) {
+			dolog(ll_warning, "storage_backend_readahead(%s): read-ahead of %ld blocks at %ld failed: %s", id.c_str(), pf->n, pf->first, strerror(err));
+
+			forget(pf);
+		}
+
+		n_in_flight--;
+
+		cond.notify_all();
+	});
+}
+
+std::vector<std::shared_ptr<storage_backend_readahead::prefetch_t> > storage_backend_readahead::detect(const block_nr_t block_nr, const block_nr_t n)
+{
+	std::vector<std::shared_ptr<prefetch_t> > out;
+
+	std::unique_lock<std::mutex> lck(lock);
+
+	access_counter++;
+
+	size_t idx     = streams.size();
+	bool   matched = false;
+
+	for(size_t i=0; i<streams.size(); i++) {
+		stream_t & s = streams.at(i);
+
+		// e.g. AoE reads a block in sectors
+		if (block_nr >= s.last_start && block_nr < s.last_start + s.last_n) {
+			s.last_used = access_counter;
+			return out;
+		}
+
+		const bool sequential = block_nr == s.last_start + s.last_n;
+		const bool strided    = s.stride != 0 && block_nr == s.last_start + s.stride;
+
+		if (sequential || strided) {
+			if (sequential && s.stride != s.last_n)
+				s.stride = 0;
+
+			s.hits++;
+
+			idx     = i;
+			matched = true;
+			break;
+		}
+	}
+
+	if (!matched) {
+		// a second read shortly after a stream that was read only once: maybe a stride
+		for(size_t i=0; i<streams.size(); i++) {
+			stream_t & s = streams.at(i);
+
+			if (s.hits == 0 && block_nr > s.last_start + s.last_n && block_nr - s.last_start <= max_stride) {
+				s.stride = block_nr - s.last_start;
+				s.hits   = 1;
+
+				idx     = i;
+				matched = true;
+				break;
+			}
+		}
+	}
+
+	if (!matched) {
+		stream_t s { block_nr, n, 0, 0, min_window, 0, access_counter };
+
+		if (streams.size() < max_streams) {
+			streams.push_back(s);
+		}
+		else {
+			auto lru = std::min_element(streams.begin(), streams.end(), [](const stream_t & a, const stream_t & b) { return a.last_used < b.last_used; });
+
+			*lru = s;
+		}
+
+		return out;
+	}
+
+	stream_t & s = streams.at(idx);
+
+	s.last_start = block_nr;
+	s.last_n     = n;
+	s.last_used  = access_counter;
+
+	// leave it alone until the pattern was seen a few times
+	if (s.hits < 2)
+		return out;
+
+	if (s.stride == 0 || s.stride == n) {
+		const block_nr_t start = std::max(block_nr + n, s.prefetched_until);
+		const block_nr_t end   = block_nr + n + s.window;
+
+		// in chunks of at least half a window
+		if (end > start && end - start >= std::max(block_nr_t(1), s.window / 2)) {
+			auto pf = prepare_prefetch(idx, start, end - start);
+
+			if (pf)
+				out.push_back(pf);
+
+			s.prefetched_until = end;
+		}
+	}
+	else {
+		const block_nr_t count = std::max(block_nr_t(1), s.window / n);
+
+		for(block_nr_t j=1; j<=count; j++) {
+			const block_nr_t start = block_nr + j * s.stride;
+
+			if (start < s.prefetched_until)
+				continue;
+
+			auto pf = prepare_prefetch(idx, start, n);
+
+			if (pf)
+				out.push_back(pf);
+
+			s.prefetched_until = start + n;
+		}
+	}
+
+	return out;
+}
+
+bool storage_backend_readahead::from_buffer(const block_nr_t block_nr, uint8_t *const to)
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	for(;;) {
+		auto it = buffered.find(block_nr);
+
+		if (it == buffered.end())
+			return false;
+
+		std::shared_ptr<prefetch_t> pf = it->second;
+
+		if (pf->done == false) {
+			cond.wait(lck);
+
+			continue;  // may have been dropped in the mean time
+		}
+
+		const block_nr_t index = block_nr - pf->first;
+
+		memcpy(to, pf->data.value().get_data() + index * block_size, block_size);
+
+		if (pf->used[index] == false) {
+			pf->used[index] = true;
+
+			// the stream got to the end of a read-ahead: read further ahead
+			if (index == pf->n - 1 && pf->stream < streams.size()) {
+				stream_t & s = streams.at(pf->stream);
+
+				s.window = std::min(max_window, s.window * 2);
+			}
+		}
+
+		return true;
+	}
+}
+
+void storage_backend_readahead::start_write(const offset_t offset, const uint32_t len)
+{
+	const block_nr_t first = offset / block_size;
+	const block_nr_t last  = (offset + len - 1) / block_size;
+
+	std::unique_lock<std::mutex> lck(lock);
+
+	std::vector<std::shared_ptr<prefetch_t> > stale;
+
+	for(auto it = buffered.lower_bound(first); it != buffered.end() && it->first <= last; it++)
+		stale.push_back(it->second);
+
+	for(auto & pf : stale)
+		forget(pf);
+
+	active_writes.push_back({ first, last });
+}
+
+void storage_backend_readahead::end_write(const offset_t offset, const uint32_t len)
+{
+	const block_nr_t first = offset / block_size;
+	const block_nr_t last  = (offset + len - 1) / block_size;
+
+	std::unique_lock<std::mutex> lck(lock);
+
+	auto it = std::find(active_writes.begin(), active_writes.end(), std::pair<block_nr_t, block_nr_t>(first, last));
+
+	if (it != active_writes.end())
+		active_writes.erase(it);
+}
+
+bool storage_backend_readahead::can_do_multiple_blocks() const
+{
+	return true;
+}
+
+bool storage_backend_readahead::get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *const to)
+{
+	// start reading ahead before serving this request
+	for(auto & pf : detect(block_nr, blocks_to_do))
+		submit_prefetch(pf);
+
+	block_nr_t i = 0;
+
+	while(i < blocks_to_do) {
+		if (from_buffer(block_nr + i, &to[i * block_size])) {
+			n_hits++;
+			i++;
+			continue;
+		}
+
+		// a run of blocks that are not read ahead
+		block_nr_t j = i + 1;
+
+		{
+			std::unique_lock<std::mutex> lck(lock);
+
+			while(j < blocks_to_do && buffered.find(block_nr + j) == buffered.end())
+				j++;
+		}
+
+		struct iovec iov { &to[i * block_size], size_t((j - i) * block_size) };
+		int err = 0;
+		sb->get_data_into((block_nr + i) * block_size, &iov, 1, &err);
+
+		if (err) {
+			dolog(ll_error, "storage_backend_readahead::get_multiple_blocks(%s): failed to read %ld blocks starting at %ld from %s", id.c_str(), j - i, block_nr + i, sb->get_id().c_str());
+			return false;
+		}
+
+		n_misses += j - i;
+
+		i = j;
+	}
+
+	return true;
+}
+
+bool storage_backend_readahead::get_block_into(const block_nr_t block_nr, uint8_t *const to)
+{
+	return get_multiple_blocks(block_nr, 1, to);
+}
+
+bool storage_backend_readahead::get_block(const block_nr_t block_nr, uint8_t **const data)
+{
+	*data = pool_malloc(block_size);
+	if (!*data) {
+		dolog(ll_error, "storage_backend_readahead::get_block(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
+		return false;
+	}
+
+	if (!get_block_into(block_nr, *data)) {
+		pool_free(*data);
+		*data = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+bool storage_backend_readahead::put_block(const block_nr_t block_nr, const uint8_t *const data)
+{
+	start_write(block_nr * block_size, block_size);
+
+	int err = 0;
+	sb->put_data(block_nr * block_size, block(data, block_size, false), &err);
+
+	end_write(block_nr * block_size, block_size);
+
+	return err == 0;
+}
+
+void storage_backend_readahead::put_data(const offset_t offset, const block & b, int *const err)
+{
+	stats_timer st(stats, so_put, b.get_size());
+
+	*err = 0;
+
+	if (b.get_size() == 0)
+		return;
+
+	lg.un_lock_block_group(offset, b.get_size(), block_size, true, false);
+
+	start_write(offset, b.get_size());
+
+	sb->put_data(offset, b, err);
+
+	end_write(offset, b.get_size());
+
+	lg.un_lock_block_group(offset, b.get_size(), block_size, false, false);
+}
+
+bool storage_backend_readahead::fsync()
+{
+	stats_timer st(stats, so_fsync, 0);
+
+	return sb->fsync();
+}
+
+bool storage_backend_readahead::trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err)
+{
+	stats_timer st(stats, so_trim, len);
+
+	*err = 0;
+
+	if (len == 0)
+		return true;
+
+	lg.un_lock_block_group(offset, len, block_size, true, false);
+
+	start_write(offset, len);
+
+	bool rc = sb->trim_zero(offset, len, trim, err);
+
+	end_write(offset, len);
+
+	lg.un_lock_block_group(offset, len, block_size, false, false);
+
+	return rc;
+}
+
+void storage_backend_readahead::dump_stats(const std::string & base_filename)
+{
+	size_t n_streams = 0;
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		n_streams = streams.size();
+	}
+
+	dolog(ll_info, "storage_backend_readahead(%s): %lu blocks from read-ahead, %lu read directly, %lu blocks read ahead of which %lu were evicted unused, %zu streams", id.c_str(), n_hits.load(), n_misses.load(), n_prefetched.load(), n_wasted.load(), n_streams);
+
+	sb->dump_stats(base_filename);
+}
+
+YAML::Node storage_backend_readahead::emit_configuration() const
+{
+	YAML::Node out_cfg;
+	out_cfg["id"] = id;
+	out_cfg["storage-backend"] = sb->emit_configuration();
+	out_cfg["max-memory"] = max_memory;
+	out_cfg["min-window"] = min_window * block_size;
+	out_cfg["max-window"] = max_window * block_size;
+
+	YAML::Node out;
+	out["type"] = "storage-backend-readahead";
+	out["cfg"] = out_cfg;
+
+	return out;
+}
+
+storage_backend_readahead * storage_backend_readahead::load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, std::optional<int> block_size)
+{
+	dolog(ll_info, " * storage_backend_readahead::load_configuration");
+
+	const YAML::Node cfg = yaml_get_yaml_node(node, "cfg", "storage-backend-readahead configuration");
+
+	std::string id = yaml_get_string(cfg, "id", "module id");
+
+	storage_backend *sb = storage_backend::load_configuration(cfg["storage-backend"], size, block_size);
+
+	uint64_t max_memory = yaml_get_uint64_t(cfg, "max-memory", "how much memory (in bytes) the read-ahead buffers may use", true);
+
+	uint64_t min_window = yaml_get_uint64_t(cfg, "min-window", "initial read-ahead (in bytes) of a detected stream", true);
+
+	uint64_t max_window = yaml_get_uint64_t(cfg, "max-window", "maximum read-ahead (in bytes) of a stream", true);
+
+	return new storage_backend_readahead(id, sb, max_memory, min_window, max_window);
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "storage_backend.h"
+#include "thread_pool.h"
+
+
+// Detects sequential and fixed-stride read streams and reads ahead of them
+// (asynchronously, in threads of its own) into a bounded buffer. Random access is passed through untouched. The read-ahead
+// window of a stream doubles when the read-ahead data is used and is halved
+// when it gets evicted unused.
+class storage_backend_readahead : public storage_backend
+{
+private:
+	typedef struct {
+		block_nr_t        first;
+		block_nr_t        n;
+		std::optional<block> data;
+		std::vector<bool> used;
+		size_t            stream;
+		bool              done;
+		bool              valid;  // false when overwritten or evicted while in flight
+		int               err;
+	} prefetch_t;
+
+	typedef struct {
+		block_nr_t last_start;
+		block_nr_t last_n;
+		block_nr_t stride;  // distance between the starts of reads, 0: sequential
+		int        hits;    // how often the pattern was confirmed
+		block_nr_t window;  // in blocks
+		block_nr_t prefetched_until;
+		uint64_t   last_used;
+	} stream_t;
+
+	static constexpr size_t max_streams { 16 };
+	static constexpr block_nr_t max_stride { 1024 };  // in blocks
+	static constexpr int        n_prefetch_threads { 4 };
+
+	storage_backend *const sb;
+	const uint64_t         max_memory;
+	const block_nr_t       min_window;
+	const block_nr_t       max_window;
+
+	// the read-aheads are not run in the shared pool: a thread of that pool
+	// that waits for one (e.g. via submit_get_data) could deadlock it
+	thread_pool           *tp { nullptr };
+
+	std::mutex             lock;
+	std::condition_variable cond;  // prefetch completions
+	std::vector<stream_t>  streams;
+	uint64_t               access_counter { 0 };
+	std::map<block_nr_t, std::shared_ptr<prefetch_t> > buffered;
+	std::deque<std::shared_ptr<prefetch_t> > fifo;  // oldest first, for eviction
+	block_nr_t             n_buffered { 0 };
+	int                    n_in_flight { 0 };
+	std::vector<std::pair<block_nr_t, block_nr_t> > active_writes;  // first, last
+
+	std::atomic_uint64_t   n_hits { 0 };
+	std::atomic_uint64_t   n_misses { 0 };
+	std::atomic_uint64_t   n_prefetched { 0 };
+	std::atomic_uint64_t   n_wasted { 0 };
+
+	// these expect 'lock' to be locked
+	void forget(const std::shared_ptr<prefetch_t> & pf);
+	void evict(const block_nr_t room_for);
+	// skips what is read ahead already (or is being read)
+	std::shared_ptr<prefetch_t> prepare_prefetch(const size_t stream, block_nr_t first, block_nr_t n);
+
+	std::vector<std::shared_ptr<prefetch_t> > detect(const block_nr_t block_nr, const block_nr_t n);
+	void submit_prefetch(const std::shared_ptr<prefetch_t> & pf);
+	bool from_buffer(const block_nr_t block_nr, uint8_t *const to);
+	void start_write(const offset_t offset, const uint32_t len);
+	void end_write(const offset_t offset, const uint32_t len);
+
+protected:
+	bool can_do_multiple_blocks() const override;
+	bool get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *const to) override;
+
+	bool get_block(const block_nr_t block_nr, uint8_t **const data) override;
+	bool get_block_into(const block_nr_t block_nr, uint8_t *const to) override;
+	bool put_block(const block_nr_t block_nr, const uint8_t *const data) override;
+
+public:
+	storage_backend_readahead(const std::string & id, storage_backend *const sb, const uint64_t max_memory, const uint64_t min_window, const uint64_t max_window);
+	virtual ~storage_backend_readahead();
+
+	offset_t get_size() const override;
+
+	void put_data(const offset_t offset, const block & b, int *const err) override;
+	using storage_backend::put_data;
+
+	bool fsync() override;
+
+	bool trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err) override;
+
+	void dump_stats(const std::string & base_filename) override;
+
+	YAML::Node emit_configuration() const override;
+	static storage_backend_readahead * load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, std::optional<int> block_size);
+};
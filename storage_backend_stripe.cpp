@@ -0,0 +1,511 @@
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+
+#include "buffer_pool.h"
+#include "logging.h"
+#include "str.h"
+#include "storage_backend_stripe.h"
+#include "yaml-helpers.h"
+
+
+storage_backend_stripe::storage_backend_stripe(const std::string & id, const std::vector<storage_backend *> & sbs, const uint64_t stripe_size) :
+	storage_backend(id, sbs.empty() ? 4096 : sbs.at(0)->get_block_size(), { }),
+	sbs(sbs),
+	stripe_size(stripe_size)
+{
+	// the destructor does not run when this throws
+	try {
+		if (sbs.size() < 2)
+			throw myformat("storage_backend_stripe(%s): at least 2 storage-backends are required", id.c_str());
+
+		if (stripe_size == 0 || stripe_size % block_size)
+			throw myformat("storage_backend_stripe(%s): stripe-size (%lu) must be a multiple of the block size (%d)", id.c_str(), stripe_size, block_size);
+
+		offset_t smallest = sbs.at(0)->get_size();
+
+		for(auto sb : sbs) {
+			if (sb->get_block_size() != block_size)
+				throw myformat("storage_backend_stripe(%s): %s has a different block size (%d) than %s (%d)", id.c_str(), sb->get_id().c_str(), sb->get_block_size(), sbs.at(0)->get_id().c_str(), block_size);
+
+			smallest = std::min(smallest, sb->get_size());
+		}
+
+		size = smallest / stripe_size * stripe_size * sbs.size();
+
+		if (size == 0)
+			throw myformat("storage_backend_stripe(%s): the storage-backends are smaller than the stripe-size (%lu)", id.c_str(), stripe_size);
+	}
+	catch(...) {
+		for(auto sb : sbs)
+			delete sb;
+
+		throw;
+	}
+
+	// enough for two requests that each go to all backends at the same time
+	tp = new thread_pool(sbs.size() * 2);
+}
+
+storage_backend_stripe::~storage_backend_stripe()
+{
+	delete tp;
+
+	for(auto sb : sbs)
+		delete sb;
+}
+
+offset_t storage_backend_stripe::get_size() const
+{
+	return size;
+}
+
+std::vector<storage_backend_stripe::sub_request_t> storage_backend_stripe::split(const offset_t offset, const uint64_t len, const struct iovec *const iov, const int iov_n) const
+{
+	std::vector<sub_request_t> per_sb(sbs.size());
+
+	int    iov_idx    = 0;
+	size_t iov_offset = 0;
+
+	offset_t work_offset = offset;
+	const offset_t end   = offset + len;
+
+	while(work_offset < end) {
+		const uint64_t stripe_nr  = work_offset / stripe_size;
+		const uint64_t in_stripe  = work_offset % stripe_size;
+		const uint64_t n          = std::min(stripe_size - in_stripe, end - work_offset);
+
+		sub_request_t & r = per_sb.at(stripe_nr % sbs.size());
+
+		// the stripes of a backend are consecutive on it
+		if (r.len == 0) {
+			r.sb     = sbs.at(stripe_nr % sbs.size());
+			r.offset = stripe_nr / sbs.size() * stripe_size + in_stripe;
+		}
+
+		r.len += n;
+
+		if (iov) {
+			uint64_t todo = n;
+
+			while(todo > 0) {
+				while(iov_offset == iov[iov_idx].iov_len) {
+					iov_idx++;
+					iov_offset = 0;
+				}
+
+				const size_t current = std::min(todo, iov[iov_idx].iov_len - iov_offset);
+
+				r.iov.push_back({ reinterpret_cast<uint8_t *>(iov[iov_idx].iov_base) + iov_offset, current });
+
+				iov_offset += current;
+				todo       -= current;
+			}
+		}
+
+		work_offset += n;
+	}
+
+	std::vector<sub_request_t> out;
+
+	for(auto & r : per_sb) {
+		if (r.len)
+			out.push_back(r);
+	}
+
+	return out;
+}
+
+int storage_backend_stripe::run_parallel(const std::vector<std::function<int()> > & work)
+{
+	n_requests++;
+
+	if (work.size() > 1)
+		n_split++;
+
+	return tp->run_all(work);
+}
+
+std::optional<block> storage_backend_stripe::gather(const sub_request_t & r, const block & b) const
+{
+	const uint8_t *const start = b.get_data();
+
+	if (r.iov.size() == 1)
+		return b.slice(reinterpret_cast<const uint8_t *>(r.iov.at(0).iov_base) - start, r.len);
+
+	uint8_t *buffer = pool_malloc(r.len);
+	if (!buffer) {
+		dolog(ll_error, "storage_backend_stripe::gather(%s): cannot allocate %lu bytes of memory", id.c_str(), r.len);
+		return { };
+	}
+
+	size_t o = 0;
+
+	for(auto & v : r.iov) {
+		memcpy(&buffer[o], v.iov_base, v.iov_len);
+
+		o += v.iov_len;
+	}
+
+	return block(buffer, r.len);
+}
+
+std::function<void(const int err)> storage_backend_stripe::join(const size_t n, async_done_t done)
+{
+	n_requests++;
+
+	if (n > 1)
+		n_split++;
+
+	typedef struct {
+		std::atomic_size_t left;
+		std::atomic_int    err;
+	} join_t;
+
+	std::shared_ptr<join_t> j = std::make_shared<join_t>();
+	j->left = n;
+	j->err  = 0;
+
+	return [j, done](const int err) {
+		if (err) {
+			int expected = 0;
+			j->err.compare_exchange_strong(expected, err);
+		}
+
+		if (--j->left == 0)
+			done(j->err);
+	};
+}
+
+bool storage_backend_stripe::can_do_multiple_blocks() const
+{
+	return true;
+}
+
+bool storage_backend_stripe::get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *const to)
+{
+	struct iovec iov { to, size_t(blocks_to_do * block_size) };
+
+	auto requests = split(block_nr * block_size, blocks_to_do * block_size, &iov, 1);
+
+	std::vector<std::function<int()> > work;
+
+	for(auto & r : requests) {
+		work.push_back([&r] {
+			int err = 0;
+			r.sb->get_data_into(r.offset, r.iov.data(), r.iov.size(), &err);
+
+			return err;
+		});
+	}
+
+	int err = run_parallel(work);
+
+	if (err) {
+		dolog(ll_error, "storage_backend_stripe::get_multiple_blocks(%s): failed to read %ld blocks starting at %ld: %s", id.c_str(), blocks_to_do, block_nr, strerror(err));
+		return false;
+	}
+
+	return true;
+}
+
+bool storage_backend_stripe::get_block_into(const block_nr_t block_nr, uint8_t *const to)
+{
+	const offset_t offset = block_nr * block_size;
+	const uint64_t stripe_nr = offset / stripe_size;
+
+	storage_backend *sb = sbs.at(stripe_nr % sbs.size());
+
+	struct iovec iov { to, size_t(block_size) };
+	int err = 0;
+	sb->get_data_into(stripe_nr / sbs.size() * stripe_size + offset % stripe_size, &iov, 1, &err);
+
+	if (err) {
+		dolog(ll_error, "storage_backend_stripe::get_block_into(%s): failed to read block %ld from %s: %s", id.c_str(), block_nr, sb->get_id().c_str(), strerror(err));
+		return false;
+	}
+
+	return true;
+}
+
+bool storage_backend_stripe::get_block(const block_nr_t block_nr, uint8_t **const data)
+{
+	*data = pool_malloc(block_size);
+	if (!*data) {
+		dolog(ll_error, "storage_backend_stripe::get_block(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
+		return false;
+	}
+
+	if (!get_block_into(block_nr, *data)) {
+		pool_free(*data);
+		*data = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+bool storage_backend_stripe::put_block(const block_nr_t block_nr, const uint8_t *const data)
+{
+	const offset_t offset = block_nr * block_size;
+	const uint64_t stripe_nr = offset / stripe_size;
+
+	storage_backend *sb = sbs.at(stripe_nr % sbs.size());
+
+	int err = 0;
+	sb->put_data(stripe_nr / sbs.size() * stripe_size + offset % stripe_size, block(data, block_size, false), &err);
+
+	if (err) {
+		dolog(ll_error, "storage_backend_stripe::put_block(%s): failed to write block %ld to %s: %s", id.c_str(), block_nr, sb->get_id().c_str(), strerror(err));
+		return false;
+	}
+
+	return true;
+}
+
+void storage_backend_stripe::put_data(const offset_t offset, const block & b, int *const err)
+{
+	stats_timer st(stats, so_put, b.get_size());
+
+	*err = 0;
+
+	if (b.get_size() == 0)
+		return;
+
+	if (offset + b.get_size() > size) {
+		dolog(ll_error, "storage_backend_stripe::put_data(%s): this write would be beyond the device size (%ld > %ld)", id.c_str(), offset + b.get_size(), size);
+		*err = EINVAL;
+		return;
+	}
+
+	lg.un_lock_block_group(offset, b.get_size(), block_size, true, false);
+
+	struct iovec iov { const_cast<uint8_t *>(b.get_data()), b.get_size() };
+
+	auto requests = split(offset, b.get_size(), &iov, 1);
+
+	std::vector<std::function<int()> > work;
+
+	for(auto & r : requests) {
+		work.push_back([this, &r, &b] {
+			auto data = gather(r, b);
+			if (data.has_value() == false)
+				return ENOMEM;
+
+			int err = 0;
+			r.sb->put_data(r.offset, data.value(), &err);
+
+			return err;
+		});
+	}
+
+	*err = run_parallel(work);
+
+	if (*err)
+		dolog(ll_error, "storage_backend_stripe::put_data(%s): failed to write %zu bytes at offset %ld: %s", id.c_str(), b.get_size(), offset, strerror(*err));
+
+	lg.un_lock_block_group(offset, b.get_size(), block_size, false, false);
+}
+
+bool storage_backend_stripe::fsync()
+{
+	stats_timer st(stats, so_fsync, 0);
+
+	std::vector<std::function<int()> > work;
+
+	for(auto sb : sbs)
+		work.push_back([sb] { return sb->fsync() ? 0 : EIO; });
+
+	if (run_parallel(work)) {
+		dolog(ll_error, "storage_backend_stripe::fsync(%s): failed to sync one or more storage-backends", id.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool storage_backend_stripe::trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err)
+{
+	stats_timer st(stats, so_trim, len);
+
+	*err = 0;
+
+	if (len == 0)
+		return true;
+
+	if (offset + len > size) {
+		dolog(ll_error, "storage_backend_stripe::trim_zero(%s): this trim would be beyond the device size (%ld > %ld)", id.c_str(), offset + len, size);
+		*err = EINVAL;
+		return false;
+	}
+
+	lg.un_lock_block_group(offset, len, block_size, true, false);
+
+	auto requests = split(offset, len, nullptr, 0);
+
+	std::vector<std::function<int()> > work;
+
+	for(auto & r : requests) {
+		work.push_back([&r, trim] {
+			int err = 0;
+			if (r.sb->trim_zero(r.offset, r.len, trim, &err) == false && err == 0)
+				err = EIO;
+
+			return err;
+		});
+	}
+
+	*err = run_parallel(work);
+
+	lg.un_lock_block_group(offset, len, block_size, false, false);
+
+	if (*err) {
+		dolog(ll_error, "storage_backend_stripe::trim_zero(%s): failed to trim/zero %u bytes at offset %ld: %s", id.c_str(), len, offset, strerror(*err));
+		return false;
+	}
+
+	return true;
+}
+
+void storage_backend_stripe::submit_get_data(const offset_t offset, const struct iovec *const iov, const int iov_n, async_done_t done)
+{
+	uint64_t len = 0;
+	for(int i=0; i<iov_n; i++)
+		len += iov[i].iov_len;
+
+	if (offset + len > size) {
+		dolog(ll_error, "storage_backend_stripe::submit_get_data(%s): this read would be beyond the device size (%ld > %ld)", id.c_str(), offset + len, size);
+		done(EINVAL);
+		return;
+	}
+
+	auto requests = split(offset, len, iov, iov_n);
+
+	if (requests.empty())
+		return done(0);
+
+	lg.un_lock_block_group(offset, len, block_size, true, true);
+
+	auto sub_done = join(requests.size(), unlock_wrap(offset, len, true, stats_wrap(so_get, len, done)));
+
+	for(auto & r : requests)
+		r.sb->submit_get_data(r.offset, r.iov.data(), r.iov.size(), sub_done);
+}
+
+void storage_backend_stripe::submit_put_data(const offset_t offset, const block & b, async_done_t done)
+{
+	if (offset + b.get_size() > size) {
+		dolog(ll_error, "storage_backend_stripe::submit_put_data(%s): this write would be beyond the device size (%ld > %ld)", id.c_str(), offset + b.get_size(), size);
+		done(EINVAL);
+		return;
+	}
+
+	struct iovec iov { const_cast<uint8_t *>(b.get_data()), b.get_size() };
+
+	auto requests = split(offset, b.get_size(), &iov, 1);
+
+	if (requests.empty())
+		return done(0);
+
+	lg.un_lock_block_group(offset, b.get_size(), block_size, true, false);
+
+	auto sub_done = join(requests.size(), unlock_wrap(offset, b.get_size(), false, stats_wrap(so_put, b.get_size(), done)));
+
+	for(auto & r : requests) {
+		auto data = gather(r, b);
+
+		if (data.has_value())
+			r.sb->submit_put_data(r.offset, data.value(), sub_done);
+		else
+			sub_done(ENOMEM);
+	}
+}
+
+void storage_backend_stripe::submit_trim_zero(const offset_t offset, const uint32_t len, const bool trim, async_done_t done)
+{
+	if (offset + len > size) {
+		dolog(ll_error, "storage_backend_stripe::submit_trim_zero(%s): this trim would be beyond the device size (%ld > %ld)", id.c_str(), offset + len, size);
+		done(EINVAL);
+		return;
+	}
+
+	auto requests = split(offset, len, nullptr, 0);
+
+	if (requests.empty())
+		return done(0);
+
+	lg.un_lock_block_group(offset, len, block_size, true, false);
+
+	auto sub_done = join(requests.size(), unlock_wrap(offset, len, false, stats_wrap(so_trim, len, done)));
+
+	for(auto & r : requests)
+		r.sb->submit_trim_zero(r.offset, r.len, trim, sub_done);
+}
+
+void storage_backend_stripe::submit_fsync(async_done_t done)
+{
+	auto sub_done = join(sbs.size(), stats_wrap(so_fsync, 0, done));
+
+	for(auto sb : sbs)
+		sb->submit_fsync(sub_done);
+}
+
+void storage_backend_stripe::dump_stats(const std::string & base_filename)
+{
+	dolog(ll_info, "storage_backend_stripe(%s): %lu requests of which %lu were split over multiple storage-backends", id.c_str(), n_requests.load(), n_split.load());
+
+	for(auto sb : sbs)
+		sb->dump_stats(base_filename);
+}
+
+YAML::Node storage_backend_stripe::emit_configuration() const
+{
+	std::vector<YAML::Node> out_sbs;
+	for(auto sb : sbs)
+		out_sbs.push_back(sb->emit_configuration());
+
+	YAML::Node out_cfg;
+	out_cfg["id"] = id;
+	out_cfg["storage-backends"] = out_sbs;
+	out_cfg["stripe-size"] = stripe_size;
+
+	YAML::Node out;
+	out["type"] = "storage-backend-stripe";
+	out["cfg"] = out_cfg;
+
+	return out;
+}
+
+storage_backend_stripe * storage_backend_stripe::load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, std::optional<int> block_size)
+{
+	dolog(ll_info, " * storage_backend_stripe::load_configuration");
+
+	const YAML::Node cfg = yaml_get_yaml_node(node, "cfg", "storage-backend-stripe configuration");
+
+	std::string id = yaml_get_string(cfg, "id", "module id");
+
+	uint64_t stripe_size = yaml_get_uint64_t(cfg, "stripe-size", "how many bytes go to a storage-backend before switching to the next", true);
+
+	const YAML::Node y_sbs = yaml_get_yaml_node(cfg, "storage-backends", "the storage-backends to stripe over");
+
+	// each holds a part of the total
+	std::optional<uint64_t> sb_size;
+	if (size.has_value() && y_sbs.size() > 0)
+		sb_size = size.value() / y_sbs.size();
+
+	std::vector<storage_backend *> sbs;
+	for(YAML::const_iterator it = y_sbs.begin(); it != y_sbs.end(); it++) {
+		storage_backend *sb = storage_backend::load_configuration(it->as<YAML::Node>(), sb_size, block_size);
+
+		if (!sb) {
+			for(auto s : sbs)
+				delete s;
+
+			throw myformat("storage_backend_stripe::load_configuration(%s): failed to configure a storage-backend", id.c_str());
+		}
+
+		sbs.push_back(sb);
+	}
+
+	return new storage_backend_stripe(id, sbs, stripe_size);
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <atomic>
+#include <optional>
+#include <vector>
+#include <sys/uio.h>
+
+#include "storage_backend.h"
+#include "thread_pool.h"
+
+
+// RAID-0: the address space is cut in units of 'stripe_size' bytes that go
+// round-robin to the underlying backends. A request that spans more than one
+// of them is split in one sub-request per backend (the part for a backend is
+// always contiguous on that backend) and these are executed in parallel.
+class storage_backend_stripe : public storage_backend
+{
+private:
+	typedef struct {
+		storage_backend          *sb;
+		offset_t                  offset;  // on 'sb'
+		uint64_t                  len;
+		std::vector<struct iovec> iov;     // where the data is in the request, in order
+	} sub_request_t;
+
+	const std::vector<storage_backend *> sbs;
+	const uint64_t                       stripe_size;
+	offset_t                             size { 0 };
+
+	// the synchronous sub-requests are not run in the shared pool: a thread of
+	// that pool that waits for them (e.g. via submit_get_data) could deadlock it
+	thread_pool                         *tp { nullptr };
+
+	std::atomic_uint64_t                 n_requests { 0 };
+	std::atomic_uint64_t                 n_split { 0 };  // requests that went to more than one backend
+
+	// 'iov' may be nullptr (for trim_zero and fsync)
+	std::vector<sub_request_t> split(const offset_t offset, const uint64_t len, const struct iovec *const iov, const int iov_n) const;
+	// counts the request, then tp->run_all()
+	int run_parallel(const std::vector<std::function<int()> > & work);
+	// the data of a sub-request of a write, copied when it is scattered
+	std::optional<block> gather(const sub_request_t & r, const block & b) const;
+	// invokes 'done' when all sub-requests have finished (with the first error)
+	std::function<void(const int err)> join(const size_t n, async_done_t done);
+
+protected:
+	bool can_do_multiple_blocks() const override;
+	bool get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *const to) override;
+
+	bool get_block(const block_nr_t block_nr, uint8_t **const data) override;
+	bool get_block_into(const block_nr_t block_nr, uint8_t *const to) override;
+	bool put_block(const block_nr_t block_nr, const uint8_t *const data) override;
+
+public:
+	storage_backend_stripe(const std::string & id, const std::vector<storage_backend *> & sbs, const uint64_t stripe_size);
+	virtual ~storage_backend_stripe();
+
+	offset_t get_size() const override;
+
+	void put_data(const offset_t offset, const block & b, int *const err) override;
+	using storage_backend::put_data;
+
+	bool fsync() override;
+
+	bool trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err) override;
+
+	void submit_get_data(const offset_t offset, const struct iovec *const iov, const int iov_n, async_done_t done) override;
+	void submit_put_data(const offset_t offset, const block & b, async_done_t done) override;
+	void submit_trim_zero(const offset_t offset, const uint32_t len, const bool trim, async_done_t done) override;
+	void submit_fsync(async_done_t done) override;
+
+	void dump_stats(const std::string & base_filename) override;
+
+	YAML::Node emit_configuration() const override;
+	static storage_backend_stripe * load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, std::optional<int> block_size);
+};
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <arpa/inet.h>
 
+#include "buffer_pool.h"
 #include "hash.h"
 #include "logging.h"
 #include "mirror.h"
@@ -64,6 +65,23 @@ uint64_t storage_backend_tiering::hash_block_nr(const uint64_t block_nr)
 }
 
 bool storage_backend_tiering::get_block(const block_nr_t block_nr, uint8_t **const data)
+{
+	*data = pool_malloc(block_size);
+	if (!*data) {
+		dolog(ll_error, "storage_backend_tiering::get_block(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
+		return false;
+	}
+
+	if (get_block_into(block_nr, *data) == false) {
+		pool_free(*data);
+		*data = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+bool storage_backend_tiering::get_block_into(const block_nr_t block_nr, uint8_t *const to)
 {
 	bool     ok = true;
 	uint64_t complete_block_nr_hash = hash_block_nr(block_nr);
@@ -77,18 +95,19 @@ bool storage_backend_tiering::get_block(const block_nr_t block_nr, uint8_t **con
 
 	lgt.un_lock_block_group(map_index, 1, 1, true, false);
 
-	uint8_t *dp = nullptr;
+	descriptor_bin_t descriptor { };
+	struct iovec     descriptor_iov { &descriptor, sizeof descriptor };
 	int err = 0;
-	meta_storage->get_data(map_index * sizeof(descriptor_bin_t), sizeof(descriptor_bin_t), &dp, &err);
+	meta_storage->get_data_into(map_index * sizeof(descriptor_bin_t), &descriptor_iov, 1, &err);
 
 	if (err) {
 		lgt.un_lock_block_group(map_index, 1, 1, false, false);
 
-		dolog(ll_error, "storage_backend_tiering::get_block(%s): failed retrieving block from meta storage (%s): %s", id.c_str(), meta_storage->get_id().c_str(), strerror(err));
+		dolog(ll_error, "storage_backend_tiering::get_block_into(%s): failed retrieving block from meta storage (%s): %s", id.c_str(), meta_storage->get_id().c_str(), strerror(err));
 		return false;
 	}
 
-	descriptor_bin_t *d = reinterpret_cast<descriptor_bin_t *>(dp);
+	descriptor_bin_t *d = &descriptor;
 
 	int replace_slot = -1;
 	uint64_t oldest = UINT64_MAX;
@@ -106,11 +125,12 @@ bool storage_backend_tiering::get_block(const block_nr_t block_nr, uint8_t **con
 	}
 
 	if (match) {
+		struct iovec iov { to, size_t(f_s_block_size) };
 		int err = 0;
-		fast_storage->get_data(map_index * f_s_block_size, f_s_block_size, data, &err);
+		fast_storage->get_data_into(map_index * f_s_block_size, &iov, 1, &err);
 
 		if (err) {
-			dolog(ll_error, "storage_backend_tiering::get_block(%s): failed retrieving block from fast storage (%s): %s", id.c_str(), fast_storage->get_id().c_str(), strerror(err));
+			dolog(ll_error, "storage_backend_tiering::get_block_into(%s): failed retrieving block from fast storage (%s): %s", id.c_str(), fast_storage->get_id().c_str(), strerror(err));
 			ok = false;
 		}
 		else {
@@ -126,7 +146,7 @@ bool storage_backend_tiering::get_block(const block_nr_t block_nr, uint8_t **con
 			int g_err = 0;
 			fast_storage->get_data(map_index * f_s_block_size, f_s_block_size, &dirty_block, &g_err);
 			if (g_err) {
-				dolog(ll_error, "storage_backend_tiering::get_block(%s): failed retrieving block from fast storage (%s): %s", id.c_str(), fast_storage->get_id().c_str(), strerror(g_err));
+				dolog(ll_error, "storage_backend_tiering::get_block_into(%s): failed retrieving block from fast storage (%s): %s", id.c_str(), fast_storage->get_id().c_str(), strerror(g_err));
 				ok = false;
 			}
 			else {
@@ -136,7 +156,7 @@ bool storage_backend_tiering::get_block(const block_nr_t block_nr, uint8_t **con
 				int p_err = 0;
 				slow_storage->put_data(d->d[replace_slot].block_nr_slow_storage * f_s_block_size, *dirty_block, &p_err);
 				if (p_err) {
-					dolog(ll_error, "storage_backend_tiering::get_block(%s): failed writing dirty block to slow storage (%s): %s", id.c_str(), slow_storage->get_id().c_str(), strerror(p_err));
+					dolog(ll_error, "storage_backend_tiering::get_block_into(%s): failed writing dirty block to slow storage (%s): %s", id.c_str(), slow_storage->get_id().c_str(), strerror(p_err));
 					ok = false;
 				}
 			}
@@ -149,25 +169,37 @@ bool storage_backend_tiering::get_block(const block_nr_t block_nr, uint8_t **con
 
 		slow_hist->count(block_nr);
 
+		struct iovec iov { to, size_t(f_s_block_size) };
 		int g_err = 0;
-		slow_storage->get_data(block_nr * f_s_block_size, f_s_block_size, data, &g_err);
+		slow_storage->get_data_into(block_nr * f_s_block_size, &iov, 1, &g_err);
 		if (g_err) {
-			dolog(ll_error, "storage_backend_tiering::get_block(%s): failed retrieving block from slow storage (%s): %s", id.c_str(), slow_storage->get_id().c_str(), strerror(g_err));
+			dolog(ll_error, "storage_backend_tiering::get_block_into(%s): failed retrieving block from slow storage (%s): %s", id.c_str(), slow_storage->get_id().c_str(), strerror(g_err));
 			ok = false;
 		}
 		else {
-			d->d[replace_slot].complete_block_nr_hash = complete_block_nr_hash;
-			d->d[replace_slot].block_nr_slow_storage  = block_nr;
-			d->d[replace_slot].age   = now;
-			d->d[replace_slot].flags = 0;
+			// the descriptor is going to point to the fast storage so the block must be there
+			block new_data(to, f_s_block_size, false);
+
+			int p_err = 0;
+			fast_storage->put_data(map_index * f_s_block_size, new_data, &p_err);
+			if (p_err) {
+				dolog(ll_error, "storage_backend_tiering::get_block_into(%s): failed storing block in fast storage (%s): %s", id.c_str(), fast_storage->get_id().c_str(), strerror(p_err));
+				ok = false;
+			}
+			else {
+				d->d[replace_slot].complete_block_nr_hash = complete_block_nr_hash;
+				d->d[replace_slot].block_nr_slow_storage  = block_nr;
+				d->d[replace_slot].age   = now;
+				d->d[replace_slot].flags = 0;
+			}
 		}
 	}
 
-	block bd(dp, sizeof(descriptor_bin_t));
+	block bd(reinterpret_cast<const uint8_t *>(&descriptor), sizeof(descriptor_bin_t), false);
 	meta_storage->put_data(map_index * sizeof(descriptor_bin_t), bd, &err);  // TODO alleen 'replace_slot', niet de hele descriptor_bin_t
 
 	if (err) {
-		dolog(ll_error, "storage_backend_tiering::get_block(%s): failed storing block into meta storage (%s): %s", id.c_str(), meta_storage->get_id().c_str(), strerror(err));
+		dolog(ll_error, "storage_backend_tiering::get_block_into(%s): failed storing block into meta storage (%s): %s", id.c_str(), meta_storage->get_id().c_str(), strerror(err));
 
 		ok = false;
 	}
@@ -191,9 +223,10 @@ bool storage_backend_tiering::put_block(const block_nr_t block_nr, const uint8_t
 
 	lgt.un_lock_block_group(map_index, 1, 1, true, false);
 
-	uint8_t *dp = nullptr;
+	descriptor_bin_t descriptor { };
+	struct iovec     descriptor_iov { &descriptor, sizeof descriptor };
 	int err = 0;
-	meta_storage->get_data(map_index * sizeof(descriptor_bin_t), sizeof(descriptor_bin_t), &dp, &err);
+	meta_storage->get_data_into(map_index * sizeof(descriptor_bin_t), &descriptor_iov, 1, &err);
 
 	if (err) {
 		lgt.un_lock_block_group(map_index, 1, 1, false, false);
@@ -202,7 +235,7 @@ bool storage_backend_tiering::put_block(const block_nr_t block_nr, const uint8_t
 		return false;
 	}
 
-	descriptor_bin_t *d = reinterpret_cast<descriptor_bin_t *>(dp);
+	descriptor_bin_t *d = &descriptor;
 
 	int replace_slot = -1;
 	uint64_t oldest = UINT64_MAX;
@@ -280,7 +313,7 @@ bool storage_backend_tiering::put_block(const block_nr_t block_nr, const uint8_t
 		}
 	}
 
-	block bd(dp, sizeof(descriptor_bin_t));
+	block bd(reinterpret_cast<const uint8_t *>(&descriptor), sizeof(descriptor_bin_t), false);
 	meta_storage->put_data(map_index * sizeof(descriptor_bin_t), bd, &err);
 
 	if (err) {
@@ -301,6 +334,8 @@ offset_t storage_backend_tiering::get_size() const
 
 bool storage_backend_tiering::fsync()
 {
+	stats_timer st(stats, so_fsync, 0);
+
 	bool ok = true;
 
 	if (fast_storage->fsync() == false) {
@@ -328,11 +363,13 @@ bool storage_backend_tiering::can_do_multiple_blocks() const
 
 bool storage_backend_tiering::trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err)
 {
+	stats_timer st(stats, so_trim, len);
+
 	*err = 0;
 
 	int      f_s_block_size = fast_storage->get_block_size();
 
-	uint8_t *b0x00 = reinterpret_cast<uint8_t *>(calloc(1, f_s_block_size));
+	uint8_t *b0x00 = pool_calloc(f_s_block_size);
 
 	offset_t work_offset = offset;
 	size_t work_size = len;
@@ -368,22 +405,25 @@ bool storage_backend_tiering::trim_zero(const offset_t offset, const uint32_t le
 			if (!put_block(block_nr, temp)) {
 				dolog(ll_error, "storage_backend_tiering::trim_zero(%s): failed to update block %ld", id.c_str(), id.c_str(), block_nr);
 				*err = EIO;
-				free(temp);
+				pool_free(temp);
 				break;
 			}
 
-			free(temp);
+			pool_free(temp);
 		}
 
 		work_offset += current_size;
 		work_size -= current_size;
 	}
 
+	// inside the lock so that the mirrors see the writes to a region in the same order
+	bool mirrors_ok = do_mirror_trim_zero(offset, len, trim);
+
 	lg.un_lock_block_group(offset, len, f_s_block_size, false, false);
 
-	free(b0x00);
+	pool_free(b0x00);
 
-	if (do_mirror_trim_zero(offset, len, trim) == false) {
+	if (mirrors_ok == false) {
 		dolog(ll_error, "storage_backend_tiering::trim_zero(%s): failed to send to mirror(s)", id.c_str(), id.c_str());
 		return false;
 	}
@@ -44,6 +44,7 @@ private:
 	bool can_do_multiple_blocks() const override;
 
         bool get_block(const block_nr_t block_nr, uint8_t **const data) override;
+        bool get_block_into(const block_nr_t block_nr, uint8_t *const to) override;
         bool put_block(const block_nr_t block_nr, const uint8_t *const data) override;
 
 public:
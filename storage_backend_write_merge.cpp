@@ -0,0 +1,562 @@
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <string.h>
+
+#include "buffer_pool.h"
+#include "logging.h"
+#include "str.h"
+#include "storage_backend_write_merge.h"
+#include "time.h"
+#include "yaml-helpers.h"
+
+
+storage_backend_write_merge::storage_backend_write_merge(const std::string & id, storage_backend *const sb, const int max_age, const uint64_t max_memory) :
+	storage_backend(id, sb->get_block_size(), { }),
+	sb(sb),
+	max_age(max_age),
+	max_memory(max_memory),
+	n_sectors(sb->get_block_size() / sector_size)
+{
+	if (block_size % sector_size)
+		throw myformat("storage_backend_write_merge(%s): block size (%d) must be a multiple of %d", id.c_str(), block_size, sector_size);
+
+	th = new std::thread(std::ref(*this));
+}
+
+storage_backend_write_merge::~storage_backend_write_merge()
+{
+	stop_flag = true;
+
+	cond.notify_all();
+
+	if (th) {
+		th->join();
+		delete th;
+	}
+
+	if (flush(true) == false)
+		dolog(ll_error, "~storage_backend_write_merge(%s): failed to flush %zu pending block(s)", id.c_str(), pending.size());
+
+	for(auto & p : pending)
+		pool_free(p.second.data);
+
+	delete sb;
+}
+
+offset_t storage_backend_write_merge::get_size() const
+{
+	return sb->get_size();
+}
+
+void storage_backend_write_merge::overlay(const pending_block_t & pb, uint8_t *const to) const
+{
+	auto is_valid = [&pb](const int s) { return pb.valid[s / 64] & (1ull << (s & 63)); };
+
+	int s = 0;
+
+	while(s < n_sectors) {
+		if (!is_valid(s)) {
+			s++;
+			continue;
+		}
+
+		// copy runs of valid sectors in one go
+		int e = s + 1;
+		while(e < n_sectors && is_valid(e))
+			e++;
+
+		memcpy(&to[s * sector_size], &pb.data[s * sector_size], (e - s) * sector_size);
+
+		s = e;
+	}
+}
+
+// data == nullptr: merge 0x00 bytes
+// *complete is set to the block when all its sectors are valid, it is then no longer pending
+bool storage_backend_write_merge::merge(const block_nr_t block_nr, const uint32_t block_offset, const uint8_t *const data, const uint32_t len, uint8_t **const complete)
+{
+	*complete = nullptr;
+
+	std::unique_lock<std::mutex> lck(lock);
+
+	auto it = pending.find(block_nr);
+
+	if (it == pending.end()) {
+		uint8_t *buffer = pool_malloc(block_size);
+		if (!buffer) {
+			dolog(ll_error, "storage_backend_write_merge::merge(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
+			return false;
+		}
+
+		it = pending.insert({ block_nr, { buffer, std::vector<uint64_t>((n_sectors + 63) / 64), 0, get_ms() } }).first;
+	}
+
+	pending_block_t & pb = it->second;
+
+	if (data)
+		memcpy(&pb.data[block_offset], data, len);
+	else
+		memset(&pb.data[block_offset], 0x00, len);
+
+	for(uint32_t s = block_offset / sector_size; s < (block_offset + len) / sector_size; s++) {
+		const uint64_t mask = 1ull << (s & 63);
+
+		if ((pb.valid[s / 64] & mask) == 0) {
+			pb.valid[s / 64] |= mask;
+			pb.n_valid++;
+		}
+	}
+
+	if (pb.n_valid == n_sectors) {
+		*complete = pb.data;
+
+		pending.erase(it);
+	}
+
+	return true;
+}
+
+bool storage_backend_write_merge::write_block(const block_nr_t block_nr, const uint8_t *const data)
+{
+	int err = 0;
+	sb->put_data(block_nr * block_size, block(data, block_size, false), &err);
+
+	if (err) {
+		dolog(ll_error, "storage_backend_write_merge::write_block(%s): failed to write block %ld to %s", id.c_str(), block_nr, sb->get_id().c_str());
+		return false;
+	}
+
+	return true;
+}
+
+// caller must have locked block_nr in 'lg' (exclusive)
+bool storage_backend_write_merge::flush_block(const block_nr_t block_nr)
+{
+	pending_block_t pb;
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		auto it = pending.find(block_nr);
+		if (it == pending.end())
+			return true;
+
+		pb = std::move(it->second);
+
+		pending.erase(it);
+	}
+
+	bool ok = false;
+
+	uint8_t *temp = pool_malloc(block_size);
+
+	if (temp) {
+		struct iovec iov { temp, size_t(block_size) };
+		int err = 0;
+		sb->get_data_into(block_nr * block_size, &iov, 1, &err);
+
+		if (err)
+			dolog(ll_error, "storage_backend_write_merge::flush_block(%s): failed to read block %ld from %s", id.c_str(), block_nr, sb->get_id().c_str());
+		else {
+			overlay(pb, temp);
+
+			ok = write_block(block_nr, temp);
+		}
+
+		pool_free(temp);
+	}
+	else {
+		dolog(ll_error, "storage_backend_write_merge::flush_block(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
+	}
+
+	if (!ok) {
+		// keep it for a next attempt; no-one could have touched it while 'lg' is locked
+		std::unique_lock<std::mutex> lck(lock);
+
+		pending.insert({ block_nr, std::move(pb) });
+
+		return false;
+	}
+
+	pool_free(pb.data);
+
+	n_rmw_performed++;
+
+	return true;
+}
+
+bool storage_backend_write_merge::flush(const bool all)
+{
+	std::vector<block_nr_t> todo;
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		uint64_t now = get_ms();
+
+		for(auto & p : pending) {
+			if (all || now - p.second.since >= uint64_t(max_age))
+				todo.push_back(p.first);
+		}
+	}
+
+	bool ok = true;
+
+	for(auto block_nr : todo) {
+		lg.un_lock_block_group(block_nr * block_size, block_size, block_size, true, false);
+
+		if (flush_block(block_nr) == false)
+			ok = false;
+
+		lg.un_lock_block_group(block_nr * block_size, block_size, block_size, false, false);
+	}
+
+	return ok;
+}
+
+// flush the oldest blocks until there's 25% room below max_memory
+bool storage_backend_write_merge::flush_oldest()
+{
+	std::vector<std::pair<uint64_t, block_nr_t> > by_age;
+	size_t n_to_flush = 0;
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		if (pending.size() * block_size <= max_memory)
+			return true;
+
+		for(auto & p : pending)
+			by_age.push_back({ p.second.since, p.first });
+
+		n_to_flush = pending.size() - std::min(pending.size(), size_t(max_memory * 3 / 4 / block_size));
+	}
+
+	std::sort(by_age.begin(), by_age.end());
+
+	bool ok = true;
+
+	for(size_t i=0; i<n_to_flush; i++) {
+		block_nr_t block_nr = by_age.at(i).second;
+
+		lg.un_lock_block_group(block_nr * block_size, block_size, block_size, true, false);
+
+		if (flush_block(block_nr) == false)
+			ok = false;
+
+		lg.un_lock_block_group(block_nr * block_size, block_size, block_size, false, false);
+	}
+
+	return ok;
+}
+
+bool storage_backend_write_merge::can_do_multiple_blocks() const
+{
+	return true;
+}
+
+bool storage_backend_write_merge::get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *const to)
+{
+	struct iovec iov { to, size_t(blocks_to_do * block_size) };
+	int err = 0;
+	sb->get_data_into(block_nr * block_size, &iov, 1, &err);
+
+	if (err) {
+		dolog(ll_error, "storage_backend_write_merge::get_multiple_blocks(%s): failed to read %ld blocks starting at %ld from %s", id.c_str(), blocks_to_do, block_nr, sb->get_id().c_str());
+		return false;
+	}
+
+	std::unique_lock<std::mutex> lck(lock);
+
+	for(auto it = pending.lower_bound(block_nr); it != pending.end() && it->first < block_nr + blocks_to_do; it++)
+		overlay(it->second, &to[(it->first - block_nr) * block_size]);
+
+	return true;
+}
+
+bool storage_backend_write_merge::get_block_into(const block_nr_t block_nr, uint8_t *const to)
+{
+	return get_multiple_blocks(block_nr, 1, to);
+}
+
+bool storage_backend_write_merge::get_block(const block_nr_t block_nr, uint8_t **const data)
+{
+	*data = pool_malloc(block_size);
+	if (!*data) {
+		dolog(ll_error, "storage_backend_write_merge::get_block(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
+		return false;
+	}
+
+	if (!get_block_into(block_nr, *data)) {
+		pool_free(*data);
+		*data = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+bool storage_backend_write_merge::put_block(const block_nr_t block_nr, const uint8_t *const data)
+{
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		auto it = pending.find(block_nr);
+		if (it != pending.end()) {
+			pool_free(it->second.data);
+
+			pending.erase(it);
+		}
+	}
+
+	return write_block(block_nr, data);
+}
+
+void storage_backend_write_merge::put_data(const offset_t offset, const block & b, int *const err)
+{
+	stats_timer st(stats, so_put, b.get_size());
+
+	*err = 0;
+
+	lg.un_lock_block_group(offset, b.get_size(), block_size, true, false);
+
+	offset_t work_offset = offset;
+	size_t   input_offset = 0;
+	size_t   work_size = b.get_size();
+
+	while(work_size > 0) {
+		block_nr_t block_nr = work_offset / block_size;
+		uint32_t block_offset = work_offset % block_size;
+
+		size_t current_size = std::min(work_size, size_t(block_size - block_offset));
+
+		if (block_offset == 0 && current_size == size_t(block_size)) {
+			// run of whole blocks: they replace whatever was pending for them
+			block_nr_t n_blocks = work_size / block_size;
+
+			current_size = n_blocks * block_size;
+
+			{
+				std::unique_lock<std::mutex> lck(lock);
+
+				auto it = pending.lower_bound(block_nr);
+
+				while(it != pending.end() && it->first < block_nr + n_blocks) {
+					pool_free(it->second.data);
+
+					it = pending.erase(it);
+				}
+			}
+
+			sb->put_data(work_offset, b.slice(input_offset, current_size), err);
+
+			if (*err) {
+				dolog(ll_error, "storage_backend_write_merge::put_data(%s): failed to write %ld blocks starting at %ld", id.c_str(), n_blocks, block_nr);
+				break;
+			}
+		}
+		else if (block_offset % sector_size == 0 && current_size % sector_size == 0) {
+			n_partial_writes++;
+
+			uint8_t *complete = nullptr;
+
+			if (!merge(block_nr, block_offset, b.get_data() + input_offset, current_size, &complete)) {
+				*err = ENOMEM;
+				break;
+			}
+
+			if (complete) {
+				bool ok = write_block(block_nr, complete);
+
+				pool_free(complete);
+
+				if (!ok) {
+					*err = EINVAL;
+					break;
+				}
+
+				n_rmw_avoided++;
+			}
+		}
+		else {
+			// not sector aligned: let the underlying storage do the read-modify-write
+			n_partial_writes++;
+
+			if (!flush_block(block_nr)) {
+				*err = EINVAL;
+				break;
+			}
+
+			sb->put_data(work_offset, b.slice(input_offset, current_size), err);
+
+			if (*err) {
+				dolog(ll_error, "storage_backend_write_merge::put_data(%s): failed to update block %ld", id.c_str(), block_nr);
+				break;
+			}
+
+			n_rmw_performed++;
+		}
+
+		work_offset += current_size;
+		input_offset += current_size;
+		work_size -= current_size;
+	}
+
+	lg.un_lock_block_group(offset, b.get_size(), block_size, false, false);
+
+	if (*err == 0 && flush_oldest() == false)
+		dolog(ll_warning, "storage_backend_write_merge::put_data(%s): failed to flush pending blocks", id.c_str());
+}
+
+bool storage_backend_write_merge::fsync()
+{
+	stats_timer st(stats, so_fsync, 0);
+
+	if (flush(true) == false) {
+		dolog(ll_error, "storage_backend_write_merge::fsync(%s): failed to flush pending blocks", id.c_str());
+		return false;
+	}
+
+	return sb->fsync();
+}
+
+bool storage_backend_write_merge::trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err)
+{
+	stats_timer st(stats, so_trim, len);
+
+	*err = 0;
+
+	lg.un_lock_block_group(offset, len, block_size, true, false);
+
+	offset_t work_offset = offset;
+	size_t   work_size = len;
+
+	while(work_size > 0) {
+		block_nr_t block_nr = work_offset / block_size;
+		uint32_t block_offset = work_offset % block_size;
+
+		size_t current_size = std::min(work_size, size_t(block_size - block_offset));
+
+		if (block_offset == 0 && current_size == size_t(block_size)) {
+			block_nr_t n_blocks = work_size / block_size;
+
+			current_size = n_blocks * block_size;
+
+			{
+				std::unique_lock<std::mutex> lck(lock);
+
+				auto it = pending.lower_bound(block_nr);
+
+				while(it != pending.end() && it->first < block_nr + n_blocks) {
+					pool_free(it->second.data);
+
+					it = pending.erase(it);
+				}
+			}
+
+			if (sb->trim_zero(work_offset, current_size, trim, err) == false)
+				break;
+		}
+		else if (block_offset % sector_size == 0 && current_size % sector_size == 0) {
+			uint8_t *complete = nullptr;
+
+			if (!merge(block_nr, block_offset, nullptr, current_size, &complete)) {
+				*err = ENOMEM;
+				break;
+			}
+
+			if (complete) {
+				bool ok = write_block(block_nr, complete);
+
+				pool_free(complete);
+
+				if (!ok) {
+					*err = EINVAL;
+					break;
+				}
+
+				n_rmw_avoided++;
+			}
+		}
+		else {
+			if (!flush_block(block_nr)) {
+				*err = EINVAL;
+				break;
+			}
+
+			if (sb->trim_zero(work_offset, current_size, trim, err) == false)
+				break;
+		}
+
+		work_offset += current_size;
+		work_size -= current_size;
+	}
+
+	lg.un_lock_block_group(offset, len, block_size, false, false);
+
+	if (*err)
+		dolog(ll_error, "storage_backend_write_merge::trim_zero(%s): failed to %s %u bytes at offset %ld", id.c_str(), trim ? "trim" : "zero", len, offset);
+
+	return *err == 0;
+}
+
+void storage_backend_write_merge::dump_stats(const std::string & base_filename)
+{
+	dolog(ll_info, "storage_backend_write_merge(%s): %lu partial writes, read-modify-write avoided: %lu, performed: %lu", id.c_str(), n_partial_writes.load(), n_rmw_avoided.load(), n_rmw_performed.load());
+
+	sb->dump_stats(base_filename);
+}
+
+void storage_backend_write_merge::operator()()
+{
+	dolog(ll_info, "storage_backend_write_merge::operator(%s): thread started", id.c_str());
+
+	while(!stop_flag) {
+		{
+			std::unique_lock<std::mutex> lck(lock);
+
+			cond.wait_for(lck, std::chrono::milliseconds(std::max(1, max_age / 2)));
+		}
+
+		if (stop_flag) {
+			dolog(ll_debug, "storage_backend_write_merge::operator(%s): thread terminating", id.c_str());
+			break;
+		}
+
+		if (flush(false) == false)
+			dolog(ll_warning, "storage_backend_write_merge::operator(%s): failed to flush expired blocks", id.c_str());
+	}
+}
+
+YAML::Node storage_backend_write_merge::emit_configuration() const
+{
+	YAML::Node out_cfg;
+	out_cfg["id"] = id;
+	out_cfg["storage-backend"] = sb->emit_configuration();
+	out_cfg["max-age"] = max_age;
+	out_cfg["max-memory"] = max_memory;
+
+	YAML::Node out;
+	out["type"] = "storage-backend-write-merge";
+	out["cfg"] = out_cfg;
+
+	return out;
+}
+
+storage_backend_write_merge * storage_backend_write_merge::load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, std::optional<int> block_size)
+{
+	dolog(ll_info, " * storage_backend_write_merge::load_configuration");
+
+	const YAML::Node cfg = yaml_get_yaml_node(node, "cfg", "storage-backend-write-merge configuration");
+
+	std::string id = yaml_get_string(cfg, "id", "module id");
+
+	storage_backend *sb = storage_backend::load_configuration(cfg["storage-backend"], size, block_size);
+
+	int max_age = yaml_get_int(cfg, "max-age", "how long (in milliseconds) to wait for the rest of a partially written block before doing a read-modify-write");
+
+	uint64_t max_memory = yaml_get_uint64_t(cfg, "max-memory", "maximum amount of memory for partially written blocks", true);
+
+	return new storage_backend_write_merge(id, sb, max_age, max_memory);
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "storage_backend.h"
+
+
+// Writes that cover only a part of a block of the underlying storage would
+// require a read-modify-write cycle. This layer holds such (sector aligned)
+// partial writes for a short while so that the neighbouring writes that
+// complete the block can be merged in first: then the block is written in
+// one go without reading it. Only when a block stays incomplete for longer
+// than max_age, when max_memory is exceeded or at fsync, the remaining
+// sectors are read from the underlying storage.
+class storage_backend_write_merge : public storage_backend
+{
+private:
+	typedef struct {
+		uint8_t              *data;     // block_size bytes, pool_malloc()
+		std::vector<uint64_t> valid;    // one bit per sector
+		int                   n_valid;  // number of bits set in valid
+		uint64_t              since;    // get_ms() of the first write
+	} pending_block_t;
+
+	static constexpr int sector_size { 512 };
+
+	storage_backend *const sb;
+	const int              max_age;  // in milliseconds
+	const uint64_t         max_memory;
+	const int              n_sectors;
+
+	std::mutex             lock;  // protects 'pending'
+	std::condition_variable cond;
+	std::map<block_nr_t, pending_block_t> pending;
+
+	std::thread           *th { nullptr };
+
+	std::atomic_uint64_t   n_partial_writes { 0 };
+	std::atomic_uint64_t   n_rmw_avoided { 0 };
+	std::atomic_uint64_t   n_rmw_performed { 0 };
+
+	void overlay(const pending_block_t & pb, uint8_t *const to) const;
+	bool merge(const block_nr_t block_nr, const uint32_t block_offset, const uint8_t *const data, const uint32_t len, uint8_t **const complete);
+	bool write_block(const block_nr_t block_nr, const uint8_t *const data);
+	bool flush_block(const block_nr_t block_nr);
+	bool flush(const bool all);
+	bool flush_oldest();
+
+protected:
+	bool can_do_multiple_blocks() const override;
+	bool get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *const to) override;
+
+	bool get_block(const block_nr_t block_nr, uint8_t **const data) override;
+	bool get_block_into(const block_nr_t block_nr, uint8_t *const to) override;
+	bool put_block(const block_nr_t block_nr, const uint8_t *const data) override;
+
+public:
+	storage_backend_write_merge(const std::string & id, storage_backend *const sb, const int max_age, const uint64_t max_memory);
+	virtual ~storage_backend_write_merge();
+
+	offset_t get_size() const override;
+
+	void put_data(const offset_t offset, const block & b, int *const err) override;
+	using storage_backend::put_data;
+
+	bool fsync() override;
+
+	bool trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err) override;
+
+	void dump_stats(const std::string & base_filename) override;
+
+	void operator()();
+
+	YAML::Node emit_configuration() const override;
+	static storage_backend_write_merge * load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, std::optional<int> block_size);
+};
@@ -0,0 +1,436 @@
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <string.h>
+
+#include "buffer_pool.h"
+#include "logging.h"
+#include "str.h"
+#include "storage_backend_writeback.h"
+#include "yaml-helpers.h"
+
+
+storage_backend_writeback::storage_backend_writeback(const std::string & id, storage_backend *const sb, const uint64_t max_dirty, const int flush_interval) :
+	storage_backend(id, sb->get_block_size(), { }),
+	sb(sb),
+	max_dirty(max_dirty),
+	flush_interval(flush_interval)
+{
+	if (max_dirty < uint64_t(block_size))
+		throw myformat("storage_backend_writeback(%s): max-dirty (%lu bytes) must be at least one block (%d bytes)", id.c_str(), max_dirty, block_size);
+
+	th = new std::thread(std::ref(*this));
+}
+
+storage_backend_writeback::~storage_backend_writeback()
+{
+	stop_flag = true;
+
+	cond_destage.notify_all();
+	cond_clean.notify_all();
+
+	if (th) {
+		th->join();
+		delete th;
+	}
+
+	if (destage() == false)
+		dolog(ll_error, "~storage_backend_writeback(%s): %zu dirty blocks could not be written", id.c_str(), dirty.size());
+
+	delete sb;
+}
+
+offset_t storage_backend_writeback::get_size() const
+{
+	return sb->get_size();
+}
+
+uint64_t storage_backend_writeback::get_dirty_bytes() const
+{
+	return dirty.size() * block_size;
+}
+
+bool storage_backend_writeback::set_dirty(const block_nr_t block_nr, const block & b)
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	auto it = dirty.find(block_nr);
+
+	// a copy of a non-owning block is a private copy, else it's shared
+	if (it != dirty.end()) {
+		it->second = b;
+		n_rewrites++;
+	}
+	else {
+		dirty.insert({ block_nr, b });
+	}
+
+	n_writes++;
+
+	// start destaging in the background before writers get throttled
+	if (get_dirty_bytes() > max_dirty / 2)
+		cond_destage.notify_one();
+
+	return true;
+}
+
+void storage_backend_writeback::throttle()
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	if (get_dirty_bytes() <= max_dirty)
+		return;
+
+	n_throttled++;
+
+	while(get_dirty_bytes() > max_dirty && !stop_flag) {
+		cond_destage.notify_one();
+
+		cond_clean.wait_for(lck, std::chrono::milliseconds(100));
+	}
+}
+
+// writes everything that is dirty at the moment of invocation
+bool storage_backend_writeback::destage()
+{
+	std::unique_lock<std::mutex> dlck(destage_lock);
+
+	std::vector<block_nr_t> todo;
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		for(auto & d : dirty)
+			todo.push_back(d.first);  // in block order
+	}
+
+	const size_t max_run = std::clamp(sb->get_maximum_transaction_size() / block_size, 1, 256);
+
+	bool ok = true;
+
+	size_t i = 0;
+
+	while(i < todo.size()) {
+		// a run of consecutive blocks
+		size_t j = i + 1;
+
+		while(j < todo.size() && todo[j] == todo[j - 1] + 1 && j - i < max_run)
+			j++;
+
+		const block_nr_t first = todo[i];
+		const size_t     n     = j - i;
+
+		// no reader (nor writer) of these blocks while they're in transit
+		lg.un_lock_block_group(first * block_size, n * block_size, block_size, true, false);
+
+		std::vector<std::pair<block_nr_t, block> > run;
+
+		{
+			std::unique_lock<std::mutex> lck(lock);
+
+			for(block_nr_t nr=first; nr<first + n; nr++) {
+				auto it = dirty.find(nr);
+
+				if (it != dirty.end())  // may have been trimmed in the mean time
+					run.push_back(*it);
+			}
+		}
+
+		bool run_ok = true;
+
+		if (run.size() == n && n > 1) {
+			uint8_t *buffer = pool_malloc(n * block_size);
+
+			if (buffer) {
+				for(size_t k=0; k<n; k++)
+					memcpy(&buffer[k * block_size], run.at(k).second.get_data(), block_size);
+
+				int err = 0;
+				sb->put_data(first * block_size, block(buffer, n * block_size), &err);
+
+				run_ok = err == 0;
+
+				n_destage_writes++;
+			}
+			else {
+				dolog(ll_error, "storage_backend_writeback::destage(%s): cannot allocate %zu bytes of memory", id.c_str(), n * block_size);
+				run_ok = false;
+			}
+		}
+		else {
+			for(auto & r : run) {
+				int err = 0;
+				sb->put_data(r.first * block_size, r.second, &err);
+
+				if (err)
+					run_ok = false;
+
+				n_destage_writes++;
+			}
+		}
+
+		if (run_ok) {
+			std::unique_lock<std::mutex> lck(lock);
+
+			for(auto & r : run)
+				dirty.erase(r.first);
+
+			n_blocks_destaged += run.size();
+
+			cond_clean.notify_all();
+		}
+		else {
+			dolog(ll_error, "storage_backend_writeback::destage(%s): failed to write %zu blocks starting at %ld to %s", id.c_str(), n, first, sb->get_id().c_str());
+			ok = false;
+		}
+
+		lg.un_lock_block_group(first * block_size, n * block_size, block_size, false, false);
+
+		i = j;
+	}
+
+	return ok;
+}
+
+void storage_backend_writeback::operator()()
+{
+	dolog(ll_info, "storage_backend_writeback::operator(%s): thread started", id.c_str());
+
+	while(!stop_flag) {
+		{
+			std::unique_lock<std::mutex> lck(lock);
+
+			if (get_dirty_bytes() <= max_dirty / 2)
+				cond_destage.wait_for(lck, std::chrono::milliseconds(flush_interval));
+		}
+
+		if (stop_flag) {
+			dolog(ll_debug, "storage_backend_writeback::operator(%s): thread terminating", id.c_str());
+			break;
+		}
+
+		if (destage() == false)
+			std::this_thread::sleep_for(std::chrono::milliseconds(flush_interval));
+	}
+}
+
+bool storage_backend_writeback::can_do_multiple_blocks() const
+{
+	return true;
+}
+
+bool storage_backend_writeback::get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *const to)
+{
+	std::vector<std::pair<block_nr_t, block> > pending;
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		for(auto it = dirty.lower_bound(block_nr); it != dirty.end() && it->first < block_nr + blocks_to_do; it++)
+			pending.push_back(*it);
+	}
+
+	if (pending.size() < blocks_to_do) {
+		struct iovec iov { to, size_t(blocks_to_do * block_size) };
+		int err = 0;
+		sb->get_data_into(block_nr * block_size, &iov, 1, &err);
+
+		if (err) {
+			dolog(ll_error, "storage_backend_writeback::get_multiple_blocks(%s): failed to read %ld blocks starting at %ld from %s", id.c_str(), blocks_to_do, block_nr, sb->get_id().c_str());
+			return false;
+		}
+	}
+
+	for(auto & p : pending)
+		memcpy(&to[(p.first - block_nr) * block_size], p.second.get_data(), block_size);
+
+	return true;
+}
+
+bool storage_backend_writeback::get_block_into(const block_nr_t block_nr, uint8_t *const to)
+{
+	return get_multiple_blocks(block_nr, 1, to);
+}
+
+bool storage_backend_writeback::get_block(const block_nr_t block_nr, uint8_t **const data)
+{
+	*data = pool_malloc(block_size);
+	if (!*data) {
+		dolog(ll_error, "storage_backend_writeback::get_block(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
+		return false;
+	}
+
+	if (!get_block_into(block_nr, *data)) {
+		pool_free(*data);
+		*data = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+bool storage_backend_writeback::put_block(const block_nr_t block_nr, const uint8_t *const data)
+{
+	return set_dirty(block_nr, block(data, block_size, false));
+}
+
+void storage_backend_writeback::put_data(const offset_t offset, const block & b, int *const err)
+{
+	stats_timer st(stats, so_put, b.get_size());
+
+	*err = 0;
+
+	lg.un_lock_block_group(offset, b.get_size(), block_size, true, false);
+
+	offset_t work_offset = offset;
+	size_t   input_offset = 0;
+	size_t   work_size = b.get_size();
+
+	while(work_size > 0) {
+		block_nr_t block_nr = work_offset / block_size;
+		uint32_t block_offset = work_offset % block_size;
+
+		size_t current_size = std::min(work_size, size_t(block_size - block_offset));
+
+		if (b.get_size() == size_t(block_size) && current_size == size_t(block_size)) {
+			set_dirty(block_nr, b);
+		}
+		else {
+			// a slice would keep all of 'b' in memory while max-dirty counts only one block of it
+			uint8_t *temp = pool_malloc(block_size);
+			if (!temp) {
+				dolog(ll_error, "storage_backend_writeback::put_data(%s): cannot allocate %d bytes of memory", id.c_str(), block_size);
+				*err = ENOMEM;
+				break;
+			}
+
+			// the dirty copy, else what's on the underlying storage
+			if (current_size != size_t(block_size) && get_multiple_blocks(block_nr, 1, temp) == false) {
+				pool_free(temp);
+				*err = EINVAL;
+				break;
+			}
+
+			memcpy(&temp[block_offset], b.get_data() + input_offset, current_size);
+
+			set_dirty(block_nr, block(temp, block_size));
+		}
+
+		work_offset += current_size;
+		input_offset += current_size;
+		work_size -= current_size;
+	}
+
+	lg.un_lock_block_group(offset, b.get_size(), block_size, false, false);
+
+	throttle();
+}
+
+bool storage_backend_writeback::fsync()
+{
+	stats_timer st(stats, so_fsync, 0);
+
+	if (destage() == false) {
+		dolog(ll_error, "storage_backend_writeback::fsync(%s): failed to write dirty blocks", id.c_str());
+		return false;
+	}
+
+	return sb->fsync();
+}
+
+bool storage_backend_writeback::trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err)
+{
+	stats_timer st(stats, so_trim, len);
+
+	*err = 0;
+
+	if (len == 0)
+		return true;
+
+	lg.un_lock_block_group(offset, len, block_size, true, false);
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		const block_nr_t first = offset / block_size;
+		const block_nr_t last  = (offset + len - 1) / block_size;
+
+		for(auto it = dirty.lower_bound(first); it != dirty.end() && it->first <= last;) {
+			const offset_t block_start = it->first * block_size;
+			const offset_t start       = std::max(offset, block_start);
+			const offset_t end         = std::min(offset + len, block_start + block_size);
+
+			if (end - start == offset_t(block_size)) {
+				it = dirty.erase(it);
+				continue;
+			}
+
+			// partially: the rest of the dirty block stays
+			uint8_t *temp = pool_malloc(block_size);
+			if (!temp) {
+				*err = ENOMEM;
+				break;
+			}
+
+			memcpy(temp, it->second.get_data(), block_size);
+			memset(&temp[start - block_start], 0x00, end - start);
+
+			it->second = block(temp, block_size);
+
+			it++;
+		}
+	}
+
+	bool rc = *err == 0 && sb->trim_zero(offset, len, trim, err);
+
+	lg.un_lock_block_group(offset, len, block_size, false, false);
+
+	return rc;
+}
+
+void storage_backend_writeback::dump_stats(const std::string & base_filename)
+{
+	size_t n_dirty = 0;
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		n_dirty = dirty.size();
+	}
+
+	dolog(ll_info, "storage_backend_writeback(%s): %lu block writes (%lu rewrites coalesced), %lu blocks destaged in %lu writes, throttled %lu times, %zu blocks dirty", id.c_str(), n_writes.load(), n_rewrites.load(), n_blocks_destaged.load(), n_destage_writes.load(), n_throttled.load(), n_dirty);
+
+	sb->dump_stats(base_filename);
+}
+
+YAML::Node storage_backend_writeback::emit_configuration() const
+{
+	YAML::Node out_cfg;
+	out_cfg["id"] = id;
+	out_cfg["storage-backend"] = sb->emit_configuration();
+	out_cfg["max-dirty"] = max_dirty;
+	out_cfg["flush-interval"] = flush_interval;
+
+	YAML::Node out;
+	out["type"] = "storage-backend-writeback";
+	out["cfg"] = out_cfg;
+
+	return out;
+}
+
+storage_backend_writeback * storage_backend_writeback::load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, std::optional<int> block_size)
+{
+	dolog(ll_info, " * storage_backend_writeback::load_configuration");
+
+	const YAML::Node cfg = yaml_get_yaml_node(node, "cfg", "storage-backend-writeback configuration");
+
+	std::string id = yaml_get_string(cfg, "id", "module id");
+
+	storage_backend *sb = storage_backend::load_configuration(cfg["storage-backend"], size, block_size);
+
+	uint64_t max_dirty = yaml_get_uint64_t(cfg, "max-dirty", "how much (in bytes) may be pending before writers are throttled", true);
+
+	int flush_interval = yaml_get_int(cfg, "flush-interval", "after how many milliseconds (max) to write dirty blocks to the underlying storage");
+
+	return new storage_backend_writeback(id, sb, max_dirty, flush_interval);
+}
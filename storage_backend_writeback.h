@@ -0,0 +1,73 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include "storage_backend.h"
+
+
+// Volatile write-back cache: writes are acknowledged as soon as they are in
+// RAM. Rewrites of a block replace the pending copy. A thread destages the
+// dirty blocks in block order, consecutive blocks as one write. fsync (and
+// thus NBD FUA) waits until everything is on the underlying storage.
+// Data that is not destaged yet is lost when the process dies: unlike the
+// journal this is meant for scratch volumes.
+class storage_backend_writeback : public storage_backend
+{
+private:
+	storage_backend *const sb;
+	const uint64_t         max_dirty;       // in bytes; writers are throttled above this
+	const int              flush_interval;  // in milliseconds
+
+	std::mutex             lock;  // for 'dirty'
+	std::condition_variable cond_destage;  // wakes the destager
+	std::condition_variable cond_clean;    // destager made progress
+	std::map<block_nr_t, block> dirty;  // always whole blocks, never part of a larger buffer
+	bool                   flush_requested { false };
+
+	std::mutex             destage_lock;  // one destage pass at a time
+
+	std::thread           *th { nullptr };
+
+	std::atomic_uint64_t   n_writes { 0 };
+	std::atomic_uint64_t   n_rewrites { 0 };
+	std::atomic_uint64_t   n_blocks_destaged { 0 };
+	std::atomic_uint64_t   n_destage_writes { 0 };
+	std::atomic_uint64_t   n_throttled { 0 };
+
+	uint64_t get_dirty_bytes() const;  // 'lock' must be locked
+	bool set_dirty(const block_nr_t block_nr, const block & b);
+	bool destage();
+	void throttle();
+
+protected:
+	bool can_do_multiple_blocks() const override;
+	bool get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *const to) override;
+
+	bool get_block(const block_nr_t block_nr, uint8_t **const data) override;
+	bool get_block_into(const block_nr_t block_nr, uint8_t *const to) override;
+	bool put_block(const block_nr_t block_nr, const uint8_t *const data) override;
+
+public:
+	storage_backend_writeback(const std::string & id, storage_backend *const sb, const uint64_t max_dirty, const int flush_interval);
+	virtual ~storage_backend_writeback();
+
+	offset_t get_size() const override;
+
+	void put_data(const offset_t offset, const block & b, int *const err) override;
+	using storage_backend::put_data;
+
+	bool fsync() override;
+
+	bool trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err) override;
+
+	void dump_stats(const std::string & base_filename) override;
+
+	void operator()();
+
+	YAML::Node emit_configuration() const override;
+	static storage_backend_writeback * load_configuration(const YAML::Node & node, const std::optional<uint64_t> size, std::optional<int> block_size);
+};
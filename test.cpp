@@ -1,25 +1,61 @@
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <errno.h>
 #include <fcntl.h>
+#include <kcpolydb.h>
 #include <stdio.h>
 #include <string.h>
+#include <thread>
 #include <unistd.h>
 #include <sys/random.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <yaml-cpp/yaml.h>
 
+#include "bloom_filter.h"
+#include "buffer_pool.h"
 #include "compresser_lzo.h"
+#include "compresser_zlib.h"
+#include "dedup_block_cache.h"
+#include "dedup_index.h"
+#include "dedup_intent_log.h"
+#include "dedup_schema.h"
+#include "gf256.h"
+#include "hash_blake3.h"
+#include "hash_sha256.h"
 #include "hash_sha384.h"
+#include "hash_xxh128.h"
 #include "journal.h"
+#include "lock_group.h"
 #include "logging.h"
+#include "mirror_async.h"
+#include "mirror_resync.h"
+#include "mirror_storage_backend.h"
+#include "server_nbd.h"
 #include "snapshots.h"
 #include "socket_client_ipv4.h"
+#include "socket_listener_ipv4.h"
+#include "stats.h"
+#include "stats_server.h"
+#include "storage_backend_cache.h"
 #include "storage_backend_file.h"
 #include "storage_backend_dedup.h"
 #include "storage_backend_nbd.h"
+#include "storage_backend_parity.h"
 #include "storage_backend_tiering.h"
+#include "storage_backend_readahead.h"
+#include "storage_backend_stripe.h"
+#include "storage_backend_write_merge.h"
+#include "storage_backend_writeback.h"
+#include "str.h"
 #include "time.h"
 #include "types.h"
+#include "yaml-helpers.h"
+#include "zero.h"
 
 void os_assert(int v)
 {
@@ -108,7 +144,7 @@ void test_integrity(storage_backend *const sb)
 				sb->put_data(i, b, &err);
 			}
 			else {
-				free(d);
+				pool_free(d);
 			}
 
 			assert(err == 0);
@@ -127,7 +163,17 @@ void test_integrity(storage_backend *const sb)
 			for(unsigned int j=0; j<block_size * 16; j += 8)
 				assert(*reinterpret_cast<uint64_t *>(d + j) == i + j);
 
-			free(d);
+			// same range, scattered over iovecs that do not align with the block size
+			uint8_t *sg = reinterpret_cast<uint8_t *>(malloc(block_size * 16));
+			struct iovec iov[3] { { sg, 1000 }, { sg + 1000, block_size * 2 + 24 }, { sg + block_size * 2 + 1024, block_size * 14 - 1024 } };
+			sb->get_data_into(i, iov, 3, &err);
+
+			assert(err == 0);
+			assert(memcmp(d, sg, block_size * 16) == 0);
+
+			free(sg);
+
+			pool_free(d);
 		}
 	}
 	catch(const std::string & error) {
@@ -273,7 +319,7 @@ void test_integrities()
 
 				hash *h = new hash_sha384();
 				compresser *c = new compresser_lzo();
-				storage_backend_dedup sbf_data("data", test_data_file, h, c, { }, data_size, block_size);
+				storage_backend_dedup sbf_data("data", test_data_file, h, dedup_options_t { .c = c }, { }, data_size, block_size);
 
 				test_integrity(&sbf_data);
 
@@ -317,6 +363,74 @@ void test_integrities()
 			os_assert(unlink("test/slow.dat"));
 			os_assert(unlink("test/fast.dat"));
 		}
+
+		if (1) {
+			storage_backend *sbf = new storage_backend_file("data", "test/data.dat", 64 * 1024 * 1024, 65536, false, { });
+
+			storage_backend_write_merge wm("storage-backend-write-merge", sbf, 100, 4 * 1024 * 1024);
+
+			test_integrity(&wm);
+
+			os_assert(unlink("test/data.dat"));
+		}
+
+		if (1) {
+			storage_backend *sbf = new storage_backend_file("data", "test/data.dat", 64 * 1024 * 1024, 4096, false, { });
+
+			storage_backend_cache cache("storage-backend-cache", sbf, 1024 * 1024, nullptr);
+
+			test_integrity(&cache);
+
+			os_assert(unlink("test/data.dat"));
+		}
+
+		if (1) {
+			storage_backend *sbf = new storage_backend_file("data", "test/data.dat", 64 * 1024 * 1024, 4096, false, { });
+
+			storage_backend_writeback wb("storage-backend-writeback", sbf, 2 * 1024 * 1024, 50);
+
+			test_integrity(&wb);
+
+			os_assert(unlink("test/data.dat"));
+		}
+
+		if (1) {
+			storage_backend *sbf = new storage_backend_file("data", "test/data.dat", 64 * 1024 * 1024, 4096, false, { });
+
+			storage_backend_readahead ra("storage-backend-readahead", sbf, 1024 * 1024, 16384, 262144);
+
+			test_integrity(&ra);
+
+			os_assert(unlink("test/data.dat"));
+		}
+
+		if (1) {
+			std::vector<storage_backend *> sbs;
+			for(int i=0; i<3; i++)
+				sbs.push_back(new storage_backend_file(myformat("data-%d", i), myformat("test/data-%d.dat", i), 64 * 1024 * 1024 / 3, 4096, false, { }));
+
+			storage_backend_stripe stripe("storage-backend-stripe", sbs, 65536);
+
+			test_integrity(&stripe);
+
+			for(int i=0; i<3; i++)
+				os_assert(unlink(myformat("test/data-%d.dat", i).c_str()));
+		}
+
+		if (1) {
+			std::vector<storage_backend *> sbs;
+			for(int i=0; i<5; i++)
+				sbs.push_back(new storage_backend_file(myformat("data-%d", i), myformat("test/data-%d.dat", i), 64 * 1024 * 1024 / 3, 4096, false, { }));
+
+			storage_backend_parity parity("storage-backend-parity", sbs, 2, 65536, "test/parity.state");
+
+			test_integrity(&parity);
+
+			for(int i=0; i<5; i++)
+				os_assert(unlink(myformat("test/data-%d.dat", i).c_str()));
+
+			unlink("test/parity.state");
+		}
 	}
 	catch(const std::string & error) {
 		fprintf(stderr, "test_integritie exception: %s\n", error.c_str());
@@ -416,7 +530,7 @@ void test_journal()
 
 				assert(*v == i || *v == 0);
 
-				free(v);
+				pool_free(v);
 
 				get_count++;
 			}
@@ -488,19 +602,2402 @@ void test_journal()
 	}
 }
 
-void setup()
+void test_block()
 {
-	setlog("test-mystorage.log", ll_debug, ll_info);
-	dolog(ll_info, "test-MyStorage starting");
+	dolog(ll_info, " -> block tests");
 
-	os_assert(mkdir("test", 0770));
+	uint8_t *p = pool_malloc(4096);
+	for(int i=0; i<4096; i++)
+		p[i] = i;
+
+	block b1(p, 4096);
+
+	// copies and slices of an owning block share the data
+	block b2(b1);
+	assert(b2.get_data() == b1.get_data());
+
+	block s = b1.slice(1024, 512);
+	assert(s.get_data() == p + 1024 && s.get_size() == 512 && s.get_data()[0] == 0);
+
+	// a copy of a non-owning block is independent of the original memory
+	uint8_t local[16] { 1, 2, 3 };
+	block n(local, sizeof local, false);
+	block n_copy(n);
+	assert(n_copy.get_data() != local && n_copy.is_owner() && n_copy == n);
+
+	// moved-in vector is not copied
+	std::vector<uint8_t> v(100, 0x55);
+	const uint8_t *v_data = v.data();
+	block bv(std::move(v));
+	assert(bv.get_data() == v_data && bv.get_size() == 100);
 }
 
-int main(int argc, char *argv[])
+void test_zero()
 {
-	dolog(ll_info, " *** TESTS STARTED ***\n");
+	dolog(ll_info, " -> zero-block detection tests (%s)", get_is_all_zero_implementation());
 
-	setup();
+	uint8_t *buffer = pool_calloc(65536);
+
+	// every length, with a non-zero byte at every position (incl. the unaligned tails)
+	for(size_t len=0; len<300; len++) {
+		assert(is_all_zero(buffer + 1, len));
+
+		for(size_t i=0; i<len; i++) {
+			buffer[1 + i] = 0x80;
+			assert(is_all_zero(buffer + 1, len) == false);
+			buffer[1 + i] = 0x00;
+		}
+	}
+
+	buffer[65535] = 1;
+	assert(is_all_zero(buffer, 65535));
+	assert(is_all_zero(buffer, 65536) == false);
+	buffer[65535] = 0;
+
+	// compared to what snapshots used to do
+	constexpr int block_size = 4096;
+	constexpr int n          = 1000000;
+
+	uint8_t *compare = pool_calloc(block_size);
+
+	uint64_t start = get_us();
+	int      count = 0;
+	for(int i=0; i<n; i++)
+		count += memcmp(compare, &buffer[(i & 7) * block_size], block_size) == 0;
+	uint64_t t_memcmp = get_us() - start;
+	assert(count == n);
+
+	start = get_us();
+	count = 0;
+	for(int i=0; i<n; i++)
+		count += is_all_zero(&buffer[(i & 7) * block_size], block_size);
+	uint64_t t_zero = get_us() - start;
+	assert(count == n);
+
+	dolog(ll_info, "    %d zero blocks of %d bytes: memcmp %.3f GB/s, is_all_zero %.3f GB/s", n, block_size, double(n) * block_size / (t_memcmp * 1000.), double(n) * block_size / (t_zero * 1000.));
+
+	pool_free(compare);
+
+	// whole zero blocks in a write are zeroed, the rest is written
+	storage_backend *sbf = new storage_backend_file("zero", "test/zero.dat", 16 * block_size, block_size, false, { });
+
+	int err = 0;
+	sbf->put_data(0, std::vector<uint8_t>(16 * block_size, 0xff), &err);
+	assert(err == 0);
+
+	std::vector<uint8_t> mixed(5 * block_size - 100, 0x00);
+	memset(mixed.data(), 0x11, 10);  // start of block 1 (partially)
+	memset(&mixed[2 * block_size - 100], 0x22, block_size);  // block 3
+	sbf->put_data(block_size + 100, mixed, &err);
+	assert(err == 0);
+
+	uint8_t *d = nullptr;
+	sbf->get_data(0, 16 * block_size, &d, &err);
+	assert(err == 0);
+
+	for(int i=0; i<16 * block_size; i++) {
+		uint8_t expected = 0xff;
+
+		if (i >= block_size + 100 && i < 6 * block_size)
+			expected = i < block_size + 110 ? 0x11 : (i / block_size == 3 ? 0x22 : 0x00);
+
+		assert(d[i] == expected);
+	}
+
+	pool_free(d);
+
+	// still one request each
+	for(auto & s : stats_get_all()) {
+		if (s.kind == "storage-backend" && s.id == "zero") {
+			assert(s.ops[so_put].n == 2);
+			assert(s.ops[so_trim].n == 0);
+		}
+	}
+
+	delete sbf;
+
+	os_assert(unlink("test/zero.dat"));
+
+	pool_free(buffer);
+}
+
+void test_lock_group()
+{
+	dolog(ll_info, " -> lock group tests");
+
+	constexpr int block_size = 4096;
+
+	{
+		lock_group lg;
+
+		std::atomic_int state { 0 };
+
+		// overlapping shared ranges go together, exclusive waits for them
+		lg.un_lock_block_group(0, 8 * block_size, block_size, true, true);
+		lg.un_lock_block_group(4 * block_size, 8 * block_size, block_size, true, true);
+
+		std::thread writer([&] {
+			lg.un_lock_block_group(7 * block_size + 100, 10, block_size, true, false);
+			state = 1;
+			lg.un_lock_block_group(7 * block_size + 100, 10, block_size, false, false);
+		});
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		assert(state == 0);
+
+		// a reader arriving after the (waiting) writer waits too, a non-overlapping one does not
+		std::thread reader([&] {
+			lg.un_lock_block_group(6 * block_size, block_size * 2, block_size, true, true);
+			assert(state == 1);
+			lg.un_lock_block_group(6 * block_size, block_size * 2, block_size, false, true);
+		});
+
+		lg.un_lock_block_group(12 * block_size, block_size, block_size, true, false);
+		lg.un_lock_block_group(12 * block_size, block_size, block_size, false, false);
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		assert(state == 0);
+
+		lg.un_lock_block_group(0, 8 * block_size, block_size, false, true);
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		assert(state == 0);
+
+		lg.un_lock_block_group(4 * block_size, 8 * block_size, block_size, false, true);
+
+		writer.join();
+		reader.join();
+
+		auto s = lg.get_stats();
+		assert(s.n_locks == 5 && s.n_contended == 2);
+	}
+
+	// readers of the same range, and writers between them: an unlock may remove
+	// the entry of an identical range whose (granted) owner did not wake up yet
+	{
+		lock_group lg;
+
+		std::atomic_int n_writers { 0 };
+
+		std::vector<std::thread *> threads;
+		for(int t=0; t<6; t++) {
+			threads.push_back(new std::thread([&lg, &n_writers, t] {
+				for(int i=0; i<20000; i++) {
+					const bool shared = (i + t) % 8 != 0;
+
+					lg.un_lock_block_group(0, block_size, block_size, true, shared);
+
+					if (shared)
+						assert(n_writers == 0);
+					else {
+						assert(++n_writers == 1);
+						n_writers--;
+					}
+
+					lg.un_lock_block_group(0, block_size, block_size, false, shared);
+				}
+			}));
+		}
+
+		for(auto th : threads) {
+			th->join();
+			delete th;
+		}
+
+		auto s = lg.get_stats();
+		assert(s.n_locks == 6 * 20000);
+	}
+
+	// microbenchmark: lock + unlock of 1 block, of a 1 GB range, and of 1 block by
+	// several threads at the same time (each a block of its own)
+	typedef struct {
+		const char *name;
+		uint32_t    len;
+		int         n_threads;
+	} lock_bench_t;
+
+	constexpr int n_pairs = 100000;
+
+	for(auto & b : { lock_bench_t { "1 block", block_size, 1 }, lock_bench_t { "1 GB range", 1024 * 1024 * 1024, 1 }, lock_bench_t { "1 block, 8 threads", block_size, 8 } }) {
+		lock_group lg;
+
+		std::vector<std::thread *> threads;
+
+		uint64_t start = get_us();
+
+		for(int t=0; t<b.n_threads; t++) {
+			threads.push_back(new std::thread([&lg, &b, t] {
+				const offset_t offset = offset_t(t) * b.len;
+
+				for(int i=0; i<n_pairs; i++) {
+					lg.un_lock_block_group(offset, b.len, block_size, true, false);
+					lg.un_lock_block_group(offset, b.len, block_size, false, false);
+				}
+			}));
+		}
+
+		for(auto th : threads) {
+			th->join();
+			delete th;
+		}
+
+		uint64_t took = get_us() - start;
+
+		dolog(ll_info, "    lock + unlock, %s: %.3f us per pair", b.name, double(took) / n_pairs);
+	}
+}
+
+void test_buffer_pool()
+{
+	dolog(ll_info, " -> buffer pool tests");
+
+	auto before = get_buffer_pool_stats();
+
+	uint8_t *p1 = pool_malloc(4096);
+	assert((uintptr_t(p1) & 4095) == 0);
+
+	auto during = get_buffer_pool_stats();
+	assert(during.in_use_bytes == before.in_use_bytes + 4096);
+
+	pool_free(p1);
+
+	// should come from this thread's cache
+	uint8_t *p2 = pool_calloc(4000);
+	assert(p2 == p1);
+	assert(get_buffer_pool_stats().cache_hits == before.cache_hits + 1);
+
+	for(int i=0; i<4000; i++)
+		assert(p2[i] == 0x00);
+
+	pool_free(p2);
+	assert(get_buffer_pool_stats().in_use_bytes == before.in_use_bytes);
+
+	// not from the pool: is released using free()
+	pool_free(malloc(100));
+
+	// also when it looks like a pool buffer
+	void *aligned = nullptr;
+	assert(posix_memalign(&aligned, 4096, 4096) == 0);
+
+	const uint64_t cached = get_buffer_pool_stats().cached_bytes;
+	pool_free(aligned);
+	assert(get_buffer_pool_stats().cached_bytes == cached);
+	assert(get_buffer_pool_stats().in_use_bytes == before.in_use_bytes);
+
+	dump_buffer_pool_stats();
+}
+
+void test_write_merge()
+{
+	dolog(ll_info, " -> write merge tests");
+
+	constexpr int block_size = 16384;
+
+	storage_backend *sbf = new storage_backend_file("data", "test/merge.dat", 1024 * 1024, block_size, false, { });
+
+	{
+		storage_backend_write_merge wm("write-merge", sbf, 60000, 1024 * 1024);
+
+		std::vector<uint8_t> first(block_size / 2, 0x11);
+		std::vector<uint8_t> second(block_size / 2, 0x22);
+
+		// first half: pending, not yet in the underlying storage
+		int err = 0;
+		wm.put_data(0, first, &err);
+		assert(err == 0);
+
+		uint8_t *d = nullptr;
+		sbf->get_data(0, block_size, &d, &err);
+		assert(err == 0 && d[0] == 0x00);
+		pool_free(d);
+
+		// but visible when reading through the merge layer
+		wm.get_data(0, block_size, &d, &err);
+		assert(err == 0 && d[0] == 0x11 && d[block_size - 1] == 0x00);
+		pool_free(d);
+
+		// second half completes the block: written without reading it
+		wm.put_data(block_size / 2, second, &err);
+		assert(err == 0);
+
+		sbf->get_data(0, block_size, &d, &err);
+		assert(err == 0 && d[0] == 0x11 && d[block_size - 1] == 0x22);
+		pool_free(d);
+
+		// a sector in the next block is written at fsync
+		wm.put_data(block_size + 512, std::vector<uint8_t>(512, 0x33), &err);
+		assert(err == 0);
+
+		assert(wm.fsync());
+
+		sbf->get_data(block_size, block_size, &d, &err);
+		assert(err == 0 && d[0] == 0x00 && d[512] == 0x33 && d[1024] == 0x00);
+		pool_free(d);
+
+		// not sector aligned: read-modify-write right away
+		wm.put_data(block_size + 1, std::vector<uint8_t>(3, 0x44), &err);
+		assert(err == 0);
+
+		sbf->get_data(block_size, block_size, &d, &err);
+		assert(err == 0 && d[1] == 0x44 && d[512] == 0x33);
+		pool_free(d);
+
+		wm.dump_stats("test/");
+	}
+
+	os_assert(unlink("test/merge.dat"));
+}
+
+void test_cache()
+{
+	dolog(ll_info, " -> cache tests");
+
+	constexpr int block_size = 4096;
+	constexpr int n = 256;
+
+	storage_backend *sbf = new storage_backend_file("data", "test/cache.dat", n * block_size, block_size, false, { });
+
+	{
+		storage_backend_cache cache("cache", sbf, 16 * block_size, new compresser_zlib(3));
+
+		int err = 0;
+
+		for(int i=0; i<n; i++) {
+			cache.put_data(i * block_size, std::vector<uint8_t>(block_size, i), &err);
+			assert(err == 0);
+		}
+
+		auto verify = [&cache](const int nr, const uint8_t v) {
+			int err = 0;
+			uint8_t *d = nullptr;
+			cache.get_data(nr * block_size, block_size, &d, &err);
+			assert(err == 0);
+
+			for(int i=0; i<block_size; i++)
+				assert(d[i] == v);
+
+			pool_free(d);
+		};
+
+		// a frequently used set, then a scan over everything
+		for(int k=0; k<3; k++) {
+			for(int i=0; i<8; i++)
+				verify(i, i);
+		}
+
+		for(int i=0; i<n; i++)
+			verify(i, i);
+
+		// cached blocks are invalidated by writes and trims
+		verify(0, 0);
+
+		cache.put_data(0, std::vector<uint8_t>(block_size, 0xff), &err);
+		assert(err == 0);
+		verify(0, 0xff);
+
+		verify(1, 1);
+		assert(cache.trim_zero(block_size, block_size, true, &err));
+		verify(1, 0x00);
+
+		cache.dump_stats("test/");
+	}
+
+	os_assert(unlink("test/cache.dat"));
+}
+
+// every block has the same hash: for testing verify-on-match
+class test_colliding_hash : public hash
+{
+public:
+	std::string get_type() const override { return "hash-test-colliding"; }
+
+	int get_size() const override { return 4; }
+
+	bool get_verify_on_match() const override { return true; }
+
+	void do_hash(const uint8_t *const in, const size_t len, uint8_t **const out) override
+	{
+		*out = reinterpret_cast<uint8_t *>(calloc(1, get_size()));
+	}
+
+	YAML::Node emit_configuration() const override { return YAML::Node(); }
+};
+
+void test_hash()
+{
+	dolog(ll_info, " -> hash tests");
+
+	const uint8_t abc[] = { 'a', 'b', 'c' };
+
+	hash *sha256 = new hash_sha256();
+	assert(sha256->do_hash(abc, sizeof abc).value() == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+	delete sha256;
+
+#if defined(HAVE_BLAKE3)
+	hash *blake3 = new hash_blake3();
+	assert(blake3->do_hash(abc, 0).value() == "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262");
+	delete blake3;
+#endif
+
+#if defined(HAVE_XXHASH)
+	hash *xxh128 = new hash_xxh128(true);
+	assert(xxh128->do_hash(abc, 0).value() == "99aa06d3014798d86001c324468d497f");
+	delete xxh128;
+#endif
+
+	// a hash function that is not available is an error, not a nullptr
+	std::vector<std::string> unavailable { "hash-unknown" };
+#if !defined(HAVE_BLAKE3)
+	unavailable.push_back("hash-blake3");
+#endif
+#if !defined(HAVE_XXHASH)
+	unavailable.push_back("hash-xxh128");
+#endif
+
+	for(auto & type : unavailable) {
+		YAML::Node cfg;
+		cfg["type"] = type;
+
+		bool thrown = false;
+		try {
+			hash::load_configuration(cfg);
+		}
+		catch(const std::string & error) {
+			thrown = true;
+		}
+		assert(thrown);
+	}
+
+	// microbenchmark: hashing 4 KB blocks, as storage-backend-dedup does
+	std::vector<hash *> hashes { new hash_sha384(), new hash_sha256() };
+#if defined(HAVE_BLAKE3)
+	hashes.push_back(new hash_blake3());
+#endif
+#if defined(HAVE_XXHASH)
+	hashes.push_back(new hash_xxh128(true));
+#endif
+
+	constexpr int block_size = 4096;
+	std::vector<uint8_t> data(block_size);
+	getrandom(data.data(), data.size(), 0);
+
+	for(auto h : hashes) {
+		uint64_t n     = 0;
+		uint64_t start = get_us();
+		uint64_t took  = 0;
+
+		do {
+			for(int i=0; i<256; i++) {
+				uint8_t *out = nullptr;
+				h->do_hash(data.data(), block_size, &out);
+				assert(out);
+				free(out);
+
+				data[i] ^= 1;
+			}
+
+			n += 256;
+
+			took = get_us() - start;
+		}
+		while(took < 250000);
+
+		dolog(ll_info, "%s: %.3f GB/s", h->get_type().c_str(), n * block_size / (took / 1000000.) / 1000000000.);
+
+		delete h;
+	}
+
+	// the hash function of a dedup store cannot change
+	constexpr int n = 4;
+	const std::string file = "test/hash.kch";
+
+	{
+		storage_backend_dedup sb("dedup", file, new hash_sha256(), dedup_options_t { }, { }, n * block_size, block_size);
+	}
+
+	try {
+		storage_backend_dedup sb("dedup", file, new hash_sha384(), dedup_options_t { }, { }, n * block_size, block_size);
+		assert(0);
+	}
+	catch(const std::string & error) {
+		// expected
+	}
+
+	os_assert(unlink(file.c_str()));
+
+	// verify-on-match: a collision fails the write instead of returning other data
+	{
+		storage_backend_dedup sb("dedup", file, new test_colliding_hash(), dedup_options_t { .c = new compresser_zlib(3) }, { }, n * block_size, block_size);
+
+		int err = 0;
+		sb.put_data(0, std::vector<uint8_t>(block_size, 1), &err);
+		assert(err == 0);
+
+		// same data: no collision
+		sb.put_data(block_size, std::vector<uint8_t>(block_size, 1), &err);
+		assert(err == 0);
+
+		sb.put_data(2 * block_size, std::vector<uint8_t>(block_size, 2), &err);
+		assert(err != 0);
+
+		for(int nr=0; nr<3; nr++) {
+			uint8_t *d = nullptr;
+			sb.get_data(nr * block_size, block_size, &d, &err);
+			assert(err == 0);
+
+			for(int i=0; i<block_size; i++)
+				assert(d[i] == (nr < 2 ? 1 : 0));
+
+			pool_free(d);
+		}
+	}
+
+	os_assert(unlink(file.c_str()));
+}
+
+void test_bloom_filter()
+{
+	dolog(ll_info, " -> Bloom filter tests");
+
+	bloom_filter bf(10 * 1000, 7);
+
+	for(uint32_t i=0; i<1000; i++)
+		bf.add(reinterpret_cast<const uint8_t *>(&i), sizeof i);
+
+	// never a false negative
+	for(uint32_t i=0; i<1000; i++)
+		assert(bf.maybe_contains(reinterpret_cast<const uint8_t *>(&i), sizeof i));
+
+	// ~1% false positives at 10 bits per item
+	int n_false_positives = 0;
+	for(uint32_t i=1000; i<11000; i++)
+		n_false_positives += bf.maybe_contains(reinterpret_cast<const uint8_t *>(&i), sizeof i);
+	assert(n_false_positives < 300);
+
+	const std::string file = "test/bloom.dat";
+	assert(bf.save(file, 1234));
+
+	bloom_filter bf2(10 * 1000, 7);
+	assert(bf2.load(file, 4321) == false);
+	assert(bf2.load(file, 1234));
+	for(uint32_t i=0; i<1000; i++)
+		assert(bf2.maybe_contains(reinterpret_cast<const uint8_t *>(&i), sizeof i));
+	assert(bf2.get_n_added() == 1000);
+
+	// made with other parameters
+	bloom_filter bf3(10 * 1000, 5);
+	assert(bf3.load(file, 1234) == false);
+
+	os_assert(unlink(file.c_str()));
+}
+
+void test_dedup_block_cache()
+{
+	dolog(ll_info, " -> dedup block cache tests");
+
+	constexpr int block_size = 4096;
+
+	dedup_block_cache bc(8 * block_size, block_size);
+
+	auto make_hash = [](const int nr) { return myformat("hash-%d", nr); };
+
+	std::vector<uint8_t> data(block_size);
+
+	for(int i=0; i<4; i++) {
+		memset(data.data(), i, block_size);
+		bc.insert(make_hash(i), data.data(), bc.get_generation(make_hash(i)));
+	}
+
+	// a frequently used set, then a scan over a lot of other data
+	for(int k=0; k<2; k++) {
+		for(int i=0; i<4; i++)
+			assert(bc.lookup(make_hash(i)).has_value());
+	}
+
+	for(int i=100; i<200; i++) {
+		assert(bc.lookup(make_hash(i)).has_value() == false);
+
+		memset(data.data(), i, block_size);
+		bc.insert(make_hash(i), data.data(), bc.get_generation(make_hash(i)));
+	}
+
+	for(int i=0; i<4; i++) {
+		auto d = bc.lookup(make_hash(i));
+		assert(d.has_value());
+		assert(d.value().get_size() == size_t(block_size));
+		assert(d.value().get_data()[0] == i && d.value().get_data()[block_size - 1] == i);
+	}
+
+	assert(bc.lookup(make_hash(100)).has_value() == false);
+
+	bc.forget(make_hash(0));
+	assert(bc.lookup(make_hash(0)).has_value() == false);
+
+	// data that was retrieved before its hash was forgotten is not cached
+	const uint64_t generation = bc.get_generation(make_hash(1000));
+	bc.forget(make_hash(1000));
+	bc.insert(make_hash(1000), data.data(), generation);
+	assert(bc.lookup(make_hash(1000)).has_value() == false);
+
+	bc.dump_stats("test");
+
+	bool thrown = false;
+	try {
+		dedup_block_cache too_small(block_size - 1, block_size);
+	}
+	catch(const std::string & error) {
+		thrown = true;
+	}
+	assert(thrown);
+}
+
+void test_dedup()
+{
+	dolog(ll_info, " -> dedup tests");
+
+	constexpr int block_size = 4096;
+	constexpr int n = 16;
+
+	const std::string file    = "test/dedup.kch";
+	const std::string file_v1 = "test/dedup-v1.kch";
+	const std::string file_v2 = "test/dedup-v2.kch";
+
+	std::vector<uint8_t> a(block_size, 0xaa);
+	std::vector<uint8_t> b(block_size, 0xbb);
+
+	hash *h = new hash_sha384();
+	std::string hash_a = h->do_hash(a.data(), block_size).value();
+	std::string hash_b = h->do_hash(b.data(), block_size).value();
+	delete h;
+
+	auto bin = [](const std::string & hex) {
+		std::string out;
+		for(size_t i=0; i<hex.size(); i += 2)
+			out += char(std::stoi(hex.substr(i, 2), nullptr, 16));
+		return out;
+	};
+
+	// use count of a hash, 0 when its record is gone
+	auto use_count = [&bin](const std::string & f, const std::string & hex) -> uint64_t {
+		kyotocabinet::PolyDB db;
+		assert(db.open(f, kyotocabinet::PolyDB::OREADER));
+
+		std::string record;
+		uint64_t    count = 0;
+		if (db.get(dedup_hash_key(bin(hex)), &record))
+			count = dedup_get_use_count(reinterpret_cast<const uint8_t *>(record.data()));
+
+		db.close();
+
+		return count;
+	};
+
+	auto verify = [](storage_backend *const sb, const int nr, const uint8_t v) {
+		int err = 0;
+		uint8_t *d = nullptr;
+		sb->get_data(nr * block_size, block_size, &d, &err);
+		assert(err == 0);
+
+		for(int i=0; i<block_size; i++)
+			assert(d[i] == v);
+
+		pool_free(d);
+	};
+
+	{
+		compresser *c = new compresser_lzo();
+
+		{
+			storage_backend_dedup sb("dedup", file, new hash_sha384(), dedup_options_t { .c = c }, { }, n * block_size, block_size);
+
+			int err = 0;
+			sb.put_data(0 * block_size, a, &err);
+			assert(err == 0);
+			sb.put_data(1 * block_size, a, &err);
+			assert(err == 0);
+			sb.put_data(2 * block_size, b, &err);
+			assert(err == 0);
+			// same data again
+			sb.put_data(2 * block_size, b, &err);
+			assert(err == 0);
+		}
+
+		assert(use_count(file, hash_a) == 2);
+		assert(use_count(file, hash_b) == 1);
+
+		{
+			storage_backend_dedup sb("dedup", file, new hash_sha384(), dedup_options_t { .c = c }, { }, n * block_size, block_size);
+
+			verify(&sb, 0, 0xaa);
+			verify(&sb, 1, 0xaa);
+			verify(&sb, 2, 0xbb);
+			verify(&sb, 3, 0x00);
+
+			int err = 0;
+			sb.put_data(0 * block_size, b, &err);
+			assert(err == 0);
+			sb.put_data(1 * block_size, b, &err);
+			assert(err == 0);
+
+			verify(&sb, 0, 0xbb);
+			verify(&sb, 1, 0xbb);
+		}
+
+		// the last user of 'a' is gone, and with it its data
+		assert(use_count(file, hash_a) == 0);
+		assert(use_count(file, hash_b) == 3);
+
+		delete c;
+
+		os_assert(unlink(file.c_str()));
+	}
+
+	// trims and blocks of only 0x00 remove the mapping: nothing is stored for them
+	{
+		auto n_mappings = [](const std::string & f) {
+			kyotocabinet::PolyDB db;
+			assert(db.open(f, kyotocabinet::PolyDB::OREADER));
+
+			int count = 0;
+			for(int nr=0; nr<n; nr++) {
+				std::string value;
+				count += db.get(dedup_block_key(nr), &value);
+			}
+
+			db.close();
+
+			return count;
+		};
+
+		{
+			storage_backend_dedup sb("dedup", file, new hash_sha384(), dedup_options_t { }, { }, n * block_size, block_size);
+
+			int err = 0;
+			for(int nr=0; nr<4; nr++) {
+				sb.put_data(nr * block_size, a, &err);
+				assert(err == 0);
+			}
+
+			// whole blocks
+			assert(sb.trim_zero(0, 2 * block_size, true, &err));
+			verify(&sb, 0, 0x00);
+			verify(&sb, 1, 0x00);
+
+			// the rest of a block that was partly zeroed
+			assert(sb.trim_zero(2 * block_size, 100, true, &err));
+			sb.put_data(2 * block_size + 100, block(std::vector<uint8_t>(block_size - 100, 0)), &err);
+			assert(err == 0);
+			verify(&sb, 2, 0x00);
+
+			// never written
+			assert(sb.trim_zero(8 * block_size, 2 * block_size, true, &err));
+			verify(&sb, 8, 0x00);
+
+			verify(&sb, 3, 0xaa);
+		}
+
+		assert(use_count(file, hash_a) == 1);
+		assert(n_mappings(file) == 1);
+
+		hash *h = new hash_sha384();
+		assert(use_count(file, h->do_hash(std::vector<uint8_t>(block_size, 0).data(), block_size).value()) == 0);
+		delete h;
+
+		os_assert(unlink(file.c_str()));
+	}
+
+	// the string keys of before schema 2, with a stale use count and data that nothing uses anymore
+	{
+		kyotocabinet::PolyDB db;
+		assert(db.open(file_v1, kyotocabinet::PolyDB::OWRITER | kyotocabinet::PolyDB::OCREATE));
+		assert(db.set("compressed", ""));
+		assert(db.set("block-to-hash_0", hash_a));
+		assert(db.set("block-to-hash_5", hash_a));
+		assert(db.set(hash_a, std::string(8, 7)));
+		assert(db.set("data-block_" + hash_a, std::string(a.begin(), a.end())));
+		assert(db.set("data-block_" + hash_b, std::string(b.begin(), b.end())));
+		db.close();
+	}
+
+	try {
+		storage_backend_dedup sb("dedup", file_v1, new hash_sha384(), dedup_options_t { }, { }, n * block_size, block_size);
+		assert(0);
+	}
+	catch(const std::string & error) {
+		// expected: must be converted first
+	}
+
+	dedup_migrate_result_t result { };
+	std::string            error;
+	assert(dedup_migrate_v1(file_v1, file_v2, &result, &error));
+	assert(result.n_blocks == 2);
+	assert(result.n_records == 1);
+	assert(result.n_unreferenced == 1);
+	assert(result.n_missing == 0);
+
+	// target exists
+	assert(dedup_migrate_v1(file_v1, file_v2, &result, &error) == false);
+
+	assert(use_count(file_v2, hash_a) == 2);
+	assert(use_count(file_v2, hash_b) == 0);
+
+	{
+		storage_backend_dedup sb("dedup", file_v2, new hash_sha384(), dedup_options_t { }, { }, n * block_size, block_size);
+
+		verify(&sb, 0, 0xaa);
+		verify(&sb, 5, 0xaa);
+		verify(&sb, 1, 0x00);
+
+		int err = 0;
+		sb.put_data(0 * block_size, b, &err);
+		assert(err == 0);
+
+		verify(&sb, 0, 0xbb);
+	}
+
+	assert(use_count(file_v2, hash_a) == 1);
+
+	// with the index: records cached (few enough that some are evicted) and a Bloom filter that is saved at shutdown
+	{
+		const std::string bloom_file = "test/dedup.bloom";
+
+		for(int k=0; k<2; k++) {
+			storage_backend_dedup sb("dedup", file_v2, new hash_sha384(), dedup_options_t { .index = new dedup_index(4 * block_size, 4096, bloom_file) }, { }, n * block_size, block_size);
+
+			// the first time there is no saved Bloom filter yet: it is made from the database
+			assert(access(bloom_file.c_str(), F_OK) == -1);
+
+			if (k == 0) {
+				verify(&sb, 0, 0xbb);
+				verify(&sb, 5, 0xaa);
+			}
+			else {
+				for(int i=0; i<n; i++)
+					verify(&sb, i, i % 4);
+			}
+
+			int err = 0;
+			for(int i=0; i<n; i++) {
+				sb.put_data(i * block_size, std::vector<uint8_t>(block_size, i % 4 + k), &err);
+				assert(err == 0);
+			}
+
+			for(int i=0; i<n; i++)
+				verify(&sb, i, i % 4 + k);
+
+			sb.dump_stats("test/");
+		}
+
+		assert(access(bloom_file.c_str(), F_OK) == 0);
+
+		// values 1...4 are used by 4 blocks each
+		hash *h = new hash_sha384();
+		for(int v=1; v<=4; v++) {
+			std::vector<uint8_t> d(block_size, v);
+			assert(use_count(file_v2, h->do_hash(d.data(), block_size).value()) == 4);
+		}
+		assert(use_count(file_v2, h->do_hash(std::vector<uint8_t>(block_size, 0).data(), block_size).value()) == 0);
+		delete h;
+
+		os_assert(unlink(bloom_file.c_str()));
+	}
+
+	// a put_data is one transaction: use counts of hashes that repeat in it are changed once;
+	// with threads, blocks are hashed and compressed in a pipeline (and read via the block cache)
+	for(int n_threads : { 0, 4 }) {
+		const std::string file_batch = "test/dedup-batch.kch";
+		constexpr int     n_batch    = 64;
+
+		auto pattern_hash = [](const int v) {
+			hash *h = new hash_sha384();
+			std::string out = h->do_hash(std::vector<uint8_t>(block_size, v).data(), block_size).value();
+			delete h;
+			return out;
+		};
+
+		{
+			storage_backend_dedup sb("dedup", file_batch, new hash_sha384(), dedup_options_t { .c = n_threads ? new compresser_zlib(3) : nullptr, .index = new dedup_index(16 * block_size, 4096, ""), .block_cache = n_threads ? new dedup_block_cache(8 * block_size, block_size) : nullptr, .n_threads = n_threads }, { }, n_batch * block_size, block_size);
+
+			std::vector<uint8_t> data(n_batch * block_size);
+			for(int i=0; i<n_batch; i++)
+				memset(&data[i * block_size], i % 8 + 1, block_size);
+
+			int err = 0;
+			sb.put_data(0, data, &err);
+			assert(err == 0);
+
+			// overwrite the first half: 8 -> 16 patterns, and a partial block
+			for(int i=0; i<n_batch / 2; i++)
+				memset(&data[i * block_size], i % 8 + 9, block_size);
+
+			sb.put_data(0, block(data.data(), n_batch / 2 * block_size + 100, false), &err);
+			assert(err == 0);
+
+			for(int i=0; i<n_batch; i++) {
+				uint8_t *d = nullptr;
+				sb.get_data(i * block_size, block_size, &d, &err);
+				assert(err == 0);
+				assert(memcmp(d, &data[i * block_size], i == n_batch / 2 ? 100 : block_size) == 0);
+				pool_free(d);
+			}
+
+			// writers and readers at the same time
+			std::vector<std::thread *> threads;
+			for(int t=0; t<4; t++) {
+				threads.push_back(new std::thread([&sb, t] {
+					for(int i=0; i<200; i++) {
+						int err = 0;
+						const int nr = (i * 7 + t) % (n_batch - 4);
+
+						if (i & 1) {
+							uint8_t *d = nullptr;
+							sb.get_data(nr * block_size, 4 * block_size, &d, &err);
+							assert(err == 0);
+							pool_free(d);
+						}
+						else {
+							std::vector<uint8_t> v(4 * block_size);
+							for(int k=0; k<4; k++)
+								memset(&v[k * block_size], (nr + k) % 16 + 1, block_size);
+
+							sb.put_data(nr * block_size, v, &err);
+							assert(err == 0);
+						}
+					}
+				}));
+			}
+
+			for(auto th : threads) {
+				th->join();
+				delete th;
+			}
+
+			// back to the 8 patterns
+			for(int i=0; i<n_batch; i++)
+				memset(&data[i * block_size], i % 8 + 1, block_size);
+
+			sb.put_data(0, data, &err);
+			assert(err == 0);
+
+			sb.dump_stats("test/");
+		}
+
+		for(int v=1; v<=8; v++)
+			assert(use_count(file_batch, pattern_hash(v)) == n_batch / 8);
+
+		for(int v=9; v<=16; v++)
+			assert(use_count(file_batch, pattern_hash(v)) == 0);
+
+		os_assert(unlink(file_batch.c_str()));
+	}
+
+	// ingest rate of new data, in line and with the pipeline
+	for(int n_threads : { 0, int(std::thread::hardware_concurrency()) }) {
+		const std::string file_rate = "test/dedup-rate.kch";
+		constexpr int     n_rate    = 2048;
+
+		std::vector<uint8_t> data(n_rate * block_size);
+		for(size_t i=0; i<data.size(); i += 8)
+			*reinterpret_cast<uint64_t *>(&data[i]) = i * 0x9e3779b97f4a7c15ull;
+
+		{
+			storage_backend_dedup sb("dedup", file_rate, new hash_sha384(), dedup_options_t { .c = new compresser_zlib(3), .n_threads = n_threads }, { }, n_rate * block_size, block_size);
+
+			const uint64_t start_ts = get_us();
+
+			for(int i=0; i<n_rate; i += 256) {
+				int err = 0;
+				sb.put_data(i * block_size, block(&data[i * block_size], 256 * block_size, false), &err);
+				assert(err == 0);
+			}
+
+			dolog(ll_info, "dedup ingest with %d thread(s): %.1f MB/s", n_threads, data.size() / double(get_us() - start_ts));
+
+			int      err = 0;
+			uint8_t *d   = nullptr;
+			sb.get_data(0, data.size(), &d, &err);
+			assert(err == 0);
+			assert(memcmp(d, data.data(), data.size()) == 0);
+			pool_free(d);
+		}
+
+		os_assert(unlink(file_rate.c_str()));
+	}
+
+	// sharded: each shard has its own lock, changes over more than one go via the intent log
+	{
+		const std::string file_shards = "test/dedup-shards.kch";
+		const std::string file_intent = file_shards + ".intent";
+		constexpr int     n_shards    = 4;
+		constexpr int     n_sharded   = 1024;  // mappings of all shards are used
+
+		auto shard_file = [&file_shards](const int nr) { return myformat("%s.%d", file_shards.c_str(), nr); };
+
+		auto pattern_hash = [](const int v) {
+			hash *h = new hash_sha384();
+			std::string out = h->do_hash(std::vector<uint8_t>(block_size, v).data(), block_size).value();
+			delete h;
+			return out;
+		};
+
+		auto shard_use_count = [&use_count, &bin, &shard_file](const std::string & hex) {
+			return use_count(shard_file(dedup_get_shard_for_hash(bin(hex), n_shards)), hex);
+		};
+
+		std::vector<uint8_t> data(n_sharded * block_size);
+		for(int i=0; i<n_sharded; i++)
+			memset(&data[i * block_size], i % 8 + 1, block_size);
+
+		{
+			storage_backend_dedup sb("dedup", file_shards, new hash_sha384(), dedup_options_t { .c = new compresser_zlib(3), .index = new dedup_index(64 * block_size, 65536, ""), .block_cache = new dedup_block_cache(16 * block_size, block_size), .n_threads = 2, .n_shards = n_shards }, { }, n_sharded * block_size, block_size);
+
+			int err = 0;
+			sb.put_data(0, data, &err);
+			assert(err == 0);
+
+			std::vector<std::thread *> threads;
+			for(int t=0; t<4; t++) {
+				threads.push_back(new std::thread([&sb, t] {
+					for(int i=0; i<100; i++) {
+						int err = 0;
+						const int nr = (i * 37 + t * 251) % (n_sharded - 8);
+
+						if (i & 1) {
+							uint8_t *d = nullptr;
+							sb.get_data(nr * block_size, 8 * block_size, &d, &err);
+							assert(err == 0);
+							pool_free(d);
+						}
+						else {
+							std::vector<uint8_t> v(8 * block_size);
+							for(int k=0; k<8; k++)
+								memset(&v[k * block_size], (nr + k) % 16 + 1, block_size);
+
+							sb.put_data(nr * block_size, v, &err);
+							assert(err == 0);
+						}
+					}
+				}));
+			}
+
+			for(auto th : threads) {
+				th->join();
+				delete th;
+			}
+
+			sb.put_data(0, data, &err);
+			assert(err == 0);
+
+			uint8_t *d = nullptr;
+			sb.get_data(0, data.size(), &d, &err);
+			assert(err == 0);
+			assert(memcmp(d, data.data(), data.size()) == 0);
+			pool_free(d);
+
+			sb.dump_stats("test/");
+		}
+
+		for(int v=1; v<=8; v++)
+			assert(shard_use_count(pattern_hash(v)) == n_sharded / 8);
+
+		for(int v=9; v<=16; v++)
+			assert(shard_use_count(pattern_hash(v)) == 0);
+
+		// all was applied: nothing to replay
+		struct stat st { };
+		os_assert(stat(file_intent.c_str(), &st));
+		assert(st.st_size == 0);
+
+		// a store keeps its number of shards
+		for(int other : { 1, 2 }) {
+			bool thrown = false;
+			try {
+				storage_backend_dedup sb("dedup", file_shards, new hash_sha384(), dedup_options_t { .c = new compresser_zlib(3), .n_shards = other }, { }, n_sharded * block_size, block_size);
+			}
+			catch(const std::string & error) {
+				thrown = true;
+			}
+			assert(thrown);
+		}
+
+		// block 0 from pattern 1 to 2, as a transaction that was logged but not (completely) applied
+		{
+			std::vector<dedup_intent_log::change_t> changes;
+
+			for(auto & change : std::vector<std::pair<int, int> > { { 1, -1 }, { 2, 1 } }) {
+				const std::string hash = bin(pattern_hash(change.first));
+				const int         nr   = dedup_get_shard_for_hash(hash, n_shards);
+
+				kyotocabinet::PolyDB db;
+				assert(db.open(shard_file(nr), kyotocabinet::PolyDB::OREADER));
+				std::string record;
+				assert(db.get(dedup_hash_key(hash), &record));
+				db.close();
+
+				uint8_t *const p = reinterpret_cast<uint8_t *>(record.data());
+				dedup_set_use_count(p, dedup_get_use_count(p) + change.second);
+
+				changes.push_back({ nr, dedup_hash_key(hash), record });
+			}
+
+			changes.push_back({ dedup_get_shard_for_block(0, n_shards), dedup_block_key(0), bin(pattern_hash(2)) });
+
+			dedup_intent_log il(file_intent);
+			assert(il.log_changes(changes).has_value());
+		}
+
+		{
+			storage_backend_dedup sb("dedup", file_shards, new hash_sha384(), dedup_options_t { .c = new compresser_zlib(3), .n_shards = n_shards }, { }, n_sharded * block_size, block_size);
+
+			verify(&sb, 0, 2);
+			verify(&sb, 1, 2);
+		}
+
+		assert(shard_use_count(pattern_hash(1)) == n_sharded / 8 - 1);
+		assert(shard_use_count(pattern_hash(2)) == n_sharded / 8 + 1);
+
+		os_assert(stat(file_intent.c_str(), &st));
+		assert(st.st_size == 0);
+
+		// a transaction that was marked done must not be replayed over a later change of its records
+		{
+			const int block_shard = dedup_get_shard_for_block(0, n_shards);
+
+			// two patterns that are in the shard of block 0: changing block 0 between them touches only that shard
+			std::vector<int> local;
+			for(int v=17; v<256 && local.size() < 2; v++) {
+				if (dedup_get_shard_for_hash(bin(pattern_hash(v)), n_shards) == block_shard)
+					local.push_back(v);
+			}
+			assert(local.size() == 2);
+
+			auto put = [&](const int v) {
+				storage_backend_dedup sb("dedup", file_shards, new hash_sha384(), dedup_options_t { .c = new compresser_zlib(3), .n_shards = n_shards }, { }, n_sharded * block_size, block_size);
+
+				int err = 0;
+				sb.put_data(0, std::vector<uint8_t>(block_size, v), &err);
+				assert(err == 0);
+			};
+
+			// the records as the transaction that wrote block 0 left them
+			auto get_changes = [&]() {
+				std::vector<dedup_intent_log::change_t> changes;
+
+				std::vector<std::pair<int, std::string> > keys { { block_shard, dedup_block_key(0) } };
+				for(int v : { 2, local.at(0) }) {
+					const std::string hash = bin(pattern_hash(v));
+					keys.push_back({ dedup_get_shard_for_hash(hash, n_shards), dedup_hash_key(hash) });
+				}
+
+				for(auto & k : keys) {
+					kyotocabinet::PolyDB db;
+					assert(db.open(shard_file(k.first), kyotocabinet::PolyDB::OREADER));
+					std::string record;
+					assert(db.get(k.second, &record));
+					db.close();
+
+					changes.push_back({ k.first, k.second, record });
+				}
+
+				return changes;
+			};
+
+			put(local.at(0));
+
+			auto done = get_changes();
+
+			// later, in one shard: no intent log
+			put(local.at(1));
+
+			// the log as it is when another transaction was still in progress when the first was done
+			{
+				dedup_intent_log il(file_intent);
+				auto id = il.log_changes(done);
+				assert(id.has_value());
+				assert(il.log_changes({ }).has_value());
+				assert(il.mark_done(id.value()));
+			}
+
+			{
+				storage_backend_dedup sb("dedup", file_shards, new hash_sha384(), dedup_options_t { .c = new compresser_zlib(3), .n_shards = n_shards }, { }, n_sharded * block_size, block_size);
+
+				verify(&sb, 0, local.at(1));
+			}
+
+			assert(shard_use_count(pattern_hash(2)) == n_sharded / 8);
+			assert(shard_use_count(pattern_hash(local.at(0))) == 0);
+			assert(shard_use_count(pattern_hash(local.at(1))) == 1);
+
+			os_assert(stat(file_intent.c_str(), &st));
+			assert(st.st_size == 0);
+		}
+
+		for(int i=0; i<n_shards; i++)
+			os_assert(unlink(shard_file(i).c_str()));
+		os_assert(unlink(file_intent.c_str()));
+	}
+
+	os_assert(unlink(file_v1.c_str()));
+	os_assert(unlink(file_v2.c_str()));
+}
+
+void test_writeback()
+{
+	dolog(ll_info, " -> write-back tests");
+
+	constexpr int block_size = 4096;
+	constexpr int n = 64;
+
+	storage_backend *sbf = new storage_backend_file("data", "test/writeback.dat", n * block_size, block_size, false, { });
+
+	{
+		storage_backend_writeback wb("writeback", sbf, 16 * block_size, 60000);
+
+		int err = 0;
+
+		// more than max-dirty: writers get throttled until the destager caught up
+		for(int i=0; i<n; i++) {
+			wb.put_data(i * block_size, std::vector<uint8_t>(block_size, i), &err);
+			assert(err == 0);
+		}
+
+		// rewrites & a partial write of a block that is still dirty
+		wb.put_data((n - 1) * block_size, std::vector<uint8_t>(block_size, 0xaa), &err);
+		assert(err == 0);
+		wb.put_data((n - 1) * block_size + 10, std::vector<uint8_t>(10, 0xbb), &err);
+		assert(err == 0);
+
+		// several blocks in one write: each is kept as a copy of its own
+		{
+			std::vector<uint8_t> multiple(4 * block_size);
+
+			for(int i=0; i<4; i++)
+				memset(&multiple[i * block_size], i, block_size);
+
+			wb.put_data(0, block(std::move(multiple)), &err);
+			assert(err == 0);
+		}
+
+		uint8_t *d = nullptr;
+		wb.get_data((n - 1) * block_size, block_size, &d, &err);
+		assert(err == 0 && d[0] == 0xaa && d[10] == 0xbb && d[20] == 0xaa);
+		pool_free(d);
+
+		// part of a dirty block zeroed
+		assert(wb.trim_zero((n - 1) * block_size, 512, false, &err));
+
+		assert(wb.fsync());
+
+		// everything reached the underlying storage
+		for(int i=0; i<n; i++) {
+			sbf->get_data(i * block_size, block_size, &d, &err);
+			assert(err == 0);
+
+			if (i == n - 1)
+				assert(d[0] == 0x00 && d[511] == 0x00 && d[512] == 0xaa);
+			else
+				assert(d[0] == i && d[block_size - 1] == i);
+
+			pool_free(d);
+		}
+
+		wb.dump_stats("test/");
+	}
+
+	os_assert(unlink("test/writeback.dat"));
+}
+
+void test_readahead()
+{
+	dolog(ll_info, " -> read-ahead tests");
+
+	constexpr int block_size = 4096;
+	constexpr int n = 256;
+
+	storage_backend *sbf = new storage_backend_file("data", "test/readahead.dat", n * block_size, block_size, false, { });
+
+	{
+		int err = 0;
+
+		for(int i=0; i<n; i++) {
+			sbf->put_data(i * block_size, std::vector<uint8_t>(block_size, i), &err);
+			assert(err == 0);
+		}
+	}
+
+	{
+		storage_backend_readahead ra("readahead", sbf, 32 * block_size, 2 * block_size, 16 * block_size);
+
+		auto verify = [&ra](const int nr, const uint8_t expected) {
+			int      err = 0;
+			uint8_t *d   = nullptr;
+			ra.get_data(nr * block_size, block_size, &d, &err);
+			assert(err == 0 && d[0] == expected && d[block_size - 1] == expected);
+			pool_free(d);
+		};
+
+		// sequential, in sectors (like AoE does) and up to the end of the device
+		for(int i=0; i<n; i++) {
+			for(int s=0; s<block_size; s += 512) {
+				int      err = 0;
+				uint8_t *d   = nullptr;
+				ra.get_data(i * block_size + s, 512, &d, &err);
+				assert(err == 0 && d[0] == i && d[511] == i);
+				pool_free(d);
+			}
+		}
+
+		// strided
+		for(int i=0; i<n; i += 3)
+			verify(i, i);
+
+		// a write in the middle of a stream invalidates what was read ahead
+		for(int i=0; i<8; i++)
+			verify(i, i);
+
+		int err = 0;
+		ra.put_data(10 * block_size, std::vector<uint8_t>(block_size, 0xaa), &err);
+		assert(err == 0);
+		assert(ra.trim_zero(12 * block_size, block_size, false, &err));
+
+		for(int i=8; i<16; i++)
+			verify(i, i == 10 ? 0xaa : (i == 12 ? 0x00 : i));
+
+		// more reads than the shared pool has threads, each waiting in one of
+		// them for read-aheads: these must not need a thread of that pool
+		std::vector<uint8_t>    buffer(n * block_size);
+		std::mutex              lock;
+		std::condition_variable cond;
+		int                     pending = n;
+
+		for(int i=0; i<n; i++) {
+			struct iovec iov { &buffer[i * block_size], size_t(block_size) };
+
+			ra.submit_get_data(i * block_size, &iov, 1, [&](const int err) {
+				assert(err == 0);
+
+				std::unique_lock<std::mutex> lck(lock);
+
+				pending--;
+
+				cond.notify_all();
+			});
+		}
+
+		{
+			std::unique_lock<std::mutex> lck(lock);
+
+			while(pending)
+				cond.wait(lck);
+		}
+
+		for(int i=0; i<n; i++)
+			assert(buffer[i * block_size] == (i == 10 ? 0xaa : (i == 12 ? 0x00 : i)));
+
+		ra.dump_stats("test/");
+	}
+
+	os_assert(unlink("test/readahead.dat"));
+}
+
+void test_mirror_reads()
+{
+	dolog(ll_info, " -> mirror read balancing tests");
+
+	constexpr int block_size = 4096;
+	constexpr int n          = 16;
+
+	storage_backend   *sbm = new storage_backend_file("mirror-reads-copy", "test/mirror-reads-copy.dat", n * block_size, block_size, false, { });
+	dirty_bitmap      *bm  = new dirty_bitmap("test/mirror-reads.bitmap", sbm->get_size(), 4 * block_size, 0);
+	mirror            *m   = new mirror_storage_backend("mirror-reads-mirror", sbm, true, bm);
+	storage_backend   *sb  = new storage_backend_file("mirror-reads", "test/mirror-reads.dat", n * block_size, block_size, false, { m });
+
+	// a mirror with a new bitmap was not copied yet
+	assert(bm->get_n_dirty() == bm->get_n_regions() && m->can_serve_reads() == false);
+
+	int err = 0;
+
+	for(int i=0; i<n; i++) {
+		sb->put_data(i * block_size, std::vector<uint8_t>(block_size, i + 1), &err);
+		assert(err == 0);
+	}
+
+	// all of it was written to the mirror too
+	for(uint64_t r=0; r<bm->get_n_regions(); r++)
+		m->mark_clean(r);
+
+	assert(m->can_serve_reads());
+
+	auto verify_all = [sb] {
+		for(int i=0; i<n; i++) {
+			int      err = 0;
+			uint8_t *d   = nullptr;
+			sb->get_data(i * block_size + 10, block_size - 20, &d, &err);
+			assert(err == 0 && d[0] == i + 1 && d[block_size - 21] == i + 1);
+			pool_free(d);
+		}
+	};
+
+	auto mirror_gets = [] {
+		for(auto & s : stats_get_all()) {
+			if (s.kind == "mirror" && s.id == "mirror-reads-mirror")
+				return s.ops[so_get].n;
+		}
+
+		assert(0);
+		return uint64_t(0);
+	};
+
+	verify_all();
+
+	// the first read goes to the backend itself, after that both have a latency
+	const uint64_t served = mirror_gets();
+	assert(served > 0);
+
+	// a stale mirror is not read from
+	m->set_in_sync(false);
+	assert(m->can_serve_reads() == false);
+
+	for(int i=0; i<n; i++) {
+		sbm->put_data(i * block_size, std::vector<uint8_t>(block_size, 0xff), &err);
+		assert(err == 0);
+	}
+
+	verify_all();
+	verify_all();
+
+	assert(mirror_gets() == served);
+
+	sb->dump_stats("test/");
+
+	delete sb;  // also deletes the mirror
+
+	os_assert(unlink("test/mirror-reads.dat"));
+	os_assert(unlink("test/mirror-reads-copy.dat"));
+	os_assert(unlink("test/mirror-reads.bitmap"));
+}
+
+void test_mirror_async()
+{
+	dolog(ll_info, " -> asynchronous mirror tests");
+
+	constexpr int block_size = 4096;
+	constexpr int n          = 64;
+
+	storage_backend *sbm = new storage_backend_file("mirror-async-copy", "test/mirror-async-copy.dat", n * block_size, block_size, false, { });
+	dirty_bitmap    *bm  = new dirty_bitmap("test/mirror-async.bitmap", sbm->get_size(), 4 * block_size, 0);
+	mirror_async    *m   = new mirror_async("mirror-async", sbm, 8 * block_size, 3, bm);
+	storage_backend *sb  = new storage_backend_file("mirror-async-data", "test/mirror-async.dat", n * block_size, block_size, false, { m });
+
+	std::vector<uint8_t> shadow(n * block_size);
+
+	// overlapping, unaligned, adjacent (to be combined) and trims
+	for(int i=0; i<2000; i++) {
+		uint32_t r = 0;
+		assert(getrandom(&r, sizeof r, 0) == sizeof r);
+
+		const offset_t offset = (r % 3 == 0) ? (i % n) * block_size : r % (shadow.size() - 1);
+		const uint32_t len    = std::min(offset_t(r % 3 == 0 ? block_size : 1 + (r >> 8) % 20000), shadow.size() - offset);
+
+		int err = 0;
+
+		if (r % 17 == 0) {
+			assert(sb->trim_zero(offset, len, false, &err));
+			memset(&shadow[offset], 0x00, len);
+		}
+		else {
+			std::vector<uint8_t> data(len, uint8_t(i));
+			data[0] = r;
+
+			sb->put_data(offset, data, &err);
+			assert(err == 0);
+
+			memcpy(&shadow[offset], data.data(), len);
+		}
+	}
+
+	assert(sb->fsync());
+
+	assert(m->get_lag_bytes() == 0);
+	assert(m->get_lag_seconds() == 0.);
+
+	// everything was sent: no region is dirty (apart from the recent write intents)
+	assert(bm->get_n_dirty() == 0 && m->is_in_sync());
+
+	int      err = 0;
+	uint8_t *d   = nullptr;
+	sbm->get_data(0, shadow.size(), &d, &err);
+	assert(err == 0);
+	assert(memcmp(d, shadow.data(), shadow.size()) == 0);
+	pool_free(d);
+
+	bool found = false;
+
+	for(auto & s : stats_get_all()) {
+		if (s.kind == "mirror" && s.id == "mirror-async") {
+			assert(s.gauges.size() == 3 && s.gauges.at(1).first == "replication_lag_bytes" && s.gauges.at(1).second == 0.);  // after dirty_bytes
+			found = true;
+		}
+	}
+
+	assert(found);
+
+	delete sb;  // also deletes the mirror
+
+	os_assert(unlink("test/mirror-async.dat"));
+	os_assert(unlink("test/mirror-async-copy.dat"));
+	os_assert(unlink("test/mirror-async.bitmap"));
+}
+
+// test mirror that takes its time and fails when asked to
+class test_mirror : public mirror
+{
+private:
+	const offset_t size;
+	const int      delay_ms;
+
+public:
+	std::atomic_bool    fail { false };
+	std::atomic_int     n_put { 0 };
+	std::atomic_int     n_trim { 0 };
+	std::atomic_int     n_sync { 0 };
+
+	test_mirror(const std::string & id, const offset_t size, const int delay_ms, dirty_bitmap *const bitmap = nullptr) : mirror(id, false, bitmap), size(size), delay_ms(delay_ms)
+	{
+	}
+
+	offset_t get_size() const override
+	{
+		return size;
+	}
+
+	bool put_block(const offset_t o, const block & b) override
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+		n_put++;
+		return !fail;
+	}
+
+	bool sync() override
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+		n_sync++;
+		return !fail;
+	}
+
+	bool trim_zero(const offset_t offset, const uint32_t len, const bool trim) override
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+		n_trim++;
+		return !fail;
+	}
+
+	YAML::Node emit_configuration() const override
+	{
+		return YAML::Node();
+	}
+};
+
+void test_mirror_fan_out()
+{
+	dolog(ll_info, " -> mirror fan-out tests");
+
+	constexpr int block_size = 4096;
+	constexpr int n          = 16;
+	constexpr int delay_ms   = 50;
+
+	std::vector<test_mirror *> tm;
+	for(int i=0; i<3; i++)
+		tm.push_back(new test_mirror(myformat("fan-out-%d", i), n * block_size, delay_ms));
+
+	storage_backend *sb = new storage_backend_file("fan-out", "test/fan-out.dat", n * block_size, block_size, false, { tm.at(0), tm.at(1), tm.at(2) });
+
+	// the latency is that of the slowest mirror, not the sum
+	int err = 0;
+
+	uint64_t start = get_us();
+	sb->put_data(0, std::vector<uint8_t>(block_size, 1), &err);
+	assert(err == 0);
+	assert(get_us() - start < 2 * delay_ms * 1000);
+
+	start = get_us();
+	assert(sb->trim_zero(block_size, block_size, false, &err));
+	assert(sb->fsync());
+	assert(get_us() - start < 4 * delay_ms * 1000);
+
+	// concurrent writes are not serialized by the fan-out
+	start = get_us();
+
+	std::vector<std::thread *> threads;
+	for(int i=0; i<4; i++) {
+		threads.push_back(new std::thread([sb, i] {
+			int err = 0;
+			sb->put_data((4 + i) * block_size, std::vector<uint8_t>(block_size, i + 1), &err);
+			assert(err == 0);
+		}));
+	}
+
+	for(auto th : threads) {
+		th->join();
+		delete th;
+	}
+
+	assert(get_us() - start < 2 * delay_ms * 1000);
+
+	for(auto m : tm)
+		assert(m->n_put == 5 && m->n_trim == 1 && m->n_sync == 1 && m->is_in_sync());
+
+	// a failing mirror fails the request, is marked, the others still get it
+	tm.at(1)->fail = true;
+
+	sb->put_data(2 * block_size, std::vector<uint8_t>(block_size, 2), &err);
+	assert(err == EIO);
+
+	assert(tm.at(0)->n_put == 6 && tm.at(2)->n_put == 6);
+	assert(tm.at(0)->is_in_sync() && tm.at(1)->is_in_sync() == false && tm.at(2)->is_in_sync());
+
+	// the write itself did happen here
+	uint8_t *d = nullptr;
+	sb->get_data(2 * block_size, block_size, &d, &err);
+	assert(err == 0 && d[0] == 2);
+	pool_free(d);
+
+	assert(sb->fsync() == false);
+
+	delete sb;  // also deletes the mirrors
+
+	os_assert(unlink("test/fan-out.dat"));
+}
+
+void test_mirror_resync()
+{
+	dolog(ll_info, " -> mirror resync tests");
+
+	constexpr int block_size  = 4096;
+	constexpr int region_size = 4 * block_size;
+	constexpr int n           = 64;
+
+	auto make = [] {
+		storage_backend *sbm = new storage_backend_file("resync-copy", "test/resync-copy.dat", n * block_size, block_size, false, { });
+		dirty_bitmap    *bm  = new dirty_bitmap("test/resync.bitmap", sbm->get_size(), region_size, 0);
+		mirror          *m   = new mirror_storage_backend("resync-mirror", sbm, false, bm);
+
+		return std::pair<storage_backend *, mirror *>(new storage_backend_file("resync", "test/resync.dat", n * block_size, block_size, false, { m }), m);
+	};
+
+	auto [sb, m] = make();
+
+	// a new bitmap is clean
+	assert(m->get_dirty_bitmap()->get_n_regions() == n * block_size / region_size);
+	assert(m->get_dirty_bitmap()->get_n_dirty() == 0 && m->is_in_sync());
+
+	int err = 0;
+
+	for(int i=0; i<n; i++) {
+		sb->put_data(i * block_size, std::vector<uint8_t>(block_size, i + 1), &err);
+		assert(err == 0);
+	}
+
+	// the mirror misses some writes (straddling a region boundary)
+	storage_backend *sbm = new storage_backend_file("resync-corrupt", "test/resync-copy.dat", n * block_size, block_size, false, { });
+	sbm->put_data(3 * block_size, std::vector<uint8_t>(2 * block_size, 0xee), &err);
+	assert(err == 0);
+	delete sbm;
+
+	m->mark_dirty(3 * block_size, 2 * block_size);
+
+	assert(m->get_dirty_bitmap()->get_n_dirty() == 2);
+	assert(m->get_dirty_bitmap()->is_dirty(0) && m->get_dirty_bitmap()->is_dirty(1) && !m->get_dirty_bitmap()->is_dirty(2));
+	assert(m->is_in_sync() == false);
+
+	// it survives a restart
+	delete sb;
+
+	std::tie(sb, m) = make();
+
+	assert(m->get_dirty_bitmap()->get_n_dirty() == 2 && m->is_in_sync() == false);
+
+	mirror_resync *rs = new mirror_resync();
+
+	for(int i=0; i<500 && m->get_dirty_bitmap()->get_n_dirty() > 0; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	assert(m->get_dirty_bitmap()->get_n_dirty() == 0 && m->is_in_sync());
+
+	delete rs;
+
+	delete sb;
+
+	sbm = new storage_backend_file("resync-verify", "test/resync-copy.dat", n * block_size, block_size, false, { });
+
+	for(int i=0; i<n; i++) {
+		uint8_t *d = nullptr;
+		sbm->get_data(i * block_size, block_size, &d, &err);
+		assert(err == 0 && d[0] == i + 1 && d[block_size - 1] == i + 1);
+		pool_free(d);
+	}
+
+	delete sbm;
+
+	// a failed write to a mirror marks the regions it touches
+	test_mirror     *tm = new test_mirror("resync-failing", n * block_size, 0, new dirty_bitmap("test/resync-failing.bitmap", n * block_size, region_size, 0));
+	storage_backend *sbf = new storage_backend_file("resync-failing", "test/resync.dat", n * block_size, block_size, false, { tm });
+
+	tm->fail = true;
+
+	sbf->put_data(region_size - 1, std::vector<uint8_t>(2, 1), &err);
+	assert(err == EIO);
+	assert(sbf->trim_zero(10 * region_size, region_size, false, &err) == false);
+
+	assert(tm->get_dirty_bitmap()->get_n_dirty() == 3);
+	assert(tm->get_dirty_bitmap()->is_dirty(0) && tm->get_dirty_bitmap()->is_dirty(1) && tm->get_dirty_bitmap()->is_dirty(10));
+	assert(tm->is_in_sync() == false);
+
+	delete sbf;
+
+	// a write in progress is dirty after a crash, not once it is done
+	dirty_bitmap *bm = new dirty_bitmap("test/resync-intent.bitmap", n * block_size, region_size, 0);
+
+	bm->begin_write(region_size, 1);
+	assert(bm->get_n_dirty() == 0 && bm->find_dirty(0).has_value() == false);
+
+	dirty_bitmap *after_crash = new dirty_bitmap("test/resync-intent.bitmap", n * block_size, region_size, 0);
+	assert(after_crash->get_n_dirty() == 1 && after_crash->is_dirty(1));
+	delete after_crash;
+
+	bm->end_write(region_size, 1);
+	assert(bm->get_n_dirty() == 0 && bm->is_dirty(1) == false);
+
+	delete bm;
+
+	bm = new dirty_bitmap("test/resync-intent.bitmap", n * block_size, region_size, 0);
+	assert(bm->get_n_dirty() == 0);
+	delete bm;
+
+	os_assert(unlink("test/resync.dat"));
+	os_assert(unlink("test/resync-copy.dat"));
+	os_assert(unlink("test/resync.bitmap"));
+	os_assert(unlink("test/resync-failing.bitmap"));
+	os_assert(unlink("test/resync-intent.bitmap"));
+}
+
+// file backend that fails reads and/or writes when asked to
+class test_failing_backend : public storage_backend_file
+{
+protected:
+	bool get_block_into(const block_nr_t block_nr, uint8_t *const to) override
+	{
+		return !fail_reads && storage_backend_file::get_block_into(block_nr, to);
+	}
+
+	bool get_multiple_blocks(const block_nr_t block_nr, const block_nr_t blocks_to_do, uint8_t *const to) override
+	{
+		return !fail_reads && storage_backend_file::get_multiple_blocks(block_nr, blocks_to_do, to);
+	}
+
+	bool put_block(const block_nr_t block_nr, const uint8_t *const data) override
+	{
+		return !fail_writes && storage_backend_file::put_block(block_nr, data);
+	}
+
+public:
+	std::atomic_bool fail_reads  { false };
+	std::atomic_bool fail_writes { false };
+
+	test_failing_backend(const std::string & id, const std::string & file, const offset_t size, const int block_size) : storage_backend_file(id, file, size, block_size, false, { })
+	{
+	}
+
+	bool trim_zero(const offset_t offset, const uint32_t len, const bool trim, int *const err) override
+	{
+		if (fail_writes) {
+			*err = EIO;
+			return false;
+		}
+
+		return storage_backend_file::trim_zero(offset, len, trim, err);
+	}
+};
+
+void test_gf256()
+{
+	dolog(ll_info, " -> GF(2^8) tests (%s)", get_gf256_implementation());
+
+	for(int a=1; a<256; a++)
+		assert(gf256_mul(a, gf256_inv(a)) == 1);
+
+	assert(gf256_mul(0x53, 0xca) == gf256_mul(0xca, 0x53));
+
+	// the vector versions against the scalar one, also the tails
+	for(int c : { 0, 1, 2, 0x53, 0xff }) {
+		for(size_t len : { size_t(0), size_t(1), size_t(15), size_t(31), size_t(33), size_t(4096 + 7) }) {
+			std::vector<uint8_t> src(len), dst(len);
+			if (len) {
+				assert(getrandom(src.data(), len, 0) == ssize_t(len));
+				assert(getrandom(dst.data(), len, 0) == ssize_t(len));
+			}
+
+			std::vector<uint8_t> expected = dst;
+			for(size_t i=0; i<len; i++)
+				expected[i] ^= gf256_mul(c, src[i]);
+
+			gf256_mul_add(dst.data(), src.data(), c, len);
+
+			assert(dst == expected);
+		}
+	}
+
+	// 3x3 matrix and its inverse
+	std::vector<uint8_t> m { 1, 2, 3, 4, 5, 6, 7, 8, 10 };
+	std::vector<uint8_t> inv = m;
+	assert(gf256_invert_matrix(inv, 3));
+
+	for(int r=0; r<3; r++) {
+		for(int c=0; c<3; c++) {
+			uint8_t v = 0;
+			for(int k=0; k<3; k++)
+				v ^= gf256_mul(m[r * 3 + k], inv[k * 3 + c]);
+
+			assert(v == (r == c));
+		}
+	}
+
+	std::vector<uint8_t> singular { 1, 2, 1, 2 };
+	assert(gf256_invert_matrix(singular, 2) == false);
+}
+
+void test_parity()
+{
+	dolog(ll_info, " -> parity tests");
+
+	constexpr int block_size  = 4096;
+	constexpr int stripe_size = 2 * block_size;
+	constexpr int sb_size     = 16 * stripe_size;
+
+	for(int n_parity : { 1, 2 }) {
+		constexpr int n_sbs = 6;
+		const int     n_data = n_sbs - n_parity;
+
+		std::vector<test_failing_backend *> tfb;
+		for(int i=0; i<n_sbs; i++)
+			tfb.push_back(new test_failing_backend(myformat("parity-%d", i), myformat("test/parity-%d.dat", i), sb_size, block_size));
+
+		storage_backend *sb = new storage_backend_parity("parity", std::vector<storage_backend *>(tfb.begin(), tfb.end()), n_parity, stripe_size, "test/parity.state");
+
+		assert(sb->get_size() == offset_t(sb_size) * n_data);
+
+		std::vector<uint8_t> shadow(sb->get_size());
+
+		auto verify = [&sb, &shadow] {
+			int      err = 0;
+			uint8_t *d   = nullptr;
+			sb->get_data(0, shadow.size(), &d, &err);
+			assert(err == 0);
+			assert(memcmp(d, shadow.data(), shadow.size()) == 0);
+			pool_free(d);
+		};
+
+		auto random_writes = [&sb, &shadow](const int n, const bool expect_ok) {
+			for(int i=0; i<n; i++) {
+				uint32_t r = 0;
+				assert(getrandom(&r, sizeof r, 0) == sizeof r);
+
+				// whole rows, partial, unaligned
+				const offset_t row_size = sb->get_size() / (sb_size / stripe_size);
+				const offset_t offset   = r % 4 == 0 ? (r >> 8) % 8 * row_size : (r >> 8) % (shadow.size() - 1);
+				const uint32_t len      = std::min(offset_t(r % 4 == 0 ? row_size * (1 + r % 3) : 1 + (r >> 4) % (3 * stripe_size)), shadow.size() - offset);
+
+				int err = 0;
+
+				if (r % 13 == 0) {
+					bool ok = sb->trim_zero(offset, len, r % 2, &err);
+					assert(ok == expect_ok);
+
+					if (ok)
+						memset(&shadow[offset], 0x00, len);
+				}
+				else {
+					std::vector<uint8_t> data(len);
+					assert(getrandom(data.data(), len, 0) == ssize_t(len));
+
+					sb->put_data(offset, data, &err);
+					assert((err == 0) == expect_ok);
+
+					if (err == 0)
+						memcpy(&shadow[offset], data.data(), len);
+				}
+			}
+		};
+
+		random_writes(300, true);
+		verify();
+
+		// any 'n_parity' of them may fail reading
+		for(int a=0; a<n_sbs; a++) {
+			// with 1 parity unit: b == a
+			for(int b=a + n_parity - 1; b<(n_parity == 1 ? a + 1 : n_sbs); b++) {
+				tfb.at(a)->fail_reads = true;
+				tfb.at(b)->fail_reads = true;
+
+				verify();
+
+				tfb.at(a)->fail_reads = false;
+				tfb.at(b)->fail_reads = false;
+			}
+		}
+
+		// degraded: writes to what is left still work
+		for(int i=0; i<n_parity; i++) {
+			tfb.at(i * 3)->fail_writes = true;
+			tfb.at(i * 3)->fail_reads  = true;
+
+			random_writes(100, true);
+			verify();
+		}
+
+		assert(sb->fsync());
+
+		// the failed ones missed writes: after a restart they must still not be read
+		delete sb;
+
+		tfb.clear();
+		for(int i=0; i<n_sbs; i++)
+			tfb.push_back(new test_failing_backend(myformat("parity-%d", i), myformat("test/parity-%d.dat", i), sb_size, block_size));
+
+		sb = new storage_backend_parity("parity", std::vector<storage_backend *>(tfb.begin(), tfb.end()), n_parity, stripe_size, "test/parity.state");
+
+		verify();
+
+		random_writes(50, true);
+		verify();
+
+		// one more is too many
+		tfb.at(1)->fail_writes = true;
+
+		int err = 0;
+		sb->put_data(0, std::vector<uint8_t>(sb->get_size() / (sb_size / stripe_size), 1), &err);
+		assert(err == EIO);
+
+		sb->put_data(0, std::vector<uint8_t>(1, 1), &err);
+		assert(err == EIO);
+
+		sb->dump_stats("test/");
+
+		delete sb;
+
+		for(int i=0; i<n_sbs; i++)
+			os_assert(unlink(myformat("test/parity-%d.dat", i).c_str()));
+
+		os_assert(unlink("test/parity.state"));
+	}
+}
+
+void test_stripe()
+{
+	dolog(ll_info, " -> stripe tests");
+
+	constexpr int block_size  = 4096;
+	constexpr int stripe_size = 2 * block_size;
+	constexpr int n_sbs       = 3;
+	constexpr int sb_size     = 32 * block_size;
+
+	{
+		std::vector<storage_backend *> sbs;
+		for(int i=0; i<n_sbs; i++)
+			sbs.push_back(new storage_backend_file(myformat("stripe-%d", i), myformat("test/stripe-%d.dat", i), sb_size, block_size, false, { }));
+
+		storage_backend_stripe stripe("stripe", sbs, stripe_size);
+		assert(stripe.get_size() == n_sbs * sb_size);
+
+		std::vector<uint8_t> data(stripe.get_size());
+		for(size_t i=0; i<data.size(); i++)
+			data[i] = i * 7 + i / 4093;
+
+		// unaligned and spanning a few stripes
+		int err = 0;
+		stripe.put_data(0, std::vector<uint8_t>(data.begin(), data.begin() + 1000), &err);
+		assert(err == 0);
+		stripe.put_data(1000, std::vector<uint8_t>(data.begin() + 1000, data.begin() + 5 * stripe_size + 123), &err);
+		assert(err == 0);
+		stripe.put_data(5 * stripe_size + 123, std::vector<uint8_t>(data.begin() + 5 * stripe_size + 123, data.end()), &err);
+		assert(err == 0);
+
+		// off the end
+		stripe.put_data(stripe.get_size() - 10, std::vector<uint8_t>(20), &err);
+		assert(err != 0);
+
+		uint8_t *d = nullptr;
+		stripe.get_data(0, data.size(), &d, &err);
+		assert(err == 0 && memcmp(d, data.data(), data.size()) == 0);
+		pool_free(d);
+
+		stripe.get_data(stripe_size - 300, 600, &d, &err);
+		assert(err == 0 && memcmp(d, &data[stripe_size - 300], 600) == 0);
+		pool_free(d);
+
+		// stripe 4 is the second stripe on backend 1
+		sbs.at(1)->get_data(stripe_size, stripe_size, &d, &err);
+		assert(err == 0 && memcmp(d, &data[4 * stripe_size], stripe_size) == 0);
+		pool_free(d);
+
+		// trim over all backends
+		assert(stripe.trim_zero(block_size, 4 * stripe_size, false, &err));
+		memset(&data[block_size], 0x00, 4 * stripe_size);
+
+		stripe.get_data(0, data.size(), &d, &err);
+		assert(err == 0 && memcmp(d, data.data(), data.size()) == 0);
+		pool_free(d);
+
+		assert(stripe.fsync());
+
+		stripe.dump_stats("test/");
+	}
+
+	for(int i=0; i<n_sbs; i++)
+		os_assert(unlink(myformat("test/stripe-%d.dat", i).c_str()));
+
+	// a refused configuration deletes the storage-backends it was given
+	{
+		std::vector<storage_backend *> sbs;
+		sbs.push_back(new storage_backend_file("stripe-bad-0", "test/stripe-bad-0.dat", sb_size, block_size, false, { }));
+		sbs.push_back(new storage_backend_file("stripe-bad-1", "test/stripe-bad-1.dat", sb_size, 512, false, { }));
+
+		bool refused = false;
+
+		try {
+			storage_backend_stripe stripe("stripe-bad", sbs, stripe_size);
+		}
+		catch(const std::string & error) {
+			refused = true;
+		}
+
+		assert(refused);
+	}
+
+	os_assert(unlink("test/stripe-bad-0.dat"));
+	os_assert(unlink("test/stripe-bad-1.dat"));
+}
+
+std::string stats_request(const std::string & path, const std::string & what)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	os_assert(fd);
+
+	struct sockaddr_un addr { 0 };
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	os_assert(connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof addr));
+
+	const std::string line = what + "\n";
+	assert(write(fd, line.c_str(), line.size()) == ssize_t(line.size()));
+
+	std::string out;
+
+	for(;;) {
+		char buffer[4096];
+		ssize_t rc = read(fd, buffer, sizeof buffer);
+		if (rc <= 0)
+			break;
+
+		out += std::string(buffer, rc);
+	}
+
+	os_assert(close(fd));
+
+	return out;
+}
+
+void test_stats()
+{
+	dolog(ll_info, " -> statistics tests");
+
+	// every bucket covers the values up to its upper bound
+	for(int b=1; b<latency_histogram::n_buckets; b++) {
+		const uint64_t ub = latency_histogram::bucket_upper_bound(b);
+
+		assert(latency_histogram::value_to_bucket(ub) == b);
+		assert(latency_histogram::value_to_bucket(latency_histogram::bucket_upper_bound(b - 1) + 1) == b);
+	}
+	assert(latency_histogram::value_to_bucket(7) == 7);
+	assert(latency_histogram::value_to_bucket(UINT64_MAX) == latency_histogram::n_buckets - 1);
+
+	{
+		io_stats s("test", "percentiles");
+
+		for(int i=0; i<1000; i++)
+			s.record(so_get, 512, i < 990 ? 10 : 5000);
+
+		auto snapshot = s.get();
+		assert(snapshot.ops[so_get].n == 1000);
+		assert(snapshot.ops[so_get].bytes == 512000);
+		assert(snapshot.ops[so_get].max_us == 5000);
+		assert(stats_percentile(snapshot.ops[so_get], 0.5) == 10);
+		assert(stats_percentile(snapshot.ops[so_get], 0.999) == 5000);
+		assert(snapshot.ops[so_put].n == 0);
+	}
+
+	constexpr int block_size = 4096;
+
+	storage_backend_file *sb = new storage_backend_file("stats-file", "test/stats.dat", 16 * block_size, block_size, false, { });
+
+	{
+		int err = 0;
+		sb->put_data(0, std::vector<uint8_t>(block_size, 1), &err);
+		assert(err == 0);
+
+		uint8_t *d = nullptr;
+		sb->get_data(0, block_size, &d, &err);
+		assert(err == 0);
+		pool_free(d);
+
+		assert(sb->trim_zero(block_size, block_size, false, &err));
+		assert(sb->fsync());
+	}
+
+	bool found = false;
+
+	for(auto & s : stats_get_all()) {
+		if (s.kind != "storage-backend" || s.id != "stats-file")
+			continue;
+
+		assert(s.ops[so_get].n == 1 && s.ops[so_get].bytes == block_size);
+		assert(s.ops[so_put].n == 1 && s.ops[so_put].bytes == block_size);
+		assert(s.ops[so_trim].n == 1);
+		assert(s.ops[so_fsync].n == 1);
+
+		found = true;
+	}
+
+	assert(found);
+
+	{
+		stats_server ss("test/stats.sock");
+
+		io_stats idle("storage-backend", "stats-idle");
+
+		YAML::Node all = YAML::Load(stats_request("test/stats.sock", "json"));
+
+		found = false;
+
+		for(const auto & object : all) {
+			if (object["id"].as<std::string>() == "stats-file") {
+				assert(object["ops"]["put"]["n"].as<uint64_t>() == 1);
+				assert(object["ops"]["put"]["histogram"].size() == 1);
+				found = true;
+			}
+		}
+
+		assert(found);
+
+		std::string prometheus = stats_request("test/stats.sock", "prometheus");
+		assert(prometheus.find("mystorage_ops_total{kind=\"storage-backend\",id=\"stats-file\",op=\"put\"} 1\n") != std::string::npos);
+		assert(prometheus.find("mystorage_latency_us_bucket{kind=\"storage-backend\",id=\"stats-file\",op=\"put\",le=\"+Inf\"} 1\n") != std::string::npos);
+		// the same buckets in every scrape, also for ops that did not happen (yet)
+		assert(prometheus.find("mystorage_latency_us_bucket{kind=\"storage-backend\",id=\"stats-idle\",op=\"get\",le=\"1\"} 0\n") != std::string::npos);
+		assert(prometheus.find("mystorage_latency_us_bucket{kind=\"storage-backend\",id=\"stats-idle\",op=\"get\",le=\"9223372036854775807\"} 0\n") != std::string::npos);
+		assert(prometheus.find("mystorage_latency_us_bucket{kind=\"storage-backend\",id=\"stats-file\",op=\"put\",le=\"9223372036854775807\"} 1\n") != std::string::npos);
+
+		// all samples of a family directly below its TYPE-line
+		assert(prometheus.find("mystorage_ops_total{") > prometheus.find("# TYPE mystorage_ops_total "));
+		assert(prometheus.rfind("mystorage_ops_total{") < prometheus.find("# HELP mystorage_bytes_total "));
+		assert(prometheus.find("mystorage_bytes_total{") > prometheus.find("# TYPE mystorage_bytes_total "));
+		assert(prometheus.rfind("mystorage_bytes_total{") < prometheus.find("# HELP mystorage_latency_us "));
+		assert(prometheus.find("mystorage_latency_us_bucket{") > prometheus.find("# TYPE mystorage_latency_us "));
+
+		// the stats section is part of a stored configuration
+		store_configuration({ }, { }, { &ss }, "test/stats.yaml");
+		assert(YAML::LoadFile("test/stats.yaml")["stats"]["socket"].as<std::string>() == "test/stats.sock");
+		os_assert(unlink("test/stats.yaml"));
+	}
+
+	delete sb;
+
+	os_assert(unlink("test/stats.dat"));
+
+	// unregistered when deleted
+	for(auto & s : stats_get_all())
+		assert(s.id != "stats-file");
+}
+
+void test_async_backend(storage_backend *const sb)
+{
+	dolog(ll_info, " -> asynchronous interface tests, \"%s\"", sb->get_id().c_str());
+
+	const int block_size = sb->get_block_size();
+	const int n = sb->get_size() / block_size;
+
+	std::mutex              lock;
+	std::condition_variable cond;
+	int                     pending = 0;
+	int                     errors = 0;
+
+	async_done_t done = [&](const int err) {
+		std::unique_lock<std::mutex> lck(lock);
+
+		if (err)
+			errors++;
+
+		pending--;
+
+		cond.notify_all();
+	};
+
+	auto submitted = [&] {
+		std::unique_lock<std::mutex> lck(lock);
+		pending++;
+	};
+
+	auto wait_all = [&] {
+		std::unique_lock<std::mutex> lck(lock);
+
+		while(pending)
+			cond.wait(lck);
+	};
+
+	// all in flight at the same time
+	for(int i=0; i<n; i++) {
+		submitted();
+		sb->submit_put_data(i * block_size, block(std::vector<uint8_t>(block_size, i)), done);
+	}
+
+	wait_all();
+
+	submitted();
+	sb->submit_fsync(done);
+
+	wait_all();
+
+	// each block scattered over two buffers
+	std::vector<uint8_t> buffer(n * block_size);
+
+	for(int i=0; i<n; i++) {
+		struct iovec iov[2] { { &buffer[i * block_size], 100 }, { &buffer[i * block_size + 100], size_t(block_size - 100) } };
+
+		submitted();
+		sb->submit_get_data(i * block_size, iov, 2, done);
+	}
+
+	wait_all();
+
+	for(int i=0; i<n * block_size; i++)
+		assert(buffer[i] == uint8_t(i / block_size));
+
+	submitted();
+	sb->submit_trim_zero(block_size, block_size, false, done);
+
+	wait_all();
+
+	assert(errors == 0);
+
+	int err = 0;
+	uint8_t *d = nullptr;
+	sb->get_data(block_size, block_size, &d, &err);
+	assert(err == 0 && d[0] == 0x00 && d[block_size - 1] == 0x00);
+	pool_free(d);
+}
+
+void test_async()
+{
+	constexpr int block_size = 4096;
+	constexpr int size = 64 * block_size;
+
+	{
+		storage_backend_file sbf("async", "test/async.dat", size, block_size, false, { });
+
+		test_async_backend(&sbf);
+	}
+
+	os_assert(unlink("test/async.dat"));
+
+	// fans out over the asynchronous interface of the backends
+	{
+		std::vector<storage_backend *> sbs;
+		for(int i=0; i<2; i++)
+			sbs.push_back(new storage_backend_file(myformat("async-stripe-%d", i), myformat("test/async-stripe-%d.dat", i), size / 2, block_size, false, { }));
+
+		storage_backend_stripe stripe("async-stripe", sbs, 3 * block_size);
+
+		test_async_backend(&stripe);
+	}
+
+	for(int i=0; i<2; i++)
+		os_assert(unlink(myformat("test/async-stripe-%d.dat", i).c_str()));
+
+	// pipelined NBD client against our own server
+	{
+		storage_backend *sbf = new storage_backend_file("async-nbd", "test/async-nbd.dat", size, block_size, false, { });
+
+		{
+			nbd server("nbd-server", { new socket_listener_ipv4("127.0.0.1", 10909) }, { sbf });
+
+			socket_client_ipv4 sc("127.0.0.1", 10909);
+
+			storage_backend_nbd sbn("nbd-client", &sc, "async-nbd", block_size, { });
+
+			test_async_backend(&sbn);
+		}
+
+		delete sbf;
+	}
+
+	os_assert(unlink("test/async-nbd.dat"));
+}
+
+void setup()
+{
+	setlog("test-mystorage.log", ll_debug, ll_info);
+	dolog(ll_info, "test-MyStorage starting");
+
+	os_assert(mkdir("test", 0770));
+}
+
+int main(int argc, char *argv[])
+{
+	dolog(ll_info, " *** TESTS STARTED ***\n");
+
+	setup();
+
+	test_buffer_pool();
+
+	test_block();
+
+	test_zero();
+
+	test_lock_group();
+
+	test_write_merge();
+
+	test_async();
+
+	test_cache();
+
+	test_hash();
+
+	test_bloom_filter();
+
+	test_dedup_block_cache();
+
+	test_dedup();
+
+	test_writeback();
+
+	test_readahead();
+
+	test_stripe();
+
+	test_gf256();
+
+	test_parity();
+
+	test_mirror_reads();
+
+	test_mirror_async();
+
+	test_mirror_fan_out();
+
+	test_mirror_resync();
+
+	test_stats();
 
 	test_integrities();
 
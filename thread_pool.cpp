@@ -0,0 +1,107 @@
+#include <algorithm>
+
+#include "thread_pool.h"
+
+
+thread_pool::thread_pool(const int n_threads)
+{
+	for(int i=0; i<n_threads; i++)
+		threads.push_back(new std::thread(&thread_pool::worker, this));
+}
+
+thread_pool::~thread_pool()
+{
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		stop = true;
+
+		cond.notify_all();
+	}
+
+	// work that is still queued is finished first
+	for(auto th : threads) {
+		th->join();
+
+		delete th;
+	}
+}
+
+void thread_pool::worker()
+{
+	for(;;) {
+		std::function<void()> f;
+
+		{
+			std::unique_lock<std::mutex> lck(lock);
+
+			while(work.empty() && !stop)
+				cond.wait(lck);
+
+			if (work.empty())
+				break;
+
+			f = std::move(work.front());
+
+			work.pop();
+		}
+
+		f();
+	}
+}
+
+void thread_pool::enqueue(std::function<void()> f)
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	work.push(std::move(f));
+
+	cond.notify_one();
+}
+
+int thread_pool::run_all(const std::vector<std::function<int()> > & work)
+{
+	std::mutex              finished_lock;
+	std::condition_variable finished_cond;
+	size_t                  n_finished { 0 };
+	int                     first_err  { 0 };
+
+	auto finished = [&](const int err) {
+		std::unique_lock<std::mutex> lck(finished_lock);
+
+		if (err && first_err == 0)
+			first_err = err;
+
+		n_finished++;
+
+		finished_cond.notify_all();
+	};
+
+	for(size_t i=1; i<work.size(); i++)
+		enqueue([&work, i, &finished] { finished(work.at(i)()); });
+
+	if (work.empty() == false)
+		finished(work.at(0)());
+
+	// everything above refers to this stack frame
+	std::unique_lock<std::mutex> lck(finished_lock);
+
+	while(n_finished < work.size())
+		finished_cond.wait(lck);
+
+	return first_err;
+}
+
+size_t thread_pool::get_queue_size()
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	return work.size();
+}
+
+thread_pool * get_shared_thread_pool()
+{
+	static thread_pool tp(std::max(4u, std::thread::hardware_concurrency()));
+
+	return &tp;
+}
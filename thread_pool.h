@@ -0,0 +1,37 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+
+// A fixed set of threads that execute queued work in FIFO order.
+class thread_pool
+{
+private:
+	std::vector<std::thread *>         threads;
+
+	std::mutex                         lock;
+	std::condition_variable            cond;
+	std::queue<std::function<void()> > work;
+	bool                               stop { false };
+
+	void worker();
+
+public:
+	thread_pool(const int n_threads);
+	virtual ~thread_pool();
+
+	void enqueue(std::function<void()> f);
+
+	// runs all but the first in the pool, the first in the calling thread; returns when
+	// all are done, with the first error (0: none); not for use from a thread of the pool
+	int run_all(const std::vector<std::function<int()> > & work);
+
+	size_t get_queue_size();
+};
+
+// used by the asynchronous storage_backend interface (a thread per core, at least 4)
+thread_pool * get_shared_thread_pool();
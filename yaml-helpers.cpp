@@ -5,9 +5,12 @@
 #include <yaml-cpp/yaml.h>
 
 #include "base.h"
+#include "buffer_pool.h"
 #include "logging.h"
+#include "mirror_resync.h"
 #include "server.h"
 #include "snapshots.h"
+#include "stats_server.h"
 #include "storage_backend.h"
 #include "str.h"
 
@@ -80,7 +83,7 @@ bool yaml_get_bool(const YAML::Node & node, const std::string & key, const std::
 	}
 }
 
-void store_configuration(const std::vector<server *> & servers, const std::vector<storage_backend *> & storage, const std::string & file)
+void store_configuration(const std::vector<server *> & servers, const std::vector<storage_backend *> & storage, const std::vector<base *> & stats, const std::string & file)
 {
 	YAML::Node out;
 
@@ -96,6 +99,10 @@ void store_configuration(const std::vector<server *> & servers, const std::vecto
 
 	out["storage"] = y_storage;
 
+	// as returned by load_configuration(): empty or one stats_server
+	if (stats.empty() == false)
+		out["stats"] = stats.at(0)->emit_configuration();
+
 	YAML::Node logging;
 	logging["file"] = logfile;
 	logging["loglevel-files"] = ll_to_str(log_level_file);
@@ -103,6 +110,12 @@ void store_configuration(const std::vector<server *> & servers, const std::vecto
 
 	out["logging"] = logging;
 
+	YAML::Node bp;
+	bp["hugepages"] = get_buffer_pool_hugepages();
+	bp["max-cached-per-class"] = get_buffer_pool_max_cached_per_class();
+
+	out["buffer-pool"] = bp;
+
 	YAML::Emitter output;
 	output << out;
 
@@ -124,6 +137,16 @@ std::map<std::string, std::vector<base *> > load_configuration(const std::string
 
 	YAML::Node config = YAML::LoadFile(file);
 
+	// optional; must be set before anything allocates buffers
+	YAML::Node cfg_buffer_pool = config["buffer-pool"];
+
+	if (cfg_buffer_pool) {
+		bool hugepages = yaml_get_bool(cfg_buffer_pool, "hugepages", "use (transparent) hugepages for large buffers");
+		int  max_cached_per_class = yaml_get_int(cfg_buffer_pool, "max-cached-per-class", "number of free buffers kept per thread per size class");
+
+		set_buffer_pool(hugepages, max_cached_per_class);
+	}
+
 	YAML::Node cfg_storage = config["storage"];
 
 	std::vector<base *> snapshotters;
@@ -159,6 +182,20 @@ std::map<std::string, std::vector<base *> > load_configuration(const std::string
 		servers.push_back(server::load_configuration(node, storage));
 	}
 
+	// optional
+	std::vector<base *> stats;
+
+	YAML::Node cfg_stats = config["stats"];
+
+	if (cfg_stats)
+		stats.push_back(stats_server::load_configuration(cfg_stats));
+
+	// only when a mirror has a dirty-region bitmap
+	std::vector<base *> resync;
+
+	if (mirror_resync::has_backends())
+		resync.push_back(new mirror_resync());
+
 	YAML::Node cfg_logging = config["logging"];
 	const std::string logfile = cfg_logging["file"].as<std::string>();
 
@@ -171,6 +208,8 @@ std::map<std::string, std::vector<base *> > load_configuration(const std::string
 	out.insert({ "servers", servers });
 	out.insert({ "storage", storage_rc });
 	out.insert({ "snapshots", snapshotters });  // do not manually free as it is a storage object
+	out.insert({ "stats", stats });
+	out.insert({ "resync", resync });
 
 	return out;
 }
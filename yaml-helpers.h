@@ -14,5 +14,5 @@ uint64_t yaml_get_uint64_t(const YAML::Node & node, const std::string & key, con
 const YAML::Node yaml_get_yaml_node(const YAML::Node & node, const std::string & key, const std::string & description);
 bool yaml_get_bool(const YAML::Node & node, const std::string & key, const std::string & description);
 
-void store_configuration(const std::vector<server *> & servers, const std::vector<storage_backend *> & storage, const std::string & file);
+void store_configuration(const std::vector<server *> & servers, const std::vector<storage_backend *> & storage, const std::vector<base *> & stats, const std::string & file);
 std::map<std::string, std::vector<base *> > load_configuration(const std::string & file);
@@ -0,0 +1,123 @@
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "zero.h"
+
+
+static bool is_all_zero_scalar(const uint8_t *const p, const size_t len)
+{
+	size_t i = 0;
+
+	// 64 bytes per check so that the loop stays branch-light
+	for(; i + 64 <= len; i += 64) {
+		uint64_t w[8];
+		memcpy(w, &p[i], sizeof w);
+
+		if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0)
+			return false;
+	}
+
+	for(; i < len; i++) {
+		if (p[i])
+			return false;
+	}
+
+	return true;
+}
+
+#if defined(__x86_64__)
+static bool is_all_zero_sse2(const uint8_t *const p, const size_t len)
+{
+	size_t i = 0;
+
+	for(; i + 64 <= len; i += 64) {
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&p[i +  0]));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&p[i + 16]));
+		__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&p[i + 32]));
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&p[i + 48]));
+
+		__m128i o = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(o, _mm_setzero_si128())) != 0xffff)
+			return false;
+	}
+
+	for(; i < len; i++) {
+		if (p[i])
+			return false;
+	}
+
+	return true;
+}
+
+__attribute__((target("avx2")))
+static bool is_all_zero_avx2(const uint8_t *const p, const size_t len)
+{
+	size_t i = 0;
+
+	for(; i + 128 <= len; i += 128) {
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&p[i +  0]));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&p[i + 32]));
+		__m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&p[i + 64]));
+		__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&p[i + 96]));
+
+		__m256i o = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+
+		if (!_mm256_testz_si256(o, o))
+			return false;
+	}
+
+	// not via the sse2 version: mixing non-VEX sse code with dirty upper
+	// halves of the ymm registers is very slow on some cpus
+	for(; i < len; i++) {
+		if (p[i])
+			return false;
+	}
+
+	return true;
+}
+#endif
+
+typedef bool (*is_all_zero_t)(const uint8_t *const p, const size_t len);
+
+static const char *implementation = "scalar";
+
+static is_all_zero_t select_is_all_zero()
+{
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		implementation = "avx2";
+		return is_all_zero_avx2;
+	}
+
+	implementation = "sse2";  // part of x86-64
+	return is_all_zero_sse2;
+#else
+	return is_all_zero_scalar;
+#endif
+}
+
+static const is_all_zero_t is_all_zero_selected = select_is_all_zero();
+
+bool is_all_zero(const uint8_t *const p, const size_t len)
+{
+	// most data that is not zero, is not zero at the start either
+	if (len >= 8) {
+		uint64_t first = 0;
+		memcpy(&first, p, sizeof first);
+
+		if (first)
+			return false;
+	}
+
+	return is_all_zero_selected(p, len);
+}
+
+const char *get_is_all_zero_implementation()
+{
+	return implementation;
+}
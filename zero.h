@@ -0,0 +1,10 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+
+// true when all 'len' bytes at 'p' are 0x00
+// uses AVX2 or SSE2 when the cpu has it (selected at startup)
+bool is_all_zero(const uint8_t *const p, const size_t len);
+
+const char *get_is_all_zero_implementation();